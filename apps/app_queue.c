@@ -92,6 +92,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/causes.h"
 #include "callweaver/callweaver_db.h"
 #include "callweaver/devicestate.h"
+#include "callweaver/callweaver_hash.h"
 
 
 static void *queueagentcount_function;
@@ -308,6 +309,8 @@ struct member
     time_t lastcall;		/*!< When last successful call was hungup */
     int dead;			/*!< Used to detect members deleted in realtime */
     time_t added;		/* used to track when member was added */
+    struct cw_call_queue *parent;	/*!< Queue this member belongs to */
+    struct member *hash_next;	/*!< Next member in the interface index */
     struct member *next;		/*!< Next member */
 };
 
@@ -472,92 +475,199 @@ static enum queue_member_status get_member_status(struct cw_call_queue *q)
     return result;
 }
 
+/*! \brief Members of all queues hashed by interface, so a device state
+    change only visits the members using that device.
+    \note Protected by qlock; every member list change happens under it. */
+#define MEMBER_INDEX_BUCKETS 1021
+
+static struct member *member_index[MEMBER_INDEX_BUCKETS];
+
+static void member_index_add(struct cw_call_queue *q, struct member *m)
+{
+    unsigned int h = cw_hash_string_tolower(m->interface) % MEMBER_INDEX_BUCKETS;
+
+    m->parent = q;
+    m->hash_next = member_index[h];
+    member_index[h] = m;
+}
+
+static void member_index_del(struct member *m)
+{
+    struct member **link;
+
+    link = &member_index[cw_hash_string_tolower(m->interface) % MEMBER_INDEX_BUCKETS];
+    for (  ;  *link;  link = &(*link)->hash_next)
+    {
+        if (*link == m)
+        {
+            *link = m->hash_next;
+            break;
+        }
+    }
+    m->hash_next = NULL;
+}
+
+static void free_members(struct cw_call_queue *q, int all)
+{
+    /* Free non-dynamic members */
+    struct member *curm, *next, *prev;
+
+    curm = q->members;
+    prev = NULL;
+    while (curm)
+    {
+        next = curm->next;
+        if (all  ||  !curm->dynamic)
+        {
+            if (prev)
+                prev->next = next;
+            else
+                q->members = next;
+            member_index_del(curm);
+            free(curm);
+        }
+        else
+            prev = curm;
+        curm = next;
+    }
+}
+
+/*! \brief Pending device state changes, consumed by a single thread.
+    A device already waiting in the queue only has its state updated. */
+#define STATECHANGE_BUCKETS 257
+#define STATECHANGE_MAX_PENDING 8192
+
 struct statechange
 {
+    struct statechange *next;		/*!< Next in arrival order */
+    struct statechange *hash_next;	/*!< Next pending change in the same bucket */
     int state;
     char dev[0];
 };
 
-static void *changethread(void *data)
+static struct statechange *statechange_head;
+static struct statechange *statechange_tail;
+static struct statechange *statechange_hash[STATECHANGE_BUCKETS];
+static int statechange_pending;
+static int statechange_dropped;
+static int statechange_stop;
+static pthread_t statechange_thread = CW_PTHREADT_NULL;
+CW_MUTEX_DEFINE_STATIC(statechange_lock);
+static cw_cond_t statechange_cond;
+
+static void handle_statechange(struct statechange *sc)
 {
     struct cw_call_queue *q;
-    struct statechange *sc = data;
     struct member *cur;
-    char *loc;
-    char *technology;
 
-    technology = cw_strdupa(sc->dev);
-    loc = strchr(technology, '/');
-    if (loc)
-    {
-        *loc = '\0';
-        loc++;
-    }
-    else
-    {
-        free(sc);
-        return NULL;
-    }
+    if (!strchr(sc->dev, '/'))
+        return;
     if (option_debug)
-        cw_log(LOG_DEBUG, "Device '%s/%s' changed to state '%d' (%s)\n", technology, loc, sc->state, devstate2str(sc->state));
+        cw_log(LOG_DEBUG, "Device '%s' changed to state '%d' (%s)\n", sc->dev, sc->state, devstate2str(sc->state));
     cw_mutex_lock(&qlock);
-    for (q = queues; q; q = q->next)
+    for (cur = member_index[cw_hash_string_tolower(sc->dev) % MEMBER_INDEX_BUCKETS];  cur;  cur = cur->hash_next)
     {
+        if (strcasecmp(sc->dev, cur->interface))
+            continue;
+        q = cur->parent;
         cw_mutex_lock(&q->lock);
-        cur = q->members;
-        while (cur)
+        if (cur->status != sc->state)
         {
-            if (!strcasecmp(sc->dev, cur->interface))
+            cur->status = sc->state;
+            if (!q->maskmemberstatus)
             {
-                if (cur->status != sc->state)
-                {
-                    cur->status = sc->state;
-                    if (!q->maskmemberstatus)
-                    {
-                        manager_event(EVENT_FLAG_AGENT, "QueueMemberStatus",
-                                      "Queue: %s\r\n"
-                                      "Location: %s\r\n"
-                                      "Membership: %s\r\n"
-                                      "Penalty: %d\r\n"
-                                      "CallsTaken: %d\r\n"
-                                      "LastCall: %ld\r\n"
-                                      "Status: %d\r\n"
-                                      "Paused: %d\r\n",
-                                      q->name, cur->interface, cur->dynamic ? "dynamic" : "static",
-                                      cur->penalty, cur->calls, cur->lastcall, cur->status, cur->paused);
-                    }
-                }
+                manager_event(EVENT_FLAG_AGENT, "QueueMemberStatus",
+                              "Queue: %s\r\n"
+                              "Location: %s\r\n"
+                              "Membership: %s\r\n"
+                              "Penalty: %d\r\n"
+                              "CallsTaken: %d\r\n"
+                              "LastCall: %ld\r\n"
+                              "Status: %d\r\n"
+                              "Paused: %d\r\n",
+                              q->name, cur->interface, cur->dynamic ? "dynamic" : "static",
+                              cur->penalty, cur->calls, cur->lastcall, cur->status, cur->paused);
             }
-            cur = cur->next;
         }
         cw_mutex_unlock(&q->lock);
     }
     cw_mutex_unlock(&qlock);
-    free(sc);
+}
+
+static void *changethread(void *data)
+{
+    struct statechange *sc, **link;
+
+    for (;;)
+    {
+        cw_mutex_lock(&statechange_lock);
+        while (!statechange_head  &&  !statechange_stop)
+            cw_cond_wait(&statechange_cond, &statechange_lock);
+        if (!(sc = statechange_head))
+        {
+            cw_mutex_unlock(&statechange_lock);
+            break;
+        }
+        if (!(statechange_head = sc->next))
+            statechange_tail = NULL;
+        link = &statechange_hash[cw_hash_string_tolower(sc->dev) % STATECHANGE_BUCKETS];
+        for (  ;  *link;  link = &(*link)->hash_next)
+        {
+            if (*link == sc)
+            {
+                *link = sc->hash_next;
+                break;
+            }
+        }
+        statechange_pending--;
+        cw_mutex_unlock(&statechange_lock);
+
+        handle_statechange(sc);
+        free(sc);
+    }
     return NULL;
 }
 
 static int statechange_queue(const char *dev, int state, void *ign)
 {
-    /* Avoid potential for deadlocks by spawning a new thread to handle the event */
+    /* Avoid potential for deadlocks by handing the event to our own thread */
     struct statechange *sc;
-    pthread_t t;
-    pthread_attr_t attr;
+    unsigned int h = cw_hash_string_tolower(dev) % STATECHANGE_BUCKETS;
 
-    sc = malloc(sizeof(struct statechange) + strlen(dev) + 1);
-    if (sc)
+    cw_mutex_lock(&statechange_lock);
+    for (sc = statechange_hash[h];  sc;  sc = sc->hash_next)
     {
-        sc->state = state;
-        strcpy(sc->dev, dev);
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        if (cw_pthread_create(&t, &attr, changethread, sc))
+        if (!strcasecmp(sc->dev, dev))
         {
-            cw_log(LOG_WARNING, "Failed to create update thread!\n");
-            free(sc);
+            /* Not handled yet, so only the latest state matters */
+            sc->state = state;
+            cw_mutex_unlock(&statechange_lock);
+            return 0;
         }
-        pthread_attr_destroy(&attr);
     }
+    if (statechange_pending >= STATECHANGE_MAX_PENDING)
+    {
+        if (!(statechange_dropped++ % 1000))
+            cw_log(LOG_WARNING, "Device state queue full, dropped %d update(s)\n", statechange_dropped);
+        cw_mutex_unlock(&statechange_lock);
+        return 0;
+    }
+    if ((sc = malloc(sizeof(struct statechange) + strlen(dev) + 1)))
+    {
+        sc->state = state;
+        strcpy(sc->dev, dev);
+        sc->next = NULL;
+        sc->hash_next = statechange_hash[h];
+        statechange_hash[h] = sc;
+        if (statechange_tail)
+            statechange_tail->next = sc;
+        else
+            statechange_head = sc;
+        statechange_tail = sc;
+        statechange_pending++;
+        cw_cond_signal(&statechange_cond);
+    }
+    cw_mutex_unlock(&statechange_lock);
     return 0;
 }
 
@@ -879,6 +989,7 @@ static void rt_handle_member_record(struct cw_call_queue *q, char *interface, co
             {
                 q->members = m;
             }
+            member_index_add(q, m);
         }
     }
     else
@@ -958,6 +1069,7 @@ static struct cw_call_queue *reload_queue_rt(const char *queuename, struct cw_va
                 {
                     prev_q->next = q->next;
                 }
+                free_members(q, 1);
                 cw_mutex_unlock(&q->lock);
                 free(q);
             }
@@ -1029,6 +1141,7 @@ static struct cw_call_queue *reload_queue_rt(const char *queuename, struct cw_va
                 prev_m->next = next_m;
             else
                 q->members = next_m;
+            member_index_del(m);
             free(m);
         }
         else
@@ -1138,30 +1251,6 @@ static int join_queue(char *queuename, struct queue_ent *qe, enum queue_result *
     return res;
 }
 
-static void free_members(struct cw_call_queue *q, int all)
-{
-    /* Free non-dynamic members */
-    struct member *curm, *next, *prev;
-
-    curm = q->members;
-    prev = NULL;
-    while (curm)
-    {
-        next = curm->next;
-        if (all  ||  !curm->dynamic)
-        {
-            if (prev)
-                prev->next = next;
-            else
-                q->members = next;
-            free(curm);
-        }
-        else
-            prev = curm;
-        curm = next;
-    }
-}
-
 static void destroy_queue(struct cw_call_queue *q)
 {
     struct cw_call_queue *cur, *prev = NULL;
@@ -1181,8 +1270,9 @@ static void destroy_queue(struct cw_call_queue *q)
             prev = cur;
         }
     }
-    cw_mutex_unlock(&qlock);
+    /* Members must leave the interface index under qlock */
     free_members(q, 1);
+    cw_mutex_unlock(&qlock);
     cw_mutex_destroy(&q->lock);
     free(q);
 }
@@ -2815,6 +2905,7 @@ static int remove_from_queue(char *queuename, char *interface, time_t *added)
                               q->name, last_member->interface);
                 if (added != NULL)
                     *added = last_member->added;
+                member_index_del(last_member);
                 free(last_member);
 
                 if (queue_persistent_members)
@@ -2897,6 +2988,7 @@ static int add_to_queue(char *queuename, char *interface, int penalty, int pause
                     new_member->dynamic = 1;
                     new_member->next = q->members;
                     q->members = new_member;
+                    member_index_add(q, new_member);
                     manager_event(EVENT_FLAG_AGENT, "QueueMemberAdded",
                                   "Queue: %s\r\n"
                                   "Location: %s\r\n"
@@ -3685,6 +3777,7 @@ static void reload_queues(void)
                             else
                                 q->members = cur;
                             prev = cur;
+                            member_index_add(q, cur);
                         }
                     }
                     else
@@ -3717,7 +3810,10 @@ static void reload_queues(void)
             else
                 queues = q->next;
             if (!q->count)
+            {
+                free_members(q, 1);
                 free(q);
+            }
             else
                 cw_log(LOG_WARNING, "XXX Leaking a little memory :( XXX\n");
         }
@@ -4358,6 +4454,15 @@ int unload_module(void)
     cw_manager_unregister("QueuePause");
     cw_manager_unregister("QueueMemberUpdate");
     cw_devstate_del(statechange_queue, NULL);
+    if (statechange_thread != CW_PTHREADT_NULL)
+    {
+        cw_mutex_lock(&statechange_lock);
+        statechange_stop = 1;
+        cw_cond_signal(&statechange_cond);
+        cw_mutex_unlock(&statechange_lock);
+        pthread_join(statechange_thread, NULL);
+        statechange_thread = CW_PTHREADT_NULL;
+    }
     res |= cw_unregister_application(app_aqm);
     res |= cw_unregister_application(app_rqm);
     res |= cw_unregister_application(app_pqm);
@@ -4374,6 +4479,13 @@ int load_module(void)
     cw_cli_register(&cli_show_queues);
     cw_cli_register(&cli_add_queue_member);
     cw_cli_register(&cli_remove_queue_member);
+    cw_cond_init(&statechange_cond, NULL);
+    statechange_stop = 0;
+    if (cw_pthread_create(&statechange_thread, NULL, changethread, NULL))
+    {
+        cw_log(LOG_ERROR, "Unable to start device state thread\n");
+        statechange_thread = CW_PTHREADT_NULL;
+    }
     cw_devstate_add(statechange_queue, NULL);
     cw_manager_register("Queues", 0, manager_queues_show, "Queues");
     cw_manager_register("QueueStatus", 0, manager_queues_status, "Queue Status");
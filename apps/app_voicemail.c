@@ -49,6 +49,9 @@
 #include <sys/mman.h>
 #include <time.h>
 #include <dirent.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
 #include <spandsp.h>
 
@@ -2087,6 +2090,312 @@ yuck:
 
 #else
 
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Message count index.
+ *
+ * MWI asks has_voicemail() and messagecount() about every subscribed
+ * mailbox, over and over, and each answer used to read the folder.  A
+ * folder is now listed once, on its first query, and then followed with
+ * inotify, so later answers come from memory.  Pending events are applied
+ * before each answer, which keeps it exact right after leave_voicemail(),
+ * save_to_folder(), vm_delete() or resequence_mailbox() have touched the
+ * folder, and picks up anything else writing to the spool as well.  The
+ * names of the msg* files are kept rather than bare counts, so a rename
+ * over an existing message, or an event for a file the listing already
+ * saw, can't make a count drift.  Folders that don't exist yet, or can't be
+ * watched, are still read each time.
+ */
+#define VM_INDEX_BUCKETS	1024
+
+struct vm_index_folder {
+	struct vm_index_folder *next;		/* Same key bucket */
+	struct vm_index_folder *wdnext;		/* Same watch descriptor bucket */
+	unsigned int hash;
+	int wd;
+	int nmsgs;				/* How many of the names are msg*.txt */
+	int nnames;
+	int maxnames;
+	char **names;				/* The msg* files in the folder */
+	char key[0];				/* context/mailbox/folder */
+};
+
+CW_MUTEX_DEFINE_STATIC(vm_index_lock);
+static struct vm_index_folder *vm_index[VM_INDEX_BUCKETS];
+static struct vm_index_folder *vm_index_wds[VM_INDEX_BUCKETS];
+static int vm_index_fd = -1;
+static int vm_index_full = 0;
+
+static unsigned int vm_index_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (unsigned char) *key++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* 0 for names that aren't messages, 1 for msg* files, 2 for msg*.txt */
+static int vm_index_msgtype(const char *name)
+{
+	size_t len;
+
+	if (strncasecmp(name, "msg", 3))
+		return 0;
+	len = strlen(name);
+	if (len > 3 && !strcasecmp(name + len - 3, "txt"))
+		return 2;
+	return 1;
+}
+
+static void vm_index_add_name(struct vm_index_folder *f, const char *name)
+{
+	char **names;
+	int type;
+	int x;
+
+	if (!(type = vm_index_msgtype(name)))
+		return;
+	for (x = 0;  x < f->nnames;  x++) {
+		if (!strcmp(f->names[x], name))
+			return;
+	}
+	if (f->nnames == f->maxnames) {
+		if (!(names = realloc(f->names, (f->maxnames + 32) * sizeof(*names))))
+			return;
+		f->names = names;
+		f->maxnames += 32;
+	}
+	if (!(f->names[f->nnames] = strdup(name)))
+		return;
+	f->nnames++;
+	if (type == 2)
+		f->nmsgs++;
+}
+
+static void vm_index_del_name(struct vm_index_folder *f, const char *name)
+{
+	int x;
+
+	for (x = 0;  x < f->nnames;  x++) {
+		if (!strcmp(f->names[x], name)) {
+			if (vm_index_msgtype(name) == 2)
+				f->nmsgs--;
+			free(f->names[x]);
+			f->names[x] = f->names[--f->nnames];
+			return;
+		}
+	}
+}
+
+static void vm_index_free(struct vm_index_folder *f)
+{
+	int x;
+
+	for (x = 0;  x < f->nnames;  x++)
+		free(f->names[x]);
+	free(f->names);
+	free(f);
+}
+
+/* Drops a folder from the index.  Call with vm_index_lock held */
+static void vm_index_forget(struct vm_index_folder *f, int rmwatch)
+{
+	struct vm_index_folder **p;
+
+	for (p = &vm_index[f->hash % VM_INDEX_BUCKETS];  *p;  p = &(*p)->next) {
+		if (*p == f) {
+			*p = f->next;
+			break;
+		}
+	}
+	for (p = &vm_index_wds[f->wd % VM_INDEX_BUCKETS];  *p;  p = &(*p)->wdnext) {
+		if (*p == f) {
+			*p = f->wdnext;
+			break;
+		}
+	}
+	if (rmwatch)
+		inotify_rm_watch(vm_index_fd, f->wd);
+	vm_index_free(f);
+}
+
+static struct vm_index_folder *vm_index_by_wd(int wd)
+{
+	struct vm_index_folder *f;
+
+	for (f = vm_index_wds[wd % VM_INDEX_BUCKETS];  f;  f = f->wdnext) {
+		if (f->wd == wd)
+			break;
+	}
+	return f;
+}
+
+/* Applies everything inotify has queued.  Call with vm_index_lock held */
+static void vm_index_sync(void)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct vm_index_folder *f;
+	ssize_t len;
+	char *p;
+	int x;
+
+	while ((len = read(vm_index_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf;  p < buf + len;  p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Events were lost, so nothing indexed can be trusted */
+				cw_log(LOG_NOTICE, "Voicemail index overflowed, relisting folders\n");
+				for (x = 0;  x < VM_INDEX_BUCKETS;  x++) {
+					while (vm_index[x])
+						vm_index_forget(vm_index[x], 1);
+				}
+				return;
+			}
+			if (!(f = vm_index_by_wd(ev->wd)))
+				continue;
+			if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+				vm_index_forget(f, !(ev->mask & IN_IGNORED));
+				continue;
+			}
+			if (!ev->len || (ev->mask & IN_ISDIR))
+				continue;
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				vm_index_add_name(f, ev->name);
+			else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				vm_index_del_name(f, ev->name);
+		}
+	}
+}
+
+/* Finds a folder in the index, listing and watching it if it isn't there
+   yet.  Call with vm_index_lock held */
+static struct vm_index_folder *vm_index_get(const char *context, const char *mailbox, const char *folder)
+{
+	struct vm_index_folder *f;
+	struct dirent *de;
+	char key[256];
+	char fn[512];
+	unsigned int hash;
+	DIR *dir;
+	int wd;
+
+	if (vm_index_fd < 0)
+		return NULL;
+	vm_index_sync();
+
+	snprintf(key, sizeof(key), "%s/%s/%s", context, mailbox, folder);
+	hash = vm_index_hash(key);
+	for (f = vm_index[hash % VM_INDEX_BUCKETS];  f;  f = f->next) {
+		if (f->hash == hash && !strcmp(f->key, key))
+			return f;
+	}
+
+	/* The watch goes first, so nothing that happens while listing is lost */
+	snprintf(fn, sizeof(fn), "%s/%s", VM_SPOOL_DIR, key);
+	wd = inotify_add_watch(vm_index_fd, fn, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	if (wd < 0) {
+		if (errno == ENOSPC && !vm_index_full) {
+			cw_log(LOG_WARNING, "Out of inotify watches, voicemail folders past this one are read on every query\n");
+			vm_index_full = 1;
+		}
+		return NULL;
+	}
+	/* The same directory under two names (symlinked mailboxes) is only
+	   indexed under the first */
+	if (vm_index_by_wd(wd))
+		return NULL;
+	if (!(dir = opendir(fn))) {
+		inotify_rm_watch(vm_index_fd, wd);
+		return NULL;
+	}
+	if (!(f = calloc(1, sizeof(*f) + strlen(key) + 1))) {
+		closedir(dir);
+		inotify_rm_watch(vm_index_fd, wd);
+		return NULL;
+	}
+	strcpy(f->key, key);
+	f->hash = hash;
+	f->wd = wd;
+	while ((de = readdir(dir)))
+		vm_index_add_name(f, de->d_name);
+	closedir(dir);
+
+	f->next = vm_index[hash % VM_INDEX_BUCKETS];
+	vm_index[hash % VM_INDEX_BUCKETS] = f;
+	f->wdnext = vm_index_wds[wd % VM_INDEX_BUCKETS];
+	vm_index_wds[wd % VM_INDEX_BUCKETS] = f;
+	return f;
+}
+
+/*! Looks up the msg* files, and msg*.txt messages, in a folder.  Returns 0
+    with the counts set, or -1 if the folder has to be read instead */
+static int vm_index_count(const char *context, const char *mailbox, const char *folder, int *files, int *msgs)
+{
+	struct vm_index_folder *f;
+	int res = -1;
+
+	cw_mutex_lock(&vm_index_lock);
+	if ((f = vm_index_get(context, mailbox, folder))) {
+		if (files)
+			*files = f->nnames;
+		if (msgs)
+			*msgs = f->nmsgs;
+		res = 0;
+	}
+	cw_mutex_unlock(&vm_index_lock);
+	return res;
+}
+
+static void vm_index_init(void)
+{
+	cw_mutex_lock(&vm_index_lock);
+	if (vm_index_fd < 0) {
+		vm_index_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (vm_index_fd < 0)
+			cw_log(LOG_WARNING, "Unable to watch the voicemail spool (%s), mailboxes will be read on every query\n", strerror(errno));
+	}
+	cw_mutex_unlock(&vm_index_lock);
+}
+
+static void vm_index_destroy(void)
+{
+	struct vm_index_folder *f;
+	int x;
+
+	cw_mutex_lock(&vm_index_lock);
+	for (x = 0;  x < VM_INDEX_BUCKETS;  x++) {
+		while ((f = vm_index[x])) {
+			vm_index[x] = f->next;
+			vm_index_free(f);
+		}
+		vm_index_wds[x] = NULL;
+	}
+	if (vm_index_fd > -1) {
+		close(vm_index_fd);
+		vm_index_fd = -1;
+	}
+	vm_index_full = 0;
+	cw_mutex_unlock(&vm_index_lock);
+}
+#else
+static int vm_index_count(const char *context, const char *mailbox, const char *folder, int *files, int *msgs)
+{
+	return -1;
+}
+
+static void vm_index_init(void)
+{
+}
+
+static void vm_index_destroy(void)
+{
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
 static int has_voicemail(const char *mailbox, const char *folder)
 {
 	DIR *dir;
@@ -2096,6 +2405,7 @@ static int has_voicemail(const char *mailbox, const char *folder)
 	char *mb, *cur;
 	char *context;
 	int ret;
+	int files;
 	if (!folder)
 		folder = "INBOX";
 	/* If no mailbox, return immediately */
@@ -2120,6 +2430,8 @@ static int has_voicemail(const char *mailbox, const char *folder)
 		context++;
 	} else
 		context = "default";
+	if (!vm_index_count(context, tmp, folder, &files, NULL))
+		return (files > 0);
 	snprintf(fn, sizeof(fn), "%s/%s/%s/%s", VM_SPOOL_DIR, context, tmp, folder);
 	dir = opendir(fn);
 	if (!dir)
@@ -2177,6 +2489,10 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 		context++;
 	} else
 		context = "default";
+	if (newmsgs && !vm_index_count(context, tmp, "INBOX", NULL, newmsgs))
+		newmsgs = NULL;
+	if (oldmsgs && !vm_index_count(context, tmp, "Old", NULL, oldmsgs))
+		oldmsgs = NULL;
 	if (newmsgs) {
 		snprintf(fn, sizeof(fn), "%s/%s/%s/INBOX", VM_SPOOL_DIR, context, tmp);
 		dir = opendir(fn);
@@ -6139,6 +6455,9 @@ int unload_module(void)
 	cw_cli_unregister(&show_voicemail_users_cli);
 	cw_cli_unregister(&show_voicemail_zones_cli);
 	cw_uninstall_vm_functions();
+#ifndef USE_ODBC_STORAGE
+	vm_index_destroy();
+#endif
 	return res;
 }
 
@@ -6161,6 +6480,9 @@ int load_module(void)
 	/* compute the location of the voicemail spool directory */
 	snprintf(VM_SPOOL_DIR, sizeof(VM_SPOOL_DIR), "%s/voicemail/", cw_config_CW_SPOOL_DIR);
 
+#ifndef USE_ODBC_STORAGE
+	vm_index_init();
+#endif
 	cw_install_vm_functions(has_voicemail, messagecount);
 
 #if defined(USE_ODBC_STORAGE) && !defined(EXTENDED_ODBC_STORAGE)
@@ -57,6 +57,7 @@
 #include "callweaver/icd/icd_caller.h"
 #include "callweaver/icd/icd_member.h"
 #include "callweaver/icd/icd_member_list.h"
+#include "callweaver/icd/icd_pqueue.h"
 #include "callweaver/icd/icd_agent.h"
 #include "callweaver/icd/icd_customer.h"
 #include "callweaver/icd/icd_plugable_fn.h"
@@ -65,6 +66,8 @@
 
 #include "callweaver/icd/icd_bridge.h"
 #include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
 
 // ----------
 struct cw_channel *agent_channel0 = NULL;
@@ -81,6 +84,11 @@ icd_status icd_distributor__remove_caller(icd_distributor *that, icd_caller *tha
 icd_status icd_distributor__add_caller(icd_distributor *that, icd_member *new_member);
 icd_status icd_distributor__pushback_caller(icd_distributor *that, icd_member *new_member);
 
+/* Agent pqueue used by the keyed strategies */
+static icd_status icd_distributor__set_agent_key_fn(icd_distributor *that, long (*key_fn)(icd_member *member));
+static void icd_distributor__rebuild_agent_pq(icd_distributor *that);
+static icd_member *icd_distributor__pop_agent_locked(icd_distributor *dist);
+
 /*===== Protected functions =====*/
 
 icd_status icd_distributor__select_bridger(icd_caller *primary, 
@@ -259,6 +267,10 @@ icd_status icd_distributor__clear(icd_distributor *that) {
     that->customer_list_allocated = 0;
     that->agent_list_allocated = 0;
     pthread_cancel(that->thread);
+    if (that->agent_pq != NULL) {
+        destroy_icd_pqueue(&(that->agent_pq));
+    }
+    that->agent_key_fn = NULL;
     cw_cond_destroy(&(that->wakeup));
     cw_mutex_destroy(&(that->lock));
     
@@ -309,7 +321,7 @@ icd_status icd_distributor__add_agent_list(icd_distributor *that, icd_member_lis
     result = icd_list__merge((icd_list *)that->agents, (icd_list *)new_list);
     if (icd_distributor__agents_pending(that) > 0) {
         result = icd_distributor__lock(that);
-        cw_cond_signal(&(that->wakeup));
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
         result = icd_distributor__unlock(that);
     }
     return result;
@@ -385,7 +397,7 @@ icd_status icd_distributor__add_customer_list(icd_distributor *that, icd_member_
     result = icd_list__merge((icd_list *)that->customers, (icd_list *)new_list);
     if (icd_distributor__customers_pending(that)) {
         result = icd_distributor__lock(that);
-        cw_cond_signal(&(that->wakeup));
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
         result = icd_distributor__unlock(that);
     }
     return result;
@@ -434,6 +446,10 @@ icd_status icd_distributor__start_distributing(icd_distributor *that) {
     assert(that != NULL);
 
     that->thread_state = ICD_THREAD_STATE_RUNNING;
+    if (icd_distributor__lock(that) == ICD_SUCCESS) {
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_STATE_CHANGED);
+        icd_distributor__unlock(that);
+    }
     cw_verbose(VERBOSE_PREFIX_1 "Started [%s] State[%d] \n", 
             icd_distributor__get_name(that), that->thread_state);
     return ICD_SUCCESS;
@@ -444,6 +460,10 @@ icd_status icd_distributor__pause_distributing(icd_distributor *that) {
     assert(that != NULL);
 
     that->thread_state = ICD_THREAD_STATE_PAUSED;
+    if (icd_distributor__lock(that) == ICD_SUCCESS) {
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_STATE_CHANGED);
+        icd_distributor__unlock(that);
+    }
     return ICD_SUCCESS;
 }
 
@@ -452,6 +472,10 @@ icd_status icd_distributor__stop_distributing(icd_distributor *that) {
     assert(that != NULL);
 
     that->thread_state = ICD_THREAD_STATE_FINISHED;
+    if (icd_distributor__lock(that) == ICD_SUCCESS) {
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_STATE_CHANGED);
+        icd_distributor__unlock(that);
+    }
     return ICD_SUCCESS;
 }
 
@@ -472,7 +496,7 @@ icd_status icd_distributor__set_agent_list(icd_distributor *that, icd_member_lis
     that->agents = agents;
     if (icd_distributor__agents_pending(that)) {
         result = icd_distributor__lock(that);
-        cw_cond_signal(&(that->wakeup));
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
         result = icd_distributor__unlock(that);
     }
     return result;
@@ -499,7 +523,7 @@ icd_status icd_distributor__set_customer_list(icd_distributor *that, icd_member_
     that->customers = customers;
     if (icd_distributor__customers_pending(that)) {
         result = icd_distributor__lock(that);
-        cw_cond_signal(&(that->wakeup));
+        icd_distributor__post_event(that, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
         result = icd_distributor__unlock(that);
     }
     return result;
@@ -672,7 +696,7 @@ icd_status icd_distributor__link_callers_via_pop(icd_distributor *dist, void *ex
         return ICD_ENOTFOUND;
     }
 
-    agent_member = icd_member_list__pop_locked(dist->agents);
+    agent_member = icd_distributor__pop_agent_locked(dist);
     if(agent_member) {
         if (icd_member__lock(agent_member) == ICD_SUCCESS){
         	agent_caller = icd_member__get_caller(agent_member);
@@ -920,6 +944,12 @@ icd_status icd_distributor__standard_dump(icd_distributor *dist, int verbosity,
 
     cw_cli(fd,"%slink_fn=%p\n", indent,dist->link_fn);
     cw_cli(fd,"%sdump_fn=%p\n", indent,dist->dump_fn);
+    cw_cli(fd,"%sevents handled=%u folded=%u pending=%d\n", indent,
+            dist->events_handled, dist->events_folded, dist->event_count);
+    cw_cli(fd,"%slinks made=%u failed=%u\n", indent, dist->links_made, dist->links_failed);
+    if (dist->agent_pq != NULL) {
+        cw_cli(fd,"%sagent_pq=%d queued\n", indent, icd_pqueue__count(dist->agent_pq));
+    }
     cw_cli(fd,"\n%scustomers=%p (%s) {\n", indent,dist->customers, 
             dist->customer_list_allocated ? "alloced" : "on heap");
     if (verbosity > 1) {
@@ -1144,10 +1174,14 @@ void *icd_distributor__run(void *that) {
 	return dist->run_fn(that);
 }
 
-/* The run method for the distributor thread. */
+/* The run method for the distributor thread. The thread sleeps until an
+   event is posted to the distributor, and only then tries to link the
+   waiting customers and agents. */
 void *icd_distributor__standard_run(void *that) {
     icd_distributor *dist;
+    icd_distributor_event_type event;
     icd_status result;
+    int retry = 0;
 
     assert(that != NULL);
     assert(((icd_distributor *)that)->customers != NULL);
@@ -1155,41 +1189,211 @@ void *icd_distributor__standard_run(void *that) {
 
     dist = (icd_distributor *)that;
     
+    result = icd_distributor__lock(dist);
     while (dist->thread_state != ICD_THREAD_STATE_FINISHED) {
-        if (dist->thread_state == ICD_THREAD_STATE_RUNNING) {
-            result = icd_distributor__lock(dist);
-            /* Distribute callers if we can, or pause until some are added */
-            if (icd_distributor__customers_pending(dist) && 
-                    icd_distributor__agents_pending(dist)) {
-                icd_distributor__reset_added_callers_number(dist);
-                result = icd_distributor__unlock(dist);
-                /* func ptr to the icd_distributor__link_callers_via_?? note may also come from custom
-                 * function eg from icd_mod_?? installed using icd_distributor__set_link_callers_fn
-                */
-                if (icd_verbose > 4)
-                    cw_verbose(VERBOSE_PREFIX_3 "Distributor__run [%s] link_fn[%p]  \n", 
-                        icd_distributor__get_name(dist), dist->link_fn);
-                result = dist->link_fn(dist, dist->link_fn_extra);  
-            } else {
-                cw_cond_wait(&(dist->wakeup), &(dist->lock)); /* wait until signal received */
-                result = icd_distributor__unlock(dist);
-                if (icd_verbose > 4)
-                    cw_verbose(VERBOSE_PREFIX_3 "Distributor__run [%s] wait  \n", 
-                        icd_distributor__get_name(dist));
-            }
-        } else {
-            /* TBD - Make paused thread work better. 
-             *        - Use cw_cond_wait()
-             *        - Use same or different condition variable? 
-             */
+        /* While paused, events stay queued until we are started again */
+        event = icd_distributor__wait_event(dist, retry ? ICD_DISTRIBUTOR_RETRY_MS : 0);
+        if (event == ICD_DISTRIBUTOR_EVENT_NONE) {
+            continue;
+        }
+        dist->events_handled++;
+        if (icd_verbose > 4)
+            cw_verbose(VERBOSE_PREFIX_3 "Distributor__run [%s] event[%d]  \n", 
+                icd_distributor__get_name(dist), event);
+        /* Nothing to link until both sides have someone waiting */
+        if (!icd_distributor__customers_pending(dist) || 
+                !icd_distributor__agents_pending(dist)) {
+            retry = 0;
+            continue;
         }
-        /* Play nice */
-        sched_yield();
+        icd_distributor__reset_added_callers_number(dist);
+        result = icd_distributor__unlock(dist);
+        retry = icd_distributor__link_pending(dist);
+        result = icd_distributor__lock(dist);
     }
+    result = icd_distributor__unlock(dist);
     /* Do any cleanup here */
     return NULL;
 }
 
+/* Call the link function for as long as it makes progress. Returns true if
+   a link failed without changing the lists, in which case the run thread
+   retries on a timeout rather than waiting for the next event. */
+int icd_distributor__link_pending(icd_distributor *dist) {
+    icd_status result;
+    int before;
+    int after;
+
+    while (dist->thread_state == ICD_THREAD_STATE_RUNNING &&
+            icd_distributor__customers_pending(dist) && 
+            icd_distributor__agents_pending(dist)) {
+        before = icd_distributor__customers_pending(dist) + icd_distributor__agents_pending(dist);
+        /* func ptr to the icd_distributor__link_callers_via_?? note may also come from custom
+         * function eg from icd_mod_?? installed using icd_distributor__set_link_callers_fn
+        */
+        if (icd_verbose > 4)
+            cw_verbose(VERBOSE_PREFIX_3 "Distributor__run [%s] link_fn[%p]  \n", 
+                icd_distributor__get_name(dist), dist->link_fn);
+        result = dist->link_fn(dist, dist->link_fn_extra);  
+        after = icd_distributor__customers_pending(dist) + icd_distributor__agents_pending(dist);
+        if (result == ICD_SUCCESS) {
+            dist->links_made++;
+        } else {
+            dist->links_failed++;
+        }
+        if (after >= before) {
+            /* No one left either list, so another pass now would do the same thing */
+            return result != ICD_SUCCESS;
+        }
+    }
+    return 0;
+}
+
+/* Queue an event for the run thread and wake it up. Must be called with the
+   distributor locked. */
+void icd_distributor__post_event(icd_distributor *that, icd_distributor_event_type event) {
+    int tail;
+
+    assert(that != NULL);
+
+    tail = (that->event_head + that->event_count - 1) % ICD_DISTRIBUTOR_EVENT_QUEUE_LEN;
+    if (that->event_count == ICD_DISTRIBUTOR_EVENT_QUEUE_LEN ||
+            (that->event_count > 0 && that->events[tail] == event)) {
+        /* The thread will look at the lists anyway, no need to queue it twice */
+        that->events_folded++;
+    } else {
+        tail = (that->event_head + that->event_count) % ICD_DISTRIBUTOR_EVENT_QUEUE_LEN;
+        that->events[tail] = event;
+        that->event_count++;
+    }
+    cw_cond_signal(&(that->wakeup));
+}
+
+/* Take the next event off the queue, waiting for one if there is none. With a
+   timeout, ICD_DISTRIBUTOR_EVENT_TIMEOUT is returned if nothing came in. Returns
+   ICD_DISTRIBUTOR_EVENT_NONE if the thread state changed or we are paused.
+   Must be called with the distributor locked. */
+icd_distributor_event_type icd_distributor__wait_event(icd_distributor *that, int timeout_ms) {
+    icd_distributor_event_type event;
+    struct timeval tv;
+    struct timespec ts;
+
+    assert(that != NULL);
+
+    if (that->thread_state == ICD_THREAD_STATE_RUNNING && that->event_count == 0) {
+        if (timeout_ms > 0) {
+            tv = cw_tvadd(cw_tvnow(), cw_samp2tv(timeout_ms, 1000));
+            ts.tv_sec = tv.tv_sec;
+            ts.tv_nsec = tv.tv_usec * 1000;
+            if (cw_cond_timedwait(&(that->wakeup), &(that->lock), &ts) == ETIMEDOUT &&
+                    that->event_count == 0) {
+                return ICD_DISTRIBUTOR_EVENT_TIMEOUT;
+            }
+        } else {
+            cw_cond_wait(&(that->wakeup), &(that->lock)); /* wait until signal received */
+        }
+    } else if (that->thread_state == ICD_THREAD_STATE_PAUSED) {
+        cw_cond_wait(&(that->wakeup), &(that->lock)); /* wait until started or stopped */
+        return ICD_DISTRIBUTOR_EVENT_NONE;
+    }
+    if (that->thread_state != ICD_THREAD_STATE_RUNNING || that->event_count == 0) {
+        return ICD_DISTRIBUTOR_EVENT_NONE;
+    }
+    event = that->events[that->event_head];
+    that->event_head = (that->event_head + 1) % ICD_DISTRIBUTOR_EVENT_QUEUE_LEN;
+    that->event_count--;
+    return event;
+}
+
+/* Switch the agent side of a distributor over to a pqueue ordered by key_fn.
+   The agent list is kept in fifo order from then on, and the pqueue decides
+   which agent is popped next. */
+static icd_status icd_distributor__set_agent_key_fn(icd_distributor *that, long (*key_fn)(icd_member *member)) {
+    assert(that != NULL);
+    assert(key_fn != NULL);
+
+    if (that->agent_pq == NULL) {
+        that->agent_pq = create_icd_pqueue(icd_list__size((icd_list *)that->agents), icd_member__get_pq_slot);
+        if (that->agent_pq == NULL) {
+            return ICD_ERESOURCE;
+        }
+    }
+    that->agent_key_fn = key_fn;
+    icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_fifo, NULL);
+    return ICD_SUCCESS;
+}
+
+/* Requeue every agent in the list. Only needed when agents got onto the list
+   without going through icd_distributor__add_caller (list merges and swaps).
+   Call with the distributor and the agent list locked. */
+static void icd_distributor__rebuild_agent_pq(icd_distributor *that) {
+    icd_list_iterator *iter;
+    icd_member *member;
+
+    icd_pqueue__clear(that->agent_pq);
+    iter = icd_list__get_iterator((icd_list *)(that->agents));
+    if (iter == NULL) {
+        return;
+    }
+    while (icd_list_iterator__has_more_nolock(iter)) {
+        member = (icd_member *) icd_list_iterator__next(iter);
+        if (member != NULL) {
+            icd_pqueue__push(that->agent_pq, member, that->agent_key_fn(member));
+        }
+    }
+    destroy_icd_list_iterator(&iter);
+}
+
+/* Pop the next agent to link. For the keyed strategies that is the top of the
+   agent pqueue, otherwise it is the head of the agent list. Like
+   icd_member_list__pop_locked() the agent list stays locked if a member
+   is returned. */
+static icd_member *icd_distributor__pop_agent_locked(icd_distributor *dist) {
+    icd_member *member = NULL;
+
+    if (dist->agent_pq == NULL) {
+        return icd_member_list__pop_locked(dist->agents);
+    }
+    if (icd_distributor__lock(dist) != ICD_SUCCESS) {
+        return NULL;
+    }
+    if (icd_member_list__lock(dist->agents) != ICD_SUCCESS) {
+        icd_distributor__unlock(dist);
+        return NULL;
+    }
+    if (icd_pqueue__count(dist->agent_pq) != icd_distributor__agents_pending(dist)) {
+        icd_distributor__rebuild_agent_pq(dist);
+    }
+    while ((member = icd_pqueue__pop(dist->agent_pq)) != NULL) {
+        if (icd_member_list__remove_member_by_element(dist->agents, member) == ICD_SUCCESS) {
+            break;
+        }
+    }
+    icd_distributor__unlock(dist);
+    if (member == NULL) {
+        icd_member_list__unlock(dist->agents);
+    }
+    return member;
+}
+
+/* Keys for the agent pqueue, lowest key is linked first. These keep the order
+   the ordered agent list used to give each strategy. */
+static long icd_distributor__agent_key_newest_first(icd_member *member) {
+    return -(long) icd_caller__get_last_state_change(icd_member__get_caller(member));
+}
+
+static long icd_distributor__agent_key_oldest_first(icd_member *member) {
+    return (long) icd_caller__get_last_state_change(icd_member__get_caller(member));
+}
+
+static long icd_distributor__agent_key_priority(icd_member *member) {
+    return icd_caller__get_priority(icd_member__get_caller(member));
+}
+
+static long icd_distributor__agent_key_callcount(icd_member *member) {
+    return icd_caller__get_callcount(icd_member__get_caller(member));
+}
+
 /* Removes caller from list of members for this distributor. */
 /* TBD - Refactor this (and other removes) to only use member rather than caller. */
 icd_status icd_distributor__remove_caller(icd_distributor *that, icd_caller *that_caller) {
@@ -1212,13 +1416,21 @@ icd_status icd_distributor__remove_caller(icd_distributor *that, icd_caller *tha
         return ICD_EGENERAL;
     }
     member = icd_caller__get_member_for_distributor(that_caller, that);
+    if (target == that->agents && that->agent_pq != NULL && member != NULL) {
+        if (icd_distributor__lock(that) == ICD_SUCCESS) {
+            icd_pqueue__remove(that->agent_pq, member);
+            icd_distributor__unlock(that);
+        }
+    }
     return icd_member_list__remove_member_by_element(target, member);
 }
  
 /* Add a caller to the appropriate list in the distributor. */
 icd_status icd_distributor__add_caller(icd_distributor *that, icd_member *new_member) {
+    icd_distributor_event_type event;
     icd_status result;
     icd_caller *caller;
+    int queued;
 
     assert(that != NULL);
     assert(that->agents != NULL);
@@ -1227,23 +1439,32 @@ icd_status icd_distributor__add_caller(icd_distributor *that, icd_member *new_me
     caller = icd_member__get_caller(new_member);
     if(icd_caller__has_role(caller, ICD_AGENT_ROLE)) {
         result = icd_member_list__push(that->agents, new_member);
+        event = ICD_DISTRIBUTOR_EVENT_AGENT_ADDED;
     } else if(icd_caller__has_role(caller, ICD_CUSTOMER_ROLE)) {
         result = icd_member_list__push(that->customers, new_member);
+        event = ICD_DISTRIBUTOR_EVENT_CUSTOMER_ADDED;
     } else {
         cw_log(LOG_WARNING,"Danger Will Robinson!  No suitable role to join distributor!");
+        event = ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED;
     }
+    queued = (event == ICD_DISTRIBUTOR_EVENT_AGENT_ADDED && result == ICD_SUCCESS);
 
     result = icd_distributor__lock(that);
     that->number_of_callers_added++;
-    cw_cond_signal(&(that->wakeup));
+    if (queued && that->agent_pq != NULL) {
+        icd_pqueue__push(that->agent_pq, new_member, that->agent_key_fn(new_member));
+    }
+    icd_distributor__post_event(that, event);
     result = icd_distributor__unlock(that);
     return result;
 }
 
 /* Pushback a caller to the top of the appropriate list in the distributor. */
 icd_status icd_distributor__pushback_caller(icd_distributor *that, icd_member *new_member) {
+    icd_distributor_event_type event;
     icd_status result;
     icd_caller *caller;
+    int queued;
 
     assert(that != NULL);
     assert(that->agents != NULL);
@@ -1253,15 +1474,22 @@ icd_status icd_distributor__pushback_caller(icd_distributor *that, icd_member *n
     caller = icd_member__get_caller(new_member);
     if(icd_caller__has_role(caller, ICD_AGENT_ROLE)) {
         result = icd_member_list__pushback(that->agents, new_member);
+        event = ICD_DISTRIBUTOR_EVENT_AGENT_ADDED;
     } else if(icd_caller__has_role(caller, ICD_CUSTOMER_ROLE)) {
         result = icd_member_list__pushback(that->customers, new_member);
+        event = ICD_DISTRIBUTOR_EVENT_CUSTOMER_ADDED;
     } else {
         cw_log(LOG_WARNING,"Danger Will Robinson!  No suitable role to join distributor!");
+        event = ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED;
     }
+    queued = (event == ICD_DISTRIBUTOR_EVENT_AGENT_ADDED && result == ICD_SUCCESS);
 
     result = icd_distributor__lock(that);
     that->number_of_callers_added++;
-    cw_cond_signal(&(that->wakeup));
+    if (queued && that->agent_pq != NULL) {
+        icd_pqueue__push(that->agent_pq, new_member, that->agent_key_fn(new_member));
+    }
+    icd_distributor__post_event(that, event);
     result = icd_distributor__unlock(that);
     return result;
 }
@@ -1299,8 +1527,12 @@ icd_status init_icd_distributor_least_recent_agent(icd_distributor *that, char *
     /*that->name = strdup(name);*/
     icd_distributor__set_config_params(that, data);
     icd_distributor__create_lists(that, data);
-    icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
-            icd_member__cmp_last_state_change_reverse_order);
+    if (that->link_fn == icd_distributor__link_callers_via_pop) {
+        icd_distributor__set_agent_key_fn(that, icd_distributor__agent_key_newest_first);
+    } else {
+        icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
+                icd_member__cmp_last_state_change_reverse_order);
+    }
     icd_distributor__create_thread(that);
 
     return ICD_SUCCESS;
@@ -1315,8 +1547,12 @@ icd_status init_icd_distributor_most_recent_agent(icd_distributor *that, char *n
     /*that->name = strdup(name);*/
     icd_distributor__set_config_params(that, data);
     icd_distributor__create_lists(that, data);
-    icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
-            icd_member__cmp_last_state_change_order);
+    if (that->link_fn == icd_distributor__link_callers_via_pop) {
+        icd_distributor__set_agent_key_fn(that, icd_distributor__agent_key_oldest_first);
+    } else {
+        icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
+                icd_member__cmp_last_state_change_order);
+    }
     icd_distributor__create_thread(that);
 
     return ICD_SUCCESS;
@@ -1331,8 +1567,12 @@ icd_status init_icd_distributor_agent_priority(icd_distributor *that, char *name
     /*that->name = strdup(name);*/
     icd_distributor__set_config_params(that, data);
     icd_distributor__create_lists(that, data);
-    icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
-            icd_member__cmp_priority_order);
+    if (that->link_fn == icd_distributor__link_callers_via_pop) {
+        icd_distributor__set_agent_key_fn(that, icd_distributor__agent_key_priority);
+    } else {
+        icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
+                icd_member__cmp_priority_order);
+    }
     icd_distributor__create_thread(that);
 
     return ICD_SUCCESS;
@@ -1348,8 +1588,12 @@ icd_status init_icd_distributor_least_calls_agent(icd_distributor *that, char *n
     strncpy(that->name,name,sizeof(that->name));
     icd_distributor__set_config_params(that, data);
     icd_distributor__create_lists(that, data);
-    icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
-            icd_member__cmp_callcount_order);
+    if (that->link_fn == icd_distributor__link_callers_via_pop) {
+        icd_distributor__set_agent_key_fn(that, icd_distributor__agent_key_callcount);
+    } else {
+        icd_list__set_node_insert_func((icd_list *)that->agents, icd_list__insert_ordered,
+                icd_member__cmp_callcount_order);
+    }
     icd_distributor__create_thread(that);
 
     return ICD_SUCCESS;
@@ -78,6 +78,7 @@ struct icd_member {
     icd_listeners *listeners;
     icd_memory *memory;
     int allocated;
+    int pq_slot;                /* position in the distributor's agent pqueue, see icd_pqueue.h */
     cw_mutex_t lock;
 };
 
@@ -575,6 +576,14 @@ icd_caller *icd_member__get_caller(icd_member * that)
     return that->caller;
 }
 
+/* Gets the storage the distributor's pqueue uses to track this member */
+int *icd_member__get_pq_slot(void *that)
+{
+    assert(that != NULL);
+
+    return &(((icd_member *) that)->pq_slot);
+}
+
 /* Sets the number of calls dealt with by this member object */
 icd_status icd_member__set_calls(icd_member * that, int calls)
 {
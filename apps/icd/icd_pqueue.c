@@ -0,0 +1,312 @@
+/*
+ * ICD - Intelligent Call Distributor 
+ *
+ * Copyright (C) 2003, 2004, 2005
+ *
+ * Written by Anthony Minessale II <anthmct at yahoo dot com>
+ * Written by Bruce Atherton <bruce at callenish dot com>
+ * Additions, Changes and Support by Tim R. Clark <tclark at shaw dot ca>
+ * Changed to adopt to jabber interaction and adjusted for CallWeaver.org by
+ * Halo Kwadrat Sp. z o.o., Piotr Figurny and Michal Bielicki
+ * 
+ * This application is a part of:
+ * 
+ * CallWeaver -- An open source telephony toolkit.
+ * Copyright (C) 1999 - 2005, Digium, Inc.
+ * Mark Spencer <markster@digium.com>
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+ 
+
+/*! \file
+ *  \brief icd_pqueue.c - binary heap of payloads ordered by a numeric key
+ *
+ * The heap is kept in a plain array of entries. Each entry holds the
+ * payload, its key and a sequence number handed out on every push. The
+ * sequence number breaks ties between equal keys so that payloads with the
+ * same key come out in FIFO order.
+ *
+ * Each payload's slot holds its heap position plus one, so zero means
+ * "not queued". The slot is updated every time an entry moves, which keeps
+ * icd_pqueue__remove() and re-keying on push at O(log n).
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "confdefs.h"
+#endif 
+
+#include <assert.h>
+#include "callweaver/icd/icd_common.h"
+#include "callweaver/icd/icd_pqueue.h"
+
+/*===== Private types and APIs =====*/
+
+typedef struct {
+    void *payload;
+    long key;
+    unsigned int seq;
+} icd_pqueue_entry;
+
+struct icd_pqueue {
+    icd_pqueue_entry *heap;
+    int count;
+    int size;
+    unsigned int seq;
+    int *(*slot_fn) (void *payload);
+    icd_memory *memory;
+    int allocated;
+};
+
+static int icd_pqueue__before(icd_pqueue_entry * a, icd_pqueue_entry * b);
+static void icd_pqueue__set(icd_pqueue * that, int pos, icd_pqueue_entry * entry);
+static void icd_pqueue__sift(icd_pqueue * that, int pos);
+static icd_status icd_pqueue__grow(icd_pqueue * that);
+
+/*===== Public Implementations  =====*/
+
+/***** Init - Destroyers *****/
+
+/* Create a pqueue with room for size payloads. */
+icd_pqueue *create_icd_pqueue(int size, int *(*slot_fn) (void *payload))
+{
+    icd_pqueue *pqueue;
+
+    assert(slot_fn != NULL);
+
+    ICD_MALLOC(pqueue, sizeof(icd_pqueue));
+    if (pqueue == NULL) {
+        cw_log(LOG_ERROR, "No memory available to create a new ICD PQueue\n");
+        return NULL;
+    }
+    if (size < 16) {
+        size = 16;
+    }
+    pqueue->heap = (icd_pqueue_entry *) ICD_STD_MALLOC(sizeof(icd_pqueue_entry) * size);
+    if (pqueue->heap == NULL) {
+        cw_log(LOG_ERROR, "No memory available to create a new ICD PQueue\n");
+        ICD_FREE(pqueue);
+        return NULL;
+    }
+    pqueue->size = size;
+    pqueue->slot_fn = slot_fn;
+    pqueue->allocated = 1;
+    return pqueue;
+}
+
+/* Destroy a pqueue, leaving the payloads alone apart from their slots. */
+icd_status destroy_icd_pqueue(icd_pqueue ** pqueuep)
+{
+    assert(pqueuep != NULL);
+    assert((*pqueuep) != NULL);
+
+    icd_pqueue__clear(*pqueuep);
+    ICD_STD_FREE((*pqueuep)->heap);
+    (*pqueuep)->heap = NULL;
+    if ((*pqueuep)->allocated) {
+        ICD_FREE((*pqueuep));
+        *pqueuep = NULL;
+    }
+    return ICD_SUCCESS;
+}
+
+/* Empty the pqueue. Every payload still in it is marked as not queued. */
+icd_status icd_pqueue__clear(icd_pqueue * that)
+{
+    int x;
+
+    assert(that != NULL);
+
+    for (x = 0; x < that->count; x++) {
+        *(that->slot_fn(that->heap[x].payload)) = 0;
+    }
+    that->count = 0;
+    return ICD_SUCCESS;
+}
+
+/***** Actions *****/
+
+/* Add a payload, or re-key it if it is already queued. */
+icd_status icd_pqueue__push(icd_pqueue * that, void *payload, long key)
+{
+    icd_pqueue_entry entry;
+    int *slot;
+    int pos;
+
+    assert(that != NULL);
+    assert(payload != NULL);
+
+    entry.payload = payload;
+    entry.key = key;
+    entry.seq = that->seq++;
+
+    slot = that->slot_fn(payload);
+    if (*slot > 0 && *slot <= that->count && that->heap[*slot - 1].payload == payload) {
+        pos = *slot - 1;
+    } else {
+        if (that->count == that->size && icd_pqueue__grow(that) != ICD_SUCCESS) {
+            return ICD_ERESOURCE;
+        }
+        pos = that->count++;
+    }
+    icd_pqueue__set(that, pos, &entry);
+    icd_pqueue__sift(that, pos);
+    return ICD_SUCCESS;
+}
+
+/* Remove and return the payload with the lowest key. */
+void *icd_pqueue__pop(icd_pqueue * that)
+{
+    void *payload;
+
+    assert(that != NULL);
+
+    if (that->count == 0) {
+        return NULL;
+    }
+    payload = that->heap[0].payload;
+    icd_pqueue__remove(that, payload);
+    return payload;
+}
+
+/* Return the payload with the lowest key, leaving it queued. */
+void *icd_pqueue__peek(icd_pqueue * that)
+{
+    assert(that != NULL);
+
+    if (that->count == 0) {
+        return NULL;
+    }
+    return that->heap[0].payload;
+}
+
+/* Remove a payload from wherever it is in the heap. */
+icd_status icd_pqueue__remove(icd_pqueue * that, void *payload)
+{
+    int *slot;
+    int pos;
+
+    assert(that != NULL);
+    assert(payload != NULL);
+
+    if (!icd_pqueue__contains(that, payload)) {
+        return ICD_ENOTFOUND;
+    }
+    slot = that->slot_fn(payload);
+    pos = *slot - 1;
+    *slot = 0;
+    that->count--;
+    if (pos != that->count) {
+        icd_pqueue__set(that, pos, &that->heap[that->count]);
+        icd_pqueue__sift(that, pos);
+    }
+    return ICD_SUCCESS;
+}
+
+/* Is the payload queued in this pqueue? */
+int icd_pqueue__contains(icd_pqueue * that, void *payload)
+{
+    int *slot;
+
+    assert(that != NULL);
+    assert(payload != NULL);
+
+    slot = that->slot_fn(payload);
+    return (*slot > 0 && *slot <= that->count && that->heap[*slot - 1].payload == payload);
+}
+
+/* Number of payloads in the pqueue. */
+int icd_pqueue__count(icd_pqueue * that)
+{
+    assert(that != NULL);
+
+    return that->count;
+}
+
+/*===== Private Implementations  =====*/
+
+/* Does entry a come out of the heap before entry b? */
+static int icd_pqueue__before(icd_pqueue_entry * a, icd_pqueue_entry * b)
+{
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+    /* Signed difference so that the sequence number can wrap around */
+    return (int) (a->seq - b->seq) < 0;
+}
+
+/* Store an entry at a position and tell its payload where it went */
+static void icd_pqueue__set(icd_pqueue * that, int pos, icd_pqueue_entry * entry)
+{
+    that->heap[pos] = *entry;
+    *(that->slot_fn(entry->payload)) = pos + 1;
+}
+
+/* Move the entry at pos up or down until the heap property holds again */
+static void icd_pqueue__sift(icd_pqueue * that, int pos)
+{
+    icd_pqueue_entry entry;
+    int parent;
+    int child;
+
+    entry = that->heap[pos];
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (!icd_pqueue__before(&entry, &that->heap[parent])) {
+            break;
+        }
+        icd_pqueue__set(that, pos, &that->heap[parent]);
+        pos = parent;
+    }
+    for (;;) {
+        child = pos * 2 + 1;
+        if (child >= that->count) {
+            break;
+        }
+        if (child + 1 < that->count && icd_pqueue__before(&that->heap[child + 1], &that->heap[child])) {
+            child++;
+        }
+        if (!icd_pqueue__before(&that->heap[child], &entry)) {
+            break;
+        }
+        icd_pqueue__set(that, pos, &that->heap[child]);
+        pos = child;
+    }
+    icd_pqueue__set(that, pos, &entry);
+}
+
+/* Double the room in the heap */
+static icd_status icd_pqueue__grow(icd_pqueue * that)
+{
+    icd_pqueue_entry *heap;
+
+    heap = (icd_pqueue_entry *) ICD_STD_MALLOC(sizeof(icd_pqueue_entry) * that->size * 2);
+    if (heap == NULL) {
+        cw_log(LOG_WARNING, "No memory available to grow ICD PQueue past %d entries\n", that->size);
+        return ICD_ERESOURCE;
+    }
+    memcpy(heap, that->heap, sizeof(icd_pqueue_entry) * that->count);
+    ICD_STD_FREE(that->heap);
+    that->heap = heap;
+    that->size *= 2;
+    return ICD_SUCCESS;
+}
+
+/* For Emacs:
+ * Local Variables:
+ * indent-tabs-mode:nil
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+ */
@@ -6,6 +6,8 @@
 #include "CuTest.h"
 
 CuSuite* test_icd_list__get_suite(void);
+CuSuite* test_icd_pqueue__get_suite(void);
+CuSuite* test_icd_distributor__get_suite(void);
 
 void RunAllTests(void)
 {
@@ -13,6 +15,8 @@ void RunAllTests(void)
     CuSuite* suite = CuSuiteNew();
 
     CuSuiteAddSuite(suite, test_icd_list__get_suite());
+    CuSuiteAddSuite(suite, test_icd_pqueue__get_suite());
+    CuSuiteAddSuite(suite, test_icd_distributor__get_suite());
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
@@ -0,0 +1,233 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "CuTest.h"
+#include "callweaver/icd/icd_common.h"
+#include "callweaver/icd/icd_distributor.h"
+#include "callweaver/icd/icd_distributor_private.h"
+#include "callweaver/icd/icd_list.h"
+#include "callweaver/icd/icd_config.h"
+
+/*-------------------------------------------------------------------------*
+ * Helper functions
+ *-------------------------------------------------------------------------*/
+
+static icd_config_registry *registry = NULL;
+
+static icd_list *get_list(CuTest *tc, char *name) {
+    icd_config *config;
+    icd_list *list;
+    icd_status result;
+
+    config = create_icd_config(registry, "Test Config");
+    CuAssertPtrNotNull(tc, config);
+    result = icd_config__set_value(config, "size", "10");
+    CuAssertTrue(tc, result == ICD_SUCCESS);
+    result = icd_config__set_value(config, "name", name);
+    CuAssertTrue(tc, result == ICD_SUCCESS);
+    list = create_icd_list(config);
+    CuAssertPtrNotNull(tc, list);
+    destroy_icd_config(&config);
+    return list;
+}
+
+/* Only the parts of a distributor the event queue and the link loop look at.
+   The customer and agent lists are plain icd_lists, which is all the pending
+   counts need. */
+static icd_distributor *get_distributor(CuTest *tc) {
+    icd_distributor *dist;
+
+    dist = (icd_distributor *) calloc(1, sizeof(icd_distributor));
+    CuAssertPtrNotNull(tc, dist);
+    strcpy(dist->name, "test.distributor");
+    dist->customers = (icd_member_list *) get_list(tc, "test.customers");
+    dist->agents = (icd_member_list *) get_list(tc, "test.agents");
+    dist->state = ICD_DISTRIBUTOR_STATE_INITIALIZED;
+    dist->thread_state = ICD_THREAD_STATE_RUNNING;
+    cw_mutex_init(&dist->lock);
+    cw_cond_init(&dist->wakeup, NULL);
+    return dist;
+}
+
+static void put_distributor(icd_distributor *dist) {
+    icd_list *list;
+
+    list = (icd_list *) dist->customers;
+    destroy_icd_list(&list);
+    list = (icd_list *) dist->agents;
+    destroy_icd_list(&list);
+    cw_cond_destroy(&dist->wakeup);
+    cw_mutex_destroy(&dist->lock);
+    free(dist);
+}
+
+/* Links the first customer with the first agent */
+static icd_status link_one(icd_distributor *dist, void *extra) {
+    icd_list__pop((icd_list *) dist->customers);
+    icd_list__pop((icd_list *) dist->agents);
+    return ICD_SUCCESS;
+}
+
+/* Fails without touching the lists, as when no bridge could be set up */
+static icd_status link_none(icd_distributor *dist, void *extra) {
+    (*(int *) extra)++;
+    return ICD_EGENERAL;
+}
+
+static void *wait_one_event(void *arg) {
+    icd_distributor *dist = (icd_distributor *) arg;
+    icd_distributor_event_type event;
+
+    cw_mutex_lock(&dist->lock);
+    dist->number_of_callers_added = 1;
+    cw_cond_signal(&dist->wakeup);
+    do {
+        event = icd_distributor__wait_event(dist, 0);
+    } while (event == ICD_DISTRIBUTOR_EVENT_NONE);
+    cw_mutex_unlock(&dist->lock);
+    return (void *) (long) event;
+}
+
+/*-------------------------------------------------------------------------*
+ * Test functions
+ *-------------------------------------------------------------------------*/
+
+/* Events come out in the order they were posted, and a repeat of the one
+   at the tail of the queue is folded into it. */
+void test_icd_distributor__post_wait(CuTest *tc) {
+    icd_distributor *dist;
+
+    dist = get_distributor(tc);
+    cw_mutex_lock(&dist->lock);
+    icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
+    icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
+    icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_STATE_CHANGED);
+    icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
+    CuAssertIntEquals(tc, 3, dist->event_count);
+    CuAssertIntEquals(tc, 1, dist->events_folded);
+
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED, icd_distributor__wait_event(dist, 0));
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_STATE_CHANGED, icd_distributor__wait_event(dist, 0));
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED, icd_distributor__wait_event(dist, 0));
+    CuAssertIntEquals(tc, 0, dist->event_count);
+
+    /* Nothing queued, so a timed wait runs out */
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_TIMEOUT, icd_distributor__wait_event(dist, 10));
+    cw_mutex_unlock(&dist->lock);
+    put_distributor(dist);
+}
+
+/* A full queue folds whatever comes next, and the queue wraps around
+   without losing the order of what it kept. */
+void test_icd_distributor__full_queue(CuTest *tc) {
+    icd_distributor *dist;
+    icd_distributor_event_type event;
+    int x;
+
+    dist = get_distributor(tc);
+    cw_mutex_lock(&dist->lock);
+    for (x = 0; x < ICD_DISTRIBUTOR_EVENT_QUEUE_LEN / 2; x++) {
+        icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
+        icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_STATE_CHANGED);
+    }
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_QUEUE_LEN, dist->event_count);
+    icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED);
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_QUEUE_LEN, dist->event_count);
+    CuAssertIntEquals(tc, 1, dist->events_folded);
+
+    for (x = 0; x < ICD_DISTRIBUTOR_EVENT_QUEUE_LEN * 3; x++) {
+        event = icd_distributor__wait_event(dist, 0);
+        CuAssertIntEquals(tc, (x % 2) ? ICD_DISTRIBUTOR_EVENT_STATE_CHANGED
+                : ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED, event);
+        icd_distributor__post_event(dist, event);
+    }
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_QUEUE_LEN, dist->event_count);
+    CuAssertIntEquals(tc, 1, dist->events_folded);
+
+    /* Once the thread is told to finish, what is left is not handed out */
+    dist->thread_state = ICD_THREAD_STATE_FINISHED;
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_NONE, icd_distributor__wait_event(dist, 0));
+    cw_mutex_unlock(&dist->lock);
+    put_distributor(dist);
+}
+
+/* Posting an event wakes up a thread waiting for one */
+void test_icd_distributor__wakeup(CuTest *tc) {
+    icd_distributor *dist;
+    pthread_t thread;
+    void *event;
+
+    dist = get_distributor(tc);
+    cw_mutex_lock(&dist->lock);
+    CuAssertIntEquals(tc, 0, pthread_create(&thread, NULL, wait_one_event, dist));
+    /* The waiter flags itself under the lock before it starts waiting */
+    while (dist->number_of_callers_added == 0) {
+        cw_cond_wait(&dist->wakeup, &dist->lock);
+    }
+    icd_distributor__post_event(dist, ICD_DISTRIBUTOR_EVENT_CUSTOMER_ADDED);
+    cw_mutex_unlock(&dist->lock);
+    pthread_join(thread, &event);
+    CuAssertIntEquals(tc, ICD_DISTRIBUTOR_EVENT_CUSTOMER_ADDED, (int) (long) event);
+    CuAssertIntEquals(tc, 0, dist->event_count);
+    put_distributor(dist);
+}
+
+/* The link function is called for as long as both sides have someone
+   waiting, and a link that changes nothing asks for a retry. */
+void test_icd_distributor__link_pending(CuTest *tc) {
+    icd_distributor *dist;
+    static int callers[5];
+    int calls = 0;
+    int x;
+
+    dist = get_distributor(tc);
+    for (x = 0; x < 3; x++) {
+        icd_list__push((icd_list *) dist->customers, &callers[x]);
+    }
+    for (x = 3; x < 5; x++) {
+        icd_list__push((icd_list *) dist->agents, &callers[x]);
+    }
+
+    dist->link_fn = link_one;
+    CuAssertIntEquals(tc, 0, icd_distributor__link_pending(dist));
+    CuAssertIntEquals(tc, 2, dist->links_made);
+    CuAssertIntEquals(tc, 1, icd_distributor__customers_pending(dist));
+    CuAssertIntEquals(tc, 0, icd_distributor__agents_pending(dist));
+
+    /* Nobody to link with, so the link function is not called at all */
+    dist->link_fn = link_none;
+    dist->link_fn_extra = &calls;
+    CuAssertIntEquals(tc, 0, icd_distributor__link_pending(dist));
+    CuAssertIntEquals(tc, 0, calls);
+
+    icd_list__push((icd_list *) dist->agents, &callers[3]);
+    CuAssertIntEquals(tc, 1, icd_distributor__link_pending(dist));
+    CuAssertIntEquals(tc, 1, calls);
+    CuAssertIntEquals(tc, 1, dist->links_failed);
+    CuAssertIntEquals(tc, 1, icd_distributor__customers_pending(dist));
+    CuAssertIntEquals(tc, 1, icd_distributor__agents_pending(dist));
+
+    /* Nor is it called once the distributor is paused */
+    dist->thread_state = ICD_THREAD_STATE_PAUSED;
+    CuAssertIntEquals(tc, 0, icd_distributor__link_pending(dist));
+    CuAssertIntEquals(tc, 1, calls);
+    put_distributor(dist);
+}
+
+/* Generate the test suite */
+CuSuite* test_icd_distributor__get_suite(void)
+{
+    CuSuite* suite = CuSuiteNew();
+    registry = create_icd_config_registry("name");
+
+    SUITE_ADD_TEST(suite, test_icd_distributor__post_wait);
+    SUITE_ADD_TEST(suite, test_icd_distributor__full_queue);
+    SUITE_ADD_TEST(suite, test_icd_distributor__wakeup);
+    SUITE_ADD_TEST(suite, test_icd_distributor__link_pending);
+
+    return suite;
+}
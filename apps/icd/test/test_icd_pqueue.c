@@ -0,0 +1,243 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "CuTest.h"
+#include "callweaver/icd/icd_pqueue.h"
+#include "callweaver/icd/icd_list.h"
+#include "callweaver/icd/icd_config.h"
+
+/*-------------------------------------------------------------------------*
+ * Helper functions
+ *-------------------------------------------------------------------------*/
+
+static icd_config_registry *registry = NULL;
+
+/* Stands in for an icd_member in the distributor's agent pqueue */
+typedef struct {
+    int slot;
+    long key;
+    int id;
+} test_agent;
+
+static int *get_slot(void *payload) {
+    return &(((test_agent *)payload)->slot);
+}
+
+static int cmp_key_order(void *arg1, void *arg2) {
+    test_agent *a1 = (test_agent *)arg1;
+    test_agent *a2 = (test_agent *)arg2;
+
+    return (a1->key > a2->key) ? 1 : ((a1->key < a2->key) ? -1 : 0);
+}
+
+static test_agent *get_many_agents(CuTest *tc, int number) {
+    test_agent *retval;
+    int x;
+
+    retval = (test_agent *) calloc(number, sizeof(test_agent));
+    CuAssertPtrNotNull(tc, retval);
+    srandom(4711);
+    for (x = 0; x < number; x++) {
+        retval[x].id = x;
+        retval[x].key = random() % (number / 4 + 1);
+    }
+    return retval;
+}
+
+static icd_config *get_config(CuTest *tc, char *size, char *name) {
+    icd_config *config;
+    icd_status result;
+
+    config = create_icd_config(registry, "Test Config");
+    CuAssertPtrNotNull(tc, config);
+    result = icd_config__set_value(config, "size", size);
+    CuAssertTrue(tc, result == ICD_SUCCESS);
+    result = icd_config__set_value(config, "name", name);
+    CuAssertTrue(tc, result == ICD_SUCCESS);
+    return config;
+}
+
+static double elapsed_ms(struct timeval *start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/*-------------------------------------------------------------------------*
+ * Test functions
+ *-------------------------------------------------------------------------*/
+
+void test_icd_pqueue__create(CuTest *tc) {
+    icd_pqueue *pqueue;
+    icd_status result;
+
+    pqueue = create_icd_pqueue(0, get_slot);
+    CuAssertPtrNotNull(tc, pqueue);
+    CuAssertIntEquals(tc, 0, icd_pqueue__count(pqueue));
+    CuAssertPtrEquals(tc, NULL, icd_pqueue__pop(pqueue));
+    CuAssertPtrEquals(tc, NULL, icd_pqueue__peek(pqueue));
+    result = destroy_icd_pqueue(&pqueue);
+    CuAssertTrue(tc, result == ICD_SUCCESS);
+    CuAssertPtrEquals(tc, NULL, pqueue);
+}
+
+/* Lowest key first, equal keys in the order they were pushed */
+void test_icd_pqueue__order(CuTest *tc) {
+    icd_pqueue *pqueue;
+    test_agent *agents;
+    test_agent *popped;
+    test_agent *last = NULL;
+    int nodes = 1000;
+    int x;
+
+    agents = get_many_agents(tc, nodes);
+    pqueue = create_icd_pqueue(4, get_slot);
+    CuAssertPtrNotNull(tc, pqueue);
+
+    for (x = 0; x < nodes; x++) {
+        CuAssertTrue(tc, icd_pqueue__push(pqueue, &agents[x], agents[x].key) == ICD_SUCCESS);
+    }
+    CuAssertIntEquals(tc, nodes, icd_pqueue__count(pqueue));
+
+    for (x = 0; x < nodes; x++) {
+        popped = (test_agent *)icd_pqueue__pop(pqueue);
+        CuAssertPtrNotNull(tc, popped);
+        CuAssertIntEquals(tc, 0, popped->slot);
+        if (last != NULL) {
+            CuAssertTrue(tc, last->key <= popped->key);
+            if (last->key == popped->key) {
+                CuAssertTrue(tc, last->id < popped->id);
+            }
+        }
+        last = popped;
+    }
+    CuAssertIntEquals(tc, 0, icd_pqueue__count(pqueue));
+
+    destroy_icd_pqueue(&pqueue);
+    free(agents);
+}
+
+/* Pushing a queued payload again re-keys it, remove takes it out from anywhere */
+void test_icd_pqueue__rekey_remove(CuTest *tc) {
+    icd_pqueue *pqueue;
+    test_agent agents[5];
+    int x;
+
+    memset(agents, 0, sizeof(agents));
+    pqueue = create_icd_pqueue(0, get_slot);
+    CuAssertPtrNotNull(tc, pqueue);
+    for (x = 0; x < 5; x++) {
+        agents[x].id = x;
+        icd_pqueue__push(pqueue, &agents[x], x * 10);
+    }
+    CuAssertPtrEquals(tc, &agents[0], icd_pqueue__peek(pqueue));
+
+    /* Move the last one to the front, and the first one to the back */
+    icd_pqueue__push(pqueue, &agents[4], -1);
+    icd_pqueue__push(pqueue, &agents[0], 100);
+    CuAssertIntEquals(tc, 5, icd_pqueue__count(pqueue));
+    CuAssertPtrEquals(tc, &agents[4], icd_pqueue__peek(pqueue));
+
+    CuAssertTrue(tc, icd_pqueue__remove(pqueue, &agents[2]) == ICD_SUCCESS);
+    CuAssertTrue(tc, icd_pqueue__remove(pqueue, &agents[2]) == ICD_ENOTFOUND);
+    CuAssertTrue(tc, !icd_pqueue__contains(pqueue, &agents[2]));
+    CuAssertIntEquals(tc, 4, icd_pqueue__count(pqueue));
+
+    CuAssertPtrEquals(tc, &agents[4], icd_pqueue__pop(pqueue));
+    CuAssertPtrEquals(tc, &agents[1], icd_pqueue__pop(pqueue));
+    CuAssertPtrEquals(tc, &agents[3], icd_pqueue__pop(pqueue));
+    CuAssertPtrEquals(tc, &agents[0], icd_pqueue__pop(pqueue));
+    CuAssertPtrEquals(tc, NULL, icd_pqueue__pop(pqueue));
+
+    icd_pqueue__push(pqueue, &agents[1], 1);
+    icd_pqueue__clear(pqueue);
+    CuAssertIntEquals(tc, 0, agents[1].slot);
+    destroy_icd_pqueue(&pqueue);
+}
+
+/* Agents churning through a busy distributor: the best agent is taken, and
+   comes back later with a new key. The timings against the ordered icd_list
+   the keyed strategies used before are printed, not asserted, since they
+   depend on the machine; only the order the agents come out in is checked. */
+void test_icd_pqueue__throughput(CuTest *tc) {
+    icd_pqueue *pqueue;
+    icd_list *list;
+    icd_config *config;
+    test_agent *agents;
+    test_agent *popped;
+    struct timeval start;
+    double pqueue_ms;
+    double list_ms;
+    long last;
+    int nodes = 2000;
+    int rounds = 50000;
+    int x;
+
+    agents = get_many_agents(tc, nodes);
+
+    pqueue = create_icd_pqueue(nodes, get_slot);
+    CuAssertPtrNotNull(tc, pqueue);
+    gettimeofday(&start, NULL);
+    for (x = 0; x < nodes; x++) {
+        icd_pqueue__push(pqueue, &agents[x], agents[x].key);
+    }
+    last = 0;
+    for (x = 0; x < rounds; x++) {
+        popped = (test_agent *)icd_pqueue__pop(pqueue);
+        CuAssertPtrNotNull(tc, popped);
+        CuAssertTrue(tc, popped->key >= last);
+        last = popped->key;
+        popped->key += nodes / 4;
+        icd_pqueue__push(pqueue, popped, popped->key);
+    }
+    pqueue_ms = elapsed_ms(&start);
+    CuAssertIntEquals(tc, nodes, icd_pqueue__count(pqueue));
+    destroy_icd_pqueue(&pqueue);
+    free(agents);
+
+    agents = get_many_agents(tc, nodes);
+    config = get_config(tc, "2000", "test.pqueue.throughput");
+    list = create_icd_list(config);
+    CuAssertPtrNotNull(tc, list);
+    icd_list__set_node_insert_func(list, icd_list__insert_ordered, cmp_key_order);
+    destroy_icd_config(&config);
+    gettimeofday(&start, NULL);
+    for (x = 0; x < nodes; x++) {
+        icd_list__push(list, &agents[x]);
+    }
+    last = 0;
+    for (x = 0; x < rounds; x++) {
+        popped = (test_agent *)icd_list__pop(list);
+        CuAssertPtrNotNull(tc, popped);
+        CuAssertTrue(tc, popped->key >= last);
+        last = popped->key;
+        popped->key += nodes / 4;
+        icd_list__push(list, popped);
+    }
+    list_ms = elapsed_ms(&start);
+    CuAssertIntEquals(tc, nodes, icd_list__count(list));
+    destroy_icd_list(&list);
+    free(agents);
+
+    printf("icd_pqueue: %d agents, %d links in %.1fms (ordered icd_list %.1fms)\n",
+            nodes, rounds, pqueue_ms, list_ms);
+}
+
+/* Generate the test suite */
+CuSuite* test_icd_pqueue__get_suite(void)
+{
+    CuSuite* suite = CuSuiteNew();
+    registry = create_icd_config_registry("name");
+
+    SUITE_ADD_TEST(suite, test_icd_pqueue__create);
+    SUITE_ADD_TEST(suite, test_icd_pqueue__order);
+    SUITE_ADD_TEST(suite, test_icd_pqueue__rekey_remove);
+    SUITE_ADD_TEST(suite, test_icd_pqueue__throughput);
+
+    return suite;
+}
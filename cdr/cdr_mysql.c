@@ -112,23 +112,10 @@ static struct cw_cli_entry cdr_mysql_status_cli =
 	handle_cdr_mysql_status, "Show connection status of cdr_mysql",
 	cdr_mysql_status_help, NULL };
 
-static int mysql_log(struct cw_cdr *cdr)
+/* Don't call without mysql_lock */
+static void mysql_reconnect(void)
 {
-	struct tm tm;
-	char *userfielddata = NULL;
-	char sqlcmd[2048], timestr[128];
-	char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
 	int retries = 5;
-#ifdef MYSQL_LOGUNIQUEID
-	char *uniqueid = NULL;
-#endif
-
-	cw_mutex_lock(&mysql_lock);
-
-	memset(sqlcmd, 0, 2048);
-
-	localtime_r(&cdr->start.tv_sec, &tm);
-	strftime(timestr, 128, DATE_FORMAT, &tm);
 
 db_reconnect:
 	if ((!connected) && (hostname || dbsock) && dbuser && password && dbname && dbtable ) {
@@ -167,6 +154,20 @@ db_reconnect:
 				cw_log(LOG_ERROR, "cdr_mysql: Retried to connect fives times, giving up.\n");
 		}
 	}
+}
+
+static void mysql_build_insert(struct cw_cdr *cdr, char *sqlcmd, size_t len)
+{
+	struct tm tm;
+	char *userfielddata = NULL;
+	char timestr[128];
+	char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
+#ifdef MYSQL_LOGUNIQUEID
+	char *uniqueid = NULL;
+#endif
+
+	localtime_r(&cdr->start.tv_sec, &tm);
+	strftime(timestr, 128, DATE_FORMAT, &tm);
 
 	/* Maximum space needed would be if all characters needed to be escaped, plus a trailing NULL */
 	/* WARNING: This code previously used mysql_real_escape_string, but the use of said function
@@ -196,22 +197,35 @@ db_reconnect:
 		mysql_escape_string(userfielddata, cdr->userfield, strlen(cdr->userfield));
 	}
 
-	cw_log(LOG_DEBUG, "cdr_mysql: inserting a CDR record.\n");
-
 	if (userfield && userfielddata) {
 #ifdef MYSQL_LOGUNIQUEID
-		sprintf(sqlcmd, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s','%s','%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext, channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, uniqueid, userfielddata);
+		snprintf(sqlcmd, len, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s','%s','%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext, channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, uniqueid, userfielddata);
 #else
-		sprintf(sqlcmd, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,userfield) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s','%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext,channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, userfielddata);
+		snprintf(sqlcmd, len, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,userfield) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s','%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext,channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, userfielddata);
 #endif
 	} else {
 #ifdef MYSQL_LOGUNIQUEID
-		sprintf(sqlcmd, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s','%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext,channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, uniqueid);
+		snprintf(sqlcmd, len, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s','%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext,channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, uniqueid);
 #else
-		sprintf(sqlcmd, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext, channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode);
+		snprintf(sqlcmd, len, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode) VALUES ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%i,%i,'%s',%i,'%s')", dbtable, timestr, clid, cdr->src, cdr->dst, dcontext, channel, dstchannel, lastapp, lastdata, cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode);
 #endif
 	}
-	
+}
+
+static int mysql_log(struct cw_cdr *cdr)
+{
+	char sqlcmd[2048];
+
+	cw_mutex_lock(&mysql_lock);
+
+	memset(sqlcmd, 0, 2048);
+
+	mysql_reconnect();
+
+	cw_log(LOG_DEBUG, "cdr_mysql: inserting a CDR record.\n");
+
+	mysql_build_insert(cdr, sqlcmd, sizeof(sqlcmd));
+
 	cw_log(LOG_DEBUG, "cdr_mysql: SQL command as follows: %s\n", sqlcmd);
 	
 	if (connected) {
@@ -228,6 +242,48 @@ db_reconnect:
 	return 0;
 }
 
+/*! Inserts a whole batch of CDRs in one transaction.  On error the
+ *  transaction is rolled back and the CDR engine retries the records one at
+ *  a time through mysql_log().  Only a transactional table (InnoDB) can roll
+ *  back the rows of a failed batch. */
+static int mysql_log_batch(struct cw_cdr **cdrs, int count)
+{
+	char sqlcmd[2048];
+	int x;
+
+	cw_mutex_lock(&mysql_lock);
+
+	mysql_reconnect();
+	if (!connected) {
+		cw_mutex_unlock(&mysql_lock);
+		return -1;
+	}
+
+	cw_log(LOG_DEBUG, "cdr_mysql: inserting a batch of %d CDR records.\n", count);
+
+	if (mysql_real_query(&mysql, "START TRANSACTION", 17)) {
+		cw_log(LOG_ERROR, "mysql_cdr: Failed to start a transaction: (%d) %s\n", mysql_errno(&mysql), mysql_error(&mysql));
+		cw_mutex_unlock(&mysql_lock);
+		return -1;
+	}
+	for (x = 0;  x < count;  x++) {
+		mysql_build_insert(cdrs[x], sqlcmd, sizeof(sqlcmd));
+		if (mysql_real_query(&mysql, sqlcmd, strlen(sqlcmd)))
+			break;
+	}
+	if (x < count || mysql_real_query(&mysql, "COMMIT", 6)) {
+		cw_log(LOG_ERROR, "mysql_cdr: Failed to insert a batch into database: (%d) %s\n", mysql_errno(&mysql), mysql_error(&mysql));
+		mysql_real_query(&mysql, "ROLLBACK", 8);
+		cw_mutex_unlock(&mysql_lock);
+		return -1;
+	}
+	records += count;
+	totalrecords += count;
+
+	cw_mutex_unlock(&mysql_lock);
+	return 0;
+}
+
 static int my_unload_module(void)
 { 
 	cw_cli_unregister(&cdr_mysql_status_cli);
@@ -432,7 +488,7 @@ static int my_load_module(void)
 		connect_time = time(NULL);
 	}
 
-	res = cw_cdr_register(name, desc, mysql_log);
+	res = cw_cdr_register_batch(name, desc, mysql_log, mysql_log_batch);
 	if (res) {
 		cw_log(LOG_ERROR, "Unable to register MySQL CDR handling\n");
 	} else {
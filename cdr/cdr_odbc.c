@@ -80,6 +80,57 @@ static SQLHENV	ODBC_env = SQL_NULL_HANDLE;	/* global ODBC Environment */
 static SQLHDBC	ODBC_con;			/* global ODBC Connection Handle */
 static SQLHSTMT	ODBC_stmt;			/* global ODBC Statement Handle */
 
+static void odbc_build_insert(unsigned char *sqlcmd, size_t len)
+{
+	if (loguniqueid) {
+		snprintf((char *) sqlcmd,len,"INSERT INTO %s "
+		"(calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,"
+		"lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) "
+		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)", table);
+	} else {
+		snprintf((char *) sqlcmd,len,"INSERT INTO %s "
+		"(calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,"
+		"duration,billsec,disposition,amaflags,accountcode) "
+		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)", table);
+	}
+}
+
+/* Binds a CDR to the parameters of the prepared INSERT, timestr must stay
+   valid until the statement is executed */
+static void odbc_bind_cdr(struct cw_cdr *cdr, char *timestr, size_t timelen)
+{
+	struct tm tm;
+
+	if (usegmtime) 
+		gmtime_r(&cdr->start.tv_sec,&tm);
+	else
+		localtime_r(&cdr->start.tv_sec,&tm);
+	strftime(timestr, timelen, DATE_FORMAT, &tm);
+
+	SQLBindParameter(ODBC_stmt, 1, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, timelen, 0, timestr, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 2, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->clid), 0, cdr->clid, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 3, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->src), 0, cdr->src, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 4, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dst), 0, cdr->dst, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 5, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dcontext), 0, cdr->dcontext, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 6, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->channel), 0, cdr->channel, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 7, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dstchannel), 0, cdr->dstchannel, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 8, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->lastapp), 0, cdr->lastapp, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 9, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->lastdata), 0, cdr->lastdata, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 10, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->duration, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 11, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->billsec, 0, NULL);
+	if (dispositionstring)
+		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, strlen(cw_cdr_disp2str(cdr->disposition)) + 1, 0, cw_cdr_disp2str(cdr->disposition), 0, NULL);
+	else
+		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->disposition, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 13, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->amaflags, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 14, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->accountcode), 0, cdr->accountcode, 0, NULL);
+
+	if (loguniqueid) {
+		SQLBindParameter(ODBC_stmt, 15, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->uniqueid), 0, cdr->uniqueid, 0, NULL);
+		SQLBindParameter(ODBC_stmt, 16, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->userfield), 0, cdr->userfield, 0, NULL);
+	}
+}
+
 static int odbc_log(struct cw_cdr *cdr)
 {
 	SQLINTEGER ODBC_err;
@@ -89,27 +140,10 @@ static int odbc_log(struct cw_cdr *cdr)
 	unsigned char sqlcmd[2048] = "";
 	char timestr[128];
 	int res = 0;
-	struct tm tm;
-
-	if (usegmtime) 
-		gmtime_r(&cdr->start.tv_sec,&tm);
-	else
-		localtime_r(&cdr->start.tv_sec,&tm);
 
 	cw_mutex_lock(&odbc_lock);
-	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
 	memset(sqlcmd,0,2048);
-	if (loguniqueid) {
-		snprintf((char *) sqlcmd,sizeof(sqlcmd),"INSERT INTO %s "
-		"(calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,"
-		"lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) "
-		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)", table);
-	} else {
-		snprintf((char *) sqlcmd,sizeof(sqlcmd),"INSERT INTO %s "
-		"(calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,"
-		"duration,billsec,disposition,amaflags,accountcode) "
-		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)", table);
-	}
+	odbc_build_insert(sqlcmd, sizeof(sqlcmd));
 
 	if (!connected) {
 		res = odbc_init();
@@ -148,28 +182,7 @@ static int odbc_log(struct cw_cdr *cdr)
 		return 0;
 	}
 
-	SQLBindParameter(ODBC_stmt, 1, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(timestr), 0, &timestr, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 2, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->clid), 0, cdr->clid, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 3, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->src), 0, cdr->src, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 4, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dst), 0, cdr->dst, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 5, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dcontext), 0, cdr->dcontext, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 6, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->channel), 0, cdr->channel, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 7, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dstchannel), 0, cdr->dstchannel, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 8, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->lastapp), 0, cdr->lastapp, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 9, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->lastdata), 0, cdr->lastdata, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 10, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->duration, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 11, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->billsec, 0, NULL);
-	if (dispositionstring)
-		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, strlen(cw_cdr_disp2str(cdr->disposition)) + 1, 0, cw_cdr_disp2str(cdr->disposition), 0, NULL);
-	else
-		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->disposition, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 13, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->amaflags, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 14, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->accountcode), 0, cdr->accountcode, 0, NULL);
-
-	if (loguniqueid) {
-		SQLBindParameter(ODBC_stmt, 15, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->uniqueid), 0, cdr->uniqueid, 0, NULL);
-		SQLBindParameter(ODBC_stmt, 16, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->userfield), 0, cdr->userfield, 0, NULL);
-	}
+	odbc_bind_cdr(cdr, timestr, sizeof(timestr));
 
 	if (connected) {
 		res = odbc_do_query();
@@ -202,6 +215,71 @@ static int odbc_log(struct cw_cdr *cdr)
 	return 0;
 }
 
+/*! Inserts a whole batch of CDRs in one transaction, preparing the INSERT
+ *  once.  On error the transaction is rolled back and the CDR engine retries
+ *  the records one at a time through odbc_log() */
+static int odbc_log_batch(struct cw_cdr **cdrs, int count)
+{
+	SQLINTEGER ODBC_err;
+	short int ODBC_mlen;
+	int ODBC_res;
+	unsigned char ODBC_msg[200], ODBC_stat[10];
+	unsigned char sqlcmd[2048] = "";
+	char timestr[128];
+	int res = 0;
+	int x;
+
+	cw_mutex_lock(&odbc_lock);
+
+	if (!connected && odbc_init() < 0) {
+		connected = 0;
+		cw_mutex_unlock(&odbc_lock);
+		return -1;
+	}
+
+	ODBC_res = SQLAllocHandle(SQL_HANDLE_STMT, ODBC_con, &ODBC_stmt);
+	if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
+		if (option_verbose > 10)
+			cw_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Failure in AllocStatement %d\n", ODBC_res);
+		connected = 0;
+		cw_mutex_unlock(&odbc_lock);
+		return -1;
+	}
+
+	odbc_build_insert(sqlcmd, sizeof(sqlcmd));
+	ODBC_res = SQLPrepare(ODBC_stmt, sqlcmd, SQL_NTS);
+	if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
+		if (option_verbose > 10)
+			cw_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Error in PREPARE %d\n", ODBC_res);
+		SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
+		connected = 0;
+		cw_mutex_unlock(&odbc_lock);
+		return -1;
+	}
+
+	SQLSetConnectAttr(ODBC_con, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_OFF, 0);
+	for (x = 0;  x < count;  x++) {
+		odbc_bind_cdr(cdrs[x], timestr, sizeof(timestr));
+		ODBC_res = SQLExecute(ODBC_stmt);
+		if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO))
+			break;
+	}
+	if (x == count)
+		ODBC_res = SQLEndTran(SQL_HANDLE_DBC, ODBC_con, SQL_COMMIT);
+	if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
+		if (option_verbose > 10)
+			cw_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Batch of %d records FAILED at record %d\n", count, x);
+		SQLGetDiagRec(SQL_HANDLE_DBC, ODBC_con, 1, ODBC_stat, &ODBC_err, ODBC_msg, 100, &ODBC_mlen);
+		SQLEndTran(SQL_HANDLE_DBC, ODBC_con, SQL_ROLLBACK);
+		res = -1;
+	}
+	SQLSetConnectAttr(ODBC_con, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_ON, 0);
+
+	SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
+	cw_mutex_unlock(&odbc_lock);
+	return res;
+}
+
 char *description(void)
 {
 	return desc;
@@ -363,7 +441,7 @@ static int odbc_load_module(void)
 			cw_verbose( VERBOSE_PREFIX_3 "cdr_odbc: Unable to connect to datasource: %s\n", dsn);
 		}
 	}
-	res = cw_cdr_register(name, desc, odbc_log);
+	res = cw_cdr_register_batch(name, desc, odbc_log, odbc_log_batch);
 	if (res) {
 		cw_log(LOG_ERROR, "cdr_odbc: Unable to register ODBC CDR handling\n");
 	}
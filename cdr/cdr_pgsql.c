@@ -148,11 +148,9 @@ static int pgsql_reconnect(void)
 	return -1;
 }
 
-static int pgsql_log(struct cw_cdr *cdr)
+static void pgsql_build_insert(struct cw_cdr *cdr, char *sql, size_t sqllen)
 {
-	PGresult *res;
 	struct tm tm;
-	char sql[2048] = "";
 	char timestr[128];
 	char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
 	char *uniqueid=NULL, *userfield=NULL;
@@ -178,13 +176,37 @@ static int pgsql_log(struct cw_cdr *cdr)
 	userfield = alloca(strlen(cdr->userfield) * 2 + 1);
 	PQescapeString(userfield, cdr->userfield, strlen(cdr->userfield));
 
-	cw_log(LOG_DEBUG,"Inserting a CDR record.\n");
-
-	snprintf(sql, sizeof(sql), "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
+	snprintf(sql, sqllen, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
 		"lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES"
 		" ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%d,%d,'%s',%d,'%s','%s','%s')",
 		table, timestr, clid, cdr->src, cdr->dst, dcontext,channel, dstchannel, lastapp, lastdata,
 		cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, uniqueid, userfield);
+}
+
+/* Don't call without pgsql_lock */
+static int pgsql_exec(const char *sql)
+{
+	PGresult *res;
+
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		cw_log(LOG_ERROR, "Failed to execute '%s'!\n", sql);
+		cw_log(LOG_ERROR, "Reason: %s\n", PQresultErrorMessage(res));
+		PQclear(res);
+		return -1;
+	}
+	PQclear(res);
+	return 0;
+}
+
+static int pgsql_log(struct cw_cdr *cdr)
+{
+	PGresult *res;
+	char sql[2048] = "";
+
+	cw_log(LOG_DEBUG,"Inserting a CDR record.\n");
+
+	pgsql_build_insert(cdr, sql, sizeof(sql));
 
 	cw_log(LOG_DEBUG, "SQL command executed:  %s\n", sql);
 
@@ -210,6 +232,43 @@ static int pgsql_log(struct cw_cdr *cdr)
 	return 0;
 }
 
+/*! Inserts a whole batch of CDRs in one transaction, so either all of them
+ *  are stored or, on error, none of them are and the CDR engine retries
+ *  them one at a time through pgsql_log() */
+static int pgsql_log_batch(struct cw_cdr **cdrs, int count)
+{
+	char sql[2048];
+	int x;
+
+	cw_log(LOG_DEBUG, "Inserting a batch of %d CDR records.\n", count);
+
+	cw_mutex_lock(&pgsql_lock);
+
+	if (pgsql_reconnect() != 1) {
+		cw_log(LOG_ERROR, "Unable to reconnect to database server. Some calls will not be logged!\n");
+		cw_mutex_unlock(&pgsql_lock);
+		return -1;
+	}
+
+	if (pgsql_exec("BEGIN")) {
+		cw_mutex_unlock(&pgsql_lock);
+		return -1;
+	}
+	for (x = 0;  x < count;  x++) {
+		pgsql_build_insert(cdrs[x], sql, sizeof(sql));
+		if (pgsql_exec(sql))
+			break;
+	}
+	if (x < count || pgsql_exec("COMMIT")) {
+		pgsql_exec("ROLLBACK");
+		cw_mutex_unlock(&pgsql_lock);
+		return -1;
+	}
+
+	cw_mutex_unlock(&pgsql_lock);
+	return 0;
+}
+
 char *description(void)
 {
 	return desc;
@@ -229,7 +288,7 @@ static int my_load_module(void)
 	
 	pgsql_reconnect();
 
-	res = cw_cdr_register(name, desc, pgsql_log);
+	res = cw_cdr_register_batch(name, desc, pgsql_log, pgsql_log_batch);
 	if (res) {
 		cw_log(LOG_ERROR, "Unable to register PGSQL CDR handling\n");
 	}
@@ -90,28 +90,12 @@ static char sql_create_table[] = "CREATE TABLE cdr ("
 #endif
 ");";
 
-static int sqlite_log(struct cw_cdr *cdr)
+/*! Builds the INSERT for a CDR, free it with sqlite3_free() */
+static char *sqlite_build_insert(struct cw_cdr *cdr)
 {
-	int res = 0;
-	char *zErr = 0;
 	struct tm tm;
 	time_t t;
 	char startstr[80], answerstr[80], endstr[80];
-	int count;
-	char fn[PATH_MAX];
-	char *sql;
-
-	cw_mutex_lock(&sqlite3_lock);
-
-	/* is the database there? */
-	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
-	sqlite3_open(fn, &db);
-	if (!db) {
-		cw_log(LOG_ERROR, "cdr_sqlite: %s\n", zErr);
-		free(zErr);
-		return -1;
-	}
-
 
 	t = cdr->start.tv_sec;
 	localtime_r(&t, &tm);
@@ -125,45 +109,67 @@ static int sqlite_log(struct cw_cdr *cdr)
 	localtime_r(&t, &tm);
 	strftime(endstr, sizeof(endstr), DATE_FORMAT, &tm);
 
-	for(count=0; count<5; count++) {
-		sql = sqlite3_mprintf(
-			"INSERT INTO cdr ("
-				"clid,src,dst,dcontext,"
-				"channel,dstchannel,lastapp,lastdata, "
-				"start,answer,end,"
-				"duration,billsec,disposition,amaflags, "
-				"accountcode"
+	return sqlite3_mprintf(
+		"INSERT INTO cdr ("
+			"clid,src,dst,dcontext,"
+			"channel,dstchannel,lastapp,lastdata, "
+			"start,answer,end,"
+			"duration,billsec,disposition,amaflags, "
+			"accountcode"
 #				if LOG_UNIQUEID
-				",uniqueid"
+			",uniqueid"
 #				endif
 #				if LOG_USERFIELD
-				",userfield"
+			",userfield"
 #				endif
-			") VALUES ("
-				"'%q', '%q', '%q', '%q', "
-				"'%q', '%q', '%q', '%q', "
-				"'%q', '%q', '%q', "
-				"%d, %d, %d, %d, "
-				"'%q'"
+		") VALUES ("
+			"'%q', '%q', '%q', '%q', "
+			"'%q', '%q', '%q', '%q', "
+			"'%q', '%q', '%q', "
+			"%d, %d, %d, %d, "
+			"'%q'"
 #				if LOG_UNIQUEID
-				",'%q'"
+			",'%q'"
 #				endif
 #				if LOG_USERFIELD
-				",'%q'"
+			",'%q'"
 #				endif
-			")",
-				cdr->clid, cdr->src, cdr->dst, cdr->dcontext,
-				cdr->channel, cdr->dstchannel, cdr->lastapp, cdr->lastdata,
-				startstr, answerstr, endstr,
-				cdr->duration, cdr->billsec, cdr->disposition, cdr->amaflags,
-				cdr->accountcode
+		")",
+			cdr->clid, cdr->src, cdr->dst, cdr->dcontext,
+			cdr->channel, cdr->dstchannel, cdr->lastapp, cdr->lastdata,
+			startstr, answerstr, endstr,
+			cdr->duration, cdr->billsec, cdr->disposition, cdr->amaflags,
+			cdr->accountcode
 #				if LOG_UNIQUEID
-				,cdr->uniqueid
+			,cdr->uniqueid
 #				endif
 #				if LOG_USERFIELD
-				,cdr->userfield
+			,cdr->userfield
 #				endif
-			);
+		);
+}
+
+static int sqlite_log(struct cw_cdr *cdr)
+{
+	int res = 0;
+	char *zErr = 0;
+	int count;
+	char fn[PATH_MAX];
+	char *sql;
+
+	cw_mutex_lock(&sqlite3_lock);
+
+	/* is the database there? */
+	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
+	sqlite3_open(fn, &db);
+	if (!db) {
+		cw_log(LOG_ERROR, "cdr_sqlite: Unable to open %s\n", fn);
+		cw_mutex_unlock(&sqlite3_lock);
+		return -1;
+	}
+
+	for(count=0; count<5; count++) {
+		sql = sqlite_build_insert(cdr);
 		cw_log(LOG_DEBUG, "CDR SQLITE3 SQL [%s]\n", sql);
 		res = sqlite3_exec(db,
 						   sql,
@@ -188,16 +194,63 @@ static int sqlite_log(struct cw_cdr *cdr)
 	
 	if (zErr) {
 		cw_log(LOG_ERROR, "cdr_sqlite: %s\n", zErr);
-		free(zErr);
+		sqlite3_free(zErr);
 	}
 
 	if (db) sqlite3_close(db);
+	db = NULL;
 
 	cw_mutex_unlock(&sqlite3_lock);
 	return res;
 }
 
 
+/*! Inserts a whole batch of CDRs in one transaction, so the database is
+ *  opened and synced once per batch instead of once per record.  On error
+ *  nothing of the batch is kept and the CDR engine retries the records one
+ *  at a time through sqlite_log() */
+static int sqlite_log_batch(struct cw_cdr **cdrs, int count)
+{
+	int res;
+	char *zErr = 0;
+	char fn[PATH_MAX];
+	char *sql;
+	int x;
+
+	cw_mutex_lock(&sqlite3_lock);
+
+	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
+	sqlite3_open(fn, &db);
+	if (!db) {
+		cw_mutex_unlock(&sqlite3_lock);
+		return -1;
+	}
+	sqlite3_busy_timeout(db, 1000);
+
+	res = sqlite3_exec(db, "BEGIN", NULL, NULL, &zErr);
+	for (x = 0;  x < count && res == SQLITE_OK;  x++) {
+		sql = sqlite_build_insert(cdrs[x]);
+		res = sqlite3_exec(db, sql, NULL, NULL, &zErr);
+		sqlite3_free(sql);
+	}
+	if (res == SQLITE_OK)
+		res = sqlite3_exec(db, "COMMIT", NULL, NULL, &zErr);
+
+	if (res != SQLITE_OK) {
+		cw_log(LOG_ERROR, "cdr_sqlite: batch of %d records failed: %s\n", count, zErr ? zErr : "unknown error");
+		if (zErr)
+			sqlite3_free(zErr);
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		res = -1;
+	}
+
+	sqlite3_close(db);
+	db = NULL;
+
+	cw_mutex_unlock(&sqlite3_lock);
+	return res;
+}
+
 char *description(void)
 {
 	return desc;
@@ -238,7 +291,7 @@ int load_module(void)
 		/* TODO: here we should probably create an index */
 	}
 	
-	res = cw_cdr_register(name, desc, sqlite_log);
+	res = cw_cdr_register_batch(name, desc, sqlite_log, sqlite_log_batch);
 	if (res) {
 		cw_log(LOG_ERROR, "Unable to register SQLite CDR handling\n");
 		goto err;
@@ -108,67 +108,97 @@ static const struct cw_channel_tech local_tech = {
 	.send_html = local_sendhtml,
 };
 
+/* Frames queued for one half of a pair */
+struct local_queue {
+	struct cw_frame *head;
+	struct cw_frame *tail;
+	int frames;
+	int voice;
+	int hungup;				/* A hangup is queued, so nothing else is */
+	int signalled;				/* The reader's end of the socketpair is readable */
+};
+
 static struct local_pvt {
 	cw_mutex_t lock;			/* Channel private lock */
 	char context[CW_MAX_CONTEXT];		/* Context to call */
 	char exten[CW_MAX_EXTENSION];		/* Extension to call */
 	int reqformat;				/* Requested format */
 	struct cw_jb_conf jb_conf;		/*!< jitterbuffer configuration for this local channel */
-	int glaredetect;			/* Detect glare on hangup */
-	int cancelqueue;			/* Cancel queue */
 	int alreadymasqed;			/* Already masqueraded */
 	int launchedpbx;			/* Did we launch the PBX */
 	int nooptimization;			/* Don't leave masq state */
 	struct cw_channel *owner;		/* Master Channel */
 	struct cw_channel *chan;		/* Outbound channel */
+	/* Frames for the owner (0) and for the outbound channel (1) */
+	struct local_queue queue[2];
+	/* Both halves wait on one socketpair, the owner on sv[0] and the
+	   outbound channel on sv[1].  Writing to one end wakes the other */
+	int sv[2];
 	struct local_pvt *next;			/* Next entity */
 } *locals = NULL;
 
-static int local_queue_frame(struct local_pvt *p, int isoutbound, struct cw_frame *f, struct cw_channel *us)
+/*
+ * Frames pass between the two halves of a pair through the pvt rather than
+ * through cw_queue_frame().  A frame is still copied once per hop, when it
+ * comes in with cw_write(), since the caller keeps and frees its own and
+ * frames carry no reference count; that copy is the one cw_queue_frame()
+ * made too, and it is handed over as is to whoever reads the other half.
+ * Only the pvt lock is needed, so neither half ever has to lock, or wait for,
+ * the other channel, and the reader is woken through the shared socketpair
+ * only when its queue goes from empty to not empty.
+ */
+static void local_queue_free(struct local_queue *q)
 {
-	struct cw_channel *other;
-retrylock:		
-	/* Recalculate outbound channel */
-	if (isoutbound) {
-		other = p->owner;
-	} else {
-		other = p->chan;
-	}
-	/* Set glare detection */
-	p->glaredetect = 1;
-	if (p->cancelqueue) {
-		/* We had a glare on the hangup.  Forget all this business,
-		return and destroy p.  */
-		cw_mutex_unlock(&p->lock);
-		cw_mutex_destroy(&p->lock);
-		free(p);
-		return -1;
+	struct cw_frame *f;
+
+	while ((f = q->head)) {
+		q->head = f->next;
+		cw_fr_free(f);
 	}
-	if (!other) {
-		p->glaredetect = 0;
+	q->tail = NULL;
+	q->frames = q->voice = 0;
+}
+
+/* Call with the pvt locked */
+static int local_queue_frame(struct local_pvt *p, int isoutbound, struct cw_frame *f)
+{
+	/* What the outbound channel writes is read by the owner, and back */
+	struct local_queue *q = &p->queue[isoutbound ? 0 : 1];
+	struct cw_channel *other = isoutbound ? p->owner : p->chan;
+	struct cw_frame *dup;
+	char c = 0;
+
+	if (!other || q->hungup)
+		return 0;
+	/* Allow up to 96 voice frames outstanding, and up to 128 total frames */
+	if ((f->frametype == CW_FRAME_VOICE && q->voice > 96) || q->frames > 128) {
+		if (f->frametype != CW_FRAME_VOICE)
+			cw_log(LOG_ERROR, "Dropping non-voice (type %d) frame for %s due to long queue length\n", f->frametype, other->name);
+		else
+			cw_log(LOG_WARNING, "Dropping voice frame for %s due to exceptionally long queue\n", other->name);
 		return 0;
 	}
-	if (cw_mutex_trylock(&other->lock)) {
-		/* Failed to lock.  Release main lock and try again */
-		cw_mutex_unlock(&p->lock);
-		if (us) {
-			if (cw_mutex_unlock(&us->lock)) {
-				cw_log(LOG_WARNING, "%s wasn't locked while sending %d/%d\n",
-					us->name, f->frametype, f->subclass);
-				us = NULL;
-			}
-		}
-		/* Wait just a bit */
-		usleep(1);
-		/* Only we can destroy ourselves, so we can't disappear here */
-		if (us)
-			cw_mutex_lock(&us->lock);
-		cw_mutex_lock(&p->lock);
-		goto retrylock;
+	if (!(dup = cw_frdup(f))) {
+		cw_log(LOG_WARNING, "Unable to duplicate frame\n");
+		return -1;
+	}
+	dup->next = NULL;
+	if (q->tail)
+		q->tail->next = dup;
+	else
+		q->head = dup;
+	q->tail = dup;
+	q->frames++;
+	if (f->frametype == CW_FRAME_VOICE)
+		q->voice++;
+	if (f->frametype == CW_FRAME_CONTROL && f->subclass == CW_CONTROL_HANGUP)
+		q->hungup = 1;
+
+	if (!q->signalled) {
+		if (write(p->sv[isoutbound ? 1 : 0], &c, 1) != 1)
+			cw_log(LOG_WARNING, "Unable to wake up %s: %s\n", other->name, strerror(errno));
+		q->signalled = 1;
 	}
-	cw_queue_frame(other, f);
-	cw_mutex_unlock(&other->lock);
-	p->glaredetect = 0;
 	return 0;
 }
 
@@ -183,7 +213,7 @@ static int local_answer(struct cw_channel *ast)
 	if (isoutbound) {
 		/* Pass along answer since somebody answered us */
 		struct cw_frame answer = { CW_FRAME_CONTROL, CW_CONTROL_ANSWER };
-		res = local_queue_frame(p, isoutbound, &answer, ast);
+		res = local_queue_frame(p, isoutbound, &answer);
 	} else
 		cw_log(LOG_WARNING, "Huh?  Local is being asked to answer?\n");
 	cw_mutex_unlock(&p->lock);
@@ -202,7 +232,7 @@ static void check_bridge(struct local_pvt *p, int isoutbound)
 	   frames on the owner channel (because they would be transferred to the
 	   outbound channel during the masquerade)
 	*/
-	if (isoutbound && p->chan->_bridge /* Not cw_bridged_channel!  Only go one step! */ && !p->owner->readq) {
+	if (isoutbound && p->chan->_bridge /* Not cw_bridged_channel!  Only go one step! */ && !p->owner->readq && !p->queue[0].head) {
 		/* Masquerade bridged channel into owner */
 		/* Lock everything we need, one by one, and give up if
 		   we can't get everything.  Remember, we'll get another
@@ -225,7 +255,7 @@ static void check_bridge(struct local_pvt *p, int isoutbound)
 	   when the local channels go away.
 	*/
 #if 0
-	} else if (!isoutbound && p->owner && p->owner->_bridge && p->chan && !p->chan->readq) {
+	} else if (!isoutbound && p->owner && p->owner->_bridge && p->chan && !p->chan->readq && !p->queue[1].head) {
 		/* Masquerade bridged channel into chan */
 		if (!cw_mutex_trylock(&(p->owner->_bridge)->lock)) {
 			if (!p->owner->_bridge->_softhangup) {
@@ -246,8 +276,43 @@ static void check_bridge(struct local_pvt *p, int isoutbound)
 static struct cw_frame  *local_read(struct cw_channel *ast)
 {
 	static struct cw_frame null = { CW_FRAME_NULL, };
+	struct local_pvt *p = ast->tech_pvt;
+	struct local_queue *q;
+	struct cw_frame *f;
+	char buf[16];
+	int res;
+
+	if (!p)
+		return &null;
+	cw_mutex_lock(&p->lock);
+	q = &p->queue[IS_OUTBOUND(ast, p) ? 1 : 0];
+	if (!(f = q->head)) {
+		f = &null;
+	} else {
+		if (!(q->head = f->next))
+			q->tail = NULL;
+		f->next = NULL;
+		q->frames--;
+		if (f->frametype == CW_FRAME_VOICE)
+			q->voice--;
+	}
+	if (!q->head && q->signalled) {
+		/* The socket is non-blocking and holds one byte at most, so
+		   EAGAIN only means there is nothing left to clear */
+		while ((res = read(p->sv[IS_OUTBOUND(ast, p) ? 1 : 0], buf, sizeof(buf))) < 0 && errno == EINTR)
+			;
+		if (res < 0 && errno != EAGAIN)
+			cw_log(LOG_WARNING, "Unable to clear wakeup on %s: %s\n", ast->name, strerror(errno));
+		q->signalled = 0;
+	}
+	cw_mutex_unlock(&p->lock);
 
-	return &null;
+	/* The other half hung up */
+	if (f->frametype == CW_FRAME_CONTROL && f->subclass == CW_CONTROL_HANGUP) {
+		cw_fr_free(f);
+		return NULL;
+	}
+	return f;
 }
 
 static int local_write(struct cw_channel *ast, struct cw_frame *f)
@@ -262,7 +327,7 @@ static int local_write(struct cw_channel *ast, struct cw_frame *f)
 	if (f && (f->frametype == CW_FRAME_VOICE)) 
 		check_bridge(p, isoutbound);
 	if (!p->alreadymasqed)
-		res = local_queue_frame(p, isoutbound, f, ast);
+		res = local_queue_frame(p, isoutbound, f);
 	else {
 		cw_log(LOG_DEBUG, "Not posting to queue since already masked on '%s'\n", ast->name);
 		res = 0;
@@ -300,7 +365,7 @@ static int local_indicate(struct cw_channel *ast, int condition)
 	cw_mutex_lock(&p->lock);
 	isoutbound = IS_OUTBOUND(ast, p);
 	f.subclass = condition;
-	res = local_queue_frame(p, isoutbound, &f, ast);
+	res = local_queue_frame(p, isoutbound, &f);
 	cw_mutex_unlock(&p->lock);
 	return res;
 }
@@ -315,7 +380,7 @@ static int local_digit(struct cw_channel *ast, char digit)
 	cw_mutex_lock(&p->lock);
 	isoutbound = IS_OUTBOUND(ast, p);
 	f.subclass = digit;
-	res = local_queue_frame(p, isoutbound, &f, ast);
+	res = local_queue_frame(p, isoutbound, &f);
 	cw_mutex_unlock(&p->lock);
 	return res;
 }
@@ -332,7 +397,7 @@ static int local_sendhtml(struct cw_channel *ast, int subclass, const char *data
 	f.subclass = subclass;
 	f.data = (char *)data;
 	f.datalen = datalen;
-	res = local_queue_frame(p, isoutbound, &f, ast);
+	res = local_queue_frame(p, isoutbound, &f);
 	cw_mutex_unlock(&p->lock);
 	return res;
 }
@@ -396,30 +461,17 @@ static int local_call(struct cw_channel *ast, char *dest, int timeout)
 	return res;
 }
 
-#if 0
 static void local_destroy(struct local_pvt *p)
 {
-	struct local_pvt *cur, *prev = NULL;
-	cw_mutex_lock(&locallock);
-	cur = locals;
-	while(cur) {
-		if (cur == p) {
-			if (prev)
-				prev->next = cur->next;
-			else
-				locals = cur->next;
-			cw_mutex_destroy(cur);
-			free(cur);
-			break;
-		}
-		prev = cur;
-		cur = cur->next;
-	}
-	cw_mutex_unlock(&locallock);
-	if (!cur)
-		cw_log(LOG_WARNING, "Unable to find local '%s@%s' in local list\n", p->exten, p->context);
+	local_queue_free(&p->queue[0]);
+	local_queue_free(&p->queue[1]);
+	if (p->sv[0] > -1)
+		close(p->sv[0]);
+	if (p->sv[1] > -1)
+		close(p->sv[1]);
+	cw_mutex_destroy(&p->lock);
+	free(p);
 }
-#endif
 
 /*--- local_hangup: Hangup a call through the local proxy channel */
 static int local_hangup(struct cw_channel *ast)
@@ -429,8 +481,6 @@ static int local_hangup(struct cw_channel *ast)
 	struct cw_frame f = { CW_FRAME_CONTROL, CW_CONTROL_HANGUP };
 	struct local_pvt *cur, *prev=NULL;
 	struct cw_channel *ochan = NULL;
-	int glaredetect;
-	int res=0;
 
 	cw_mutex_lock(&p->lock);
 	isoutbound = IS_OUTBOUND(ast, p);
@@ -447,11 +497,6 @@ static int local_hangup(struct cw_channel *ast)
 	
 	if (!p->owner && !p->chan) {
 		/* Okay, done with the private part now, too. */
-		glaredetect = p->glaredetect;
-		/* If we have a queue holding, don't actually destroy p yet, but
-		   let local_queue do it. */
-		if (p->glaredetect)
-			p->cancelqueue = 1;
 		cw_mutex_unlock(&p->lock);
 		/* Remove from list */
 		cw_mutex_lock(&locallock);
@@ -472,24 +517,41 @@ static int local_hangup(struct cw_channel *ast)
 		cw_mutex_lock(&p->lock);
 		cw_mutex_unlock(&p->lock);
 		/* And destroy */
-		if (!glaredetect) {
-			cw_mutex_destroy(&p->lock);
-			free(p);
-		}
+		local_destroy(p);
 		return 0;
 	}
 	if (p->chan && !p->launchedpbx)
 		/* Need to actually hangup since there is no PBX */
 		ochan = p->chan;
 	else
-		res = local_queue_frame(p, isoutbound, &f, NULL);
-	if(res==0)
-		cw_mutex_unlock(&p->lock);
+		local_queue_frame(p, isoutbound, &f);
+	cw_mutex_unlock(&p->lock);
 	if (ochan)
 		cw_hangup(ochan);
 	return 0;
 }
 
+/*--- local_pvt_new: Create an empty pvt with its socketpair */
+static struct local_pvt *local_pvt_new(void)
+{
+	struct local_pvt *tmp;
+
+	tmp = malloc(sizeof(struct local_pvt));
+	if (tmp) {
+		memset(tmp, 0, sizeof(struct local_pvt));
+		cw_mutex_init(&tmp->lock);
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, tmp->sv)) {
+			cw_log(LOG_WARNING, "Unable to create socketpair: %s\n", strerror(errno));
+			cw_mutex_destroy(&tmp->lock);
+			free(tmp);
+			return NULL;
+		}
+		fcntl(tmp->sv[0], F_SETFL, fcntl(tmp->sv[0], F_GETFL) | O_NONBLOCK);
+		fcntl(tmp->sv[1], F_SETFL, fcntl(tmp->sv[1], F_GETFL) | O_NONBLOCK);
+	}
+	return tmp;
+}
+
 /*--- local_alloc: Create a call structure */
 static struct local_pvt *local_alloc(char *data, int format)
 {
@@ -497,10 +559,8 @@ static struct local_pvt *local_alloc(char *data, int format)
 	char *c;
 	char *opts;
 
-	tmp = malloc(sizeof(struct local_pvt));
+	tmp = local_pvt_new();
 	if (tmp) {
-		memset(tmp, 0, sizeof(struct local_pvt));
-		cw_mutex_init(&tmp->lock);
 		strncpy(tmp->exten, data, sizeof(tmp->exten) - 1);
 		
 		memcpy(&tmp->jb_conf, &g_jb_conf, sizeof(tmp->jb_conf)); 
@@ -530,8 +590,7 @@ static struct local_pvt *local_alloc(char *data, int format)
 		tmp->reqformat = format;
 		if (!cw_exists_extension(NULL, tmp->context, tmp->exten, 1, NULL)) {
 			cw_log(LOG_NOTICE, "No such extension/context %s@%s creating local channel\n", tmp->exten, tmp->context);
-			cw_mutex_destroy(&tmp->lock);
-			free(tmp);
+			local_destroy(tmp);
 			tmp = NULL;
 		} else {
 			/* Add to list */
@@ -583,6 +642,8 @@ static struct cw_channel *local_new(struct local_pvt *p, int state)
 	tmp->rawreadformat = fmt;
 	tmp2->rawreadformat = fmt;
 
+	tmp->fds[0] = p->sv[0];
+	tmp2->fds[0] = p->sv[1];
 	tmp->tech_pvt = p;
 	tmp2->tech_pvt = p;
 	p->owner = tmp;
@@ -645,6 +706,100 @@ static struct cw_cli_entry cli_show_locals = {
 	{ "local", "show", "channels", NULL }, locals_show, 
 	"Show status of local channels", show_locals_usage, NULL };
 
+/*--- locals_benchmark: CLI command "local benchmark" */
+/* Passes voice frames down a chain of Local pairs the way a bridge would:
+   each frame is written to the owner of one pair, read from its outbound
+   channel and written on to the owner of the next.  The pairs are not
+   real channels, only stand-ins carrying the pvt, so nothing is started
+   in the dialplan and nothing shows up in "show channels". */
+static int locals_benchmark(int fd, int argc, char **argv)
+{
+	struct local_pvt **pvts;
+	struct cw_channel *chans;
+	struct cw_frame voice;
+	struct cw_frame *f;
+	struct timeval start;
+	short samples[160];
+	int pairs = 8;
+	int frames = 10000;
+	int received = 0;
+	int x, y, ms;
+
+	if (argc > 4)
+		return RESULT_SHOWUSAGE;
+	if (argc > 2 && ((pairs = atoi(argv[2])) <= 0 || pairs > 1000))
+		return RESULT_SHOWUSAGE;
+	if (argc > 3 && (frames = atoi(argv[3])) <= 0)
+		return RESULT_SHOWUSAGE;
+
+	pvts = calloc(pairs, sizeof(*pvts));
+	chans = calloc(pairs * 2, sizeof(*chans));
+	if (!pvts || !chans) {
+		cw_cli(fd, "Out of memory\n");
+		goto out;
+	}
+	for (x = 0; x < pairs; x++) {
+		if (!(pvts[x] = local_pvt_new())) {
+			cw_cli(fd, "Unable to create Local pair %d\n", x);
+			goto out;
+		}
+		pvts[x]->nooptimization = 1;
+		pvts[x]->owner = &chans[x * 2];
+		pvts[x]->chan = &chans[x * 2 + 1];
+		snprintf(chans[x * 2].name, sizeof(chans[x * 2].name), "Local/benchmark-%d,1", x);
+		snprintf(chans[x * 2 + 1].name, sizeof(chans[x * 2 + 1].name), "Local/benchmark-%d,2", x);
+		chans[x * 2].tech_pvt = chans[x * 2 + 1].tech_pvt = pvts[x];
+	}
+
+	memset(samples, 0, sizeof(samples));
+	cw_fr_init_ex(&voice, CW_FRAME_VOICE, CW_FORMAT_SLINEAR, "benchmark");
+	voice.data = samples;
+	voice.datalen = sizeof(samples);
+	voice.samples = 160;
+
+	start = cw_tvnow();
+	for (y = 0; y < frames; y++) {
+		f = &voice;
+		for (x = 0; x < pairs && f; x++) {
+			local_write(pvts[x]->owner, f);
+			if (f != &voice)
+				cw_fr_free(f);
+			f = local_read(pvts[x]->chan);
+			if (f && f->frametype != CW_FRAME_VOICE) {
+				cw_fr_free(f);
+				f = NULL;
+			}
+		}
+		if (f) {
+			received++;
+			cw_fr_free(f);
+		}
+	}
+	ms = cw_tvdiff_ms(cw_tvnow(), start);
+	cw_cli(fd, "%d of %d frames through %d Local pairs in %d ms (%.2f us per hop)\n",
+		received, frames, pairs, ms, ms * 1000.0 / ((double) frames * pairs));
+
+out:
+	if (pvts) {
+		for (x = 0; x < pairs; x++) {
+			if (pvts[x])
+				local_destroy(pvts[x]);
+		}
+		free(pvts);
+	}
+	free(chans);
+	return RESULT_SUCCESS;
+}
+
+static char benchmark_locals_usage[] =
+"Usage: local benchmark [pairs [frames]]\n"
+"       Times frames (default 10000) passed down a chain of pairs\n"
+"(default 8) Local channel pairs, as bridges between them would.\n";
+
+static struct cw_cli_entry cli_benchmark_locals = {
+	{ "local", "benchmark", NULL }, locals_benchmark,
+	"Measure frame passing through Local channels", benchmark_locals_usage, NULL };
+
 /*--- load_module: Load module into PBX, register channel */
 int load_module()
 {
@@ -654,6 +809,7 @@ int load_module()
 		return -1;
 	}
 	cw_cli_register(&cli_show_locals);
+	cw_cli_register(&cli_benchmark_locals);
 	return 0;
 }
 
@@ -670,6 +826,7 @@ int unload_module()
 
 	/* First, take us out of the channel loop */
 	cw_cli_unregister(&cli_show_locals);
+	cw_cli_unregister(&cli_benchmark_locals);
 	cw_channel_unregister(&local_tech);
 	if (!cw_mutex_lock(&locallock)) {
 		/* Hangup all interfaces if they have an owner */
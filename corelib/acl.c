@@ -76,14 +76,49 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 CW_MUTEX_DEFINE_STATIC(routeseq_lock);
 #endif
 
+/* Lists shorter than this are just walked, it's cheaper than the tree */
+#define HA_TREE_MIN	8
+
+/* The compiled tree is looked up without ha_lock, see cw_apply_ha() */
+#define ha_barrier()	__sync_synchronize()
+#define ha_tree_get(ha)	(*(struct ha_tree * volatile *) &(ha)->tree)
+
+/* One bit of the prefix tree.  order/sense are those of the last rule in
+   the list covering this prefix, -1 if no rule does */
+struct ha_node {
+	int child[2];
+	int order;
+	int sense;
+};
+
+/* A compiled cw_ha list.  Rules with a contiguous netmask go into a binary
+   prefix tree, where the deepest node on an address's path gives the last
+   of them that matches.  Rules with odd netmasks (255.0.255.0 and the like)
+   can't be put in the tree and are kept aside to be checked one by one */
+struct ha_tree {
+	struct ha_node *nodes;
+	int nnodes;
+	int maxnodes;
+	struct cw_ha **odd;
+	int *oddorder;
+	int nodd;
+	struct ha_tree *next;		/* Superseded trees, see cw_append_ha() */
+};
+
 struct cw_ha {
 	/* Host access rule */
 	struct in_addr netaddr;
 	struct in_addr netmask;
 	int sense;
 	struct cw_ha *next;
+	/* Only used on the first rule of a list */
+	struct ha_tree *tree;		/* Compiled list, built on first use */
+	struct ha_tree *retired;	/* Trees that may still be in use */
+	int rules;			/* Number of rules in the list */
 };
 
+CW_MUTEX_DEFINE_STATIC(ha_lock);
+
 /* Default IP - if not otherwise set, don't breathe garbage */
 static struct in_addr __ourip = { 0x00000000 };
 
@@ -92,6 +127,127 @@ struct my_ifreq {
 	struct sockaddr_in ifru_addr;
 };
 
+static void ha_tree_free(struct ha_tree *tree)
+{
+	struct ha_tree *next;
+
+	while (tree) {
+		next = tree->next;
+		free(tree->nodes);
+		free(tree->odd);
+		free(tree->oddorder);
+		free(tree);
+		tree = next;
+	}
+}
+
+static int ha_tree_node(struct ha_tree *tree)
+{
+	struct ha_node *nodes;
+	int n;
+
+	if (tree->nnodes == tree->maxnodes) {
+		n = tree->maxnodes ? tree->maxnodes * 2 : 64;
+		if (!(nodes = realloc(tree->nodes, n * sizeof(struct ha_node))))
+			return -1;
+		tree->nodes = nodes;
+		tree->maxnodes = n;
+	}
+	n = tree->nnodes++;
+	tree->nodes[n].child[0] = tree->nodes[n].child[1] = 0;
+	tree->nodes[n].order = -1;
+	tree->nodes[n].sense = CW_SENSE_ALLOW;
+	return n;
+}
+
+/* Compile a list into a prefix tree, NULL if we run out of memory */
+static struct ha_tree *ha_tree_build(struct cw_ha *ha)
+{
+	struct ha_tree *tree;
+	struct ha_node *node;
+	unsigned int addr, mask;
+	int order, bits, n, c, x;
+
+	if (!(tree = calloc(1, sizeof(struct ha_tree))))
+		return NULL;
+	if (ha_tree_node(tree) < 0)
+		goto fail;
+	for (order = 0;  ha;  ha = ha->next, order++) {
+		addr = ntohl(ha->netaddr.s_addr);
+		mask = ntohl(ha->netmask.s_addr);
+		if ((~mask & (~mask + 1))) {
+			/* Not a prefix */
+			if (!(tree->nodd % 16)) {
+				struct cw_ha **odd;
+				int *oddorder;
+
+				if (!(odd = realloc(tree->odd, (tree->nodd + 16) * sizeof(*odd))))
+					goto fail;
+				tree->odd = odd;
+				if (!(oddorder = realloc(tree->oddorder, (tree->nodd + 16) * sizeof(*oddorder))))
+					goto fail;
+				tree->oddorder = oddorder;
+			}
+			tree->odd[tree->nodd] = ha;
+			tree->oddorder[tree->nodd++] = order;
+			continue;
+		}
+		for (bits = 0;  mask;  mask <<= 1)
+			bits++;
+		n = 0;
+		for (x = 0;  x < bits;  x++) {
+			c = (addr >> (31 - x)) & 1;
+			if (!tree->nodes[n].child[c]) {
+				int m;
+
+				if ((m = ha_tree_node(tree)) < 0)
+					goto fail;
+				tree->nodes[n].child[c] = m;
+			}
+			n = tree->nodes[n].child[c];
+		}
+		/* Later rules for the same prefix replace earlier ones */
+		tree->nodes[n].order = order;
+		tree->nodes[n].sense = ha->sense;
+	}
+	/* Children are always created after their parent, so a single pass
+	   in creation order hands every node the last rule covering it */
+	for (n = 0;  n < tree->nnodes;  n++) {
+		node = &tree->nodes[n];
+		for (c = 0;  c < 2;  c++) {
+			if (node->child[c] && tree->nodes[node->child[c]].order < node->order) {
+				tree->nodes[node->child[c]].order = node->order;
+				tree->nodes[node->child[c]].sense = node->sense;
+			}
+		}
+	}
+	return tree;
+
+fail:
+	ha_tree_free(tree);
+	return NULL;
+}
+
+static int ha_tree_apply(struct ha_tree *tree, struct sockaddr_in *sin)
+{
+	struct ha_node *nodes = tree->nodes;
+	unsigned int addr = ntohl(sin->sin_addr.s_addr);
+	int n, c, x;
+
+	n = 0;
+	for (x = 31;  x >= 0;  x--) {
+		if (!(c = nodes[n].child[(addr >> x) & 1]))
+			break;
+		n = c;
+	}
+	/* The last odd rule that matches, if it comes after the tree's one */
+	for (x = tree->nodd - 1;  x >= 0  &&  tree->oddorder[x] > nodes[n].order;  x--) {
+		if ((sin->sin_addr.s_addr & tree->odd[x]->netmask.s_addr) == tree->odd[x]->netaddr.s_addr)
+			return tree->odd[x]->sense;
+	}
+	return (nodes[n].order < 0)  ?  CW_SENSE_ALLOW  :  nodes[n].sense;
+}
+
 /* Free HA structure */
 void cw_free_ha(struct cw_ha *ha)
 {
@@ -99,6 +255,8 @@ void cw_free_ha(struct cw_ha *ha)
 	while(ha) {
 		hal = ha;
 		ha = ha->next;
+		ha_tree_free(hal->tree);
+		ha_tree_free(hal->retired);
 		free(hal);
 	}
 }
@@ -114,7 +272,7 @@ static void cw_copy_ha(struct cw_ha *from, struct cw_ha *to)
 /* Create duplicate of ha structure */
 static struct cw_ha *cw_duplicate_ha(struct cw_ha *original)
 {
-	struct cw_ha *new_ha = malloc(sizeof(struct cw_ha));
+	struct cw_ha *new_ha = calloc(1, sizeof(struct cw_ha));
 	/* Copy from original to new object */
 	cw_copy_ha(original, new_ha); 
 
@@ -140,6 +298,8 @@ struct cw_ha *cw_duplicate_ha_list(struct cw_ha *original)
 		start = start->next;		/* Go to next object */
 		prev = link;			/* Save pointer to this object */
 	}
+	if (ret)
+		ret->rules = original->rules;
 	return ret;    			/* Return start of list */
 }
 
@@ -192,17 +352,30 @@ struct cw_ha *cw_append_ha(char *sense, char *stuff, struct cw_ha *path)
 			ha->sense = CW_SENSE_DENY;
 		}
 		ha->next = NULL;
+		ha->tree = ha->retired = NULL;
+		ha->rules = 0;
 		if (prev) {
 			prev->next = ha;
 		} else {
 			ret = ha;
 		}
+		/* The compiled list is out of date.  Somebody may still be looking
+		   at it, so keep it until the whole list is freed */
+		cw_mutex_lock(&ha_lock);
+		ret->rules++;
+		if (ret->tree) {
+			ret->tree->next = ret->retired;
+			ret->retired = ret->tree;
+			ret->tree = NULL;
+		}
+		cw_mutex_unlock(&ha_lock);
 	}
 	cw_log(LOG_DEBUG, "%s/%s appended to acl for peer\n", stuff, nm);
 	return ret;
 }
 
-int cw_apply_ha(struct cw_ha *ha, struct sockaddr_in *sin)
+/* Walk the list, the last rule that matches wins */
+static int ha_apply_list(struct cw_ha *ha, struct sockaddr_in *sin)
 {
 	/* Start optimistic */
 	int res = CW_SENSE_ALLOW;
@@ -229,6 +402,33 @@ int cw_apply_ha(struct cw_ha *ha, struct sockaddr_in *sin)
 	return res;
 }
 
+int cw_apply_ha(struct cw_ha *ha, struct sockaddr_in *sin)
+{
+	struct ha_tree *tree;
+
+	/* Short lists, or debugging every rule */
+	if (!ha || ha->rules < HA_TREE_MIN || option_debug > 5)
+		return ha_apply_list(ha, sin);
+
+	/* The tree is published only once it is fully built, and a reader that
+	   sees it also sees what went into it.  A tree superseded meanwhile by
+	   cw_append_ha() is retired, not freed, so it stays safe to use */
+	tree = ha_tree_get(ha);
+	ha_barrier();
+	if (!tree) {
+		cw_mutex_lock(&ha_lock);
+		if (!(tree = ha->tree)) {
+			tree = ha_tree_build(ha);
+			ha_barrier();
+			ha_tree_get(ha) = tree;
+		}
+		cw_mutex_unlock(&ha_lock);
+		if (!tree)
+			return ha_apply_list(ha, sin);
+	}
+	return ha_tree_apply(tree, sin);
+}
+
 int cw_get_ip_or_srv(struct sockaddr_in *sin, const char *value, const char *service)
 {
 	struct hostent *hp;
@@ -0,0 +1,117 @@
+/* Checks the compiled ACLs against walking the list, on random lists */
+
+#include "acl.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CuTest.h"
+
+/* The rules are all addresses, so nothing is ever looked up */
+struct hostent *cw_gethostbyname(const char *host, struct cw_hostent *hp)
+{
+	return NULL;
+}
+
+int cw_get_srv(struct cw_channel *chan, char *host, int hostlen, int *port, const char *service)
+{
+	return 0;
+}
+
+/* Addresses and rules are drawn from a few networks so they overlap */
+static unsigned int random_addr(void)
+{
+	static const unsigned int nets[] = { 0x0a000000, 0xc0a80000, 0xac100000, 0x0a0a0000 };
+
+	if (!(random() % 8))
+		return random();
+	return nets[random() % 4] | (random() & (0xffffffff >> (8 + random() % 16)));
+}
+
+static char *random_rule(char *buf, size_t len)
+{
+	struct in_addr addr;
+	char iabuf[INET_ADDRSTRLEN];
+
+	addr.s_addr = htonl(random_addr());
+	cw_inet_ntoa(iabuf, sizeof(iabuf), addr);
+	switch (random() % 10) {
+	case 0:
+		/* Not a prefix */
+		snprintf(buf, len, "%s/255.%ld.255.0", iabuf, random() % 256);
+		break;
+	case 1:
+		snprintf(buf, len, "%s", iabuf);
+		break;
+	case 2:
+		snprintf(buf, len, "0.0.0.0/0");
+		break;
+	default:
+		snprintf(buf, len, "%s/%ld", iabuf, 8 + random() % 25);
+		break;
+	}
+	return buf;
+}
+
+/* Checks one address against the tree and against the list the tree was
+   built from */
+static void check_addr(CuTest *tc, struct cw_ha *ha, struct sockaddr_in *sin, int list, int rules)
+{
+	char iabuf[INET_ADDRSTRLEN];
+	char msg[128];
+	int want = ha_apply_list(ha, sin);
+
+	if (cw_apply_ha(ha, sin) != want) {
+		snprintf(msg, sizeof(msg), "list %d (%d rules) differs for %s", list, rules,
+			cw_inet_ntoa(iabuf, sizeof(iabuf), sin->sin_addr));
+		CuAssertIntEquals_Msg(tc, msg, want, cw_apply_ha(ha, sin));
+	}
+}
+
+/* The tree answers as the list does, for lists, their duplicates, and
+   lists appended to after their tree was built */
+void test_acl_tree(CuTest *tc)
+{
+	struct cw_ha *ha, *dup;
+	struct sockaddr_in sin;
+	char rule[64];
+	int lists, rules, x, y;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+
+	for (lists = 0;  lists < 500;  lists++) {
+		ha = NULL;
+		rules = 1 + random() % (lists < 450 ? 64 : 2000);
+		for (x = 0;  x < rules;  x++)
+			ha = cw_append_ha(random() % 2 ? "permit" : "deny", random_rule(rule, sizeof(rule)), ha);
+		dup = cw_duplicate_ha_list(ha);
+		for (y = 0;  y < 2000;  y++) {
+			sin.sin_addr.s_addr = htonl(random_addr());
+			check_addr(tc, ha, &sin, lists, rules);
+			check_addr(tc, dup, &sin, lists, rules);
+			/* Appending must not leave a stale tree behind */
+			if (y == 1000) {
+				ha = cw_append_ha("deny", random_rule(rule, sizeof(rule)), ha);
+				rules++;
+			}
+		}
+		cw_free_ha(ha);
+		cw_free_ha(dup);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	CuString *output = CuStringNew();
+	CuSuite *suite = CuSuiteNew();
+
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+
+	SUITE_ADD_TEST(suite, test_acl_tree);
+
+	CuSuiteRun(suite);
+	CuSuiteSummary(suite, output);
+	CuSuiteDetails(suite, output);
+	printf("%s\n", output->buffer);
+	return suite->failCount ? 1 : 0;
+}
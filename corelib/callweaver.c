@@ -157,6 +157,10 @@ int option_reconnect = 0;
 int option_transcode_slin = 1;
 int option_maxcalls = 0;
 double option_maxload = 0.0;
+int option_prompt_cache = 16384;
+int option_record_writers = 2;
+int option_dns_threads = 4;
+int option_config_cache = 1;
 int option_dontwarn = 0;
 int option_priority_jumping = 1;
 int fully_booted = 0;
@@ -2155,6 +2159,31 @@ static void cw_readconfig(void)
                 option_maxload = 0.0;
             }
         }
+        else if (!strcasecmp(v->name, "promptcache"))
+        {
+            if ((sscanf(v->value, "%d", &option_prompt_cache) != 1) || (option_prompt_cache < 0))
+            {
+                option_prompt_cache = 0;
+            }
+        }
+        else if (!strcasecmp(v->name, "recordwriters"))
+        {
+            if ((sscanf(v->value, "%d", &option_record_writers) != 1) || (option_record_writers < 0))
+            {
+                option_record_writers = 0;
+            }
+        }
+        else if (!strcasecmp(v->name, "resolvers"))
+        {
+            if ((sscanf(v->value, "%d", &option_dns_threads) != 1) || (option_dns_threads < 0))
+            {
+                option_dns_threads = 0;
+            }
+        }
+        else if (!strcasecmp(v->name, "configcache"))
+        {
+            option_config_cache = cw_true(v->value);
+        }
         else if (!strcasecmp(v->name, "systemname"))
         {
             cw_copy_string(cw_config_CW_SYSTEM_NAME, v->value, sizeof(cw_config_CW_SYSTEM_NAME));
@@ -2612,6 +2641,10 @@ int callweaver_main(int argc, char *argv[])
     {
         cw_exit(1);
     }
+    if (cw_dns_init())
+    {
+        cw_exit(1);
+    }
     if (dnsmgr_init())
     {
         cw_exit(1);
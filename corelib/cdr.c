@@ -29,9 +29,15 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "callweaver.h"
 
@@ -46,7 +52,6 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/options.h"
 #include "callweaver/linkedlists.h"
 #include "callweaver/utils.h"
-#include "callweaver/sched.h"
 #include "callweaver/config.h"
 #include "callweaver/cli.h"
 #include "callweaver/module.h"
@@ -59,6 +64,7 @@ struct cw_cdr_beitem {
 	char name[20];
 	char desc[80];
 	cw_cdrbe be;
+	cw_cdrbe_batch batch_be;
 	CW_LIST_ENTRY(cw_cdr_beitem) list;
 };
 
@@ -69,32 +75,42 @@ struct cw_cdr_batch_item {
 	struct cw_cdr_batch_item *next;
 };
 
-static struct cw_cdr_batch {
+struct cw_cdr_batch {
 	int size;
 	struct cw_cdr_batch_item *head;
 	struct cw_cdr_batch_item *tail;
-} *batch = NULL;
+	struct cw_cdr_batch *next;
+};
+
+static struct cw_cdr_batch *batch = NULL;
 
-static struct sched_context *sched;
-static int cdr_sched = -1;
+/* Batches handed to the CDR thread and not posted yet, oldest first */
+static struct cw_cdr_batch *cdr_queue_head = NULL;
+static struct cw_cdr_batch *cdr_queue_tail = NULL;
+static int cdr_queue_len;
+/* Set while the CDR thread is posting a batch it took off the queue */
+static int cdr_busy;
+/* When the CDR thread submits the current batch, however small it is */
+static struct timeval cdr_next_submit;
 static pthread_t cdr_thread = CW_PTHREADT_NULL;
 
 #define BATCH_SIZE_DEFAULT 100
 #define BATCH_TIME_DEFAULT 300
-#define BATCH_SCHEDULER_ONLY_DEFAULT 0
+#define BATCH_QUEUE_DEFAULT 16
 #define BATCH_SAFE_SHUTDOWN_DEFAULT 1
 
 static int enabled;
 static int batchmode;
 static int batchsize;
 static int batchtime;
-static int batchscheduleronly;
+static int batchqueue;
 static int batchsafeshutdown;
 
 CW_MUTEX_DEFINE_STATIC(cdr_batch_lock);
 
 /* these are used to wake up the CDR thread when there's work to do */
 CW_MUTEX_DEFINE_STATIC(cdr_pending_lock);
+static cw_cond_t cdr_pending_cond;
 
 /*
  * We do a lot of checking here in the CDR code to try to be sure we don't ever let a CDR slip
@@ -104,6 +120,11 @@ CW_MUTEX_DEFINE_STATIC(cdr_pending_lock);
  */
 
 int cw_cdr_register(char *name, char *desc, cw_cdrbe be)
+{
+	return cw_cdr_register_batch(name, desc, be, NULL);
+}
+
+int cw_cdr_register_batch(char *name, char *desc, cw_cdrbe be, cw_cdrbe_batch batch_be)
 {
 	struct cw_cdr_beitem *i;
 
@@ -132,6 +153,7 @@ int cw_cdr_register(char *name, char *desc, cw_cdrbe be)
 
 	memset(i, 0, sizeof(*i));
 	i->be = be;
+	i->batch_be = batch_be;
 	cw_copy_string(i->name, name, sizeof(i->name));
 	cw_copy_string(i->desc, desc, sizeof(i->desc));
 
@@ -792,20 +814,26 @@ int cw_cdr_amaflags2int(const char *flag)
 	return -1;
 }
 
-static void post_cdr(struct cw_cdr *cdr)
+static void check_post(struct cw_cdr *cdr)
 {
 	char *chan;
+
+	chan = !cw_strlen_zero(cdr->channel) ? cdr->channel : "<unknown>";
+	if (cw_test_flag(cdr, CW_CDR_FLAG_POSTED))
+		cw_log(LOG_WARNING, "CDR on channel '%s' already posted\n", chan);
+	if (cw_tvzero(cdr->end))
+		cw_log(LOG_WARNING, "CDR on channel '%s' lacks end\n", chan);
+	if (cw_tvzero(cdr->start))
+		cw_log(LOG_WARNING, "CDR on channel '%s' lacks start\n", chan);
+	cw_set_flag(cdr, CW_CDR_FLAG_POSTED);
+}
+
+static void post_cdr(struct cw_cdr *cdr)
+{
 	struct cw_cdr_beitem *i;
 
 	while (cdr) {
-		chan = !cw_strlen_zero(cdr->channel) ? cdr->channel : "<unknown>";
-		if (cw_test_flag(cdr, CW_CDR_FLAG_POSTED))
-			cw_log(LOG_WARNING, "CDR on channel '%s' already posted\n", chan);
-		if (cw_tvzero(cdr->end))
-			cw_log(LOG_WARNING, "CDR on channel '%s' lacks end\n", chan);
-		if (cw_tvzero(cdr->start))
-			cw_log(LOG_WARNING, "CDR on channel '%s' lacks start\n", chan);
-		cw_set_flag(cdr, CW_CDR_FLAG_POSTED);
+		check_post(cdr);
 		CW_LIST_LOCK(&be_list);
 		CW_LIST_TRAVERSE(&be_list, i, list) {
 			i->be(cdr);
@@ -815,6 +843,56 @@ static void post_cdr(struct cw_cdr *cdr)
 	}
 }
 
+/*! Posts every CDR of a batch.  Backends with a batch handler get the whole
+ *  batch in one call, the others (and any batch handler that fails) get the
+ *  records one at a time. */
+static void post_cdr_batch(struct cw_cdr_batch_item *items)
+{
+	struct cw_cdr_batch_item *item;
+	struct cw_cdr_beitem *i;
+	struct cw_cdr **cdrs;
+	struct cw_cdr *cdr;
+	int count = 0;
+	int x;
+
+	for (item = items;  item;  item = item->next) {
+		for (cdr = item->cdr;  cdr;  cdr = cdr->next)
+			count++;
+	}
+	if (!count)
+		return;
+
+	cdrs = malloc(count * sizeof(*cdrs));
+	if (!cdrs) {
+		cw_log(LOG_WARNING, "CDR: out of memory while posting a batch, posting records one at a time\n");
+		for (item = items;  item;  item = item->next)
+			post_cdr(item->cdr);
+		return;
+	}
+
+	x = 0;
+	for (item = items;  item;  item = item->next) {
+		for (cdr = item->cdr;  cdr;  cdr = cdr->next) {
+			check_post(cdr);
+			cdrs[x++] = cdr;
+		}
+	}
+
+	CW_LIST_LOCK(&be_list);
+	CW_LIST_TRAVERSE(&be_list, i, list) {
+		if (i->batch_be) {
+			if (!i->batch_be(cdrs, count))
+				continue;
+			cw_log(LOG_WARNING, "CDR backend '%s' failed to store a batch of %d records, storing them one at a time\n", i->name, count);
+		}
+		for (x = 0;  x < count;  x++)
+			i->be(cdrs[x]);
+	}
+	CW_LIST_UNLOCK(&be_list);
+
+	free(cdrs);
+}
+
 void cw_cdr_reset(struct cw_cdr *cdr, int flags)
 {
 	struct cw_flags tmp = {flags};
@@ -892,82 +970,595 @@ static int init_batch(void)
 	return 0;
 }
 
-static void *do_batch_backend_process(void *data)
+static void do_batch_backend_process(struct cw_cdr_batch_item *batchitem)
 {
 	struct cw_cdr_batch_item *processeditem;
-	struct cw_cdr_batch_item *batchitem = data;
 
-	/* Push each CDR into storage mechanism(s) and free all the memory */
+	/* Push the CDRs into storage mechanism(s) and free all the memory */
+	post_cdr_batch(batchitem);
 	while (batchitem) {
-		post_cdr(batchitem->cdr);
 		cw_cdr_free(batchitem->cdr);
 		processeditem = batchitem;
 		batchitem = batchitem->next;
 		free(processeditem);
 	}
+}
 
-	return NULL;
+/*
+ * CDR spool.  With "spool" set in batch mode, detached CDRs are appended to
+ * an on-disk spool instead of being kept in memory, and the CDR thread feeds
+ * each backend from its own cursor into the spool.  A backend that is down
+ * falls behind and catches up later, even across a restart, without holding
+ * up calls or the other backends.
+ *
+ * Each record is a header followed by an image of the struct cw_cdr up to its
+ * variables, then the variables as name\0value\0 pairs.  A record torn by a
+ * crash fails its checksum and is cut off when the spool is next opened.
+ */
+#define CDR_SPOOL_MAGIC		0x43445231	/* "CDR1" */
+#define CDR_SPOOL_RETRY		30		/* seconds before retrying a backend that failed */
+#define CDR_SPOOL_MAX_RECORD	65536
+
+struct cdr_spool_hdr {
+	uint32_t magic;
+	/*! Size of the struct cw_cdr image, records of another build are skipped */
+	uint32_t fixed;
+	/*! Bytes following this header */
+	uint32_t len;
+	/*! Checksum of those bytes */
+	uint32_t sum;
+};
+
+struct cdr_spool_cursor {
+	char name[20];
+	/*! Offset of the first record this backend has not stored yet */
+	off_t offset;
+	/*! When to try again after the backend failed */
+	time_t retry;
+	struct cdr_spool_cursor *next;
+};
+
+static int spoolmode;
+static int spool_fd = -1;
+static char spool_path[PATH_MAX];
+static char spool_cursor_path[PATH_MAX];
+/* End of the records written so far, and of those known to be on disk */
+static off_t spool_end;
+static off_t spool_synced;
+/* Records written since the last sync */
+static int spool_unsynced;
+/* Only the CDR thread changes these, cdr_spool_lock guards them for readers */
+static struct cdr_spool_cursor *spool_cursors;
+
+CW_MUTEX_DEFINE_STATIC(cdr_spool_lock);
+
+static uint32_t spool_checksum(const unsigned char *buf, size_t len)
+{
+	uint32_t sum = 2166136261U;
+
+	while (len--)
+		sum = (sum ^ *buf++) * 16777619U;
+	return sum;
 }
 
-void cw_cdr_submit_batch(int shutdown)
+/*! Reads the record at offset into buf.  Returns its total length, 0 at the
+ *  end of the spool or -1 if the record is not whole */
+static int spool_read_record(off_t offset, unsigned char *buf, size_t size)
 {
-	struct cw_cdr_batch_item *oldbatchitems = NULL;
-	pthread_attr_t attr;
-	pthread_t batch_post_thread = CW_PTHREADT_NULL;
+	struct cdr_spool_hdr *hdr = (struct cdr_spool_hdr *) buf;
+	ssize_t n;
 
-	/* if there's no batch, or no CDRs in the batch, then there's nothing to do */
-	if (!batch || !batch->head)
+	n = pread(spool_fd, buf, sizeof(*hdr), offset);
+	if (n == 0)
+		return 0;
+	if (n != sizeof(*hdr) || hdr->magic != CDR_SPOOL_MAGIC || hdr->len > size - sizeof(*hdr))
+		return -1;
+	if (pread(spool_fd, buf + sizeof(*hdr), hdr->len, offset + sizeof(*hdr)) != hdr->len)
+		return -1;
+	if (spool_checksum(buf + sizeof(*hdr), hdr->len) != hdr->sum)
+		return -1;
+	return sizeof(*hdr) + hdr->len;
+}
+
+static struct cdr_spool_cursor *spool_cursor(const char *name)
+{
+	struct cdr_spool_cursor *c;
+
+	for (c = spool_cursors;  c;  c = c->next) {
+		if (!strcasecmp(c->name, name))
+			return c;
+	}
+	/* a backend we have no cursor for gets whatever is still in the spool */
+	if ((c = calloc(1, sizeof(*c)))) {
+		cw_copy_string(c->name, name, sizeof(c->name));
+		cw_mutex_lock(&cdr_spool_lock);
+		c->next = spool_cursors;
+		spool_cursors = c;
+		cw_mutex_unlock(&cdr_spool_lock);
+	}
+	return c;
+}
+
+static void spool_save_cursors(void)
+{
+	char tmp[PATH_MAX];
+	struct cdr_spool_cursor *c;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", spool_cursor_path);
+	if (!(f = fopen(tmp, "w"))) {
+		cw_log(LOG_WARNING, "Unable to write CDR spool cursors to '%s': %s\n", tmp, strerror(errno));
 		return;
+	}
+	for (c = spool_cursors;  c;  c = c->next)
+		fprintf(f, "%s %lld\n", c->name, (long long) c->offset);
+	fflush(f);
+	fsync(fileno(f));
+	fclose(f);
+	if (rename(tmp, spool_cursor_path))
+		cw_log(LOG_WARNING, "Unable to rename '%s' to '%s': %s\n", tmp, spool_cursor_path, strerror(errno));
+}
 
-	/* move the old CDRs aside, and prepare a new CDR batch */
-	cw_mutex_lock(&cdr_batch_lock);
-	oldbatchitems = batch->head;
-	reset_batch();
-	cw_mutex_unlock(&cdr_batch_lock);
+static int cdr_spool_open(void)
+{
+	unsigned char *buf;
+	char dir[PATH_MAX];
+	char name[20];
+	long long offset;
+	struct cdr_spool_cursor *c;
+	FILE *f;
+	off_t end = 0;
+	int len;
+	int records = 0;
+
+	snprintf(dir, sizeof(dir), "%s/cdr", cw_config_CW_SPOOL_DIR);
+	mkdir(dir, 0755);
+	snprintf(spool_path, sizeof(spool_path), "%s/cdr.spool", dir);
+	snprintf(spool_cursor_path, sizeof(spool_cursor_path), "%s/cdr.cursors", dir);
+
+	if ((spool_fd = open(spool_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+		cw_log(LOG_ERROR, "Unable to open CDR spool '%s': %s\n", spool_path, strerror(errno));
+		return -1;
+	}
 
-	/* if configured, spawn a new thread to post these CDRs,
-	   also try to save as much as possible if we are shutting down safely */
-	if (batchscheduleronly || shutdown) {
-		if (option_debug)
-			cw_log(LOG_DEBUG, "CDR single-threaded batch processing begins now\n");
-		do_batch_backend_process(oldbatchitems);
+	/* find the end of the last whole record, and drop anything after it */
+	if (!(buf = malloc(CDR_SPOOL_MAX_RECORD))) {
+		close(spool_fd);
+		spool_fd = -1;
+		return -1;
+	}
+	while ((len = spool_read_record(end, buf, CDR_SPOOL_MAX_RECORD)) > 0) {
+		end += len;
+		records++;
+	}
+	free(buf);
+	if (len < 0) {
+		cw_log(LOG_WARNING, "CDR spool '%s' has a torn record at %lld, dropping it\n", spool_path, (long long) end);
+		if (ftruncate(spool_fd, end))
+			cw_log(LOG_WARNING, "Unable to truncate CDR spool '%s': %s\n", spool_path, strerror(errno));
+	}
+	spool_end = spool_synced = end;
+
+	if ((f = fopen(spool_cursor_path, "r"))) {
+		while (fscanf(f, "%19s %lld", name, &offset) == 2) {
+			if ((c = spool_cursor(name)))
+				c->offset = (offset >= 0 && offset <= end) ? offset : 0;
+		}
+		fclose(f);
+	}
+
+	if (records)
+		cw_log(LOG_NOTICE, "CDR spool '%s' holds %d records to replay\n", spool_path, records);
+	return 0;
+}
+
+/*! Appends a detached CDR chain to the spool.  Returns 0 once it is written,
+ *  after which the caller no longer owns the records' data */
+static int cdr_spool_write(struct cw_cdr *cdr)
+{
+	const size_t fixed = offsetof(struct cw_cdr, varshead);
+	struct cdr_spool_hdr *hdr;
+	struct cw_var_t *var;
+	struct cw_cdr *c;
+	unsigned char *buf;
+	size_t len = 0;
+	size_t pos;
+	size_t n;
+	ssize_t res;
+	int unsynced;
+
+	for (c = cdr;  c;  c = c->next) {
+		len += sizeof(*hdr) + fixed;
+		CW_LIST_TRAVERSE(&c->varshead, var, entries)
+			len += strlen(cw_var_name(var)) + strlen(cw_var_value(var)) + 2;
+	}
+	if (!(buf = malloc(len)))
+		return -1;
+
+	pos = 0;
+	for (c = cdr;  c;  c = c->next) {
+		hdr = (struct cdr_spool_hdr *) (buf + pos);
+		pos += sizeof(*hdr);
+		hdr->magic = CDR_SPOOL_MAGIC;
+		hdr->fixed = fixed;
+		memcpy(buf + pos, c, fixed);
+		pos += fixed;
+		CW_LIST_TRAVERSE(&c->varshead, var, entries) {
+			n = strlen(cw_var_name(var)) + 1;
+			memcpy(buf + pos, cw_var_name(var), n);
+			pos += n;
+			n = strlen(cw_var_value(var)) + 1;
+			memcpy(buf + pos, cw_var_value(var), n);
+			pos += n;
+		}
+		hdr->len = (buf + pos) - (unsigned char *) (hdr + 1);
+		if (hdr->len > CDR_SPOOL_MAX_RECORD - sizeof(*hdr)) {
+			free(buf);
+			return -1;
+		}
+		hdr->sum = spool_checksum((unsigned char *) (hdr + 1), hdr->len);
+	}
+
+	cw_mutex_lock(&cdr_spool_lock);
+	res = write(spool_fd, buf, len);
+	if (res != (ssize_t) len) {
+		cw_log(LOG_WARNING, "Unable to write to CDR spool '%s': %s\n", spool_path, (res < 0) ? strerror(errno) : "short write");
+		/* don't leave half a record for the next one to follow */
+		if (res > 0 && ftruncate(spool_fd, spool_end))
+			cw_log(LOG_WARNING, "Unable to truncate CDR spool '%s': %s\n", spool_path, strerror(errno));
+		cw_mutex_unlock(&cdr_spool_lock);
+		free(buf);
+		return -1;
+	}
+	spool_end += len;
+	for (c = cdr;  c;  c = c->next)
+		spool_unsynced++;
+	unsynced = spool_unsynced;
+	cw_mutex_unlock(&cdr_spool_lock);
+	free(buf);
+
+	/* wake the CDR thread once there is a batch worth of records */
+	if (unsynced >= batchsize) {
+		cw_mutex_lock(&cdr_pending_lock);
+		cdr_next_submit = cw_tvnow();
+		cw_cond_broadcast(&cdr_pending_cond);
+		cw_mutex_unlock(&cdr_pending_lock);
+	}
+	return 0;
+}
+
+/*! Makes sure everything written to the spool is on disk.  One sync covers
+ *  every record written since the last one */
+static void cdr_spool_sync(void)
+{
+	off_t end;
+
+	cw_mutex_lock(&cdr_spool_lock);
+	end = spool_end;
+	if (!spool_unsynced) {
+		cw_mutex_unlock(&cdr_spool_lock);
+		return;
+	}
+	spool_unsynced = 0;
+	cw_mutex_unlock(&cdr_spool_lock);
+
+	if (fdatasync(spool_fd))
+		cw_log(LOG_WARNING, "Unable to sync CDR spool '%s': %s\n", spool_path, strerror(errno));
+	/* only the CDR thread moves spool_synced, so no lock needed */
+	spool_synced = end;
+}
+
+/*! Rebuilds a CDR from a spool record */
+static struct cw_cdr *spool_decode(unsigned char *buf, int len)
+{
+	struct cdr_spool_hdr *hdr = (struct cdr_spool_hdr *) buf;
+	struct cw_var_t *var;
+	struct cw_cdr *cdr;
+	char *name;
+	char *value;
+	char *p;
+	char *end;
+
+	if (hdr->fixed != offsetof(struct cw_cdr, varshead) || hdr->len < hdr->fixed)
+		return NULL;
+	if (!(cdr = cw_cdr_alloc()))
+		return NULL;
+	memcpy(cdr, hdr + 1, hdr->fixed);
+	p = (char *) (hdr + 1) + hdr->fixed;
+	end = (char *) buf + len;
+	while (p < end) {
+		name = p;
+		p += strnlen(p, end - p) + 1;
+		if (p >= end)
+			break;
+		value = p;
+		p += strnlen(p, end - p) + 1;
+		if (p > end)
+			break;
+		if ((var = cw_var_assign(name, value)))
+			CW_LIST_INSERT_TAIL(&cdr->varshead, var, entries);
+	}
+	return cdr;
+}
+
+/*! Feeds one backend up to a batch of records from its cursor.  Returns -1
+ *  if the backend failed, 1 if it has more to do and 0 once it caught up */
+static int spool_feed(struct cw_cdr_beitem *be, struct cdr_spool_cursor *c, unsigned char *buf, struct cw_cdr **cdrs, off_t *ends, int max)
+{
+	off_t offset = c->offset;
+	int count = 0;
+	int done;
+	int len;
+	int res = 0;
+	int x;
+
+	while (count < max && offset < spool_synced) {
+		len = spool_read_record(offset, buf, CDR_SPOOL_MAX_RECORD);
+		if (len <= 0) {
+			cw_log(LOG_ERROR, "CDR spool '%s' is unreadable at %lld, skipping to its end\n", spool_path, (long long) offset);
+			offset = spool_synced;
+			break;
+		}
+		offset += len;
+		if (!(cdrs[count] = spool_decode(buf, len))) {
+			cw_log(LOG_WARNING, "Skipping a CDR spooled by another version\n");
+			continue;
+		}
+		ends[count++] = offset;
+	}
+
+	done = 0;
+	if (count > 1 && be->batch_be && !be->batch_be(cdrs, count))
+		done = count;
+	while (done < count && !be->be(cdrs[done]))
+		done++;
+
+	if (done < count) {
+		c->offset = done ? ends[done - 1] : c->offset;
+		c->retry = time(NULL) + CDR_SPOOL_RETRY;
+		cw_log(LOG_WARNING, "CDR backend '%s' failed, %lld bytes of spool left for it, retrying in %d seconds\n",
+			be->name, (long long) (spool_synced - c->offset), CDR_SPOOL_RETRY);
+		res = -1;
 	} else {
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-		if (cw_pthread_create(&batch_post_thread, &attr, do_batch_backend_process, oldbatchitems)) {
-			cw_log(LOG_WARNING, "CDR processing thread could not detach, now trying in this thread\n");
-			do_batch_backend_process(oldbatchitems);
-		} else {
-			if (option_debug)
-				cw_log(LOG_DEBUG, "CDR multi-threaded batch processing begins now\n");
+		c->offset = offset;
+		res = (offset < spool_synced);
+	}
+
+	for (x = 0;  x < count;  x++) {
+		cw_set_flag(cdrs[x], CW_CDR_FLAG_POSTED);
+		cw_cdr_free(cdrs[x]);
+	}
+	return res;
+}
+
+/*! Run by the CDR thread: syncs the spool, lets every backend catch up as
+ *  far as it can and empties the spool once they all have.  Returns 1 if a
+ *  failed backend is still behind */
+static int cdr_spool_run(void)
+{
+	struct cw_cdr_beitem *i;
+	struct cdr_spool_cursor *c;
+	unsigned char *buf;
+	struct cw_cdr **cdrs;
+	off_t *ends;
+	time_t now;
+	int max = (batchsize > 0) ? batchsize : 1;
+	int behind = 0;
+	int caughtup = 1;
+	int backends = 0;
+	int moved = 0;
+	int res;
+
+	cdr_spool_sync();
+
+	buf = malloc(CDR_SPOOL_MAX_RECORD);
+	cdrs = malloc(max * sizeof(*cdrs));
+	ends = malloc(max * sizeof(*ends));
+	if (!buf || !cdrs || !ends) {
+		free(buf);
+		free(cdrs);
+		free(ends);
+		return 1;
+	}
+
+	now = time(NULL);
+	CW_LIST_LOCK(&be_list);
+	CW_LIST_TRAVERSE(&be_list, i, list) {
+		backends++;
+		if (!(c = spool_cursor(i->name)))
+			continue;
+		if (c->offset < spool_synced && c->retry <= now) {
+			moved = 1;
+			while ((res = spool_feed(i, c, buf, cdrs, ends, max)) > 0)
+				;
+		}
+		if (c->offset < spool_synced) {
+			caughtup = 0;
+			behind = 1;
 		}
 	}
+	CW_LIST_UNLOCK(&be_list);
+
+	free(buf);
+	free(cdrs);
+	free(ends);
+
+	/* start the spool over once every backend has everything in it.  Wait
+	   until all modules are loaded, so no backend misses its records.  A
+	   backend that is not loaded at that point starts over with the rest */
+	if (caughtup && backends && fully_booted && spool_synced > 0) {
+		cw_mutex_lock(&cdr_spool_lock);
+		if (spool_end == spool_synced) {
+			if (ftruncate(spool_fd, 0)) {
+				cw_log(LOG_WARNING, "Unable to truncate CDR spool '%s': %s\n", spool_path, strerror(errno));
+			} else {
+				spool_end = spool_synced = 0;
+				for (c = spool_cursors;  c;  c = c->next)
+					c->offset = 0;
+				moved = 1;
+			}
+		}
+		cw_mutex_unlock(&cdr_spool_lock);
+	}
+
+	if (moved)
+		spool_save_cursors();
+	/* records left over from the last run wait for all backends to load */
+	if (!fully_booted && spool_synced > 0)
+		behind = 1;
+	return behind;
+}
+
+/* Don't call without cdr_pending_lock */
+static void schedule_next_submit(void)
+{
+	/* a zero batch time would leave the CDR thread spinning */
+	cdr_next_submit = cw_tvadd(cw_tvnow(), cw_tv(batchtime > 0 ? batchtime : 1, 0));
 }
 
-static int submit_scheduled_batch(void *data)
+static void submit_memory_batch(int shutdown)
 {
+	struct cw_cdr_batch_item *oldbatchitems = NULL;
+	struct cw_cdr_batch *queued = NULL;
+	struct cw_cdr_batch *b;
+	int size;
+
 	cw_mutex_lock(&cdr_pending_lock);
-	cw_cdr_submit_batch(0);
+	schedule_next_submit();
+	if (shutdown) {
+		/* save whatever the CDR thread has not got to yet, in this thread */
+		queued = cdr_queue_head;
+		cdr_queue_head = cdr_queue_tail = NULL;
+		cdr_queue_len = 0;
+	}
 	cw_mutex_unlock(&cdr_pending_lock);
 
-	/* manually reschedule from this point in time */
-	cdr_sched = cw_sched_add(sched, batchtime * 1000, submit_scheduled_batch, NULL);
-	/* returning zero so the scheduler does not automatically reschedule */
-	return 0;
+	while ((b = queued)) {
+		queued = b->next;
+		do_batch_backend_process(b->head);
+		free(b);
+	}
+
+	/* if there's no batch, or no CDRs in the batch, then there's nothing to do */
+	if (batch && batch->head) {
+		b = malloc(sizeof(*b));
+
+		/* move the old CDRs aside, and prepare a new CDR batch */
+		cw_mutex_lock(&cdr_batch_lock);
+		oldbatchitems = batch->head;
+		size = batch->size;
+		reset_batch();
+		cw_mutex_unlock(&cdr_batch_lock);
+
+		/* the CDR thread posts the batch, unless we are shutting down
+		   and should save as much as possible right now */
+		if (!b || shutdown || cdr_thread == CW_PTHREADT_NULL) {
+			if (!b)
+				cw_log(LOG_WARNING, "CDR: out of memory while queueing a batch, now trying in this thread\n");
+			else if (option_debug)
+				cw_log(LOG_DEBUG, "CDR batch processing begins now in this thread\n");
+			do_batch_backend_process(oldbatchitems);
+			free(b);
+		} else {
+			b->head = oldbatchitems;
+			b->tail = NULL;
+			b->size = size;
+			b->next = NULL;
+			cw_mutex_lock(&cdr_pending_lock);
+			if (cdr_queue_len >= batchqueue) {
+				/* the backends are not keeping up, so push back on whoever is adding records */
+				cw_mutex_unlock(&cdr_pending_lock);
+				cw_log(LOG_WARNING, "CDR queue is full (%d batches), posting %d records in this thread\n", batchqueue, size);
+				do_batch_backend_process(oldbatchitems);
+				free(b);
+			} else {
+				if (cdr_queue_tail)
+					cdr_queue_tail->next = b;
+				else
+					cdr_queue_head = b;
+				cdr_queue_tail = b;
+				cdr_queue_len++;
+				cw_cond_broadcast(&cdr_pending_cond);
+				cw_mutex_unlock(&cdr_pending_lock);
+				if (option_debug)
+					cw_log(LOG_DEBUG, "CDR batch of %d records queued for the CDR thread\n", size);
+			}
+		}
+	}
+
+	if (shutdown) {
+		/* and wait for the batch the CDR thread may be in the middle of */
+		cw_mutex_lock(&cdr_pending_lock);
+		while (cdr_busy)
+			cw_cond_wait(&cdr_pending_cond, &cdr_pending_lock);
+		cw_mutex_unlock(&cdr_pending_lock);
+	}
 }
 
-static void submit_unscheduled_batch(void)
+void cw_cdr_submit_batch(int shutdown)
 {
-	/* this is okay since we are not being called from within the scheduler */
-	if (cdr_sched > -1)
-		cw_sched_del(sched, cdr_sched);
-	/* schedule the submission to occur ASAP (1 ms) */
-	cdr_sched = cw_sched_add(sched, 1, submit_scheduled_batch, NULL);
+	submit_memory_batch(shutdown);
+
+	if (spool_fd > -1) {
+		if (shutdown) {
+			/* what the backends have not stored yet is replayed on the next start */
+			fdatasync(spool_fd);
+		} else {
+			/* have the CDR thread feed the backends from the spool now */
+			cw_mutex_lock(&cdr_pending_lock);
+			cdr_next_submit = cw_tvnow();
+			cw_cond_broadcast(&cdr_pending_cond);
+			cw_mutex_unlock(&cdr_pending_lock);
+		}
+	}
+}
+
+/*! The CDR thread posts queued batches in order and submits the current
+ *  batch every batchtime seconds */
+static void *do_cdr(void *data)
+{
+	struct cw_cdr_batch *b;
+	struct timespec ts;
+	int behind;
+
+	cw_mutex_lock(&cdr_pending_lock);
+	for (;;) {
+		if ((b = cdr_queue_head)) {
+			if (!(cdr_queue_head = b->next))
+				cdr_queue_tail = NULL;
+			cdr_queue_len--;
+			cdr_busy = 1;
+			cw_mutex_unlock(&cdr_pending_lock);
+
+			do_batch_backend_process(b->head);
+			free(b);
+
+			cw_mutex_lock(&cdr_pending_lock);
+			cdr_busy = 0;
+			cw_cond_broadcast(&cdr_pending_cond);
+		} else if (cw_tvdiff_ms(cdr_next_submit, cw_tvnow()) <= 0) {
+			cw_mutex_unlock(&cdr_pending_lock);
+			submit_memory_batch(0);
+			behind = (spool_fd > -1) ? cdr_spool_run() : 0;
+			cw_mutex_lock(&cdr_pending_lock);
+			/* come back sooner for a backend that is behind on the spool */
+			if (behind && batchtime > CDR_SPOOL_RETRY)
+				cdr_next_submit = cw_tvadd(cw_tvnow(), cw_tv(CDR_SPOOL_RETRY, 0));
+		} else {
+			ts.tv_sec = cdr_next_submit.tv_sec;
+			ts.tv_nsec = cdr_next_submit.tv_usec * 1000;
+			cw_cond_timedwait(&cdr_pending_cond, &cdr_pending_lock, &ts);
+		}
+	}
+	cw_mutex_unlock(&cdr_pending_lock);
+
+	return NULL;
 }
 
 void cw_cdr_detach(struct cw_cdr *cdr)
 {
 	struct cw_cdr_batch_item *newtail;
+	struct cw_cdr *c;
 	int curr;
 
 	/* maybe they disabled CDR stuff completely, so just drop it */
@@ -986,6 +1577,14 @@ void cw_cdr_detach(struct cw_cdr *cdr)
 		return;
 	}
 
+	/* with a spool, the CDRs go to disk right away and are not kept in memory */
+	if (spoolmode && spool_fd > -1 && !cdr_spool_write(cdr)) {
+		for (c = cdr;  c;  c = c->next)
+			cw_set_flag(c, CW_CDR_FLAG_POSTED);
+		cw_cdr_free(cdr);
+		return;
+	}
+
 	/* otherwise, each CDR gets put into a batch list (at the end) */
 	if (option_debug)
 		cw_log(LOG_DEBUG, "CDR detaching from this thread\n");
@@ -1018,14 +1617,16 @@ void cw_cdr_detach(struct cw_cdr *cdr)
 
 	/* if we have enough stuff to post, then do it */
 	if (curr >= (batchsize - 1))
-		submit_unscheduled_batch();
+		cw_cdr_submit_batch(0);
 }
 
 
 static int handle_cli_status(int fd, int argc, char *argv[])
 {
 	struct cw_cdr_beitem *beitem=NULL;
+	struct cdr_spool_cursor *c;
 	int cnt=0;
+	int queued;
 	long nextbatchtime=0;
 
 	if (argc > 2)
@@ -1037,14 +1638,26 @@ static int handle_cli_status(int fd, int argc, char *argv[])
 		if (batchmode) {
 			if (batch)
 				cnt = batch->size;
-			if (cdr_sched > -1)
-				nextbatchtime = cw_sched_when(sched, cdr_sched);
+			cw_mutex_lock(&cdr_pending_lock);
+			queued = cdr_queue_len;
+			nextbatchtime = cw_tvdiff_ms(cdr_next_submit, cw_tvnow()) / 1000;
+			cw_mutex_unlock(&cdr_pending_lock);
+			if (nextbatchtime < 0)
+				nextbatchtime = 0;
 			cw_cli(fd, "CDR safe shut down: %s\n", batchsafeshutdown ? "enabled" : "disabled");
-			cw_cli(fd, "CDR batch threading model: %s\n", batchscheduleronly ? "scheduler only" : "scheduler plus separate threads");
+			cw_cli(fd, "CDR batch thread: %s\n", (cdr_thread != CW_PTHREADT_NULL) ? "running" : "not running");
+			cw_cli(fd, "CDR batches queued for posting: %d of %d\n", queued, batchqueue);
 			cw_cli(fd, "CDR current batch size: %d record%s\n", cnt, (cnt != 1) ? "s" : "");
 			cw_cli(fd, "CDR maximum batch size: %d record%s\n", batchsize, (batchsize != 1) ? "s" : "");
 			cw_cli(fd, "CDR maximum batch time: %d second%s\n", batchtime, (batchtime != 1) ? "s" : "");
 			cw_cli(fd, "CDR next scheduled batch processing time: %ld second%s\n", nextbatchtime, (nextbatchtime != 1) ? "s" : "");
+			if (spool_fd > -1) {
+				cw_cli(fd, "CDR spool: %s (%s), %lld bytes\n", spool_path, spoolmode ? "in use" : "draining", (long long) spool_end);
+				cw_mutex_lock(&cdr_spool_lock);
+				for (c = spool_cursors;  c;  c = c->next)
+					cw_cli(fd, "CDR spool backlog for %s: %lld bytes\n", c->name, (long long) (spool_synced - c->offset));
+				cw_mutex_unlock(&cdr_spool_lock);
+			}
 		}
 		CW_LIST_LOCK(&be_list);
 		CW_LIST_TRAVERSE(&be_list, beitem, list) {
@@ -1061,7 +1674,7 @@ static int handle_cli_submit(int fd, int argc, char *argv[])
 	if (argc > 2)
 		return RESULT_SHOWUSAGE;
 
-	submit_unscheduled_batch();
+	cw_cdr_submit_batch(0);
 	cw_cli(fd, "Submitted CDRs to backend engines for processing.  This may take a while.\n");
 
 	return 0;
@@ -1091,12 +1704,15 @@ static int do_reload(void)
 	const char *enabled_value = NULL;
 	const char *batched_value = NULL;
 	const char *end_before_h_value = NULL;
-	const char *scheduleronly_value = NULL;
+	const char *queue_value = NULL;
+	const char *spool_value = NULL;
 	const char *batchsafeshutdown_value = NULL;
 	const char *size_value = NULL;
 	const char *time_value = NULL;
 	int cfg_size;
 	int cfg_time;
+	int cfg_queue;
+	pthread_attr_t attr;
 	int was_enabled;
 	int was_batchmode;
 	int res=0;
@@ -1105,7 +1721,8 @@ static int do_reload(void)
 
 	batchsize = BATCH_SIZE_DEFAULT;
 	batchtime = BATCH_TIME_DEFAULT;
-	batchscheduleronly = BATCH_SCHEDULER_ONLY_DEFAULT;
+	batchqueue = BATCH_QUEUE_DEFAULT;
+	spoolmode = 0;
 	batchsafeshutdown = BATCH_SAFE_SHUTDOWN_DEFAULT;
 	was_enabled = enabled;
 	was_batchmode = batchmode;
@@ -1113,10 +1730,6 @@ static int do_reload(void)
 	batchmode = 0;
 	cw_end_cdr_before_h_exten = 0;
 
-	/* don't run the next scheduled CDR posting while reloading */
-	if (cdr_sched > -1)
-		cw_sched_del(sched, cdr_sched);
-
 	if ((config = cw_config_load("cdr.conf"))) {
 		if ((enabled_value = cw_variable_retrieve(config, "general", "enable"))) {
 			enabled = cw_true(enabled_value);
@@ -1127,12 +1740,16 @@ static int do_reload(void)
 		if ((batched_value = cw_variable_retrieve(config, "general", "batch"))) {
 			batchmode = cw_true(batched_value);
 		}
-		if ((scheduleronly_value = cw_variable_retrieve(config, "general", "scheduleronly"))) {
-			batchscheduleronly = cw_true(scheduleronly_value);
+		if ((spool_value = cw_variable_retrieve(config, "general", "spool"))) {
+			spoolmode = cw_true(spool_value);
 		}
 		if ((batchsafeshutdown_value = cw_variable_retrieve(config, "general", "safeshutdown"))) {
 			batchsafeshutdown = cw_true(batchsafeshutdown_value);
 		}
+		if (cw_variable_retrieve(config, "general", "scheduleronly")) {
+			cw_log(LOG_WARNING, "The 'scheduleronly' option in cdr.conf is no longer used, batches are "
+				"always posted by the CDR thread.  See 'maxqueue' instead\n");
+		}
 		if ((size_value = cw_variable_retrieve(config, "general", "size"))) {
 			if (sscanf(size_value, "%d", &cfg_size) < 1)
 				cw_log(LOG_WARNING, "Unable to convert '%s' to a numeric value.\n", size_value);
@@ -1149,12 +1766,24 @@ static int do_reload(void)
 			else
 				batchtime = cfg_time;
 		}
+		if ((queue_value = cw_variable_retrieve(config, "general", "maxqueue"))) {
+			if (sscanf(queue_value, "%d", &cfg_queue) < 1)
+				cw_log(LOG_WARNING, "Unable to convert '%s' to a numeric value.\n", queue_value);
+			else if (cfg_queue < 1)
+				cw_log(LOG_WARNING, "Invalid maximum batch queue '%d' specified, using default\n", cfg_queue);
+			else
+				batchqueue = cfg_queue;
+		}
 	}
 
 	if (enabled && !batchmode) {
 		cw_log(LOG_NOTICE, "CDR simple logging enabled.\n");
 	} else if (enabled && batchmode) {
-		cdr_sched = cw_sched_add(sched, batchtime * 1000, submit_scheduled_batch, NULL);
+		/* restart the batch timer with the new time */
+		cw_mutex_lock(&cdr_pending_lock);
+		schedule_next_submit();
+		cw_cond_broadcast(&cdr_pending_cond);
+		cw_mutex_unlock(&cdr_pending_lock);
 		cw_log(LOG_NOTICE, "CDR batch mode logging enabled, first of either size %d or time %d seconds.\n", batchsize, batchtime);
 	} else {
 		cw_log(LOG_NOTICE, "CDR logging disabled, data will be lost.\n");
@@ -1162,14 +1791,22 @@ static int do_reload(void)
 
 	/* if this reload enabled the CDR batch mode, create the background thread
 	   if it does not exist */
-	if (enabled && batchmode && (!was_enabled || !was_batchmode) && (cdr_thread == CW_PTHREADT_NULL)) {
+	if (enabled && batchmode && (!was_enabled || !was_batchmode)) {
+		if (cdr_thread == CW_PTHREADT_NULL) {
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			if (cw_pthread_create(&cdr_thread, &attr, do_cdr, NULL)) {
+				cw_log(LOG_WARNING, "Unable to start CDR thread, batches will be posted by the threads that fill them\n");
+				cdr_thread = CW_PTHREADT_NULL;
+			}
+			pthread_attr_destroy(&attr);
+		}
 		cw_cli_register(&cli_submit);
 		cw_register_atexit(cw_cdr_engine_term);
 		res = 0;
-	/* if this reload disabled the CDR and/or batch mode and there is a background thread,
-	   kill it */
-	}else if (((!enabled && was_enabled) || (!batchmode && was_batchmode)) && (cdr_thread != CW_PTHREADT_NULL)) {
-		cdr_thread = CW_PTHREADT_NULL;
+	/* if this reload disabled the CDR and/or batch mode, stop taking batches.
+	   The CDR thread stays, idle, for when batch mode comes back */
+	}else if ((!enabled && was_enabled && was_batchmode) || (!batchmode && was_batchmode)) {
 		cw_cli_unregister(&cli_submit);
 		cw_unregister_atexit(cw_cdr_engine_term);
 		res = 0;
@@ -1182,6 +1819,15 @@ static int do_reload(void)
 		res = 0;
 	}
 
+	/* once opened, the spool stays open so that what is in it gets drained
+	   even if the spool is turned off again */
+	if (enabled && batchmode && spoolmode && spool_fd < 0 && !cdr_spool_open()) {
+		cw_mutex_lock(&cdr_pending_lock);
+		cdr_next_submit = cw_tvnow();
+		cw_cond_broadcast(&cdr_pending_cond);
+		cw_mutex_unlock(&cdr_pending_lock);
+	}
+
 	cw_mutex_unlock(&cdr_batch_lock);
 	cw_config_destroy(config);
 
@@ -1192,11 +1838,7 @@ int cw_cdr_engine_init(void)
 {
 	int res;
 
-	sched = sched_context_create();
-	if (!sched) {
-		cw_log(LOG_ERROR, "Unable to create schedule context.\n");
-		return -1;
-	}
+	cw_cond_init(&cdr_pending_cond, NULL);
 
 	cw_cli_register(&cli_status);
 
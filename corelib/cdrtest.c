@@ -0,0 +1,230 @@
+/* Posts batches of CDRs to the SQLite backend through the CDR engine,
+   checking a batch is stored in one transaction, rolled back in full when
+   any record of it fails, and then stored a record at a time */
+
+#include "cdr.c"
+/* Only one file version can be registered from one file */
+#undef CALLWEAVER_FILE_VERSION
+#define CALLWEAVER_FILE_VERSION(file, version)
+#include "../cdr/cdr_sqlite3.c"
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "CuTest.h"
+
+char cw_config_CW_LOG_DIR[CW_CONFIG_MAX_PATH];
+char cw_config_CW_SPOOL_DIR[CW_CONFIG_MAX_PATH];
+int fully_booted = 1;
+
+/* The engine is never configured here, the tests set it up themselves */
+struct cw_config *cw_config_load(const char *filename)
+{
+	return NULL;
+}
+
+void cw_config_destroy(struct cw_config *config)
+{
+}
+
+char *cw_variable_retrieve(const struct cw_config *config, const char *category, const char *variable)
+{
+	return NULL;
+}
+
+int cw_true(const char *s)
+{
+	return 0;
+}
+
+int cw_register_atexit(void (*func)(void))
+{
+	return 0;
+}
+
+void cw_unregister_atexit(void (*func)(void))
+{
+}
+
+struct timeval cw_tvadd(struct timeval a, struct timeval b)
+{
+	a.tv_sec += b.tv_sec;
+	if ((a.tv_usec += b.tv_usec) >= 1000000) {
+		a.tv_sec++;
+		a.tv_usec -= 1000000;
+	}
+	return a;
+}
+
+int cw_build_string(char **buffer, size_t *space, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = vsnprintf(*buffer, *space, fmt, ap);
+	va_end(ap);
+	if (res < 0 || res >= *space)
+		return -1;
+	*buffer += res;
+	*space -= res;
+	return 0;
+}
+
+#define BATCH	50
+
+static int rows(const char *where)
+{
+	char fn[PATH_MAX];
+	sqlite3 *d;
+	sqlite3_stmt *st;
+	char *sql;
+	int n = -1;
+
+	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
+	if (sqlite3_open(fn, &d) != SQLITE_OK)
+		return -1;
+	sql = sqlite3_mprintf("SELECT COUNT(*) FROM cdr WHERE %s", where);
+	if (sqlite3_prepare(d, sql, -1, &st, NULL) == SQLITE_OK) {
+		if (sqlite3_step(st) == SQLITE_ROW)
+			n = sqlite3_column_int(st, 0);
+		sqlite3_finalize(st);
+	}
+	sqlite3_free(sql);
+	sqlite3_close(d);
+	return n;
+}
+
+static int exec(const char *sql)
+{
+	char fn[PATH_MAX];
+	sqlite3 *d;
+	int res;
+
+	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
+	if (sqlite3_open(fn, &d) != SQLITE_OK)
+		return -1;
+	res = sqlite3_exec(d, sql, NULL, NULL, NULL);
+	sqlite3_close(d);
+	return res;
+}
+
+static struct cw_cdr *test_cdr(const char *src, int n)
+{
+	struct cw_cdr *cdr;
+
+	if (!(cdr = cw_cdr_alloc()))
+		return NULL;
+	snprintf(cdr->clid, sizeof(cdr->clid), "\"O'Brien\" <%d>", n);
+	cw_copy_string(cdr->src, src, sizeof(cdr->src));
+	cw_copy_string(cdr->channel, "Test/cdrtest", sizeof(cdr->channel));
+	cdr->start = cdr->answer = cdr->end = cw_tvnow();
+	cdr->duration = n;
+	return cdr;
+}
+
+/* A batch as the CDR thread takes it off the queue, the last record of it
+   from \a last */
+static struct cw_cdr_batch_item *test_batch(const char *src, const char *last)
+{
+	struct cw_cdr_batch_item *head = NULL, **tail = &head;
+	int x;
+
+	for (x = 0;  x < BATCH;  x++) {
+		if (!(*tail = calloc(1, sizeof(**tail))))
+			break;
+		(*tail)->cdr = test_cdr((x == BATCH - 1) ? last : src, x);
+		tail = &(*tail)->next;
+	}
+	return head;
+}
+
+static void free_batch(struct cw_cdr_batch_item *items)
+{
+	struct cw_cdr_batch_item *next;
+
+	for (;  items;  items = next) {
+		next = items->next;
+		cw_set_flag(items->cdr, CW_CDR_FLAG_POSTED);
+		cw_cdr_free(items->cdr);
+		free(items);
+	}
+}
+
+/* The backend registers its batch handler with the engine */
+void test_cdr_register(CuTest *tc)
+{
+	struct cw_cdr_beitem *i;
+
+	CuAssertIntEquals(tc, 0, load_module());
+	i = CW_LIST_FIRST(&be_list);
+	CuAssertPtrNotNull(tc, i);
+	CuAssertStrEquals(tc, "sqlite", i->name);
+	CuAssertTrue(tc, i->batch_be == sqlite_log_batch);
+	/* Fails any record from "bad" */
+	CuAssertIntEquals(tc, SQLITE_OK, exec("CREATE TRIGGER cdrtest BEFORE INSERT ON cdr WHEN NEW.src = 'bad' "
+		"BEGIN SELECT RAISE(ABORT, 'bad record'); END"));
+}
+
+/* A whole batch goes in */
+void test_cdr_batch(CuTest *tc)
+{
+	do_batch_backend_process(test_batch("good", "good"));
+	CuAssertIntEquals(tc, BATCH, rows("src = 'good'"));
+	CuAssertIntEquals(tc, 1, rows("duration = 0 AND clid = '\"O''Brien\" <0>'"));
+}
+
+/* A batch with a record that fails leaves nothing of itself behind */
+void test_cdr_batch_rollback(CuTest *tc)
+{
+	struct cw_cdr_batch_item *items, *item;
+	struct cw_cdr *cdrs[BATCH];
+	int x = 0;
+
+	items = test_batch("rollback", "bad");
+	for (item = items;  item;  item = item->next)
+		cdrs[x++] = item->cdr;
+	CuAssertIntEquals(tc, BATCH, x);
+	CuAssertIntEquals(tc, -1, sqlite_log_batch(cdrs, BATCH));
+	CuAssertIntEquals(tc, 0, rows("src = 'rollback'"));
+	CuAssertIntEquals(tc, BATCH, rows("1"));
+	free_batch(items);
+}
+
+/* The engine then stores the records of the failed batch one at a time,
+   each of the good ones once */
+void test_cdr_batch_replay(CuTest *tc)
+{
+	do_batch_backend_process(test_batch("replay", "bad"));
+	CuAssertIntEquals(tc, BATCH - 1, rows("src = 'replay'"));
+	CuAssertIntEquals(tc, 0, rows("src = 'bad'"));
+	CuAssertIntEquals(tc, 1, rows("src = 'replay' AND duration = 0"));
+	CuAssertIntEquals(tc, 1, rows("src = 'replay' AND duration = 48"));
+}
+
+int main(int argc, char **argv)
+{
+	CuString *output = CuStringNew();
+	CuSuite *suite = CuSuiteNew();
+	char fn[PATH_MAX];
+	int res;
+
+	snprintf(cw_config_CW_LOG_DIR, sizeof(cw_config_CW_LOG_DIR), "%s", argc > 1 ? argv[1] : ".");
+	snprintf(cw_config_CW_SPOOL_DIR, sizeof(cw_config_CW_SPOOL_DIR), "%s", cw_config_CW_LOG_DIR);
+	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
+	unlink(fn);
+
+	SUITE_ADD_TEST(suite, test_cdr_register);
+	SUITE_ADD_TEST(suite, test_cdr_batch);
+	SUITE_ADD_TEST(suite, test_cdr_batch_rollback);
+	SUITE_ADD_TEST(suite, test_cdr_batch_replay);
+
+	CuSuiteRun(suite);
+	CuSuiteSummary(suite, output);
+	CuSuiteDetails(suite, output);
+	printf("%s\n", output->buffer);
+	res = suite->failCount ? 1 : 0;
+
+	unload_module();
+	unlink(fn);
+	return res;
+}
@@ -1842,6 +1842,10 @@ struct cw_frame *cw_read(struct cw_channel *chan)
 		    		if (cw_writestream(chan->monitor->read_stream, f) < 0)
 			    		cw_log(LOG_WARNING, "Failed to write data to channel monitor read stream\n");
     			}
+    			else if (chan->monitor && chan->monitor->mix_frame)
+    			{
+    				chan->monitor->mix_frame(chan->monitor, f, 0);
+    			}
 			
 	    		if (chan->readtrans)
             		{
@@ -2269,6 +2273,11 @@ int cw_write(struct cw_channel *chan, struct cw_frame *fr)
 					if (cw_writestream(chan->monitor->write_stream, f) < 0)
 						cw_log(LOG_WARNING, "Failed to write data to channel monitor write stream\n");
 				}
+				else if (chan->monitor && chan->monitor->mix_frame &&
+						f->frametype == CW_FRAME_VOICE)
+				{
+					chan->monitor->mix_frame(chan->monitor, f, 1);
+				}
 
 				res = chan->tech->write(chan, f);
 			}
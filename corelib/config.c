@@ -33,6 +33,7 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #if defined(HAVE_GLOB_H)
 #include <glob.h>
@@ -76,17 +77,29 @@ static struct cw_config_engine *config_engine_list;
 
 #define MAX_INCLUDE_LEVEL 10
 
+/* Categories and variables are looked up through a hash table once there
+   are this many of them, and by walking the list below that */
+#define CONFIG_INDEX_MIN 16
+
 struct cw_comment {
 	struct cw_comment *next;
 	char cmt[0];
 };
 
+struct config_deps;
+
 struct cw_category {
 	char name[80];
 	int ignored;			/* do not let user of the config see this category */
 	struct cw_variable *root;
 	struct cw_variable *last;
 	struct cw_category *next;
+	struct cw_config *config;	/* config this category was appended to */
+	unsigned int hash;
+	struct cw_category *hash_next;	/* same bucket of config->cat_index, in list order */
+	int nvars;
+	int var_index_size;
+	struct cw_variable **var_index;	/* first variable of each name, open addressed */
 };
 
 struct cw_config {
@@ -96,8 +109,88 @@ struct cw_config {
 	struct cw_category *last_browse;		/* used to cache the last category supplied via category_browse */
 	int include_level;
 	int max_include_level;
+	int ncats;
+	int cat_index_size;
+	struct cw_category **cat_index;
+	struct config_deps *deps;		/* files read, while cw_config_load() is filling a cache entry */
 };
 
+static unsigned int config_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	for (;  *name;  name++)
+		h = (h ^ (unsigned char) tolower(*name)) * 16777619U;
+	return h;
+}
+
+/* Don't call unless the variable index exists */
+static void var_index_add(struct cw_category *cat, struct cw_variable *v)
+{
+	struct cw_variable **slot;
+	unsigned int mask = cat->var_index_size - 1;
+	unsigned int x;
+
+	for (x = config_hash(v->name) & mask;  (slot = &cat->var_index[x]) && *slot;  x = (x + 1) & mask) {
+		/* the first variable of a name is the one cw_variable_retrieve() returns */
+		if (!strcasecmp((*slot)->name, v->name))
+			return;
+	}
+	*slot = v;
+}
+
+static void var_index_free(struct cw_category *cat)
+{
+	free(cat->var_index);
+	cat->var_index = NULL;
+	cat->var_index_size = 0;
+}
+
+static void var_index_build(struct cw_category *cat)
+{
+	struct cw_variable *v;
+	int size;
+
+	var_index_free(cat);
+	for (size = 32;  size < cat->nvars * 2;  size <<= 1);
+	if (!(cat->var_index = calloc(size, sizeof(*cat->var_index))))
+		return;
+	cat->var_index_size = size;
+	for (v = cat->root;  v;  v = v->next)
+		var_index_add(cat, v);
+}
+
+/* Don't call unless the category index exists */
+static void cat_index_add(struct cw_config *cfg, struct cw_category *cat)
+{
+	struct cw_category **pc;
+
+	for (pc = &cfg->cat_index[cat->hash & (cfg->cat_index_size - 1)];  *pc;  pc = &(*pc)->hash_next);
+	cat->hash_next = NULL;
+	*pc = cat;
+}
+
+static void cat_index_free(struct cw_config *cfg)
+{
+	free(cfg->cat_index);
+	cfg->cat_index = NULL;
+	cfg->cat_index_size = 0;
+}
+
+static void cat_index_build(struct cw_config *cfg)
+{
+	struct cw_category *cat;
+	int size;
+
+	cat_index_free(cfg);
+	for (size = 64;  size < cfg->ncats * 2;  size <<= 1);
+	if (!(cfg->cat_index = calloc(size, sizeof(*cfg->cat_index))))
+		return;
+	cfg->cat_index_size = size;
+	for (cat = cfg->root;  cat;  cat = cat->next)
+		cat_index_add(cfg, cat);
+}
+
 struct cw_variable *cw_variable_new(const char *name, const char *value) 
 {
 	struct cw_variable *variable;
@@ -122,6 +215,13 @@ void cw_variable_append(struct cw_category *category, struct cw_variable *variab
 	else
 		category->root = variable;
 	category->last = variable;
+	category->nvars++;
+	if (category->var_index) {
+		if (category->nvars * 2 > category->var_index_size)
+			var_index_build(category);
+		else
+			var_index_add(category, variable);
+	}
 }
 
 void cw_variables_destroy(struct cw_variable *v)
@@ -157,7 +257,30 @@ char *cw_variable_retrieve(const struct cw_config *config, const char *category,
 	struct cw_variable *v;
 
 	if (category) {
-		for (v = cw_variable_browse(config, category); v; v = v->next) {
+		struct cw_category *cat;
+
+		if (config->last_browse && config->last_browse->name == category)
+			cat = config->last_browse;
+		else
+			cat = cw_category_get(config, category);
+		if (!cat)
+			return NULL;
+		if (cat->nvars >= CONFIG_INDEX_MIN) {
+			unsigned int mask;
+			unsigned int x;
+
+			if (!cat->var_index)
+				var_index_build(cat);
+			if (cat->var_index) {
+				mask = cat->var_index_size - 1;
+				for (x = config_hash(variable) & mask;  (v = cat->var_index[x]);  x = (x + 1) & mask) {
+					if (!strcasecmp(variable, v->name))
+						return v->value;
+				}
+				return NULL;
+			}
+		}
+		for (v = cat->root; v; v = v->next) {
 			if (!strcasecmp(variable, v->name))
 				return v->value;
 		}
@@ -181,7 +304,7 @@ static struct cw_variable *variable_clone(const struct cw_variable *old)
 		new->lineno = old->lineno;
 		new->object = old->object;
 		new->blanklines = old->blanklines;
-		new->configfile = strdup(old->configfile);
+		new->configfile = old->configfile ? strdup(old->configfile) : NULL;
 		/* TODO: clone comments? */
 	}
 
@@ -195,6 +318,9 @@ static void move_variables(struct cw_category *old, struct cw_category *new)
 
 	next = old->root;
 	old->root = NULL;
+	old->last = NULL;
+	old->nvars = 0;
+	var_index_free(old);
 	for (var = next; var; var = next) {
 		next = var->next;
 		var->next = NULL;
@@ -219,6 +345,26 @@ static struct cw_category *category_get(const struct cw_config *config, const ch
 {
 	struct cw_category *cat;
 
+	if (config->ncats >= CONFIG_INDEX_MIN) {
+		struct cw_category *bucket;
+
+		/* the index is a cache, so build it even through a const config */
+		if (!config->cat_index)
+			cat_index_build((struct cw_config *) config);
+		if (config->cat_index) {
+			bucket = config->cat_index[config_hash(category_name) & (config->cat_index_size - 1)];
+			for (cat = bucket;  cat;  cat = cat->hash_next) {
+				if (cat->name == category_name && (ignored || !cat->ignored))
+					return cat;
+			}
+			for (cat = bucket;  cat;  cat = cat->hash_next) {
+				if (!strcasecmp(cat->name, category_name) && (ignored || !cat->ignored))
+					return cat;
+			}
+			return NULL;
+		}
+	}
+
 	for (cat = config->root; cat; cat = cat->next) {
 		if (cat->name == category_name && (ignored || !cat->ignored))
 			return cat;
@@ -250,11 +396,21 @@ void cw_category_append(struct cw_config *config, struct cw_category *category)
 		config->root = category;
 	config->last = category;
 	config->current = category;
+	category->config = config;
+	category->hash = config_hash(category->name);
+	config->ncats++;
+	if (config->cat_index) {
+		if (config->ncats * 2 > config->cat_index_size)
+			cat_index_build(config);
+		else
+			cat_index_add(config, category);
+	}
 }
 
 void cw_category_destroy(struct cw_category *cat)
 {
 	cw_variables_destroy(cat->root);
+	var_index_free(cat);
 	free(cat);
 }
 
@@ -306,6 +462,9 @@ struct cw_variable *cw_category_detach_variables(struct cw_category *cat)
 
 	v = cat->root;
 	cat->root = NULL;
+	cat->last = NULL;
+	cat->nvars = 0;
+	var_index_free(cat);
 
 	return v;
 }
@@ -313,6 +472,11 @@ struct cw_variable *cw_category_detach_variables(struct cw_category *cat)
 void cw_category_rename(struct cw_category *cat, const char *name)
 {
 	cw_copy_string(cat->name, name, sizeof(cat->name));
+	if (cat->config) {
+		cat->hash = config_hash(cat->name);
+		/* rebuilt with the new name on the next lookup */
+		cat_index_free(cat->config);
+	}
 }
 
 static void inherit_category(struct cw_category *new, const struct cw_category *base)
@@ -351,10 +515,12 @@ void cw_config_destroy(struct cw_config *cfg)
 	cat = cfg->root;
 	while(cat) {
 		cw_variables_destroy(cat->root);
+		var_index_free(cat);
 		catn = cat;
 		cat = cat->next;
 		free(catn);
 	}
+	cat_index_free(cfg);
 	free(cfg);
 }
 
@@ -369,6 +535,412 @@ void cw_config_set_current_category(struct cw_config *cfg, const struct cw_categ
 	cfg->current = (struct cw_category *) cat;
 }
 
+/*
+ * Parsed config cache
+ *
+ * cw_config_load() keeps a compact copy of each text config it parses,
+ * keyed by path.  With it goes a fingerprint of every file pattern read
+ * while parsing it, the file itself and whatever it #includes: the names
+ * the pattern matched and their inode, size and modification time.  The
+ * next load of the same file checks those with stat() and, when nothing
+ * changed, builds the config from the copy, without reading, tokenizing,
+ * following #includes or copying templates again.  Configs using #exec or
+ * a realtime engine are not cached, and neither are files changed within
+ * the last second, as another change in the same second would not show.
+ */
+#define CONFIG_CACHE_BUCKETS	64
+#define CONFIG_CACHE_MAX	256
+
+struct config_dep {
+	unsigned int sum;
+	char *pattern;
+};
+
+/*! Files read by one cw_config_load() */
+struct config_deps {
+	int uncacheable;
+	int ndeps;
+	int size;
+	struct config_dep *dep;
+};
+
+struct config_image_cat {
+	unsigned int name;
+	int ignored;
+	int nvars;
+};
+
+struct config_image_var {
+	/*! name\0value\0 in the string pool */
+	unsigned int name;
+	/*! Offset of the file name in the string pool, or ~0U for none */
+	unsigned int configfile;
+	int lineno;
+	int object;
+	int blanklines;
+};
+
+/*! A parsed config in a single block: the categories in order, then the
+ *  variables of all of them in order, then the strings */
+struct config_image {
+	size_t size;
+	int ncats;
+	int nvars;
+	struct config_image_cat *cats;
+	struct config_image_var *vars;
+	char *strings;
+};
+
+struct config_cache_entry {
+	struct config_cache_entry *next;
+	unsigned int hash;
+	int refs;
+	/*! Unlinked from the cache, freed when the last user lets go */
+	int dead;
+	time_t used;
+	int ndeps;
+	struct config_dep *deps;
+	struct config_image *image;
+	char path[0];
+};
+
+static struct config_cache_entry *config_cache[CONFIG_CACHE_BUCKETS];
+static int config_cache_count;
+static unsigned long config_cache_hits;
+static unsigned long config_cache_misses;
+static unsigned long config_cache_changed;
+
+CW_MUTEX_DEFINE_STATIC(config_cache_lock);
+
+static void config_path(const char *filename, char *fn, size_t len)
+{
+	if (filename[0] == '/')
+		cw_copy_string(fn, filename, len);
+	else
+		snprintf(fn, len, "%s/%s", (char *)cw_config_CW_CONFIG_DIR, filename);
+}
+
+static unsigned int config_sum_file(unsigned int h, const char *path, time_t now, int *racy)
+{
+	struct stat st;
+	unsigned long fields[5];
+	const unsigned char *p;
+	size_t i;
+
+	for (p = (const unsigned char *) path;  *p;  p++)
+		h = (h ^ *p) * 16777619U;
+	memset(fields, 0, sizeof(fields));
+	if (!stat(path, &st)) {
+		fields[0] = st.st_dev;
+		fields[1] = st.st_ino;
+		fields[2] = st.st_mode;
+		fields[3] = st.st_size;
+		fields[4] = st.st_mtime;
+		if (st.st_mtime >= now - 1)
+			*racy = 1;
+	}
+	p = (const unsigned char *) fields;
+	for (i = 0;  i < sizeof(fields);  i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+/*! Sums up the files a config file pattern stands for, the same way
+ *  config_text_file_load() expands it.  Returns non-zero if one of them
+ *  changed too recently to be sure of seeing the next change */
+static int config_fingerprint(const char *fn, unsigned int *sum)
+{
+	unsigned int h = 2166136261U;
+	time_t now = time(NULL);
+	int racy = 0;
+#if defined(HAVE_GLOB_H)
+	glob_t globbuf;
+	int glob_ret;
+	int i;
+
+	globbuf.gl_offs = 0;
+#if defined(SOLARIS)  ||  !defined(GLOB_NOMAGIC)  ||  !defined(GLOB_BRACE)
+	glob_ret = glob(fn, GLOB_NOCHECK, NULL, &globbuf);
+#else
+	glob_ret = glob(fn, GLOB_NOMAGIC | GLOB_BRACE, NULL, &globbuf);
+#endif
+	if (!glob_ret) {
+		for (i = 0;  i < globbuf.gl_pathc;  i++)
+			h = config_sum_file(h, globbuf.gl_pathv[i], now, &racy);
+		globfree(&globbuf);
+	} else {
+		h = config_sum_file(h, fn, now, &racy);
+	}
+#else
+	h = config_sum_file(h, fn, now, &racy);
+#endif
+	*sum = h;
+	return racy;
+}
+
+static void config_deps_free(struct config_dep *dep, int ndeps)
+{
+	int x;
+
+	for (x = 0;  x < ndeps;  x++)
+		free(dep[x].pattern);
+	free(dep);
+}
+
+static void config_deps_add(struct config_deps *deps, const char *fn)
+{
+	struct config_dep *dep;
+
+	if (deps->uncacheable)
+		return;
+	if (deps->ndeps == deps->size) {
+		if (!(dep = realloc(deps->dep, (deps->size + 8) * sizeof(*dep)))) {
+			deps->uncacheable = 1;
+			return;
+		}
+		deps->dep = dep;
+		deps->size += 8;
+	}
+	dep = &deps->dep[deps->ndeps];
+	if (config_fingerprint(fn, &dep->sum) || !(dep->pattern = strdup(fn))) {
+		deps->uncacheable = 1;
+		return;
+	}
+	deps->ndeps++;
+}
+
+static struct config_image *config_image_build(const struct cw_config *cfg)
+{
+	struct config_image *img;
+	struct cw_category *cat;
+	struct cw_variable *v;
+	const char *lastfile;
+	unsigned int lastoff;
+	size_t strbytes = 0;
+	size_t len;
+	char *p;
+	int ncats = 0;
+	int nvars = 0;
+	int c;
+	int n;
+
+	lastfile = NULL;
+	for (cat = cfg->root;  cat;  cat = cat->next) {
+		ncats++;
+		strbytes += strlen(cat->name) + 1;
+		for (v = cat->root;  v;  v = v->next) {
+			nvars++;
+			strbytes += strlen(v->name) + strlen(v->value) + 2;
+			if (v->configfile && (!lastfile || strcmp(v->configfile, lastfile))) {
+				strbytes += strlen(v->configfile) + 1;
+				lastfile = v->configfile;
+			}
+		}
+	}
+	if (strbytes >= ~0U)
+		return NULL;
+
+	len = sizeof(*img) + ncats * sizeof(*img->cats) + nvars * sizeof(*img->vars) + strbytes;
+	if (!(img = malloc(len)))
+		return NULL;
+	img->size = len;
+	img->ncats = ncats;
+	img->nvars = nvars;
+	img->cats = (struct config_image_cat *) (img + 1);
+	img->vars = (struct config_image_var *) (img->cats + ncats);
+	img->strings = (char *) (img->vars + nvars);
+
+	p = img->strings;
+	lastfile = NULL;
+	lastoff = ~0U;
+	c = 0;
+	n = 0;
+	for (cat = cfg->root;  cat;  cat = cat->next, c++) {
+		img->cats[c].name = p - img->strings;
+		img->cats[c].ignored = cat->ignored;
+		img->cats[c].nvars = 0;
+		p = stpcpy(p, cat->name) + 1;
+		for (v = cat->root;  v;  v = v->next, n++) {
+			img->cats[c].nvars++;
+			img->vars[n].name = p - img->strings;
+			p = stpcpy(p, v->name) + 1;
+			p = stpcpy(p, v->value) + 1;
+			if (!v->configfile) {
+				img->vars[n].configfile = ~0U;
+			} else {
+				if (!lastfile || strcmp(v->configfile, lastfile)) {
+					lastoff = p - img->strings;
+					p = stpcpy(p, v->configfile) + 1;
+					lastfile = v->configfile;
+				}
+				img->vars[n].configfile = lastoff;
+			}
+			img->vars[n].lineno = v->lineno;
+			img->vars[n].object = v->object;
+			img->vars[n].blanklines = v->blanklines;
+		}
+	}
+	return img;
+}
+
+static struct cw_config *config_image_load(const struct config_image *img)
+{
+	struct cw_config *cfg;
+	struct cw_category *cat;
+	struct cw_variable *v;
+	const struct config_image_var *iv;
+	const char *name;
+	int c;
+	int n;
+
+	if (!(cfg = cw_config_new()))
+		return NULL;
+	iv = img->vars;
+	for (c = 0;  c < img->ncats;  c++) {
+		if (!(cat = cw_category_new(img->strings + img->cats[c].name)))
+			goto oom;
+		cat->ignored = img->cats[c].ignored;
+		cw_category_append(cfg, cat);
+		for (n = 0;  n < img->cats[c].nvars;  n++, iv++) {
+			name = img->strings + iv->name;
+			if (!(v = cw_variable_new(name, name + strlen(name) + 1)))
+				goto oom;
+			v->lineno = iv->lineno;
+			v->object = iv->object;
+			v->blanklines = iv->blanklines;
+			cw_variable_append(cat, v);
+			if (iv->configfile != ~0U && !(v->configfile = strdup(img->strings + iv->configfile)))
+				goto oom;
+		}
+	}
+	return cfg;
+
+oom:
+	cw_log(LOG_WARNING, "Out of memory\n");
+	cw_config_destroy(cfg);
+	return NULL;
+}
+
+static void config_cache_free(struct config_cache_entry *e)
+{
+	config_deps_free(e->deps, e->ndeps);
+	free(e->image);
+	free(e);
+}
+
+/* Don't call without config_cache_lock */
+static void config_cache_unlink(struct config_cache_entry *e)
+{
+	struct config_cache_entry **pe;
+
+	for (pe = &config_cache[e->hash % CONFIG_CACHE_BUCKETS];  *pe;  pe = &(*pe)->next) {
+		if (*pe == e) {
+			*pe = e->next;
+			break;
+		}
+	}
+	config_cache_count--;
+	e->dead = 1;
+	if (!e->refs)
+		config_cache_free(e);
+}
+
+/*! Returns a config built from the cached copy of path, if there is one and
+ *  none of the files it was parsed from has changed since */
+static struct cw_config *config_cache_get(const char *path)
+{
+	struct config_cache_entry *e;
+	struct cw_config *cfg = NULL;
+	unsigned int hash = config_hash(path);
+	unsigned int sum;
+	int changed = 0;
+	int x;
+
+	cw_mutex_lock(&config_cache_lock);
+	for (e = config_cache[hash % CONFIG_CACHE_BUCKETS];  e;  e = e->next) {
+		if (e->hash == hash && !strcmp(e->path, path))
+			break;
+	}
+	if (!e) {
+		config_cache_misses++;
+		cw_mutex_unlock(&config_cache_lock);
+		return NULL;
+	}
+	e->refs++;
+	e->used = time(NULL);
+	cw_mutex_unlock(&config_cache_lock);
+
+	/* the image is never changed once cached, so it is read unlocked */
+	for (x = 0;  x < e->ndeps && !changed;  x++) {
+		config_fingerprint(e->deps[x].pattern, &sum);
+		changed = (sum != e->deps[x].sum);
+	}
+	if (!changed)
+		cfg = config_image_load(e->image);
+
+	cw_mutex_lock(&config_cache_lock);
+	e->refs--;
+	if (changed)
+		config_cache_changed++;
+	else if (cfg)
+		config_cache_hits++;
+	if (changed && !e->dead)
+		config_cache_unlink(e);
+	else if (e->dead && !e->refs)
+		config_cache_free(e);
+	cw_mutex_unlock(&config_cache_lock);
+
+	if (cfg && option_verbose > 3)
+		cw_verbose(VERBOSE_PREFIX_2 "Parsing '%s': Unchanged, using the parsed copy\n", path);
+	return cfg;
+}
+
+/*! Caches cfg as the result of parsing path, taking the dependencies over */
+static void config_cache_put(const char *path, struct config_deps *deps, const struct cw_config *cfg)
+{
+	struct config_cache_entry *e;
+	struct config_cache_entry *old;
+	struct config_cache_entry *lru;
+	int x;
+
+	if (!(e = malloc(sizeof(*e) + strlen(path) + 1)))
+		return;
+	memset(e, 0, sizeof(*e));
+	if (!(e->image = config_image_build(cfg))) {
+		free(e);
+		return;
+	}
+	strcpy(e->path, path);
+	e->hash = config_hash(path);
+	e->used = time(NULL);
+	e->deps = deps->dep;
+	e->ndeps = deps->ndeps;
+	deps->dep = NULL;
+	deps->ndeps = 0;
+
+	cw_mutex_lock(&config_cache_lock);
+	for (old = config_cache[e->hash % CONFIG_CACHE_BUCKETS];  old;  old = old->next) {
+		if (old->hash == e->hash && !strcmp(old->path, path)) {
+			config_cache_unlink(old);
+			break;
+		}
+	}
+	while (config_cache_count >= CONFIG_CACHE_MAX) {
+		lru = NULL;
+		for (x = 0;  x < CONFIG_CACHE_BUCKETS;  x++) {
+			for (old = config_cache[x];  old;  old = old->next) {
+				if (!lru || old->used < lru->used)
+					lru = old;
+			}
+		}
+		config_cache_unlink(lru);
+	}
+	e->next = config_cache[e->hash % CONFIG_CACHE_BUCKETS];
+	config_cache[e->hash % CONFIG_CACHE_BUCKETS] = e;
+	config_cache_count++;
+	cw_mutex_unlock(&config_cache_lock);
+}
+
 static int process_text_line(struct cw_config *cfg, struct cw_category **cat, char *buf, int lineno, const char *configfile)
 {
 	char *c;
@@ -474,6 +1046,9 @@ static int process_text_line(struct cw_config *cfg, struct cw_category **cat, ch
 				/* #exec </path/to/executable>
 				   We create a tmp file, then we #include it, then we delete it. */
 				if (do_exec) { 
+					/* the output may differ every time */
+					if (cfg->deps)
+						cfg->deps->uncacheable = 1;
 					snprintf(exec_file, sizeof(exec_file), "/var/tmp/exec.%ld.%ld", time(NULL), (long)pthread_self());
 					snprintf(cmd, sizeof(cmd), "%s > %s 2>&1", cur, exec_file);
 					cw_safe_system(cmd);
@@ -548,11 +1123,9 @@ static struct cw_config *config_text_file_load(const char *database, const char
 	
 	cat = cw_config_get_current_category(cfg);
 
-	if (filename[0] == '/') {
-		cw_copy_string(fn, filename, sizeof(fn));
-	} else {
-		snprintf(fn, sizeof(fn), "%s/%s", (char *)cw_config_CW_CONFIG_DIR, filename);
-	}
+	config_path(filename, fn, sizeof(fn));
+	if (cfg->deps)
+		config_deps_add(cfg->deps, fn);
 
 #if defined(HAVE_GLOB_H)
 	{
@@ -743,6 +1316,317 @@ int config_text_file_save(const char *configfile, const struct cw_config *cfg, c
 	return 0;
 }
 
+/*
+ * Realtime lookup cache.  Results of cw_load_realtime() and
+ * cw_load_realtime_multientry() are kept for a while per family and set of
+ * lookup fields, lookups that found nothing included, so that a busy system
+ * does not send the same SELECT to the database over and over.  Every cached
+ * result of a family is dropped when cw_update_realtime() changes it, since
+ * an update can change what any lookup of the family returns.
+ */
+#define RT_CACHE_BUCKETS	512
+#define RT_CACHE_MAX_DEFAULT	1000
+
+struct rt_cache_entry {
+	unsigned int hash;
+	/*! Result of cw_load_realtime_multientry() rather than cw_load_realtime() */
+	int multi;
+	time_t expires;
+	struct cw_variable *var;
+	struct cw_config *cfg;
+	struct rt_cache_entry *next;
+	/*! Least recently used order, most recent first */
+	struct rt_cache_entry *lru_prev;
+	struct rt_cache_entry *lru_next;
+	size_t keylen;
+	/*! family\0name\0value\0... */
+	char key[0];
+};
+
+static struct rt_cache_entry *rt_cache[RT_CACHE_BUCKETS];
+static struct rt_cache_entry *rt_cache_lru_head;
+static struct rt_cache_entry *rt_cache_lru_tail;
+static int rt_cache_count;
+/* Bumped by every invalidation, so a lookup racing an update is not cached */
+static unsigned int rt_cache_generation;
+
+static int rt_cache_ttl;
+static int rt_cache_negttl;
+static int rt_cache_max = RT_CACHE_MAX_DEFAULT;
+
+static unsigned long rt_cache_hits;
+static unsigned long rt_cache_neghits;
+static unsigned long rt_cache_misses;
+static unsigned long rt_cache_drops;
+
+CW_MUTEX_DEFINE_STATIC(rt_cache_lock);
+
+/*! Builds the cache key from the family and the name/value pairs in ap,
+ *  without using up ap.  Returns a malloc'd key or NULL */
+static char *rt_cache_key(const char *family, va_list ap, size_t *keylen, unsigned int *hash)
+{
+	va_list aq;
+	const char *s;
+	char *key;
+	char *p;
+	size_t len;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	len = strlen(family) + 1;
+	va_copy(aq, ap);
+	while ((s = va_arg(aq, const char *))) {
+		len += strlen(s) + 1;
+		s = va_arg(aq, const char *);
+		len += strlen(s ? s : "") + 1;
+	}
+	va_end(aq);
+
+	if (!(key = malloc(len)))
+		return NULL;
+
+	p = key;
+	strcpy(p, family);
+	p += strlen(p) + 1;
+	va_copy(aq, ap);
+	while ((s = va_arg(aq, const char *))) {
+		strcpy(p, s);
+		p += strlen(p) + 1;
+		s = va_arg(aq, const char *);
+		strcpy(p, s ? s : "");
+		p += strlen(p) + 1;
+	}
+	va_end(aq);
+
+	for (i = 0;  i < len;  i++)
+		h = (h ^ (unsigned char) key[i]) * 16777619U;
+	*keylen = len;
+	*hash = h;
+	return key;
+}
+
+static struct cw_variable *rt_dup_variables(const struct cw_variable *v)
+{
+	struct cw_variable *head = NULL;
+	struct cw_variable *tail = NULL;
+	struct cw_variable *n;
+
+	for (;  v;  v = v->next) {
+		if (!(n = variable_clone(v)))
+			break;
+		if (tail)
+			tail->next = n;
+		else
+			head = n;
+		tail = n;
+	}
+	return head;
+}
+
+static struct cw_config *rt_dup_config(const struct cw_config *cfg)
+{
+	struct cw_config *new;
+	struct cw_category *cat;
+	struct cw_category *newcat;
+
+	if (!cfg || !(new = cw_config_new()))
+		return NULL;
+	for (cat = cfg->root;  cat;  cat = cat->next) {
+		if (!(newcat = cw_category_new(cat->name)))
+			break;
+		inherit_category(newcat, cat);
+		cw_category_append(new, newcat);
+	}
+	return new;
+}
+
+/* Don't call without rt_cache_lock */
+static void rt_cache_unlink(struct rt_cache_entry *e)
+{
+	struct rt_cache_entry **pe;
+
+	for (pe = &rt_cache[e->hash % RT_CACHE_BUCKETS];  *pe;  pe = &(*pe)->next) {
+		if (*pe == e) {
+			*pe = e->next;
+			break;
+		}
+	}
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		rt_cache_lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		rt_cache_lru_tail = e->lru_prev;
+	rt_cache_count--;
+
+	cw_variables_destroy(e->var);
+	if (e->cfg)
+		cw_config_destroy(e->cfg);
+	free(e);
+}
+
+/*! Looks a result up.  On a hit, returns 1 and a copy of the result for the
+ *  caller to own in *var or *cfg.  On a miss, returns 0 and the generation
+ *  to hand rt_cache_put() with what the engine fetches */
+static int rt_cache_get(const char *key, size_t keylen, unsigned int hash, int multi, unsigned int *generation, struct cw_variable **var, struct cw_config **cfg)
+{
+	struct rt_cache_entry *e;
+
+	cw_mutex_lock(&rt_cache_lock);
+	*generation = rt_cache_generation;
+	for (e = rt_cache[hash % RT_CACHE_BUCKETS];  e;  e = e->next) {
+		if (e->hash == hash && e->multi == multi && e->keylen == keylen && !memcmp(e->key, key, keylen))
+			break;
+	}
+	if (!e || e->expires <= time(NULL)) {
+		if (e)
+			rt_cache_unlink(e);
+		rt_cache_misses++;
+		cw_mutex_unlock(&rt_cache_lock);
+		return 0;
+	}
+
+	/* move to the front of the LRU list */
+	if (e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+		if (e->lru_next)
+			e->lru_next->lru_prev = e->lru_prev;
+		else
+			rt_cache_lru_tail = e->lru_prev;
+		e->lru_prev = NULL;
+		e->lru_next = rt_cache_lru_head;
+		rt_cache_lru_head->lru_prev = e;
+		rt_cache_lru_head = e;
+	}
+
+	if (multi) {
+		*cfg = rt_dup_config(e->cfg);
+		if (!e->cfg || !e->cfg->root)
+			rt_cache_neghits++;
+		else
+			rt_cache_hits++;
+	} else {
+		*var = rt_dup_variables(e->var);
+		if (!e->var)
+			rt_cache_neghits++;
+		else
+			rt_cache_hits++;
+	}
+	cw_mutex_unlock(&rt_cache_lock);
+	return 1;
+}
+
+/*! Stores a copy of a result fetched from the engine, unless the family was
+ *  invalidated since the lookup started (generation moved on) */
+static void rt_cache_put(char *key, size_t keylen, unsigned int hash, int multi, unsigned int generation, const struct cw_variable *var, const struct cw_config *cfg)
+{
+	struct rt_cache_entry *e;
+	struct rt_cache_entry *old;
+	int negative;
+	int ttl;
+
+	negative = multi ? (!cfg || !cfg->root) : !var;
+	ttl = negative ? rt_cache_negttl : rt_cache_ttl;
+	if (ttl <= 0 || rt_cache_max <= 0)
+		return;
+
+	if (!(e = malloc(sizeof(*e) + keylen)))
+		return;
+	memset(e, 0, sizeof(*e));
+	memcpy(e->key, key, keylen);
+	e->keylen = keylen;
+	e->hash = hash;
+	e->multi = multi;
+	e->expires = time(NULL) + ttl;
+	if (multi)
+		e->cfg = rt_dup_config(cfg);
+	else
+		e->var = rt_dup_variables(var);
+
+	cw_mutex_lock(&rt_cache_lock);
+	if (generation != rt_cache_generation) {
+		cw_mutex_unlock(&rt_cache_lock);
+		cw_variables_destroy(e->var);
+		if (e->cfg)
+			cw_config_destroy(e->cfg);
+		free(e);
+		return;
+	}
+	/* replace an expired entry for the same lookup */
+	for (old = rt_cache[hash % RT_CACHE_BUCKETS];  old;  old = old->next) {
+		if (old->hash == hash && old->multi == multi && old->keylen == keylen && !memcmp(old->key, key, keylen)) {
+			rt_cache_unlink(old);
+			break;
+		}
+	}
+	while (rt_cache_count >= rt_cache_max && rt_cache_lru_tail)
+		rt_cache_unlink(rt_cache_lru_tail);
+
+	e->next = rt_cache[hash % RT_CACHE_BUCKETS];
+	rt_cache[hash % RT_CACHE_BUCKETS] = e;
+	e->lru_next = rt_cache_lru_head;
+	if (rt_cache_lru_head)
+		rt_cache_lru_head->lru_prev = e;
+	else
+		rt_cache_lru_tail = e;
+	rt_cache_lru_head = e;
+	rt_cache_count++;
+	cw_mutex_unlock(&rt_cache_lock);
+}
+
+/*! Drops every cached result of a family, or of all families if family is NULL */
+static void rt_cache_drop(const char *family)
+{
+	struct rt_cache_entry *e;
+	struct rt_cache_entry *next;
+
+	cw_mutex_lock(&rt_cache_lock);
+	rt_cache_generation++;
+	for (e = rt_cache_lru_head;  e;  e = next) {
+		next = e->lru_next;
+		if (!family || !strcmp(e->key, family)) {
+			rt_cache_unlink(e);
+			rt_cache_drops++;
+		}
+	}
+	cw_mutex_unlock(&rt_cache_lock);
+}
+
+static int rt_cache_enabled(void)
+{
+	return (rt_cache_ttl > 0 || rt_cache_negttl > 0) && rt_cache_max > 0;
+}
+
+static void read_cache_settings(struct cw_config *config)
+{
+	struct cw_variable *v;
+
+	rt_cache_ttl = 0;
+	rt_cache_negttl = -1;
+	rt_cache_max = RT_CACHE_MAX_DEFAULT;
+
+	for (v = cw_variable_browse(config, "cache"); v; v = v->next) {
+		if (!strcasecmp(v->name, "ttl")) {
+			rt_cache_ttl = atoi(v->value);
+		} else if (!strcasecmp(v->name, "negativettl")) {
+			rt_cache_negttl = atoi(v->value);
+		} else if (!strcasecmp(v->name, "maxentries")) {
+			rt_cache_max = atoi(v->value);
+		} else {
+			cw_log(LOG_WARNING, "Unknown realtime cache setting '%s' at line %d of %s\n", v->name, v->lineno, extconfig_conf);
+		}
+	}
+	/* misses are cached as long as hits unless told otherwise */
+	if (rt_cache_negttl < 0)
+		rt_cache_negttl = rt_cache_ttl;
+
+	if (rt_cache_enabled() && option_verbose > 1)
+		cw_verbose(VERBOSE_PREFIX_2 "Realtime cache: %d seconds, %d seconds for misses, up to %d entries\n",
+			rt_cache_ttl, rt_cache_negttl, rt_cache_max);
+}
+
 static void clear_config_maps(void) 
 {
 	struct cw_config_map *map;
@@ -802,15 +1686,19 @@ void read_config_maps(void)
 	char *driver, *table, *database, *stringp;
 
 	clear_config_maps();
+	rt_cache_drop(NULL);
 
 	configtmp = cw_config_new();
 	configtmp->max_include_level = 1;
 	config = cw_config_internal_load(extconfig_conf, configtmp);
 	if (!config) {
 		cw_config_destroy(configtmp);
+		rt_cache_ttl = rt_cache_negttl = 0;
 		return;
 	}
 
+	read_cache_settings(config);
+
 	for (v = cw_variable_browse(config, "settings"); v; v = v->next) {
 		stringp = v->value;
 		driver = strsep(&stringp, ",");
@@ -930,35 +1818,48 @@ static struct cw_config_engine text_file_engine = {
 	.load_func = config_text_file_load,
 };
 
-struct cw_config *cw_config_internal_load(const char *filename, struct cw_config *cfg)
+/*! Picks the engine a config file is loaded with */
+static struct cw_config_engine *config_loader(const char *filename, char *db, int dbsiz, char *table, int tabsiz)
 {
-	char db[256];
-	char table[256];
 	struct cw_config_engine *loader = &text_file_engine;
-	struct cw_config *result;
-
-	if (cfg->include_level == cfg->max_include_level) {
-		cw_log(LOG_WARNING, "Maximum Include level (%d) exceeded\n", cfg->max_include_level);
-		return NULL;
-	}
-
-	cfg->include_level++;
 
 	if (strcmp(filename, extconfig_conf) && strcmp(filename, "callweaver.conf") && config_engine_list) {
 		struct cw_config_engine *eng;
 
-		eng = find_engine(filename, db, sizeof(db), table, sizeof(table));
+		eng = find_engine(filename, db, dbsiz, table, tabsiz);
 
 
 		if (eng && eng->load_func) {
 			loader = eng;
 		} else {
-			eng = find_engine("global", db, sizeof(db), table, sizeof(table));
+			eng = find_engine("global", db, dbsiz, table, tabsiz);
 			if (eng && eng->load_func)
 				loader = eng;
 		}
 	}
 
+	return loader;
+}
+
+struct cw_config *cw_config_internal_load(const char *filename, struct cw_config *cfg)
+{
+	char db[256];
+	char table[256];
+	struct cw_config_engine *loader;
+	struct cw_config *result;
+
+	if (cfg->include_level == cfg->max_include_level) {
+		cw_log(LOG_WARNING, "Maximum Include level (%d) exceeded\n", cfg->max_include_level);
+		return NULL;
+	}
+
+	cfg->include_level++;
+
+	loader = config_loader(filename, db, sizeof(db), table, sizeof(table));
+	/* there is no telling when the database changes */
+	if (loader != &text_file_engine && cfg->deps)
+		cfg->deps->uncacheable = 1;
+
 	result = loader->load_func(db, table, filename, cfg);
 
 	if (result)
@@ -971,14 +1872,35 @@ struct cw_config *cw_config_load(const char *filename)
 {
 	struct cw_config *cfg;
 	struct cw_config *result;
+	struct config_deps deps;
+	char db[256];
+	char table[256];
+	char fn[256];
+	int cache;
+
+	cache = option_config_cache && config_loader(filename, db, sizeof(db), table, sizeof(table)) == &text_file_engine;
+	if (cache) {
+		config_path(filename, fn, sizeof(fn));
+		if ((result = config_cache_get(fn)))
+			return result;
+	}
 
 	cfg = cw_config_new();
 	if (!cfg)
 		return NULL;
 
+	memset(&deps, 0, sizeof(deps));
+	if (cache)
+		cfg->deps = &deps;
 	result = cw_config_internal_load(filename, cfg);
-	if (!result)
+	if (!result) {
 		cw_config_destroy(cfg);
+	} else {
+		result->deps = NULL;
+		if (cache && !deps.uncacheable)
+			config_cache_put(fn, &deps, result);
+	}
+	config_deps_free(deps.dep, deps.ndeps);
 
 	return result;
 }
@@ -989,12 +1911,26 @@ struct cw_variable *cw_load_realtime(const char *family, ...)
 	char db[256]="";
 	char table[256]="";
 	struct cw_variable *res=NULL;
+	char *key = NULL;
+	size_t keylen = 0;
+	unsigned int hash = 0;
+	unsigned int generation;
 	va_list ap;
 
 	va_start(ap, family);
 	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng && eng->realtime_func) 
+	if (eng && eng->realtime_func) {
+		if (rt_cache_enabled() && (key = rt_cache_key(family, ap, &keylen, &hash)) && rt_cache_get(key, keylen, hash, 0, &generation, &res, NULL)) {
+			free(key);
+			va_end(ap);
+			return res;
+		}
 		res = eng->realtime_func(db, table, ap);
+		if (key) {
+			rt_cache_put(key, keylen, hash, 0, generation, res, NULL);
+			free(key);
+		}
+	}
 	va_end(ap);
 
 	return res;
@@ -1018,12 +1954,26 @@ struct cw_config *cw_load_realtime_multientry(const char *family, ...)
 	char db[256]="";
 	char table[256]="";
 	struct cw_config *res=NULL;
+	char *key = NULL;
+	size_t keylen = 0;
+	unsigned int hash = 0;
+	unsigned int generation;
 	va_list ap;
 
 	va_start(ap, family);
 	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng && eng->realtime_multi_func) 
+	if (eng && eng->realtime_multi_func) {
+		if (rt_cache_enabled() && (key = rt_cache_key(family, ap, &keylen, &hash)) && rt_cache_get(key, keylen, hash, 1, &generation, NULL, &res)) {
+			free(key);
+			va_end(ap);
+			return res;
+		}
 		res = eng->realtime_multi_func(db, table, ap);
+		if (key) {
+			rt_cache_put(key, keylen, hash, 1, generation, NULL, res);
+			free(key);
+		}
+	}
 	va_end(ap);
 
 	return res;
@@ -1043,6 +1993,8 @@ int cw_update_realtime(const char *family, const char *keyfield, const char *loo
 		res = eng->update_func(db, table, keyfield, lookup, ap);
 	va_end(ap);
 
+	rt_cache_drop(family);
+
 	return res;
 }
 
@@ -1077,7 +2029,70 @@ static struct cw_cli_entry config_command_struct = {
 	{ "show", "config", "mappings", NULL }, config_command, "Show Config mappings (file names to config engines)", show_config_help, NULL
 };
 
+static int realtime_cache_command(int fd, int argc, char **argv)
+{
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&rt_cache_lock);
+	if (!rt_cache_enabled()) {
+		cw_cli(fd, "Realtime cache is disabled\n");
+	} else {
+		cw_cli(fd, "Realtime cache: %d of %d entries, kept %d seconds, misses kept %d seconds\n",
+			rt_cache_count, rt_cache_max, rt_cache_ttl, rt_cache_negttl);
+		cw_cli(fd, "Lookups: %lu hits, %lu hits on misses, %lu sent to the engine\n",
+			rt_cache_hits, rt_cache_neghits, rt_cache_misses);
+		cw_cli(fd, "Dropped by updates and reloads: %lu\n", rt_cache_drops);
+	}
+	cw_mutex_unlock(&rt_cache_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static int config_cache_command(int fd, int argc, char **argv)
+{
+	struct config_cache_entry *e;
+	size_t bytes = 0;
+	int x;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&config_cache_lock);
+	cw_cli(fd, "%-48s %10s %10s %10s\n", "File", "Categories", "Variables", "Bytes");
+	for (x = 0;  x < CONFIG_CACHE_BUCKETS;  x++) {
+		for (e = config_cache[x];  e;  e = e->next) {
+			cw_cli(fd, "%-48s %10d %10d %10lu\n", e->path, e->image->ncats, e->image->nvars, (unsigned long) e->image->size);
+			bytes += e->image->size;
+		}
+	}
+	cw_cli(fd, "%d files in %lu bytes%s\n", config_cache_count, (unsigned long) bytes, option_config_cache ? "" : " (cache disabled)");
+	cw_cli(fd, "Loads: %lu from the cache, %lu parsed, %lu parsed again after a change\n",
+		config_cache_hits, config_cache_misses, config_cache_changed);
+	cw_mutex_unlock(&config_cache_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static char show_config_cache_help[] =
+	"Usage: show config cache\n"
+	"	Shows the config files kept parsed, and how often they were used.\n";
+
+static struct cw_cli_entry config_cache_command_struct = {
+	{ "show", "config", "cache", NULL }, config_cache_command, "Show parsed config cache", show_config_cache_help, NULL
+};
+
+static char show_realtime_cache_help[] =
+	"Usage: show realtime cache\n"
+	"	Shows the realtime lookup cache settings and statistics.\n";
+
+static struct cw_cli_entry realtime_cache_command_struct = {
+	{ "show", "realtime", "cache", NULL }, realtime_cache_command, "Show realtime lookup cache statistics", show_realtime_cache_help, NULL
+};
+
 int register_config_cli() 
 {
+	cw_cli_register(&realtime_cache_command_struct);
+	cw_cli_register(&config_cache_command_struct);
 	return cw_cli_register(&config_command_struct);
 }
@@ -72,8 +72,57 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #define SQL_MAX_RETRIES 5
 #define SQL_RETRY_USEC  500000
 
+#define DB_BATCH_MAX    100	/* writes per transaction before we commit */
+#define DB_BATCH_MS     100	/* longest a write waits for its commit */
+
 CW_MUTEX_DEFINE_STATIC(dblock);
 
+/* Statements prepared once on the shared connection */
+enum {
+	DB_STMT_GET,
+	DB_STMT_PUT,
+	DB_STMT_DEL,
+	DB_STMT_TREE,
+	DB_STMT_FAMILY,
+	DB_STMT_BEGIN,
+	DB_STMT_COMMIT,
+	DB_STMT_MAX
+};
+
+static const char *db_stmt_fmt[DB_STMT_MAX] = {
+	"select value from %q where family=? and keys=?",
+	"insert into %q values(?,?,?)",
+	"delete from %q where family=? and keys=?",
+	"select keys,value from %q where family=? and keys like ?",
+	"select keys,value from %q where family=?",
+	"BEGIN",
+	"COMMIT",
+};
+
+static char *db_stmt_sql[DB_STMT_MAX];
+static sqlite3_stmt *db_stmts[DB_STMT_MAX];
+static sqlite3 *db_handle = NULL;
+
+static int db_batching = 0;
+static int db_batch_writes = 0;
+static struct timeval db_batch_start;
+static int db_commit_stop = 0;
+static pthread_t db_commit_thread = CW_PTHREADT_NULL;
+static cw_cond_t db_commit_cond;
+
+/* The writes in the open transaction, replayed one by one if it fails to
+   commit.  which is the statement a write ran: DB_STMT_PUT or DB_STMT_DEL
+   with family, key and value in a, b and c, or -1 for a tree delete whose
+   SQL is in a */
+struct db_journal {
+	struct db_journal *next;
+	int which;
+	char *a, *b, *c;
+	char data[0];
+};
+static struct db_journal *db_journal_head = NULL;
+static struct db_journal **db_journal_tail = &db_journal_head;
+
 static char *create_odb_sql = 
 "create table odb (\n"
 "	 family varchar(255),\n"
@@ -139,15 +188,14 @@ static struct {
 static int dbinit(void);
 static void sqlite_pick_path(char *dbname, char *buf, size_t size);
 static sqlite3 *sqlite_open_db(char *filename);
-static void sqlite_check_table_exists(char *dbfile, char *test_sql, char *create_sql);
-static int get_callback(void *pArg, int argc, char **argv, char **columnNames);
-static int tree_callback(void *pArg, int argc, char **argv, char **columnNames);
+static void sqlite_check_table_exists(sqlite3 *db, char *test_sql, char *create_sql);
 static int show_callback(void *pArg, int argc, char **argv, char **columnNames);
 static int database_show(int fd, int argc, char *argv[]);
 static int database_put(int fd, int argc, char *argv[]);
 static int database_get(int fd, int argc, char *argv[]);
 static int database_del(int fd, int argc, char *argv[]);
 static int database_deltree(int fd, int argc, char *argv[]);
+static int database_benchmark(int fd, int argc, char *argv[]);
 
 /*****************************************************************************
 
@@ -163,6 +211,229 @@ static int sanity_check(void)
 }
 
 
+/*****************************************************************************
+                    SHARED CONNECTION AND STATEMENT CACHE
+ *****************************************************************************/
+
+/* Open a connection once and keep it, along with the prepared statements for
+   the common lookups. Everything that touches db_handle does so with dblock
+   held. Writes are grouped into transactions of up to DB_BATCH_MAX writes,
+   and the commit thread commits a transaction that has been open for
+   DB_BATCH_MS. Reads on the same connection see uncommitted writes, so
+   callers notice no difference. */
+
+static int db_prepare_statements(void)
+{
+	int x;
+	int res = 0;
+
+	for (x = 0; x < DB_STMT_MAX; x++) {
+		if (db_stmts[x]) {
+			sqlite3_finalize(db_stmts[x]);
+			db_stmts[x] = NULL;
+		}
+		if (!db_handle)
+			continue;
+#if SQLITE_VERSION_NUMBER >= 3003009
+		if (sqlite3_prepare_v2(db_handle, db_stmt_sql[x], -1, &db_stmts[x], NULL) != SQLITE_OK) {
+#else
+		if (sqlite3_prepare(db_handle, db_stmt_sql[x], -1, &db_stmts[x], NULL) != SQLITE_OK) {
+#endif
+			cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s]\n", db_stmt_sql[x], sqlite3_errmsg(db_handle));
+			db_stmts[x] = NULL;
+			res = -1;
+		}
+	}
+	return res;
+}
+
+/* Run one of the cached statements with up to three text parameters, calling
+   row_cb for every row returned. Returns SQLITE_DONE on success. Must be
+   called with dblock held. */
+static int db_stmt_run(int which, const char *a, const char *b, const char *c,
+		       void (*row_cb)(sqlite3_stmt *stmt, void *arg), void *arg)
+{
+	sqlite3_stmt *stmt;
+	int res = SQLITE_ERROR;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (!(stmt = db_stmts[which]))
+			return SQLITE_ERROR;
+		if (a)
+			sqlite3_bind_text(stmt, 1, a, -1, SQLITE_STATIC);
+		if (b)
+			sqlite3_bind_text(stmt, 2, b, -1, SQLITE_STATIC);
+		if (c)
+			sqlite3_bind_text(stmt, 3, c, -1, SQLITE_STATIC);
+		while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+			if (row_cb)
+				row_cb(stmt, arg);
+		}
+		/* With the legacy interface a schema change only shows up here */
+		if (sqlite3_reset(stmt) == SQLITE_SCHEMA && res != SQLITE_DONE) {
+			db_prepare_statements();
+			continue;
+		}
+		break;
+	}
+	if (res != SQLITE_DONE)
+		cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s]\n", db_stmt_sql[which], sqlite3_errmsg(db_handle));
+	return res;
+}
+
+static int db_commit(void);
+
+static char *db_journal_copy(char **dst, const char *src, char *p)
+{
+	if (!src) {
+		*dst = NULL;
+		return p;
+	}
+	*dst = p;
+	strcpy(p, src);
+	return p + strlen(src) + 1;
+}
+
+/* Note a write made in the open transaction. Must be called with dblock held. */
+static void db_journal_add(int which, const char *a, const char *b, const char *c)
+{
+	struct db_journal *j;
+	char *p;
+
+	if (!db_batch_writes)
+		return;
+	if (!(j = malloc(sizeof(*j) + (a ? strlen(a) + 1 : 0) + (b ? strlen(b) + 1 : 0) + (c ? strlen(c) + 1 : 0)))) {
+		/* Without its journal the batch can't be replayed, so commit it now */
+		db_commit();
+		return;
+	}
+	j->next = NULL;
+	j->which = which;
+	p = db_journal_copy(&j->a, a, j->data);
+	p = db_journal_copy(&j->b, b, p);
+	db_journal_copy(&j->c, c, p);
+	*db_journal_tail = j;
+	db_journal_tail = &j->next;
+}
+
+/* Commit the open write transaction, if there is one. If it fails, the
+   writes in it are rolled back and made again one at a time, so a write
+   reported done is only lost if it fails again on its own. Must be
+   called with dblock held. */
+static int db_commit(void)
+{
+	struct db_journal *j;
+	int res;
+	int lost = 0;
+
+	if (!db_batch_writes)
+		return 0;
+	res = db_stmt_run(DB_STMT_COMMIT, NULL, NULL, NULL, NULL, NULL);
+	db_batch_writes = 0;
+	if (res != SQLITE_DONE) {
+		cw_log(LOG_WARNING, "Failed to commit a batch of database writes, writing them one at a time\n");
+		sqlite3_exec(db_handle, "ROLLBACK", NULL, NULL, NULL);
+		for (j = db_journal_head;  j;  j = j->next) {
+			if (j->which == DB_STMT_PUT) {
+				db_stmt_run(DB_STMT_DEL, j->a, j->b, NULL, NULL, NULL);
+				res = db_stmt_run(DB_STMT_PUT, j->a, j->b, j->c, NULL, NULL);
+			} else if (j->which == DB_STMT_DEL) {
+				res = db_stmt_run(DB_STMT_DEL, j->a, j->b, NULL, NULL, NULL);
+			} else {
+				res = (sqlite3_exec(db_handle, j->a, NULL, NULL, NULL) == SQLITE_OK) ? SQLITE_DONE : SQLITE_ERROR;
+			}
+			if (res != SQLITE_DONE) {
+				cw_log(LOG_ERROR, "Lost database write to family '%s' key '%s'\n",
+					j->which == -1 ? "(tree)" : j->a, j->which == -1 ? j->a : j->b);
+				lost++;
+			}
+		}
+	}
+	while ((j = db_journal_head)) {
+		db_journal_head = j->next;
+		free(j);
+	}
+	db_journal_tail = &db_journal_head;
+	return lost ? -1 : 0;
+}
+
+/* Make sure a write transaction is open. Must be called with dblock held. */
+static void db_write_begin(void)
+{
+	if (!db_batching || db_batch_writes)
+		return;
+	if (db_stmt_run(DB_STMT_BEGIN, NULL, NULL, NULL, NULL, NULL) != SQLITE_DONE)
+		return;
+	/* Count the transaction as open even before the first write lands */
+	db_batch_writes = 1;
+	db_batch_start = cw_tvnow();
+	cw_cond_signal(&db_commit_cond);
+}
+
+/* Account for a write in the open transaction. Must be called with dblock held. */
+static void db_write_end(void)
+{
+	if (db_batch_writes && ++db_batch_writes > DB_BATCH_MAX)
+		db_commit();
+}
+
+static void *db_commit_thread_main(void *data)
+{
+	struct timeval tv;
+	struct timespec ts;
+	int ms;
+
+	cw_mutex_lock(&dblock);
+	while (!db_commit_stop) {
+		if (!db_batch_writes) {
+			cw_cond_wait(&db_commit_cond, &dblock);
+			continue;
+		}
+		ms = DB_BATCH_MS - cw_tvdiff_ms(cw_tvnow(), db_batch_start);
+		if (ms <= 0) {
+			db_commit();
+			continue;
+		}
+		tv = cw_tvadd(cw_tvnow(), cw_samp2tv(ms, 1000));
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		cw_cond_timedwait(&db_commit_cond, &dblock, &ts);
+	}
+	db_commit();
+	cw_mutex_unlock(&dblock);
+	return NULL;
+}
+
+static void db_get_row(sqlite3_stmt *stmt, void *arg)
+{
+	struct cw_db_data *result = arg;
+
+	cw_copy_string(result->data, (const char *) sqlite3_column_text(stmt, 0), result->datalen);
+	result->rownum++;
+}
+
+static void db_tree_row(sqlite3_stmt *stmt, void *arg)
+{
+	struct cw_db_entry **treeptr = arg;
+	struct cw_db_entry *cur;
+	const char *keys, *values;
+
+	keys = (const char *) sqlite3_column_text(stmt, 0);
+	values = (const char *) sqlite3_column_text(stmt, 1);
+	if (!keys || !values)
+		return;
+
+	cur = malloc(sizeof(struct cw_db_entry) + strlen(keys) + strlen(values) + 2);
+	if (cur) {
+		cur->key = cur->data + strlen(values) + 1;
+		strcpy(cur->data, values);
+		strcpy(cur->key, keys);
+		cur->next = *treeptr;
+		*treeptr = cur;
+	}
+}
+
 /*****************************************************************************
 
  *****************************************************************************/
@@ -256,16 +527,18 @@ static int database_flush_cache(void) {
 
     char *zErr = 0;
     int res = 0;
-    sqlite3 *db;
-    int retry=0;
 
     sanity_check();
 
-    if (!(db = sqlite_open_db(globals.dbfile))) {
+    cw_mutex_lock(&dblock);
+    if (!db_handle) {
+	cw_mutex_unlock(&dblock);
 	return -1;
     }
 
-    sqlite3_exec(db,"BEGIN",NULL,NULL,0);
+    /* Our queue goes in a transaction of its own so it can be rolled back */
+    db_commit();
+    sqlite3_exec(db_handle,"BEGIN",NULL,NULL,0);
 
     cw_mutex_lock(&db_list_lock);
     item = tmplist = db_list_head;
@@ -275,9 +548,8 @@ static int database_flush_cache(void) {
 
     while ( item && !err ) {
 
-retry_0:
 	cw_log(LOG_DEBUG, "SQL [%s]\n", item->sql);
-	res = sqlite3_exec(db,
+	res = sqlite3_exec(db_handle,
 			   item->sql,
 			   NULL,
 			   NULL,
@@ -285,17 +557,8 @@ retry_0:
 			   );
 
 	if (zErr) {
-            if (retry >= SQL_MAX_RETRIES) {
-		cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s] Retries: %d Max: %d\n", 
-                         item->sql, zErr, retry, SQL_MAX_RETRIES);
-	    	sqlite3_free(zErr);
-	    } else {
-		cw_log(LOG_DEBUG, "SQL ERR Query: %s Error: [%s] Retries %d\n", 
-                         item->sql, zErr, ++retry);
-		sqlite3_free(zErr);
-		usleep(SQL_RETRY_USEC);
-		goto retry_0;
-	    }
+	    cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s]\n", item->sql, zErr);
+	    sqlite3_free(zErr);
 	    err++;
 	}
 
@@ -315,7 +578,7 @@ retry_0:
         db_list_head = tmplist;
         cw_mutex_unlock(&db_list_lock);
 
-        sqlite3_exec(db,"ROLLBACK",NULL,NULL,0);
+        sqlite3_exec(db_handle,"ROLLBACK",NULL,NULL,0);
         cw_log(LOG_DEBUG,"Rollback\n");
         res = -1;
     }
@@ -329,12 +592,12 @@ retry_0:
             free ( tmpitem->sql );
             free ( tmpitem );
         }
-        sqlite3_exec(db,"COMMIT",NULL,NULL,0);
+        sqlite3_exec(db_handle,"COMMIT",NULL,NULL,0);
         cw_log(LOG_DEBUG,"Commit\n");
         res = 0;
     }
 
-    sqlite3_close(db);
+    cw_mutex_unlock(&dblock);
 
     return res;
 }
@@ -486,26 +749,23 @@ static void database_cache_retry_connect(void) {
 
 int cw_db_put(const char *family, const char *keys, char *value)
 {
-	char *sql = NULL;
-	char *zErr = 0;
 	int res = 0;
-	sqlite3 *db;
-	int retry=0;
 
 	if (!family || cw_strlen_zero(family)) {
 		family = "_undef_";
 	}
 
-	if ( !(sql = sqlite3_mprintf("insert into %q values('%q','%q','%q')", globals.tablename, family, keys, value)) ) {
-		cw_log(LOG_ERROR, "Memory Error!\n");
-		res = -1;	/* Return an error */
-	}
-
-	cw_db_del(family, keys);
-
 #ifdef HAVE_MEMCACHE
         if ( memcached_data.active )  
         {
+            char *sql;
+
+            cw_db_del(family, keys);
+            if ( !(sql = sqlite3_mprintf("insert into %q values('%q','%q','%q')", globals.tablename, family, keys, value)) ) {
+                cw_log(LOG_ERROR, "Memory Error!\n");
+                return -1;
+            }
+
             if ( memcached_data.has_error ) 
                 database_cache_retry_connect();
 
@@ -527,70 +787,31 @@ int cw_db_put(const char *family, const char *keys, char *value)
                 //DIDN'T WORK
                 // So store as we did before...
             }
+            sqlite3_free(sql);
         }
 #endif
 
 	sanity_check();
 
-	if (!(db = sqlite_open_db(globals.dbfile))) {
+	cw_mutex_lock(&dblock);
+	if (!db_handle) {
+		cw_mutex_unlock(&dblock);
 		return -1;
 	}
-
-
-retry_0:
-	if ( sql ) {
-		cw_log(LOG_DEBUG, "SQL [%s]\n", sql);
-
-		res = sqlite3_exec(db,
-				   sql,
-				   NULL,
-				   NULL,
-				   &zErr
-				   );
-
-		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s] Retries: %d Max: %d\n", sql, zErr, retry, SQL_MAX_RETRIES);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(LOG_DEBUG, "SQL ERR Query: %s Error: [%s] Retries %d\n", sql, zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_0;
-			}
-			res = -1;
-		} else {
-			res = 0;
-		}
-	}
-
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
-	}
-	sqlite3_close(db);
+	db_write_begin();
+	db_journal_add(DB_STMT_PUT, family, keys, value);
+	db_stmt_run(DB_STMT_DEL, family, keys, NULL, NULL, NULL);
+	res = (db_stmt_run(DB_STMT_PUT, family, keys, value, NULL, NULL) == SQLITE_DONE) ? 0 : -1;
+	db_write_end();
+	cw_mutex_unlock(&dblock);
 
 	return res;
 }
 
-static int get_callback(void *pArg, int argc, char **argv, char **columnNames) 
-{
-	struct cw_db_data *result = pArg;
-
-	cw_copy_string(result->data, argv[0], result->datalen);
-	result->rownum++;
-	return 0;
-}
-
 int cw_db_get(const char *family, const char *keys, char *value, int valuelen)
 {
-
-	char *sql;
-	char *zErr = 0;
 	int res = 0;
 	struct cw_db_data result;
-	sqlite3 *db;
-	int retry=0;
 
 	if (!family || cw_strlen_zero(family)) {
 		family = "_undef_";
@@ -631,53 +852,20 @@ int cw_db_get(const char *family, const char *keys, char *value, int valuelen)
 
 	sanity_check();
 
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return -1;
-	}
-
 	result.data = value;
 	result.datalen = valuelen;
 	result.rownum = 0;
 
-retry_1:
-	if ((sql = sqlite3_mprintf("select value from %q where family='%q' and keys='%q'", globals.tablename, family, keys))) {
-		cw_log(LOG_DEBUG, "SQL [%s]\n", sql);
-		res = sqlite3_exec(db,
-						   sql,
-						   get_callback,
-						   &result,
-						   &zErr
-						   );
-		
-		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s] Retries: %d Max: %d\n", sql, zErr, retry, SQL_MAX_RETRIES);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(LOG_DEBUG, "SQL ERR Query: %s Error: [%s] Retries %d\n", sql, zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_1;
-			}
-			res = -1;
-		} else {
-			if (result.rownum)
-				res = 0;
-			else
-				res = -1;
-		}
-	} else {
-		cw_log(LOG_ERROR, "Memory Error!\n");
-		res = -1;   /* Return an error */
-	}
-
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
+	cw_mutex_lock(&dblock);
+	if (!db_handle) {
+		cw_mutex_unlock(&dblock);
+		return -1;
 	}
-
-        
-	sqlite3_close(db);
+	if (db_stmt_run(DB_STMT_GET, family, keys, NULL, db_get_row, &result) == SQLITE_DONE && result.rownum)
+		res = 0;
+	else
+		res = -1;
+	cw_mutex_unlock(&dblock);
 
 #if defined(HAVE_MEMCACHE)
         // We got a value out of the cache.
@@ -698,10 +886,8 @@ static int cw_db_del_main(const char *family, const char *keys, int like, const
 	char *sql;
 	char *zErr = 0;
 	int res = 0;
-	sqlite3 *db;
 	char *op = "=";
 	char *pct = "";
-	int retry=0;
 
 	if (!family || cw_strlen_zero(family)) {
 		family = "_undef_";
@@ -759,48 +945,34 @@ static int cw_db_del_main(const char *family, const char *keys, int like, const
 #endif
 
 	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
+
+	cw_mutex_lock(&dblock);
+	if (!db_handle) {
+		cw_mutex_unlock(&dblock);
+		sqlite3_free(sql);
 		return -1;
 	}
 
-	if (sql) {
-retry_2:
-		if (retry > 0)
-			cw_log(LOG_DEBUG, "SQL Query: [%s] (retry %d)\n", sql, retry);
-		else
-			cw_log(LOG_DEBUG, "SQL [%s]\n", sql);
-		res = sqlite3_exec(db,
-						   sql,
-						   NULL,
-						   NULL,
-						   &zErr
-						   );
-
+	db_write_begin();
+	if (keys && !like && !value) {
+		db_journal_add(DB_STMT_DEL, family, keys, NULL);
+		res = (db_stmt_run(DB_STMT_DEL, family, keys, NULL, NULL, NULL) == SQLITE_DONE) ? 0 : -1;
+	} else {
+		db_journal_add(-1, sql, NULL, NULL);
+		cw_log(LOG_DEBUG, "SQL [%s]\n", sql);
+		sqlite3_exec(db_handle, sql, NULL, NULL, &zErr);
 		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s] Retries: %d Max: %d\n", sql, zErr, retry, SQL_MAX_RETRIES);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(LOG_DEBUG, "SQL ERR Query: %s Error: [%s] Retries %d\n", sql, zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_2;
-			}
+			cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s]\n", sql, zErr);
+			sqlite3_free(zErr);
 			res = -1;
-		} else {
-			if (!sqlite3_changes(db))
-				res = -1;
-			else
-				res = 0;
 		}
 	}
+	if (!res && !sqlite3_changes(db_handle))
+		res = -1;
+	db_write_end();
+	cw_mutex_unlock(&dblock);
 
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
-	}
-
-	sqlite3_close(db);
+	sqlite3_free(sql);
 	return res;
 }
 
@@ -823,106 +995,40 @@ int cw_db_deltree_with_value(const char *family, const char *keytree, const char
 
 
 
-static int tree_callback(void *pArg, int argc, char **argv, char **columnNames) 
-{
-	int x = 0;
-	char *keys, *values;
-	struct cw_db_entry **treeptr = pArg,
-		*cur = NULL,
-		*ret = NULL;
-
-	for(x=0; x < argc; x++) {
-		keys = argv[0];
-		values = argv[1];
-
-		cur = malloc(sizeof(struct cw_db_entry) + strlen(keys) + strlen(values) + 2);
-		if (cur) {
-			cur->next = NULL;
-			cur->key = cur->data + strlen(values) + 1;
-			strcpy(cur->data, values);
-			strcpy(cur->key, keys);
-			if (*treeptr) {
-				cur->next = *treeptr;
-			}
-			ret = cur;
-		}
-	}
-
-	*treeptr = ret;
-	return 0;
-}
-
 struct cw_db_entry *cw_db_gettree(const char *family, const char *keytree)
 {
-	char *sql;
-	char *zErr = 0;
-	int res = 0;
+	char *pattern = NULL;
 	struct cw_db_entry *tree = NULL;
-	sqlite3 *db;
-	int retry=0;
 
 #ifdef HAVE_MEMCACHE
         database_flush_cache();
 #endif
 
 	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return NULL;
-	}
 
 	if (!family || cw_strlen_zero(family)) {
 		family = "_undef_";
 	}
 
-	if (family && keytree && !cw_strlen_zero(keytree)) {
-		sql = sqlite3_mprintf("select keys,value from %q where family='%q' and keys like '%q%%'", globals.tablename, family, keytree);
-	} else if(family) {
-		sql = sqlite3_mprintf("select keys,value from %q where family='%q'", globals.tablename, family);
-	} else {
-		cw_log(LOG_ERROR, "No parameters supplied.\n");
-		return NULL;
-	}
-
-	if (sql) {
-retry_3:
-		if (retry)
-			cw_log(LOG_DEBUG, "SQL [%s] (retry %d)\n", sql, retry);
-		else
-			cw_log(LOG_DEBUG, "SQL [%s]\n", sql);
-		res = sqlite3_exec(db,
-						   sql,
-						   tree_callback,
-						   &tree,
-						   &zErr
-						   );
-		
-		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(LOG_ERROR, "SQL ERR Query: [%s] Error: [%s] Retries: %d Max: %d\n", sql, zErr, retry, SQL_MAX_RETRIES);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(LOG_DEBUG, "SQL ERR Query: %s Error: [%s] Retries %d\n", sql, zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_3;
-			}
-			res = -1;
-		} else {
-			res = 0;
+	if (keytree && !cw_strlen_zero(keytree)) {
+		if (!(pattern = sqlite3_mprintf("%s%%", keytree))) {
+			cw_log(LOG_ERROR, "Memory Error!\n");
+			return NULL;
 		}
-	} else {
-		cw_log(LOG_ERROR, "Memory Error!\n");
-		res = -1;   /* Return an error */
 	}
 
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
+	cw_mutex_lock(&dblock);
+	if (db_handle) {
+		if (pattern)
+			db_stmt_run(DB_STMT_TREE, family, pattern, NULL, db_tree_row, &tree);
+		else
+			db_stmt_run(DB_STMT_FAMILY, family, NULL, NULL, db_tree_row, &tree);
 	}
+	cw_mutex_unlock(&dblock);
 
-	sqlite3_close(db);
+	if (pattern)
+		sqlite3_free(pattern);
 	return tree;
-
 }
 
 void cw_db_freetree(struct cw_db_entry *dbe)
@@ -958,16 +1064,12 @@ static int database_show(int fd, int argc, char *argv[])
 	char *sql;
 	char *zErr = 0;
 	int res = 0;
-	sqlite3 *db;
 
 #ifdef HAVE_MEMCACHE
         database_flush_cache();
 #endif
 
 	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return -1;
-	}
 
 	if (argc == 4) {
 		/* Family and key tree */
@@ -992,9 +1094,12 @@ static int database_show(int fd, int argc, char *argv[])
 		sql = sqlite3_mprintf("select * from %q", globals.tablename);
 	}
 
-	if (sql) {
+	cw_mutex_lock(&dblock);
+	if (sql && db_handle) {
+		/* Show what is on disk, not just what this connection can see */
+		db_commit();
 		cw_log(LOG_DEBUG, "SQL [%s]\n", sql);
-		res = sqlite3_exec(db,
+		res = sqlite3_exec(db_handle,
 						   sql,
 						   show_callback,
 						   &fd,
@@ -1008,17 +1113,17 @@ static int database_show(int fd, int argc, char *argv[])
 		} else {
 			res = 0;
 		}
-	} else {
+	} else if (!sql) {
 		cw_log(LOG_ERROR, "Memory Error!\n");
 		res = -1;   /* Return an error */
 	}
+	cw_mutex_unlock(&dblock);
 
 	if (sql) {
 		sqlite3_free(sql);
 		sql = NULL;
 	}
 
-	sqlite3_close(db);
 	return RESULT_SUCCESS;	
 }
 
@@ -1086,6 +1191,43 @@ static int database_deltree(int fd, int argc, char *argv[])
 }
 
 
+static int database_benchmark(int fd, int argc, char *argv[])
+{
+	char key[32], value[32], tmp[32];
+	struct timeval start;
+	int count = 1000;
+	int x, ms;
+
+	if (argc > 3)
+		return RESULT_SHOWUSAGE;
+	if (argc == 3 && (count = atoi(argv[2])) <= 0)
+		return RESULT_SHOWUSAGE;
+
+	start = cw_tvnow();
+	for (x = 0; x < count; x++) {
+		snprintf(key, sizeof(key), "%d", x);
+		snprintf(value, sizeof(value), "value%d", x);
+		cw_db_put("_benchmark_", key, value);
+	}
+	cw_mutex_lock(&dblock);
+	db_commit();
+	cw_mutex_unlock(&dblock);
+	ms = cw_tvdiff_ms(cw_tvnow(), start);
+	cw_cli(fd, "put: %d ops in %d ms (%d ops/sec)\n", count, ms, ms ? (int) (count * 1000LL / ms) : count * 1000);
+
+	start = cw_tvnow();
+	for (x = 0; x < count; x++) {
+		snprintf(key, sizeof(key), "%d", x);
+		cw_db_get("_benchmark_", key, tmp, sizeof(tmp));
+	}
+	ms = cw_tvdiff_ms(cw_tvnow(), start);
+	cw_cli(fd, "get: %d ops in %d ms (%d ops/sec)\n", count, ms, ms ? (int) (count * 1000LL / ms) : count * 1000);
+
+	cw_db_deltree("_benchmark_", NULL);
+	return RESULT_SUCCESS;
+}
+
+
 static char database_show_usage[] =
 "Usage: database show [family [keytree]]\n"
 "       Shows CallWeaver database contents, optionally restricted\n"
@@ -1111,6 +1253,11 @@ static char database_deltree_usage[] =
 "       Deletes a family or specific keytree within a family\n"
 "in the CallWeaver database.\n";
 
+static char database_benchmark_usage[] =
+"Usage: database benchmark [count]\n"
+"       Times count (default 1000) puts and gets against the CallWeaver\n"
+"database, using a scratch family that is removed afterwards.\n";
+
 struct cw_cli_entry cli_database_show =
 { { "database", "show", NULL }, database_show, "Shows database contents", database_show_usage };
 
@@ -1126,6 +1273,9 @@ struct cw_cli_entry cli_database_del =
 struct cw_cli_entry cli_database_deltree =
 { { "database", "deltree", NULL }, database_deltree, "Removes database keytree/values", database_deltree_usage };
 
+struct cw_cli_entry cli_database_benchmark =
+{ { "database", "benchmark", NULL }, database_benchmark, "Measures database get/put speed", database_benchmark_usage };
+
 
 /*****************************************************************************
                     DATABASE INITIALIZATION
@@ -1134,6 +1284,7 @@ struct cw_cli_entry cli_database_deltree =
 static int dbinit(void)
 {
 	char *sql;
+	int x;
 
 #ifdef HAVE_MEMCACHE
         // TODO Parse a config file to retrieve the server/port pairs
@@ -1160,14 +1311,37 @@ static int dbinit(void)
 	globals.dbfile = cw_config_CW_DB;
 	globals.tablename = "odb";
 	
+	if (!db_handle && (db_handle = sqlite_open_db(globals.dbfile))) {
+		/* Let sqlite wait out other processes instead of failing with SQLITE_BUSY */
+		sqlite3_busy_timeout(db_handle, SQL_MAX_RETRIES * SQL_RETRY_USEC / 1000);
+#if SQLITE_VERSION_NUMBER >= 3007000
+		sqlite3_exec(db_handle, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+		sqlite3_exec(db_handle, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+#endif
+	}
 	
-	if ((sql = sqlite3_mprintf("select count(*) from %q limit 1", globals.tablename))) {
-		sqlite_check_table_exists(globals.dbfile, sql, create_odb_sql);
+	if (db_handle && (sql = sqlite3_mprintf("select count(*) from %q limit 1", globals.tablename))) {
+		sqlite_check_table_exists(db_handle, sql, create_odb_sql);
 		sqlite3_free(sql);
 		sql = NULL;
+		for (x = 0; x < DB_STMT_MAX; x++) {
+			if (!db_stmt_sql[x])
+				db_stmt_sql[x] = sqlite3_mprintf(db_stmt_fmt[x], globals.tablename);
+		}
+		db_prepare_statements();
 		loaded = 1;
 	}
 
+	if (loaded && db_commit_thread == CW_PTHREADT_NULL) {
+		cw_cond_init(&db_commit_cond, NULL);
+		if (cw_pthread_create(&db_commit_thread, NULL, db_commit_thread_main, NULL) < 0) {
+			cw_log(LOG_WARNING, "Unable to start database commit thread, writes will not be batched\n");
+			db_commit_thread = CW_PTHREADT_NULL;
+		} else {
+			db_batching = 1;
+		}
+	}
+
 	cw_mutex_unlock(&dblock);
 
 	return loaded ? 0 : -1;
@@ -1200,40 +1374,36 @@ static sqlite3 *sqlite_open_db(char *filename)
 }
 
 
-static void sqlite_check_table_exists(char *dbfile, char *test_sql, char *create_sql) 
+static void sqlite_check_table_exists(sqlite3 *db, char *test_sql, char *create_sql) 
 {
-	sqlite3 *db;
 	char *errmsg;
 
 
-	if ((db = sqlite_open_db(dbfile))) {
-		if (test_sql) {
+	if (db && test_sql) {
+		sqlite3_exec(
+					 db,
+					 test_sql,
+					 NULL,
+					 NULL,
+					 &errmsg
+					 );
+
+		if (errmsg) {
+			cw_log(LOG_WARNING,"SQL ERR [%s]\n[%s]\nAuto Repairing!\n",errmsg,test_sql);
+			sqlite3_free(errmsg);
+			errmsg = NULL;
 			sqlite3_exec(
 						 db,
-						 test_sql,
+						 create_sql,
 						 NULL,
 						 NULL,
 						 &errmsg
 						 );
-
 			if (errmsg) {
-				cw_log(LOG_WARNING,"SQL ERR [%s]\n[%s]\nAuto Repairing!\n",errmsg,test_sql);
+				cw_log(LOG_WARNING,"SQL ERR [%s]\n[%s]\n",errmsg,create_sql);
 				sqlite3_free(errmsg);
 				errmsg = NULL;
-				sqlite3_exec(
-							 db,
-							 create_sql,
-							 NULL,
-							 NULL,
-							 &errmsg
-							 );
-				if (errmsg) {
-					cw_log(LOG_WARNING,"SQL ERR [%s]\n[%s]\n",errmsg,create_sql);
-					sqlite3_free(errmsg);
-					errmsg = NULL;
-				}
 			}
-			sqlite3_close(db);
 		}
 	}
 
@@ -1298,12 +1468,27 @@ int cwdb_init(void)
 		cw_cli_register(&cli_database_put);
 		cw_cli_register(&cli_database_del);
 		cw_cli_register(&cli_database_deltree);
+		cw_cli_register(&cli_database_benchmark);
 	}
 	return res;
 }
 
 int cwdb_shutdown(void) {
 
+    /* Anything still writing after this goes straight to disk */
+    if ( db_commit_thread != CW_PTHREADT_NULL ) {
+        cw_mutex_lock(&dblock);
+        db_commit_stop = 1;
+        cw_cond_signal(&db_commit_cond);
+        cw_mutex_unlock(&dblock);
+        pthread_join(db_commit_thread, NULL);
+        db_commit_thread = CW_PTHREADT_NULL;
+    }
+    cw_mutex_lock(&dblock);
+    db_commit();
+    db_batching = 0;
+    cw_mutex_unlock(&dblock);
+
 #ifdef HAVE_MEMCACHE
     if ( memcached_data.mc ) {
         cw_log(LOG_DEBUG,"Database shutting down.\n");
@@ -34,7 +34,15 @@
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
+#include <netdb.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
 
 #include "callweaver.h"
 
@@ -43,6 +51,10 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/logger.h"
 #include "callweaver/channel.h"
 #include "callweaver/dns.h"
+#include "callweaver/lock.h"
+#include "callweaver/utils.h"
+#include "callweaver/options.h"
+#include "callweaver/cli.h"
 #define MAX_SIZE 4096
 
 typedef struct {
@@ -176,6 +188,44 @@ static int dns_parse_answer(void *context,
 }
 
 
+/*--- dns_answer_ttl: Lowest TTL of the records in an answer */
+static int dns_answer_ttl(unsigned char *answer, int len)
+{
+	struct dn_answer *ans;
+	dns_HEADER *h;
+	int ttl = -1;
+	int res;
+	int x;
+
+	if (len < sizeof(dns_HEADER))
+		return -1;
+	h = (dns_HEADER *)answer;
+	answer += sizeof(dns_HEADER);
+	len -= sizeof(dns_HEADER);
+
+	for (x = 0; x < ntohs(h->qdcount); x++) {
+		if ((res = skip_name((char *)answer, len)) < 0)
+			return -1;
+		answer += res + 4;
+		len -= res + 4;
+	}
+	for (x = 0; x < ntohs(h->ancount); x++) {
+		if ((res = skip_name((char *)answer, len)) < 0)
+			return -1;
+		answer += res;
+		len -= res;
+		if (len < (int)sizeof(struct dn_answer))
+			return -1;
+		ans = (struct dn_answer *)answer;
+		if (ttl < 0 || ntohl(ans->ttl) < ttl)
+			ttl = ntohl(ans->ttl);
+		answer += sizeof(struct dn_answer) + ntohs(ans->size);
+		len -= sizeof(struct dn_answer) + ntohs(ans->size);
+	}
+	return ttl;
+}
+
+
 CW_MUTEX_DEFINE_STATIC(res_lock);
 
 #if (defined(res_ninit) && !defined(__UCLIBC__))
@@ -188,14 +238,13 @@ struct state {
 static struct state *states;
 #endif
 
-
-/*--- cw_search_dns: Lookup record in DNS */
-int cw_search_dns(void *context,
-	   const char *dname, int class, int type,
-	   int (*callback)(void *context, char *answer, int len, char *fullanswer))
+/*--- dns_res_search: Ask the resolver.  Returns the answer length, 0 if
+      there is no such name or no such record, -1 if there is no answer
+      from the servers */
+static int dns_res_search(const char *dname, int class, int type, unsigned char *answer, int len)
 {
-	char answer[MAX_SIZE];
 	int ret = -1;
+	int herrno;
 #ifdef HAS_RES_NINIT
 	struct state *s;
 
@@ -207,8 +256,10 @@ int cw_search_dns(void *context,
 	if (!s && !(s = calloc(1, sizeof(*s))))
 		return -1;
 
+	herrno = NO_RECOVERY;
 	if (!(ret = res_ninit(&s->rs))) {
-		ret = res_nsearch(&s->rs, dname, class, type, (unsigned char *)answer, sizeof(answer));
+		ret = res_nsearch(&s->rs, dname, class, type, answer, len);
+		herrno = s->rs.res_h_errno;
 		res_nclose(&s->rs);
 	}
 
@@ -216,25 +267,680 @@ int cw_search_dns(void *context,
 	s->next = states;
 	states = s;
 	cw_mutex_unlock(&res_lock);
-
-	if (ret > 0 && (ret = dns_parse_answer(context, class, type, answer, ret, callback)) < 0)
-		cw_log(LOG_WARNING, "DNS Parse error for %s\n", dname);
-	if (ret == 0)
-		cw_log(LOG_DEBUG, "No matches found in DNS for %s\n", dname);
 #else
 	cw_mutex_lock(&res_lock);
+	herrno = NO_RECOVERY;
 	if ((ret = res_init())) {
-		ret = res_search(dname, class, type, answer, sizeof(answer));
+		ret = res_search(dname, class, type, answer, len);
+		herrno = h_errno;
 #ifndef __APPLE__
 		res_close();
 #endif
 	}
 	cw_mutex_unlock(&res_lock);
+#endif
+	if (ret < 0 && (herrno == HOST_NOT_FOUND || herrno == NO_DATA))
+		return 0;
+	return ret;
+}
+
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined( __NetBSD__ ) || defined(__APPLE__) || defined(__CYGWIN__)
+
+/* duh? ERANGE value copied from web... */
+#define ERANGE 34
+#undef gethostbyname
+
+CW_MUTEX_DEFINE_STATIC(__mutex);
+
+/* Recursive replacement for gethostbyname for BSD-based systems.  This
+routine is derived from code originally written and placed in the public 
+domain by Enzo Michelangeli <em@em.no-ip.com> */
+
+static int gethostbyname_r (const char *name, struct hostent *ret, char *buf,
+				size_t buflen, struct hostent **result, 
+				int *h_errnop) 
+{
+	int hsave;
+	struct hostent *ph;
+	cw_mutex_lock(&__mutex); /* begin critical area */
+	hsave = h_errno;
+
+	ph = gethostbyname(name);
+	*h_errnop = h_errno; /* copy h_errno to *h_herrnop */
+	if (ph == NULL) {
+		*result = NULL;
+	} else {
+		char **p, **q;
+		char *pbuf;
+		int nbytes=0;
+		int naddr=0, naliases=0;
+		/* determine if we have enough space in buf */
+
+		/* count how many addresses */
+		for (p = ph->h_addr_list; *p != 0; p++) {
+			nbytes += ph->h_length; /* addresses */
+			nbytes += sizeof(*p); /* pointers */
+			naddr++;
+		}
+		nbytes += sizeof(*p); /* one more for the terminating NULL */
+
+		/* count how many aliases, and total length of strings */
+		for (p = ph->h_aliases; *p != 0; p++) {
+			nbytes += (strlen(*p)+1); /* aliases */
+			nbytes += sizeof(*p);  /* pointers */
+			naliases++;
+		}
+		nbytes += sizeof(*p); /* one more for the terminating NULL */
+
+		/* here nbytes is the number of bytes required in buffer */
+		/* as a terminator must be there, the minimum value is ph->h_length */
+		if(nbytes > buflen) {
+			*result = NULL;
+			cw_mutex_unlock(&__mutex); /* end critical area */
+			return ERANGE; /* not enough space in buf!! */
+		}
+
+		/* There is enough space. Now we need to do a deep copy! */
+		/* Allocation in buffer:
+			from [0] to [(naddr-1) * sizeof(*p)]:
+			pointers to addresses
+			at [naddr * sizeof(*p)]:
+			NULL
+			from [(naddr+1) * sizeof(*p)] to [(naddr+naliases) * sizeof(*p)] :
+			pointers to aliases
+			at [(naddr+naliases+1) * sizeof(*p)]:
+			NULL
+			then naddr addresses (fixed length), and naliases aliases (asciiz).
+		*/
+
+		*ret = *ph;   /* copy whole structure (not its address!) */
+
+		/* copy addresses */
+		q = (char **)buf; /* pointer to pointers area (type: char **) */
+		ret->h_addr_list = q; /* update pointer to address list */
+		pbuf = buf + ((naddr+naliases+2)*sizeof(*p)); /* skip that area */
+		for (p = ph->h_addr_list; *p != 0; p++) {
+			memcpy(pbuf, *p, ph->h_length); /* copy address bytes */
+			*q++ = pbuf; /* the pointer is the one inside buf... */
+			pbuf += ph->h_length; /* advance pbuf */
+		}
+		*q++ = NULL; /* address list terminator */
 
-	if (ret > 0 && (ret = dns_parse_answer(context, class, type, answer, ret, callback)) < 0)
+		/* copy aliases */
+		ret->h_aliases = q; /* update pointer to aliases list */
+		for (p = ph->h_aliases; *p != 0; p++) {
+			strcpy(pbuf, *p); /* copy alias strings */
+			*q++ = pbuf; /* the pointer is the one inside buf... */
+			pbuf += strlen(*p); /* advance pbuf */
+			*pbuf++ = 0; /* string terminator */
+		}
+		*q++ = NULL; /* terminator */
+
+		strcpy(pbuf, ph->h_name); /* copy alias strings */
+		ret->h_name = pbuf;
+		pbuf += strlen(ph->h_name); /* advance pbuf */
+		*pbuf++ = 0; /* string terminator */
+
+		*result = ret;  /* and let *result point to structure */
+
+	}
+	h_errno = hsave;  /* restore h_errno */
+	cw_mutex_unlock(&__mutex); /* end critical area */
+
+	return (*result == NULL); /* return 0 on success, non-zero on error */
+}
+
+
+#endif
+
+#define DNS_MAXADDRS	16
+
+/*--- dns_host_search: Look up the addresses of a host the way the C library
+      does, /etc/hosts and all.  Returns the number of addresses, 0 if the
+      host doesn't exist and -1 if it couldn't be found out */
+static int dns_host_search(const char *host, struct in_addr *addrs, int max)
+{
+	struct cw_hostent ahp;
+	struct hostent *result = NULL;
+	int herrno = 0;
+	int x;
+#ifdef SOLARIS
+	result = gethostbyname_r(host, &ahp.hp, ahp.buf, sizeof(ahp.buf), &herrno);
+#else
+	if (gethostbyname_r(host, &ahp.hp, ahp.buf, sizeof(ahp.buf), &result, &herrno))
+		result = NULL;
+#endif
+	if (!result || result->h_addrtype != AF_INET || !result->h_addr_list || !result->h_addr_list[0])
+		return (!result && herrno == TRY_AGAIN)  ?  -1  :  0;
+	for (x = 0;  x < max  &&  result->h_addr_list[x];  x++)
+		memcpy(&addrs[x], result->h_addr_list[x], sizeof(struct in_addr));
+	return x;
+}
+
+/* Where the answers come from, and the clock they are kept by */
+static int (*dns_backend)(const char *dname, int class, int type, unsigned char *answer, int len) = dns_res_search;
+static int (*host_backend)(const char *host, struct in_addr *addrs, int max) = dns_host_search;
+static time_t (*dns_clock)(time_t *t) = time;
+
+
+/*
+ * Answers are cached, good or bad, and shared by everyone asking for the
+ * same name, class and type.  DNS answers are kept for as long as their
+ * TTL says.  Hosts are looked up through the C library, which doesn't
+ * tell us the TTL, so they are kept for DNS_HOSTTTL.
+ *
+ * A caller finding an expired answer gets it anyway, for up to DNS_STALE
+ * seconds past its expiry, while one of the resolver threads fetches a new
+ * one, so a slow name server doesn't hold up calls.  Only a lookup with
+ * nothing usable in the cache waits for the servers, and then any others
+ * asking for the same thing wait for that one lookup to finish rather
+ * than all asking themselves.  When the servers don't answer the old
+ * answer is kept for a little longer.
+ */
+#define DNS_BUCKETS	1024
+#define DNS_CACHE_MAX	8192
+#define DNS_MAXTTL	86400		/* Whatever the TTL says */
+#define DNS_NEGTTL	60		/* No such name or record */
+#define DNS_FAILTTL	5		/* The servers didn't answer */
+#define DNS_HOSTTTL	60		/* Host lookups don't give a TTL */
+#define DNS_STALE	300
+
+/* Class of cached host lookups, nothing in DNS uses it */
+#define DNS_CLASS_HOST	0
+#define DNS_TYPE_HOST	1
+
+struct dns_entry {
+	struct dns_entry *next;
+	unsigned int hash;
+	int class;
+	int type;
+	time_t expires;
+	int resolving;			/* Being looked up with callers waiting for it */
+	int refreshing;			/* Being looked up while the old answer is used */
+	int len;			/* Length of the answer, -1 for none */
+	unsigned char *answer;
+	char name[0];
+};
+
+struct dns_job {
+	struct dns_job *next;
+	int class;
+	int type;
+	int refresh;			/* Just fetch a new answer for the cache */
+	void *context;
+	int (*callback)(void *context, char *answer, int len, char *fullanswer);
+	void (*done)(void *context, int res);
+	void (*host_done)(void *data, struct hostent *hp);
+	char name[0];
+};
+
+CW_MUTEX_DEFINE_STATIC(dnslock);
+static cw_cond_t dnscond;		/* A lookup finished */
+static cw_cond_t jobcond;		/* There is work for the resolver threads */
+static struct dns_entry *dns_cache[DNS_BUCKETS];
+static struct dns_job *jobs;
+static struct dns_job *jobs_tail;
+static int dns_entries;
+static int dns_threads;
+static int dns_queued;
+static unsigned long dns_hits;
+static unsigned long dns_stale;
+static unsigned long dns_misses;
+static unsigned long dns_waits;
+static unsigned long dns_failures;
+
+static unsigned int dns_hash(int class, int type, const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)tolower(*name++);
+		hash *= 16777619U;
+	}
+	hash ^= (class << 16) | type;
+	hash *= 16777619U;
+	return hash;
+}
+
+static struct dns_entry *dns_find(unsigned int hash, int class, int type, const char *name)
+{
+	struct dns_entry *e;
+
+	for (e = dns_cache[hash % DNS_BUCKETS];  e;  e = e->next) {
+		if (e->hash == hash && e->class == class && e->type == type && !strcasecmp(e->name, name))
+			break;
+	}
+	return e;
+}
+
+static void dns_unlink(struct dns_entry *e)
+{
+	struct dns_entry **p;
+
+	for (p = &dns_cache[e->hash % DNS_BUCKETS];  *p != e;  p = &(*p)->next)
+		;
+	*p = e->next;
+	free(e->answer);
+	free(e);
+	dns_entries--;
+}
+
+/* Make room for one more, call with dnslock held */
+static void dns_evict(time_t now)
+{
+	struct dns_entry *e, *next, *oldest = NULL;
+	int x;
+
+	if (dns_entries < DNS_CACHE_MAX)
+		return;
+	for (x = 0;  x < DNS_BUCKETS;  x++) {
+		for (e = dns_cache[x];  e;  e = next) {
+			next = e->next;
+			if (e->resolving || e->refreshing)
+				continue;
+			if (e->expires + DNS_STALE < now)
+				dns_unlink(e);
+			else if (!oldest || e->expires < oldest->expires)
+				oldest = e;
+		}
+	}
+	if (dns_entries >= DNS_CACHE_MAX && oldest)
+		dns_unlink(oldest);
+}
+
+static int dns_lookup(int class, int type, const char *name, unsigned char *answer, int len, int *ttl)
+{
+	int res;
+
+	if (class == DNS_CLASS_HOST) {
+		if ((res = host_backend(name, (struct in_addr *)answer, len / sizeof(struct in_addr))) > 0)
+			res *= sizeof(struct in_addr);
+		*ttl = DNS_HOSTTTL;
+	} else {
+		if ((res = dns_backend(name, class, type, answer, len)) > 0 && (*ttl = dns_answer_ttl(answer, res)) < 0)
+			*ttl = DNS_NEGTTL;
+	}
+	if (res == 0)
+		*ttl = DNS_NEGTTL;
+	else if (res < 0)
+		*ttl = DNS_FAILTTL;
+	else if (*ttl > DNS_MAXTTL)
+		*ttl = DNS_MAXTTL;
+	return res;
+}
+
+/* Put the result of a lookup in the entry, call with dnslock held */
+static void dns_store(struct dns_entry *e, int res, unsigned char *answer, int ttl, time_t now)
+{
+	unsigned char *copy;
+
+	if (res < 0) {
+		/* Keep what we had, if anything, until the servers answer again */
+		dns_failures++;
+		e->expires = now + ttl;
+		return;
+	}
+	if (res == 0) {
+		free(e->answer);
+		e->answer = NULL;
+		e->len = -1;
+	} else if ((copy = malloc(res))) {
+		memcpy(copy, answer, res);
+		free(e->answer);
+		e->answer = copy;
+		e->len = res;
+	} else {
+		ttl = 0;
+	}
+	e->expires = now + ttl;
+}
+
+static void dns_queue(struct dns_job *job)
+{
+	job->next = NULL;
+	if (jobs_tail)
+		jobs_tail->next = job;
+	else
+		jobs = job;
+	jobs_tail = job;
+	dns_queued++;
+	cw_cond_signal(&jobcond);
+}
+
+/*--- dns_resolve: Find the answer for a query, from the cache if we can.
+      Copies the answer into the buffer and returns its length, or -1 if
+      there isn't one.  With stale set an expired answer can be used while
+      it is being refreshed */
+static int dns_resolve(int class, int type, const char *name, unsigned char *answer, int len, int stale)
+{
+	unsigned int hash = dns_hash(class, type, name);
+	struct dns_entry *e;
+	struct dns_job *job;
+	time_t now;
+	int res, ttl;
+
+	cw_mutex_lock(&dnslock);
+	for (;;) {
+		dns_clock(&now);
+		if (!(e = dns_find(hash, class, type, name))) {
+			dns_evict(now);
+			if (!(e = calloc(1, sizeof(*e) + strlen(name) + 1))) {
+				cw_mutex_unlock(&dnslock);
+				return -1;
+			}
+			e->hash = hash;
+			e->class = class;
+			e->type = type;
+			e->len = -1;
+			strcpy(e->name, name);
+			e->next = dns_cache[hash % DNS_BUCKETS];
+			dns_cache[hash % DNS_BUCKETS] = e;
+			dns_entries++;
+			break;
+		}
+		if (e->resolving) {
+			dns_waits++;
+			cw_cond_wait(&dnscond, &dnslock);
+			continue;
+		}
+		if (now < e->expires) {
+			dns_hits++;
+			goto found;
+		}
+		if (stale && dns_threads && now < e->expires + DNS_STALE) {
+			if (!e->refreshing && (job = calloc(1, sizeof(*job) + strlen(name) + 1))) {
+				job->class = class;
+				job->type = type;
+				job->refresh = 1;
+				strcpy(job->name, name);
+				e->refreshing = 1;
+				dns_queue(job);
+			}
+			dns_stale++;
+			goto found;
+		}
+		break;
+	}
+	/* We have to ask, and anyone else has to wait for us */
+	dns_misses++;
+	e->resolving = 1;
+	cw_mutex_unlock(&dnslock);
+
+	res = dns_lookup(class, type, name, answer, len, &ttl);
+
+	cw_mutex_lock(&dnslock);
+	dns_clock(&now);
+	dns_store(e, res, answer, ttl, now);
+	e->resolving = 0;
+	cw_cond_broadcast(&dnscond);
+found:
+	res = e->len;
+	if (res > len)
+		res = -1;
+	else if (res > 0)
+		memcpy(answer, e->answer, res);
+	cw_mutex_unlock(&dnslock);
+	return res;
+}
+
+/* Fetch a new answer for an entry that is still being used */
+static void dns_refresh(int class, int type, const char *name)
+{
+	unsigned char answer[MAX_SIZE];
+	struct dns_entry *e;
+	int res, ttl;
+
+	res = dns_lookup(class, type, name, answer, sizeof(answer), &ttl);
+
+	cw_mutex_lock(&dnslock);
+	if ((e = dns_find(dns_hash(class, type, name), class, type, name))) {
+		dns_store(e, res, answer, ttl, dns_clock(NULL));
+		e->refreshing = 0;
+	}
+	cw_mutex_unlock(&dnslock);
+}
+
+static int dns_search(void *context, const char *dname, int class, int type,
+	int (*callback)(void *context, char *answer, int len, char *fullanswer), int stale)
+{
+	unsigned char answer[MAX_SIZE];
+	int ret;
+
+	ret = dns_resolve(class, type, dname, answer, sizeof(answer), stale);
+	if (ret > 0 && (ret = dns_parse_answer(context, class, type, (char *)answer, ret, callback)) < 0)
 		cw_log(LOG_WARNING, "DNS Parse error for %s\n", dname);
 	if (ret == 0)
 		cw_log(LOG_DEBUG, "No matches found in DNS for %s\n", dname);
-#endif
 	return ret;
 }
+
+static struct hostent *dns_gethostbyname(const char *host, struct cw_hostent *hp, int stale)
+{
+	struct in_addr addrs[DNS_MAXADDRS];
+	char **list;
+	char *addr;
+	int dots = 0;
+	const char *s;
+	int x, n;
+
+	/* Although it is perfectly legitimate to lookup a pure integer, for
+	   the sake of the sanity of people who like to name their peers as
+	   integers, we break with tradition and refuse to look up a
+	   pure integer */
+	s = host;
+	while(s && *s) {
+		if (*s == '.')
+			dots++;
+		else if (!isdigit(*s))
+			break;
+		s++;
+	}
+	if (!s || !*s) {
+		/* Forge a reply for IP's to avoid octal IP's being interpreted as octal */
+		if (dots != 3)
+			return NULL;
+		memset(hp, 0, sizeof(struct cw_hostent));
+		hp->hp.h_addr_list = (void *) hp->buf;
+		hp->hp.h_addr = hp->buf + sizeof(void *);
+		if (inet_pton(AF_INET, host, hp->hp.h_addr) > 0)
+			return &hp->hp;
+		return NULL;
+	}
+
+	if ((n = dns_resolve(DNS_CLASS_HOST, DNS_TYPE_HOST, host, (unsigned char *)addrs, sizeof(addrs), stale)) <= 0)
+		return NULL;
+	n /= sizeof(struct in_addr);
+
+	/* The address list, the addresses and the name, in the buffer */
+	memset(hp, 0, sizeof(struct cw_hostent));
+	list = (char **)hp->buf;
+	addr = (char *)&list[n + 1];
+	for (x = 0;  x < n;  x++) {
+		list[x] = addr;
+		memcpy(addr, &addrs[x], sizeof(struct in_addr));
+		addr += sizeof(struct in_addr);
+	}
+	cw_copy_string(addr, host, hp->buf + sizeof(hp->buf) - addr);
+	hp->hp.h_name = addr;
+	hp->hp.h_aliases = &list[n];
+	hp->hp.h_addrtype = AF_INET;
+	hp->hp.h_length = sizeof(struct in_addr);
+	hp->hp.h_addr_list = list;
+	return &hp->hp;
+}
+
+static void *dns_thread(void *data)
+{
+	struct cw_hostent ahp;
+	struct hostent *hp;
+	struct dns_job *job;
+	int res;
+
+	for (;;) {
+		cw_mutex_lock(&dnslock);
+		while (!jobs)
+			cw_cond_wait(&jobcond, &dnslock);
+		job = jobs;
+		if (!(jobs = job->next))
+			jobs_tail = NULL;
+		dns_queued--;
+		cw_mutex_unlock(&dnslock);
+
+		/* Whoever is waiting for us wants a fresh answer */
+		if (job->refresh) {
+			dns_refresh(job->class, job->type, job->name);
+		} else if (job->host_done) {
+			hp = dns_gethostbyname(job->name, &ahp, 0);
+			job->host_done(job->context, hp);
+		} else {
+			res = dns_search(job->context, job->name, job->class, job->type, job->callback, 0);
+			if (job->done)
+				job->done(job->context, res);
+		}
+		free(job);
+	}
+	return NULL;
+}
+
+static struct dns_job *dns_job_new(const char *name)
+{
+	struct dns_job *job;
+
+	if (!dns_threads || cw_strlen_zero(name))
+		return NULL;
+	if ((job = calloc(1, sizeof(*job) + strlen(name) + 1)))
+		strcpy(job->name, name);
+	return job;
+}
+
+/*--- cw_search_dns: Lookup record in DNS */
+int cw_search_dns(void *context,
+	   const char *dname, int class, int type,
+	   int (*callback)(void *context, char *answer, int len, char *fullanswer))
+{
+	return dns_search(context, dname, class, type, callback, 1);
+}
+
+int cw_search_dns_async(void *context,
+	   const char *dname, int class, int type,
+	   int (*callback)(void *context, char *answer, int len, char *fullanswer),
+	   void (*done)(void *context, int res))
+{
+	struct dns_job *job;
+
+	if (!(job = dns_job_new(dname)))
+		return -1;
+	job->class = class;
+	job->type = type;
+	job->context = context;
+	job->callback = callback;
+	job->done = done;
+	cw_mutex_lock(&dnslock);
+	dns_queue(job);
+	cw_mutex_unlock(&dnslock);
+	return 0;
+}
+
+/*! \brief Re-entrant (thread safe) version of gethostbyname that replaces the 
+   standard gethostbyname (which is not thread safe)
+*/
+struct hostent *cw_gethostbyname(const char *host, struct cw_hostent *hp)
+{
+	return dns_gethostbyname(host, hp, 1);
+}
+
+int cw_gethostbyname_async(const char *host, void (*done)(void *data, struct hostent *hp), void *data)
+{
+	struct dns_job *job;
+
+	if (!done || !(job = dns_job_new(host)))
+		return -1;
+	job->context = data;
+	job->host_done = done;
+	cw_mutex_lock(&dnslock);
+	dns_queue(job);
+	cw_mutex_unlock(&dnslock);
+	return 0;
+}
+
+static const char *dns_type2str(int class, int type, char *buf, size_t len)
+{
+	if (class == DNS_CLASS_HOST)
+		return "host";
+	switch (type) {
+	case 1:
+		return "A";
+	case 16:
+		return "TXT";
+	case 33:
+		return "SRV";
+	case 35:
+		return "NAPTR";
+	}
+	snprintf(buf, len, "%d", type);
+	return buf;
+}
+
+static int show_dns_cache(int fd, int argc, char *argv[])
+{
+	struct dns_entry *e;
+	char buf[16];
+	time_t now;
+	int x;
+
+	if (argc != 3 && argc != 4)
+		return RESULT_SHOWUSAGE;
+	if (argc == 4 && strcasecmp(argv[3], "entries"))
+		return RESULT_SHOWUSAGE;
+
+	dns_clock(&now);
+	cw_mutex_lock(&dnslock);
+	cw_cli(fd, "Resolver threads: %d, lookups queued: %d\n", dns_threads, dns_queued);
+	cw_cli(fd, "Cached: %d (limit %d)\n", dns_entries, DNS_CACHE_MAX);
+	cw_cli(fd, "Answered from the cache: %lu, while being refreshed: %lu\n", dns_hits, dns_stale);
+	cw_cli(fd, "Looked up: %lu, waited for someone else's lookup: %lu, no answer from the servers: %lu\n", dns_misses, dns_waits, dns_failures);
+	if (argc == 4) {
+		cw_cli(fd, "%-40s %-6s %8s %s\n", "Name", "Type", "Expires", "Answer");
+		for (x = 0;  x < DNS_BUCKETS;  x++) {
+			for (e = dns_cache[x];  e;  e = e->next) {
+				cw_cli(fd, "%-40.40s %-6s %8ld %s\n", e->name,
+					dns_type2str(e->class, e->type, buf, sizeof(buf)), (long)(e->expires - now),
+					e->resolving ? "(looking up)" : (e->len < 0 ? "none" : "yes"));
+			}
+		}
+	}
+	cw_mutex_unlock(&dnslock);
+	return RESULT_SUCCESS;
+}
+
+static struct cw_cli_entry show_dns_cache_cli =
+{
+	{ "show", "dns", "cache", NULL },
+	show_dns_cache,
+	"Displays the DNS cache",
+	"Usage: show dns cache [entries]\n"
+	"       shows how many lookups were answered from the DNS cache and how\n"
+	"       many had to ask the servers, and optionally what is cached\n"
+};
+
+int cw_dns_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int x;
+
+	cw_cond_init(&dnscond, NULL);
+	cw_cond_init(&jobcond, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (x = 0;  x < option_dns_threads;  x++) {
+		if (cw_pthread_create(&thread, &attr, dns_thread, NULL)) {
+			cw_log(LOG_WARNING, "Unable to start resolver thread: %s\n", strerror(errno));
+			break;
+		}
+		dns_threads++;
+	}
+	pthread_attr_destroy(&attr);
+	cw_cli_register(&show_dns_cache_cli);
+	return 0;
+}
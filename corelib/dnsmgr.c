@@ -56,10 +56,20 @@ static pthread_t refresh_thread = CW_PTHREADT_NULL;
 
 struct cw_dnsmgr_entry {
 	struct in_addr *result;
+	unsigned int id;
 	CW_LIST_ENTRY(cw_dnsmgr_entry) list;
 	char name[1];
 };
 
+/* A refresh being looked up by the resolver threads.  The entry may be
+   released meanwhile, so it is found again by its id */
+struct refresh_lookup {
+	unsigned int id;
+	int verbose;
+};
+
+static unsigned int next_id;
+
 static CW_LIST_HEAD(entry_list, cw_dnsmgr_entry) entry_list;
 
 CW_MUTEX_DEFINE_STATIC(refresh_lock);
@@ -96,6 +106,7 @@ struct cw_dnsmgr_entry *cw_dnsmgr_get(const char *name, struct in_addr *result)
 	strcpy(entry->name, name);
 
 	CW_LIST_LOCK(&entry_list);
+	entry->id = ++next_id;
 	CW_LIST_INSERT_HEAD(&entry_list, entry, list);
 	CW_LIST_UNLOCK(&entry_list);
 
@@ -136,7 +147,7 @@ int cw_dnsmgr_lookup(const char *name, struct in_addr *result, struct cw_dnsmgr_
 		struct hostent *hp;
 
 		if ((hp = cw_gethostbyname(name, &ahp)))
-			memcpy(result, hp->h_addr, sizeof(result));
+			memcpy(result, hp->h_addr, sizeof(*result));
 		return 0;
 	} else {
 		if (option_verbose > 2)
@@ -146,10 +157,43 @@ int cw_dnsmgr_lookup(const char *name, struct in_addr *result, struct cw_dnsmgr_
 	}
 }
 
+static void refresh_entry(struct cw_dnsmgr_entry *entry, struct hostent *hp, int verbose)
+{
+	char iabuf[INET_ADDRSTRLEN];
+
+	/* check to see if it has changed, do callback if requested */
+	if (memcmp(entry->result, hp->h_addr, sizeof(*entry->result))) {
+		if (verbose && (option_verbose > 2))
+			cw_verbose(VERBOSE_PREFIX_2 "'%s' is now %s\n", entry->name,
+				cw_inet_ntoa(iabuf, sizeof(iabuf), *(struct in_addr *)hp->h_addr));
+		memcpy(entry->result, hp->h_addr, sizeof(*entry->result));
+	}
+}
+
+/* Called from a resolver thread */
+static void refresh_done(void *data, struct hostent *hp)
+{
+	struct refresh_lookup *lookup = data;
+	struct cw_dnsmgr_entry *entry;
+
+	if (hp) {
+		CW_LIST_LOCK(&entry_list);
+		CW_LIST_TRAVERSE(&entry_list, entry, list) {
+			if (entry->id == lookup->id) {
+				refresh_entry(entry, hp, lookup->verbose);
+				break;
+			}
+		}
+		CW_LIST_UNLOCK(&entry_list);
+	}
+	free(lookup);
+}
+
 static int refresh_list(void *data)
 {
 	struct refresh_info *info = data;
 	struct cw_dnsmgr_entry *entry;
+	struct refresh_lookup *lookup;
 	struct cw_hostent ahp;
 	struct hostent *hp;
 
@@ -170,10 +214,17 @@ static int refresh_list(void *data)
 		if (info->verbose && (option_verbose > 2))
 			cw_verbose(VERBOSE_PREFIX_2 "refreshing '%s'\n", entry->name);
 
-		if ((hp = cw_gethostbyname(entry->name, &ahp))) {
-			/* check to see if it has changed, do callback if requested */
-			memcpy(entry->result, hp->h_addr, sizeof(entry->result));
+		/* Let the resolver threads do the lookups, so a slow server doesn't
+		   keep the list locked */
+		if ((lookup = malloc(sizeof(*lookup)))) {
+			lookup->id = entry->id;
+			lookup->verbose = info->verbose;
+			if (!cw_gethostbyname_async(entry->name, refresh_done, lookup))
+				continue;
+			free(lookup);
 		}
+		if ((hp = cw_gethostbyname(entry->name, &ahp)))
+			refresh_entry(entry, hp, info->verbose);
 	}
 	CW_LIST_UNLOCK(info->entries);
 
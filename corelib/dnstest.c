@@ -0,0 +1,468 @@
+/* Checks the DNS cache and the resolver threads, with answers coming from
+   dnstest.zone instead of the name servers and time kept by the test */
+
+#include "dns.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CuTest.h"
+
+#ifndef DNSTEST_ZONE
+#define DNSTEST_ZONE "dnstest.zone"
+#endif
+
+struct zone {
+	struct zone *next;
+	char name[256];
+	char type[16];
+	int ttl;
+	int argc;
+	char argv[8][128];
+};
+
+static struct zone *zone;
+static int host_calls;
+static int dns_calls;
+static time_t test_now = 1000000000;
+static int gate_closed;
+static int gate_timeouts;
+static cw_cond_t gate;
+
+CW_MUTEX_DEFINE_STATIC(calls_lock);
+
+static int load_zone(const char *file)
+{
+	struct zone *z;
+	char line[1024], *s, *arg;
+	FILE *f;
+
+	if (!(f = fopen(file, "r"))) {
+		printf("Unable to open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == ';' || !(s = strtok(line, " \t\n")))
+			continue;
+		z = calloc(1, sizeof(*z));
+		cw_copy_string(z->name, s, sizeof(z->name));
+		if ((s = strtok(NULL, " \t\n")))
+			cw_copy_string(z->type, s, sizeof(z->type));
+		if ((s = strtok(NULL, " \t\n")))
+			z->ttl = atoi(s);
+		while (z->argc < 8 && (arg = strtok(NULL, " \t\n"))) {
+			if (*arg == '"') {
+				arg++;
+				arg[strlen(arg) - 1] = '\0';
+			}
+			cw_copy_string(z->argv[z->argc++], arg, sizeof(z->argv[0]));
+		}
+		z->next = zone;
+		zone = z;
+	}
+	fclose(f);
+	return 0;
+}
+
+static struct zone *find_zone(const char *name, const char *type)
+{
+	struct zone *z;
+
+	for (z = zone;  z;  z = z->next) {
+		if (!strcasecmp(z->name, name) && (!strcasecmp(z->type, type) || !strcmp(z->type, "FAIL")))
+			break;
+	}
+	return z;
+}
+
+static void count(int *calls)
+{
+	cw_mutex_lock(&calls_lock);
+	(*calls)++;
+	cw_mutex_unlock(&calls_lock);
+}
+
+static int calls(int *calls)
+{
+	int n;
+
+	cw_mutex_lock(&calls_lock);
+	n = *calls;
+	cw_mutex_unlock(&calls_lock);
+	return n;
+}
+
+/* The cache runs on this clock, which only moves when the test says so */
+static time_t test_clock(time_t *t)
+{
+	time_t now;
+
+	cw_mutex_lock(&calls_lock);
+	now = test_now;
+	cw_mutex_unlock(&calls_lock);
+	if (t)
+		*t = now;
+	return now;
+}
+
+static void advance_clock(int secs)
+{
+	cw_mutex_lock(&calls_lock);
+	test_now += secs;
+	cw_mutex_unlock(&calls_lock);
+}
+
+/* Holds a lookup until the test opens the gate.  Gives up after a few
+   seconds, so a caller left waiting for the lookup shows up as a failure
+   rather than as a test that never ends */
+static void wait_for_gate(void)
+{
+	struct timespec ts;
+
+	cw_mutex_lock(&calls_lock);
+	ts.tv_sec = time(NULL) + 5;
+	ts.tv_nsec = 0;
+	while (gate_closed) {
+		if (cw_cond_timedwait(&gate, &calls_lock, &ts) == ETIMEDOUT) {
+			gate_timeouts++;
+			break;
+		}
+	}
+	cw_mutex_unlock(&calls_lock);
+}
+
+static void open_gate(int open)
+{
+	cw_mutex_lock(&calls_lock);
+	gate_closed = !open;
+	cw_cond_broadcast(&gate);
+	cw_mutex_unlock(&calls_lock);
+}
+
+/* Holds a lookup until n other callers are waiting for it */
+static void wait_for_waiters(int n)
+{
+	unsigned long waits;
+	int x;
+
+	cw_mutex_lock(&dnslock);
+	waits = dns_waits;
+	cw_mutex_unlock(&dnslock);
+	for (x = 0;  x < 500;  x++) {
+		cw_mutex_lock(&dnslock);
+		if (dns_waits >= waits + n) {
+			cw_mutex_unlock(&dnslock);
+			return;
+		}
+		cw_mutex_unlock(&dnslock);
+		usleep(10000);
+	}
+	cw_mutex_lock(&calls_lock);
+	gate_timeouts++;
+	cw_mutex_unlock(&calls_lock);
+}
+
+static int stub_host(const char *host, struct in_addr *addrs, int max)
+{
+	struct zone *z;
+	int x;
+
+	count(&host_calls);
+	if (!strcasecmp(host, "slow.example.com"))
+		wait_for_waiters(7);
+	if (!(z = find_zone(host, "host")))
+		return 0;
+	if (!strcmp(z->type, "FAIL"))
+		return -1;
+	for (x = 0;  x < z->argc && x < max;  x++)
+		inet_aton(z->argv[x], &addrs[x]);
+	return x;
+}
+
+static unsigned char *put16(unsigned char *p, int v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static unsigned char *put_name(unsigned char *p, const char *name)
+{
+	const char *dot;
+	int len;
+
+	while (*name && strcmp(name, ".")) {
+		len = (dot = strchr(name, '.'))  ?  dot - name  :  strlen(name);
+		*p++ = len;
+		memcpy(p, name, len);
+		p += len;
+		name += len + (dot ? 1 : 0);
+	}
+	*p++ = 0;
+	return p;
+}
+
+static unsigned char *put_string(unsigned char *p, const char *s)
+{
+	*p++ = strlen(s);
+	memcpy(p, s, strlen(s));
+	return p + strlen(s);
+}
+
+static int stub_dns(const char *dname, int class, int type, unsigned char *answer, int len)
+{
+	unsigned char *p, *rdlen;
+	const char *types = (type == 33)  ?  "SRV"  :  (type == 35)  ?  "NAPTR"  :  "?";
+	struct zone *z;
+
+	count(&dns_calls);
+	if (!strcasecmp(dname, "_sip._udp.short.example.com"))
+		wait_for_gate();
+	if (!(z = find_zone(dname, types)))
+		return 0;
+	if (!strcmp(z->type, "FAIL"))
+		return -1;
+
+	memset(answer, 0, 12);
+	p = put16(answer + 2, 0x8180);
+	p = put16(p, 1);
+	p = put16(p, 1);
+	p = put16(p, 0);
+	p = put16(p, 0);
+	p = put_name(p, dname);
+	p = put16(p, type);
+	p = put16(p, class);
+	p = put16(p, 0xc00c);
+	p = put16(p, type);
+	p = put16(p, class);
+	p = put16(p, z->ttl >> 16);
+	p = put16(p, z->ttl);
+	rdlen = p;
+	p += 2;
+	if (type == 33) {
+		p = put16(p, atoi(z->argv[0]));
+		p = put16(p, atoi(z->argv[1]));
+		p = put16(p, atoi(z->argv[2]));
+		p = put_name(p, z->argv[3]);
+	} else {
+		p = put16(p, atoi(z->argv[0]));
+		p = put16(p, atoi(z->argv[1]));
+		p = put_string(p, z->argv[2]);
+		p = put_string(p, z->argv[3]);
+		p = put_string(p, z->argv[4]);
+		p = put_name(p, z->argv[5]);
+	}
+	put16(rdlen, p - rdlen - 2);
+	return p - answer;
+}
+
+static int srv_port(void *context, char *answer, int len, char *fullanswer)
+{
+	*(int *)context = ((unsigned char)answer[4] << 8) | (unsigned char)answer[5];
+	return 1;
+}
+
+static int naptr_services(void *context, char *answer, int len, char *fullanswer)
+{
+	/* order, preference, flags, then the services */
+	char *s = answer + 4;
+
+	s += *s + 1;
+	memcpy(context, s + 1, *s);
+	((char *)context)[(int)*s] = '\0';
+	return 1;
+}
+
+static void *slow_lookup(void *data)
+{
+	struct cw_hostent ahp;
+	struct hostent *hp;
+
+	if ((hp = cw_gethostbyname("slow.example.com", &ahp)))
+		memcpy(data, hp->h_addr, sizeof(struct in_addr));
+	return NULL;
+}
+
+static int async_done;
+static struct in_addr async_addr;
+static int async_res;
+static char async_services[256];
+
+static void host_done(void *data, struct hostent *hp)
+{
+	cw_mutex_lock(&calls_lock);
+	if (hp)
+		memcpy(&async_addr, hp->h_addr, sizeof(async_addr));
+	async_done++;
+	cw_mutex_unlock(&calls_lock);
+}
+
+static void search_done(void *context, int res)
+{
+	cw_mutex_lock(&calls_lock);
+	async_res = res;
+	async_done++;
+	cw_mutex_unlock(&calls_lock);
+}
+
+/* Waits for a resolver thread to get to n, or gives up after a few seconds */
+static int wait_calls(int *counter, int n)
+{
+	int x;
+
+	for (x = 0;  x < 500 && calls(counter) < n;  x++)
+		usleep(10000);
+	return calls(counter);
+}
+
+/* Hosts, once from the "servers" then from the cache */
+void test_dns_host_cached(CuTest *tc)
+{
+	struct cw_hostent ahp;
+	struct hostent *hp;
+	char iabuf[INET_ADDRSTRLEN];
+	int before = calls(&host_calls);
+	int x;
+
+	for (x = 0;  x < 2;  x++) {
+		hp = cw_gethostbyname("sip.example.com", &ahp);
+		CuAssertPtrNotNull(tc, hp);
+		CuAssertTrue(tc, hp->h_addr_list[0] && hp->h_addr_list[1] && !hp->h_addr_list[2]);
+		CuAssertStrEquals(tc, "192.0.2.11", (char *) cw_inet_ntoa(iabuf, sizeof(iabuf), *(struct in_addr *)hp->h_addr_list[1]));
+		CuAssertStrEquals(tc, "sip.example.com", hp->h_name);
+	}
+	CuAssertIntEquals(tc, before + 1, calls(&host_calls));
+
+	/* Addresses don't get looked up at all */
+	CuAssertPtrNotNull(tc, cw_gethostbyname("192.0.2.1", &ahp));
+	CuAssertPtrEquals(tc, NULL, cw_gethostbyname("12345", &ahp));
+	CuAssertIntEquals(tc, before + 1, calls(&host_calls));
+}
+
+/* No such host, and servers that don't answer, are remembered too */
+void test_dns_failures_cached(CuTest *tc)
+{
+	struct cw_hostent ahp;
+	int before = calls(&host_calls);
+	int x;
+
+	for (x = 0;  x < 2;  x++) {
+		CuAssertPtrEquals(tc, NULL, cw_gethostbyname("nowhere.example.com", &ahp));
+		CuAssertPtrEquals(tc, NULL, cw_gethostbyname("broken.example.com", &ahp));
+	}
+	CuAssertIntEquals(tc, before + 2, calls(&host_calls));
+}
+
+void test_dns_records_cached(CuTest *tc)
+{
+	int before = calls(&dns_calls);
+	int port, x;
+
+	for (x = 0;  x < 2;  x++) {
+		port = 0;
+		CuAssertTrue(tc, cw_search_dns(&port, "_sip._udp.example.com", C_IN, 33, srv_port) > 0);
+		CuAssertIntEquals(tc, 5060, port);
+		CuAssertTrue(tc, cw_search_dns(&port, "_sip._tcp.example.com", C_IN, 33, srv_port) < 0);
+	}
+	CuAssertIntEquals(tc, before + 2, calls(&dns_calls));
+}
+
+/* An answer is kept for as long as its TTL, by the cache's clock */
+void test_dns_ttl(CuTest *tc)
+{
+	int before = calls(&dns_calls);
+	int port = 0;
+
+	cw_search_dns(&port, "_sip._udp.example.com", C_IN, 33, srv_port);
+	advance_clock(59);
+	cw_search_dns(&port, "_sip._udp.example.com", C_IN, 33, srv_port);
+	CuAssertIntEquals(tc, before, calls(&dns_calls));
+	/* Long enough past it that it can't be used while being refreshed, it
+	   is looked up again before the caller gets an answer */
+	advance_clock(DNS_STALE + 2);
+	CuAssertTrue(tc, cw_search_dns(&port, "_sip._udp.example.com", C_IN, 33, srv_port) > 0);
+	CuAssertIntEquals(tc, before + 1, calls(&dns_calls));
+}
+
+/* Callers asking for the same thing at once share one lookup, which
+   doesn't answer until the other seven are waiting for it */
+void test_dns_shared_lookup(CuTest *tc)
+{
+	struct in_addr addrs[8];
+	pthread_t threads[8];
+	char iabuf[INET_ADDRSTRLEN];
+	int before = calls(&host_calls);
+	int x;
+
+	for (x = 0;  x < 8;  x++)
+		pthread_create(&threads[x], NULL, slow_lookup, &addrs[x]);
+	for (x = 0;  x < 8;  x++) {
+		pthread_join(threads[x], NULL);
+		CuAssertStrEquals(tc, "192.0.2.30", (char *) cw_inet_ntoa(iabuf, sizeof(iabuf), addrs[x]));
+	}
+	CuAssertIntEquals(tc, before + 1, calls(&host_calls));
+	CuAssertIntEquals(tc, 0, gate_timeouts);
+}
+
+/* An expired answer is still used while a resolver thread refreshes it */
+void test_dns_stale_refresh(CuTest *tc)
+{
+	int before = calls(&dns_calls);
+	int port = 0;
+
+	cw_search_dns(&port, "_sip._udp.short.example.com", C_IN, 33, srv_port);
+	CuAssertIntEquals(tc, 5070, port);
+	CuAssertIntEquals(tc, before + 1, calls(&dns_calls));
+
+	/* The refresh is held until we have had our answer */
+	open_gate(0);
+	advance_clock(2);
+	port = 0;
+	cw_search_dns(&port, "_sip._udp.short.example.com", C_IN, 33, srv_port);
+	CuAssertIntEquals(tc, 5070, port);
+	open_gate(1);
+	CuAssertIntEquals(tc, before + 2, wait_calls(&dns_calls, before + 2));
+	CuAssertIntEquals(tc, 0, gate_timeouts);
+}
+
+/* Lookups done by the resolver threads */
+void test_dns_async(CuTest *tc)
+{
+	char iabuf[INET_ADDRSTRLEN];
+
+	CuAssertIntEquals(tc, 0, cw_gethostbyname_async("sip.example.com", host_done, NULL));
+	CuAssertIntEquals(tc, 1, wait_calls(&async_done, 1));
+	CuAssertStrEquals(tc, "192.0.2.10", (char *) cw_inet_ntoa(iabuf, sizeof(iabuf), async_addr));
+	CuAssertIntEquals(tc, 0, cw_search_dns_async(async_services, "4.3.2.1.e164.arpa", C_IN, 35, naptr_services, search_done));
+	CuAssertIntEquals(tc, 2, wait_calls(&async_done, 2));
+	CuAssertTrue(tc, async_res > 0);
+	CuAssertStrEquals(tc, "E2U+sip", async_services);
+}
+
+int main(int argc, char **argv)
+{
+	CuString *output = CuStringNew();
+	CuSuite *suite = CuSuiteNew();
+
+	if (load_zone(argc > 1 ? argv[1] : DNSTEST_ZONE))
+		return 1;
+	dns_backend = stub_dns;
+	host_backend = stub_host;
+	dns_clock = test_clock;
+	cw_cond_init(&gate, NULL);
+	option_dns_threads = 2;
+	cw_dns_init();
+
+	SUITE_ADD_TEST(suite, test_dns_host_cached);
+	SUITE_ADD_TEST(suite, test_dns_failures_cached);
+	SUITE_ADD_TEST(suite, test_dns_records_cached);
+	SUITE_ADD_TEST(suite, test_dns_ttl);
+	SUITE_ADD_TEST(suite, test_dns_shared_lookup);
+	SUITE_ADD_TEST(suite, test_dns_stale_refresh);
+	SUITE_ADD_TEST(suite, test_dns_async);
+
+	CuSuiteRun(suite);
+	CuSuiteSummary(suite, output);
+	CuSuiteDetails(suite, output);
+	printf("%s\n", output->buffer);
+	return suite->failCount ? 1 : 0;
+}
@@ -35,6 +35,9 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "callweaver.h"
 
@@ -99,6 +102,10 @@ struct cw_filestream {
 	int lastwriteformat;
 	int lasttimeout;
 	struct cw_channel *owner;
+	/* Shared prompt image the stream reads from, if any */
+	struct prompt_image *image;
+	/* Queue of frames for the writer threads, on streams being written */
+	struct stream_writer *writer;
 };
 
 CW_MUTEX_DEFINE_STATIC(formatlock);
@@ -199,6 +206,223 @@ int cw_stopstream(struct cw_channel *tmp)
 	return 0;
 }
 
+/*
+ * Asynchronous writes.
+ *
+ * Recording used to run the format module's write() in the channel's own
+ * thread, so an fsync or a slow NFS server was heard on the call.  Streams
+ * opened with cw_writefile() now queue their frames, and a small pool of
+ * writer threads hands them to the format module.  A writer takes all a
+ * stream has queued in one go and the stream's FILE has a large buffer, so
+ * the disk sees a few big sequential writes rather than one per frame.
+ * The queue of a stream is bounded: a caller that finds it full waits for
+ * the writer, and the wait is counted, so a dead disk can't eat all the
+ * memory.  Seeking, telling, truncating and closing wait for the queue to
+ * drain first, so they see the file as the caller wrote it.
+ */
+#define WRITER_MAXQUEUE		(256*1024)
+#define WRITER_BUFSIZE		(32*1024)
+
+struct stream_writer {
+	/* Next on the run queue */
+	struct stream_writer *next;
+	struct cw_filestream *fs;
+	/* Frames waiting to be written */
+	struct cw_frame *head;
+	struct cw_frame *tail;
+	/* Bytes waiting or being written */
+	int queued;
+	/* On the run queue or being written */
+	int busy;
+	/* A write failed, so nothing more is written */
+	int failed;
+	cw_cond_t drained;
+};
+
+CW_MUTEX_DEFINE_STATIC(writerlock);
+static cw_cond_t writercond;
+static struct stream_writer *writer_runq = NULL;
+static struct stream_writer *writer_runq_tail = NULL;
+static int writer_threads = 0;
+
+/* For "show file writers" */
+static int writer_streams = 0;
+static long writer_queued = 0;
+static long writer_hwm = 0;
+static int writer_stream_hwm = 0;
+static unsigned long writer_frames = 0;
+static unsigned long writer_batches = 0;
+static unsigned long writer_stalls = 0;
+static unsigned long writer_stall_ms = 0;
+static unsigned long writer_failures = 0;
+
+static void *writer_thread(void *data)
+{
+	struct stream_writer *w;
+	struct cw_frame *f, *next;
+	int bytes, frames, failed;
+
+	for (;;) {
+		cw_mutex_lock(&writerlock);
+		while (!writer_runq)
+			cw_cond_wait(&writercond, &writerlock);
+		w = writer_runq;
+		if (!(writer_runq = w->next))
+			writer_runq_tail = NULL;
+		w->next = NULL;
+		f = w->head;
+		w->head = w->tail = NULL;
+		failed = w->failed;
+		cw_mutex_unlock(&writerlock);
+
+		bytes = frames = 0;
+		for (  ;  f;  f = next) {
+			next = f->next;
+			bytes += f->datalen;
+			frames++;
+			if (!failed && w->fs->fmt->write(w->fs, f)) {
+				cw_log(LOG_WARNING, "Write to %s failed, the rest of the recording is lost\n", w->fs->filename ? w->fs->filename : "a file");
+				failed = 1;
+			}
+			cw_fr_free(f);
+		}
+
+		cw_mutex_lock(&writerlock);
+		w->queued -= bytes;
+		writer_queued -= bytes;
+		writer_frames += frames;
+		writer_batches++;
+		if (failed && !w->failed) {
+			w->failed = 1;
+			writer_failures++;
+		}
+		if (w->head) {
+			/* More came in while we were writing */
+			if (writer_runq_tail)
+				writer_runq_tail->next = w;
+			else
+				writer_runq = w;
+			writer_runq_tail = w;
+		} else {
+			w->busy = 0;
+		}
+		cw_cond_broadcast(&w->drained);
+		cw_mutex_unlock(&writerlock);
+	}
+	return NULL;
+}
+
+static struct stream_writer *writer_new(struct cw_filestream *fs)
+{
+	struct stream_writer *w;
+
+	if (!writer_threads || !(w = calloc(1, sizeof(*w))))
+		return NULL;
+	w->fs = fs;
+	cw_cond_init(&w->drained, NULL);
+	cw_mutex_lock(&writerlock);
+	writer_streams++;
+	cw_mutex_unlock(&writerlock);
+	return w;
+}
+
+/* Waits for everything queued on a stream to be written.  Returns -1 if
+   any of it couldn't be */
+static int writer_flush(struct stream_writer *w)
+{
+	int res;
+
+	cw_mutex_lock(&writerlock);
+	while (w->busy)
+		cw_cond_wait(&w->drained, &writerlock);
+	res = w->failed ? -1 : 0;
+	cw_mutex_unlock(&writerlock);
+	return res;
+}
+
+static void writer_free(struct stream_writer *w)
+{
+	writer_flush(w);
+	cw_mutex_lock(&writerlock);
+	writer_streams--;
+	cw_mutex_unlock(&writerlock);
+	cw_cond_destroy(&w->drained);
+	free(w);
+}
+
+static int writer_queue(struct stream_writer *w, struct cw_frame *f)
+{
+	struct cw_frame *dup;
+	struct timeval start;
+
+	if (!(dup = cw_frdup(f)))
+		return -1;
+	dup->next = NULL;
+
+	cw_mutex_lock(&writerlock);
+	if (w->queued >= WRITER_MAXQUEUE && !w->failed) {
+		/* The disk isn't keeping up, so the caller has to wait for it */
+		writer_stalls++;
+		start = cw_tvnow();
+		while (w->queued >= WRITER_MAXQUEUE && !w->failed)
+			cw_cond_wait(&w->drained, &writerlock);
+		writer_stall_ms += cw_tvdiff_ms(cw_tvnow(), start);
+	}
+	if (w->failed) {
+		cw_mutex_unlock(&writerlock);
+		cw_fr_free(dup);
+		return -1;
+	}
+	if (w->tail)
+		w->tail->next = dup;
+	else
+		w->head = dup;
+	w->tail = dup;
+	w->queued += dup->datalen;
+	writer_queued += dup->datalen;
+	if (w->queued > writer_stream_hwm)
+		writer_stream_hwm = w->queued;
+	if (writer_queued > writer_hwm)
+		writer_hwm = writer_queued;
+	if (!w->busy) {
+		w->busy = 1;
+		if (writer_runq_tail)
+			writer_runq_tail->next = w;
+		else
+			writer_runq = w;
+		writer_runq_tail = w;
+		cw_cond_signal(&writercond);
+	}
+	cw_mutex_unlock(&writerlock);
+	return 0;
+}
+
+static void writer_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int x;
+
+	cw_cond_init(&writercond, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (x = 0;  x < option_record_writers;  x++) {
+		if (cw_pthread_create(&thread, &attr, writer_thread, NULL)) {
+			cw_log(LOG_WARNING, "Unable to start recording writer thread: %s\n", strerror(errno));
+			break;
+		}
+		writer_threads++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static int stream_write(struct cw_filestream *fs, struct cw_frame *f)
+{
+	if (fs->writer)
+		return writer_queue(fs->writer, f);
+	return fs->fmt->write(fs, f);
+}
+
 int cw_writestream(struct cw_filestream *fs, struct cw_frame *f)
 {
 	struct cw_frame *trf;
@@ -226,7 +450,7 @@ int cw_writestream(struct cw_filestream *fs, struct cw_frame *f)
 		return -1;
 	}
 	if (((fs->fmt->format | alt) & f->subclass) == f->subclass) {
-		res =  fs->fmt->write(fs, f);
+		res = stream_write(fs, f);
 		if (res < 0) 
 			cw_log(LOG_WARNING, "Natural write failed\n");
 		if (res > 0)
@@ -249,7 +473,7 @@ int cw_writestream(struct cw_filestream *fs, struct cw_frame *f)
 			/* Get the translated frame but don't consume the original in case they're using it on another stream */
 			trf = cw_translate(fs->trans, f, 0);
 			if (trf) {
-				res = fs->fmt->write(fs, trf);
+				res = stream_write(fs, trf);
 				if (res) 
 					cw_log(LOG_WARNING, "Translated frame write failed\n");
 			} else
@@ -341,6 +565,731 @@ static int exts_compare(const char *exts, const char *type)
 	return 0;
 }
 
+/*
+ * Index of the sounds directory.
+ *
+ * Prompts are looked up by their path under the sounds directory with the
+ * language already folded in ("en/digits/1", "fr-custom/welcome"...), and
+ * each lookup used to stat() every extension of every registered format.
+ * The index maps such a name to the extensions present on disk, so that
+ * existence checks and format selection need no filesystem probing.
+ *
+ * It is kept current with inotify.  Pending events are applied before each
+ * lookup, so a prompt written or removed just before is never missed.
+ * Without inotify, or when the tree can't be watched, lookups go back to
+ * probing the filesystem.
+ */
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define PROMPT_INDEX_BUCKETS	4096
+/* Guards against symlink loops while scanning */
+#define PROMPT_INDEX_MAXDEPTH	16
+#define PROMPT_WATCH_MASK	(IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+struct prompt_entry {
+	struct prompt_entry *next;
+	unsigned int hash;
+	/*! Extensions found on disk, as "|gsm|wav|" */
+	char *exts;
+	/*! Name relative to the sounds directory, without extension */
+	char name[0];
+};
+
+struct prompt_watch {
+	struct prompt_watch *next;
+	int wd;
+	/*! Directory relative to the sounds directory, "" for the top */
+	char dir[0];
+};
+
+CW_MUTEX_DEFINE_STATIC(promptlock);
+
+static struct prompt_entry *prompt_index[PROMPT_INDEX_BUCKETS];
+static struct prompt_watch *prompt_watches = NULL;
+static int prompt_fd = -1;
+static int prompt_entries = 0;
+static int prompt_dirs = 0;
+static unsigned long prompt_hits = 0;
+static unsigned long prompt_misses = 0;
+static unsigned long prompt_rescans = 0;
+
+static int prompt_index_scan(const char *dir, int depth);
+static int prompt_index_build(void);
+static void prompt_index_clear(void);
+
+static unsigned int prompt_hash(const char *s, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--)
+		h = (h ^ (unsigned char) *s++) * 16777619U;
+	return h;
+}
+
+#ifdef HAVE_FMEMOPEN
+/*
+ * Prompt store.
+ *
+ * Indexed prompts are read into memory once and shared.  Every stream
+ * playing one gets its own stdio FILE over the same image through
+ * fmemopen(), so the format modules are unchanged, and a thousand callers
+ * hearing the same announcement hold no file descriptors and cause no
+ * further reads.  Images are reference counted; those no stream is using
+ * are dropped least recently used first once the store outgrows the
+ * "promptcache" option.
+ *
+ * The image is a private copy rather than a mapping of the file, so a
+ * prompt overwritten or truncated in place can't fault the streams still
+ * playing it.  The index's inotify watch drops the stale image and the
+ * next playback loads the new file.
+ */
+#define PROMPT_STORE_BUCKETS	256
+
+struct prompt_image {
+	struct prompt_image *next;
+	unsigned int hash;
+	/*! Streams reading the image */
+	int refs;
+	/*! Set once the file changed; freed when the last stream closes */
+	int stale;
+	unsigned long lastuse;
+	size_t len;
+	char *data;
+	/*! File name relative to the sounds directory */
+	char path[0];
+};
+
+static struct prompt_image *prompt_store[PROMPT_STORE_BUCKETS];
+static size_t prompt_store_bytes = 0;
+static int prompt_store_images = 0;
+static unsigned long prompt_store_tick = 0;
+static unsigned long prompt_store_hits = 0;
+static unsigned long prompt_store_loads = 0;
+/*! Bumped whenever images are dropped, so a read that raced a change is thrown away */
+static unsigned long prompt_store_gen = 0;
+
+static void prompt_image_free(struct prompt_image *img)
+{
+	free(img->data);
+	free(img);
+}
+
+/*! Takes an image out of the store.  Call with promptlock held */
+static void prompt_store_unlink(struct prompt_image *img)
+{
+	struct prompt_image **pi;
+
+	for (pi = &prompt_store[img->hash % PROMPT_STORE_BUCKETS];  *pi;  pi = &(*pi)->next) {
+		if (*pi == img) {
+			*pi = img->next;
+			break;
+		}
+	}
+	prompt_store_bytes -= img->len;
+	prompt_store_images--;
+	if (img->refs)
+		img->stale = 1;
+	else
+		prompt_image_free(img);
+}
+
+/*! Finds the image of path in the store.  Call with promptlock held */
+static struct prompt_image *prompt_store_find(const char *path, unsigned int hash)
+{
+	struct prompt_image *img;
+
+	for (img = prompt_store[hash % PROMPT_STORE_BUCKETS];  img;  img = img->next) {
+		if (img->hash == hash  &&  !strcmp(img->path, path))
+			break;
+	}
+	return img;
+}
+
+/*! Drops the image of a file that changed on disk */
+static void prompt_store_drop(const char *path)
+{
+	struct prompt_image *img;
+	unsigned int hash = prompt_hash(path, strlen(path));
+
+	prompt_store_gen++;
+	if ((img = prompt_store_find(path, hash)))
+		prompt_store_unlink(img);
+}
+
+/*! Drops the images of every file under dir, "" for all of them */
+static void prompt_store_drop_dir(const char *dir)
+{
+	struct prompt_image *img;
+	struct prompt_image *next;
+	size_t dirlen = strlen(dir);
+	int x;
+
+	prompt_store_gen++;
+	for (x = 0;  x < PROMPT_STORE_BUCKETS;  x++) {
+		for (img = prompt_store[x];  img;  img = next) {
+			next = img->next;
+			if (!dirlen  ||  (!strncmp(img->path, dir, dirlen)  &&  img->path[dirlen] == '/'))
+				prompt_store_unlink(img);
+		}
+	}
+}
+
+/*! Makes room for len more bytes by dropping unused images, oldest first */
+static int prompt_store_trim(size_t len)
+{
+	struct prompt_image *img;
+	struct prompt_image *oldest;
+	size_t max = (size_t) option_prompt_cache*1024;
+	int x;
+
+	while (prompt_store_bytes + len > max) {
+		oldest = NULL;
+		for (x = 0;  x < PROMPT_STORE_BUCKETS;  x++) {
+			for (img = prompt_store[x];  img;  img = img->next) {
+				if (!img->refs  &&  (!oldest  ||  img->lastuse < oldest->lastuse))
+					oldest = img;
+			}
+		}
+		if (!oldest)
+			return -1;
+		prompt_store_unlink(oldest);
+	}
+	return 0;
+}
+
+/*! Reads a prompt into a new image, not yet in the store.  Called without
+ *  promptlock, so a slow disk doesn't hold up other lookups */
+static struct prompt_image *prompt_store_read(const char *path, unsigned int hash, const char *fn)
+{
+	struct prompt_image *img;
+	struct stat st;
+	ssize_t res;
+	size_t got;
+	int fd;
+
+	if ((fd = open(fn, O_RDONLY)) < 0)
+		return NULL;
+	/* A single long file isn't allowed to push everything else out */
+	if (fstat(fd, &st)  ||  !S_ISREG(st.st_mode)  ||  st.st_size < 1
+		||  st.st_size > (off_t) option_prompt_cache*1024/8) {
+		close(fd);
+		return NULL;
+	}
+	if (!(img = malloc(sizeof(*img) + strlen(path) + 1))  ||  !(img->data = malloc(st.st_size))) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		free(img);
+		close(fd);
+		return NULL;
+	}
+	for (got = 0;  got < st.st_size;  got += res) {
+		if ((res = read(fd, img->data + got, st.st_size - got)) <= 0) {
+			if (res < 0  &&  errno == EINTR) {
+				res = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	close(fd);
+	if (got < st.st_size) {
+		/* Shrunk while we were reading it */
+		prompt_image_free(img);
+		return NULL;
+	}
+	strcpy(img->path, path);
+	img->hash = hash;
+	img->refs = 0;
+	img->stale = 0;
+	img->len = got;
+	return img;
+}
+
+static void prompt_store_release(struct prompt_image *img)
+{
+	if (!img)
+		return;
+	cw_mutex_lock(&promptlock);
+	if (--img->refs == 0  &&  img->stale)
+		prompt_image_free(img);
+	cw_mutex_unlock(&promptlock);
+}
+
+/*! Opens an indexed prompt file for reading, from the store if it can.
+ *  *image is set to the image the stream reads, to be handed back with
+ *  prompt_store_release() once the stream is closed */
+static FILE *prompt_store_open(const char *filename, const char *ext, const char *fn, struct prompt_image **image)
+{
+	struct prompt_image *img = NULL;
+	struct prompt_image *loaded;
+	char path[PATH_MAX];
+	unsigned int hash;
+	unsigned long gen;
+	FILE *bfile;
+
+	*image = NULL;
+	if (option_prompt_cache <= 0)
+		return fopen(fn, "r");
+
+	/* Keep in step with build_filename() */
+	snprintf(path, sizeof(path), "%s.%s", filename, strcmp(ext, "wav49") ? ext : "WAV");
+	hash = prompt_hash(path, strlen(path));
+
+	cw_mutex_lock(&promptlock);
+	if ((img = prompt_store_find(path, hash))) {
+		prompt_store_hits++;
+	} else {
+		gen = prompt_store_gen;
+		cw_mutex_unlock(&promptlock);
+		if (!(loaded = prompt_store_read(path, hash, fn)))
+			return fopen(fn, "r");
+		cw_mutex_lock(&promptlock);
+		if ((img = prompt_store_find(path, hash))) {
+			/* Another stream loaded it while we were reading */
+			prompt_image_free(loaded);
+			prompt_store_hits++;
+		} else if (gen != prompt_store_gen  ||  prompt_store_trim(loaded->len)) {
+			/* Files changed while we read it, or there is no room */
+			cw_mutex_unlock(&promptlock);
+			prompt_image_free(loaded);
+			return fopen(fn, "r");
+		} else {
+			img = loaded;
+			img->next = prompt_store[hash % PROMPT_STORE_BUCKETS];
+			prompt_store[hash % PROMPT_STORE_BUCKETS] = img;
+			prompt_store_bytes += img->len;
+			prompt_store_images++;
+			prompt_store_loads++;
+		}
+	}
+	img->lastuse = ++prompt_store_tick;
+	img->refs++;
+	cw_mutex_unlock(&promptlock);
+
+	if (!(bfile = fmemopen(img->data, img->len, "r"))) {
+		prompt_store_release(img);
+		return fopen(fn, "r");
+	}
+	*image = img;
+	return bfile;
+}
+
+#else
+#define prompt_store_drop(path)
+#define prompt_store_drop_dir(dir)
+#endif /* HAVE_FMEMOPEN */
+
+static struct prompt_entry *prompt_find(const char *name, size_t len, unsigned int hash)
+{
+	struct prompt_entry *e;
+
+	for (e = prompt_index[hash % PROMPT_INDEX_BUCKETS];  e;  e = e->next) {
+		if (e->hash == hash  &&  !strncmp(e->name, name, len)  &&  !e->name[len])
+			return e;
+	}
+	return NULL;
+}
+
+static char *prompt_has_type(const char *exts, const char *type)
+{
+	char tmp[18];
+
+	snprintf(tmp, sizeof(tmp), "|%s|", type);
+	return strstr(exts, tmp);
+}
+
+/*! Checks whether the "|ext|" list holds the file extension used for ext */
+static int prompt_ext_listed(const char *exts, const char *ext)
+{
+	/* Keep in step with build_filename() */
+	return prompt_has_type(exts, strcmp(ext, "wav49") ? ext : "WAV") != NULL;
+}
+
+/*! Splits path into the indexed name and its extension */
+static const char *prompt_split(const char *path, size_t *namelen)
+{
+	const char *dot;
+
+	dot = strrchr(path, '.');
+	if (!dot  ||  dot == path  ||  dot[-1] == '/'  ||  strchr(dot, '/')  ||  !dot[1]  ||  strlen(dot + 1) > 15)
+		return NULL;
+	*namelen = dot - path;
+	return dot + 1;
+}
+
+static void prompt_add_file(const char *path)
+{
+	struct prompt_entry *e;
+	const char *ext;
+	size_t len;
+	size_t oldlen;
+	unsigned int hash;
+	char *exts;
+
+	if (!(ext = prompt_split(path, &len)))
+		return;
+	hash = prompt_hash(path, len);
+	if (!(e = prompt_find(path, len, hash))) {
+		if (!(e = malloc(sizeof(*e) + len + 1))) {
+			cw_log(LOG_WARNING, "Out of memory\n");
+			return;
+		}
+		memcpy(e->name, path, len);
+		e->name[len] = '\0';
+		e->hash = hash;
+		e->exts = NULL;
+		e->next = prompt_index[hash % PROMPT_INDEX_BUCKETS];
+		prompt_index[hash % PROMPT_INDEX_BUCKETS] = e;
+		prompt_entries++;
+	} else if (prompt_has_type(e->exts, ext)) {
+		return;
+	}
+
+	oldlen = e->exts ? strlen(e->exts) : 1;
+	if (!(exts = realloc(e->exts, oldlen + strlen(ext) + 2))) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		return;
+	}
+	if (!e->exts)
+		strcpy(exts, "|");
+	strcat(exts, ext);
+	strcat(exts, "|");
+	e->exts = exts;
+}
+
+static void prompt_unlink(struct prompt_entry *e)
+{
+	struct prompt_entry **pe;
+
+	for (pe = &prompt_index[e->hash % PROMPT_INDEX_BUCKETS];  *pe;  pe = &(*pe)->next) {
+		if (*pe == e) {
+			*pe = e->next;
+			break;
+		}
+	}
+	free(e->exts);
+	free(e);
+	prompt_entries--;
+}
+
+static void prompt_del_file(const char *path)
+{
+	struct prompt_entry *e;
+	const char *ext;
+	char *p;
+	size_t len;
+
+	if (!(ext = prompt_split(path, &len))  ||  !(e = prompt_find(path, len, prompt_hash(path, len))))
+		return;
+	if ((p = prompt_has_type(e->exts, ext))) {
+		/* Drop "|ext", keeping the following '|' */
+		memmove(p, p + strlen(ext) + 1, strlen(p + strlen(ext) + 1) + 1);
+		if (!strcmp(e->exts, "|"))
+			prompt_unlink(e);
+	}
+}
+
+static int prompt_under(const char *path, const char *dir, size_t dirlen)
+{
+	return !dirlen  ||  (!strncmp(path, dir, dirlen)  &&  (!path[dirlen]  ||  path[dirlen] == '/'));
+}
+
+/*! Forgets a directory that went away: its prompts, and the watches on it
+ *  and below it */
+static void prompt_del_dir(const char *dir)
+{
+	struct prompt_watch **pw;
+	struct prompt_watch *w;
+	struct prompt_watch *o;
+	struct prompt_entry *e;
+	struct prompt_entry *next;
+	size_t dirlen = strlen(dir);
+	int found = 0;
+	int x;
+
+	if (!dirlen) {
+		/* The sounds directory itself went away */
+		cw_log(LOG_WARNING, "%s is gone, prompts will be looked up on disk\n", cw_config_CW_SOUNDS_DIR);
+		prompt_index_clear();
+		return;
+	}
+	for (pw = &prompt_watches;  (w = *pw);  ) {
+		if (!prompt_under(w->dir, dir, dirlen)) {
+			pw = &w->next;
+			continue;
+		}
+		*pw = w->next;
+		/* The same directory may also be reached through a symlink */
+		for (o = prompt_watches;  o  &&  o->wd != w->wd;  o = o->next)
+			;
+		if (!o)
+			inotify_rm_watch(prompt_fd, w->wd);
+		free(w);
+		prompt_dirs--;
+		found = 1;
+	}
+	if (!found)
+		return;
+
+	prompt_store_drop_dir(dir);
+	for (x = 0;  x < PROMPT_INDEX_BUCKETS;  x++) {
+		for (e = prompt_index[x];  e;  e = next) {
+			next = e->next;
+			if (!strncmp(e->name, dir, dirlen)  &&  e->name[dirlen] == '/')
+				prompt_unlink(e);
+		}
+	}
+}
+
+static void prompt_index_clear(void)
+{
+	struct prompt_entry *e;
+	struct prompt_watch *w;
+	int x;
+
+	for (x = 0;  x < PROMPT_INDEX_BUCKETS;  x++) {
+		while ((e = prompt_index[x])) {
+			prompt_index[x] = e->next;
+			free(e->exts);
+			free(e);
+		}
+	}
+	while ((w = prompt_watches)) {
+		prompt_watches = w->next;
+		free(w);
+	}
+	if (prompt_fd > -1)
+		close(prompt_fd);
+	prompt_fd = -1;
+	prompt_store_drop_dir("");
+	prompt_entries = 0;
+	prompt_dirs = 0;
+}
+
+/*! Picks up whatever appeared under path, a directory or a file */
+static int prompt_add_path(const char *path, int depth)
+{
+	char fn[PATH_MAX];
+	struct stat st;
+
+	snprintf(fn, sizeof(fn), "%s/%s", cw_config_CW_SOUNDS_DIR, path);
+	if (stat(fn, &st))
+		return 0;
+	if (S_ISDIR(st.st_mode))
+		return (depth < PROMPT_INDEX_MAXDEPTH)  ?  prompt_index_scan(path, depth + 1)  :  0;
+	if (S_ISREG(st.st_mode))
+		prompt_add_file(path);
+	return 0;
+}
+
+/*! Watches dir and indexes everything in and below it.  Returns -1 if the
+ *  directory could not be watched, as the index can't be trusted then */
+static int prompt_index_scan(const char *dir, int depth)
+{
+	char path[PATH_MAX];
+	struct prompt_watch *w;
+	struct dirent *de;
+	DIR *d;
+	int wd;
+	int res = 0;
+
+	snprintf(path, sizeof(path), "%s%s%s", cw_config_CW_SOUNDS_DIR, (dir[0] ? "/" : ""), dir);
+	if ((wd = inotify_add_watch(prompt_fd, path, PROMPT_WATCH_MASK)) < 0) {
+		cw_log(LOG_WARNING, "Unable to watch %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!(w = malloc(sizeof(*w) + strlen(dir) + 1))) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		return -1;
+	}
+	w->wd = wd;
+	strcpy(w->dir, dir);
+	w->next = prompt_watches;
+	prompt_watches = w;
+	prompt_dirs++;
+
+	if (!(d = opendir(path)))
+		return 0;
+	while (!res  &&  (de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s%s%s", dir, (dir[0] ? "/" : ""), de->d_name);
+		res = prompt_add_path(path, depth);
+	}
+	closedir(d);
+	return res;
+}
+
+/*! (Re)builds the index from scratch.  Leaves it disabled on failure */
+static int prompt_index_build(void)
+{
+	prompt_index_clear();
+	if (cw_strlen_zero(cw_config_CW_SOUNDS_DIR))
+		return -1;
+	if ((prompt_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		cw_log(LOG_WARNING, "Unable to create inotify instance, prompts will not be indexed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (prompt_index_scan("", 0)) {
+		cw_log(LOG_WARNING, "Unable to index %s, prompts will be looked up on disk\n", cw_config_CW_SOUNDS_DIR);
+		prompt_index_clear();
+		return -1;
+	}
+	prompt_rescans++;
+	if (option_verbose > 1)
+		cw_verbose(VERBOSE_PREFIX_2 "Indexed %d prompts in %d directories under %s\n", prompt_entries, prompt_dirs, cw_config_CW_SOUNDS_DIR);
+	return 0;
+}
+
+/*! Copies the directories the watch descriptor wd stands for, as the
+ *  watch list may change while an event is applied to them */
+static char **prompt_watch_dirs(int wd, int *count)
+{
+	struct prompt_watch *w;
+	char **dirs;
+	int n = 0;
+
+	for (w = prompt_watches;  w;  w = w->next) {
+		if (w->wd == wd)
+			n++;
+	}
+	if (!n  ||  !(dirs = malloc(n*sizeof(char *))))
+		return NULL;
+	n = 0;
+	for (w = prompt_watches;  w;  w = w->next) {
+		if (w->wd == wd  &&  (dirs[n] = strdup(w->dir)))
+			n++;
+	}
+	*count = n;
+	return dirs;
+}
+
+/*! Applies the queued inotify events.  Call with promptlock held */
+static void prompt_index_sync(void)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	const struct inotify_event *ev;
+	const char *c;
+	char **dirs;
+	ssize_t len;
+	char *p;
+	int depth;
+	int n;
+	int x;
+
+	while (prompt_fd > -1  &&  (len = read(prompt_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf;  prompt_fd > -1  &&  p < buf + len;  p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				cw_log(LOG_NOTICE, "Too many changes under %s, re-indexing prompts\n", cw_config_CW_SOUNDS_DIR);
+				prompt_index_build();
+				break;
+			}
+			if (!(ev->mask & IN_IGNORED)  &&  (!ev->len  ||  ev->name[0] == '.'))
+				continue;
+			if (!(dirs = prompt_watch_dirs(ev->wd, &n)))
+				continue;
+			for (x = 0;  x < n;  x++) {
+				if (ev->mask & IN_IGNORED) {
+					prompt_del_dir(dirs[x]);
+				} else {
+					snprintf(path, sizeof(path), "%s%s%s", dirs[x], (dirs[x][0] ? "/" : ""), ev->name);
+					/* Whatever happened to the file, an image of it is stale */
+					if (!(ev->mask & IN_ISDIR))
+						prompt_store_drop(path);
+					if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+						depth = (dirs[x][0] != '\0');
+						for (c = dirs[x];  *c;  c++)
+							depth += (*c == '/');
+						if (prompt_add_path(path, depth)) {
+							cw_log(LOG_WARNING, "Unable to index %s, prompts will be looked up on disk\n", cw_config_CW_SOUNDS_DIR);
+							prompt_index_clear();
+						}
+					} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+						/* A symlink to a directory comes without IN_ISDIR */
+						if (!(ev->mask & IN_ISDIR))
+							prompt_del_file(path);
+						prompt_del_dir(path);
+					}
+				}
+				if (prompt_fd < 0)
+					break;
+			}
+			for (x = 0;  x < n;  x++)
+				free(dirs[x]);
+			free(dirs);
+		}
+	}
+}
+
+/*! Looks a prompt up in the index.  Returns -1 if the index can't answer
+ *  for this file name, 0 if there is no such prompt, or 1 with the "|ext|"
+ *  list of its files copied to exts */
+static int prompt_index_lookup(const char *filename, char *exts, size_t extslen)
+{
+	struct prompt_entry *e;
+	const char *s;
+	size_t len;
+	int res;
+
+	/* Only plain relative names are indexed: no "//", "./", "../" or
+	   hidden components, which the index doesn't know how to resolve */
+	if (filename[0] == '/'  ||  filename[0] == '.'  ||  strstr(filename, "//")  ||  strstr(filename, "/."))
+		return -1;
+	len = strlen(filename);
+	if (!len  ||  filename[len - 1] == '/')
+		return -1;
+
+	cw_mutex_lock(&promptlock);
+	prompt_index_sync();
+	if (prompt_fd < 0) {
+		cw_mutex_unlock(&promptlock);
+		return -1;
+	}
+	if ((e = prompt_find(filename, len, prompt_hash(filename, len)))) {
+		s = e->exts;
+		if (strlen(s) >= extslen) {
+			/* Too many to copy; let the caller probe */
+			cw_mutex_unlock(&promptlock);
+			return -1;
+		}
+		strcpy(exts, s);
+		prompt_hits++;
+		res = 1;
+	} else {
+		prompt_misses++;
+		res = 0;
+	}
+	cw_mutex_unlock(&promptlock);
+	return res;
+}
+
+#else
+
+static int prompt_index_lookup(const char *filename, char *exts, size_t extslen)
+{
+	return -1;
+}
+
+static int prompt_ext_listed(const char *exts, const char *ext)
+{
+	return 0;
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+#if !defined(HAVE_SYS_INOTIFY_H)  ||  !defined(HAVE_FMEMOPEN)
+static FILE *prompt_store_open(const char *filename, const char *ext, const char *fn, struct prompt_image **image)
+{
+	*image = NULL;
+	return fopen(fn, "r");
+}
+
+static void prompt_store_release(struct prompt_image *img)
+{
+}
+#endif
+
 #define ACTION_EXISTS 1
 #define ACTION_DELETE 2
 #define ACTION_RENAME 3
@@ -354,6 +1303,9 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 	struct cw_filestream *s;
 	int res=0, ret = 0;
 	char *ext=NULL, *exts, *fn, *nfn;
+	char found[256];
+	int indexed = -1;
+	struct prompt_image *image;
 	FILE *bfile;
 	struct cw_channel *chan = (struct cw_channel *)filename2;
 	
@@ -364,6 +1316,11 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 		res = -1;
 	if (action == ACTION_OPEN)
 		ret = -1;
+	/* Prompts under the sounds directory are known without looking */
+	if (action == ACTION_EXISTS  ||  action == ACTION_OPEN) {
+		if ((indexed = prompt_index_lookup(filename, found, sizeof(found))) == 0)
+			return -1;
+	}
 	/* Check for a specific format */
 	if (cw_mutex_lock(&formatlock)) {
 		cw_log(LOG_WARNING, "Unable to lock format list\n");
@@ -384,10 +1341,20 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 			ext = strsep(&stringp, "|,");
 			do
             {
-				fn = build_filename(filename, ext);
+				if (indexed > 0  &&  action == ACTION_EXISTS)
+                {
+					if (prompt_ext_listed(found, ext))
+						ret |= f->format;
+					ext = strsep(&stringp, "|,");
+					continue;
+				}
+				if (indexed > 0  &&  !prompt_ext_listed(found, ext))
+					fn = NULL;
+				else
+					fn = build_filename(filename, ext);
 				if (fn)
                 {
-					res = stat(fn, &st);
+					res = (indexed > 0)  ?  0  :  stat(fn, &st);
 					if (!res)
                     {
 						switch(action)
@@ -430,7 +1397,12 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 						case ACTION_OPEN:
 							if ((ret < 0) && ((chan->writeformat & f->format) ||
 										((f->format >= CW_FORMAT_MAX_AUDIO) && fmt))) {
-								bfile = fopen(fn, "r");
+								if (indexed > 0)
+									bfile = prompt_store_open(filename, ext, fn, &image);
+								else {
+									bfile = fopen(fn, "r");
+									image = NULL;
+								}
 								if (bfile)
                                 {
 									ret = 1;
@@ -441,6 +1413,8 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 										s->fmt = f;
 										s->trans = NULL;
 										s->filename = NULL;
+										s->image = image;
+										s->writer = NULL;
 										if (s->fmt->format < CW_FORMAT_MAX_AUDIO)
 											chan->stream = s;
 										else
@@ -449,6 +1423,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
                                     else
                                     {
 										fclose(bfile);
+										prompt_store_release(image);
 										cw_log(LOG_WARNING, "Unable to open file on %s\n", fn);
 										ret = -1;
 									}
@@ -465,8 +1440,10 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 							break;
 						}
 						/* Conveniently this logic is the same for all */
-						if (res)
+						if (res) {
+							free(fn);
 							break;
+						}
 					}
 					free(fn);
 				}
@@ -680,16 +1657,22 @@ int cw_playstream(struct cw_filestream *s)
 
 int cw_seekstream(struct cw_filestream *fs, long sample_offset, int whence)
 {
+	if (fs->writer)
+		writer_flush(fs->writer);
 	return fs->fmt->seek(fs, sample_offset, whence);
 }
 
 int cw_truncstream(struct cw_filestream *fs)
 {
+	if (fs->writer)
+		writer_flush(fs->writer);
 	return fs->fmt->trunc(fs);
 }
 
 long cw_tellstream(struct cw_filestream *fs)
 {
+	if (fs->writer)
+		writer_flush(fs->writer);
 	return fs->fmt->tell(fs);
 }
 
@@ -712,6 +1695,7 @@ int cw_closestream(struct cw_filestream *f)
 {
 	char *realfname = f->realfilename;
 	char *fname = f->filename;
+	struct prompt_image *image = f->image;
 	char *cmd = NULL;
 	size_t size = 0;
 	/* Stop a running stream if there is one */
@@ -728,6 +1712,11 @@ int cw_closestream(struct cw_filestream *f)
 			f->owner->vstreamid = -1;
 		}
 	}
+	/* Everything queued goes to disk before the file is closed */
+	if (f->writer) {
+		writer_free(f->writer);
+		f->writer = NULL;
+	}
 	/* destroy the translator on exit */
 	if (f->trans) {
 		cw_translator_free_path(f->trans);
@@ -738,6 +1727,7 @@ int cw_closestream(struct cw_filestream *f)
 	 */
 	f->realfilename = f->filename = NULL;
 	f->fmt->close(f);
+	prompt_store_release(image);
 	if (realfname && fname) {
 		size = strlen(fname) + strlen(realfname) + 15;
 		cmd = alloca(size);
@@ -879,6 +1869,8 @@ struct cw_filestream *cw_readfile(const char *filename, const char *type, const
 			fs->mode = mode;
 			fs->filename = strdup(filename);
 			fs->vfs = NULL;
+			fs->image = NULL;
+			fs->writer = NULL;
 		} else if (errno != EEXIST)
 			cw_log(LOG_WARNING, "Unable to open file %s: %s\n", fn, strerror(errno));
 		free(fn);
@@ -969,6 +1961,9 @@ struct cw_filestream *cw_writefile(const char *filename, const char *type, const
 		}
 		if (fd > -1) {
 			errno = 0;
+			/* Let the writer threads hand the disk big writes */
+			if (writer_threads)
+				setvbuf(bfile, NULL, _IOFBF, WRITER_BUFSIZE);
 			if ((fs = f->rewrite(bfile, comment))) {
 				fs->trans = NULL;
 				fs->fmt = f;
@@ -982,6 +1977,8 @@ struct cw_filestream *cw_writefile(const char *filename, const char *type, const
 					fs->filename = strdup(filename);
 				}
 				fs->vfs = NULL;
+				fs->image = NULL;
+				fs->writer = writer_new(fs);
 			} else {
 				cw_log(LOG_WARNING, "Unable to rewrite %s\n", fn);
 				close(fd);
@@ -1304,8 +2301,79 @@ struct cw_cli_entry show_file =
 	"       displays currently registered file formats (if any)\n"
 };
 
+static int show_file_writers(int fd, int argc, char *argv[])
+{
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&writerlock);
+	if (!writer_threads) {
+		cw_cli(fd, "Recordings are written from the threads recording them\n");
+	} else {
+		cw_cli(fd, "Writer threads: %d, streams: %d\n", writer_threads, writer_streams);
+		cw_cli(fd, "Queued: %ld bytes, at most %ld bytes, at most %d bytes for one stream (limit %d)\n", writer_queued, writer_hwm, writer_stream_hwm, WRITER_MAXQUEUE);
+		cw_cli(fd, "Written: %lu frames in %lu batches\n", writer_frames, writer_batches);
+		cw_cli(fd, "Callers held up by a full queue: %lu times, %lu ms in all\n", writer_stalls, writer_stall_ms);
+		cw_cli(fd, "Streams that failed to write: %lu\n", writer_failures);
+	}
+	cw_mutex_unlock(&writerlock);
+	return RESULT_SUCCESS;
+}
+
+static struct cw_cli_entry show_file_writers_cli =
+{
+	{ "show", "file", "writers" },
+	show_file_writers,
+	"Displays recording writer statistics",
+	"Usage: show file writers\n"
+	"       shows how much recorded audio is waiting for the disk, the most\n"
+	"       that ever has, and how often calls had to wait for it\n"
+};
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int show_file_index(int fd, int argc, char *argv[])
+{
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&promptlock);
+	prompt_index_sync();
+	if (prompt_fd < 0) {
+		cw_cli(fd, "Prompts under %s are not indexed and are looked up on disk\n", cw_config_CW_SOUNDS_DIR);
+	} else {
+		cw_cli(fd, "Prompts indexed: %d in %d directories under %s\n", prompt_entries, prompt_dirs, cw_config_CW_SOUNDS_DIR);
+		cw_cli(fd, "Lookups: %lu found, %lu not found\n", prompt_hits, prompt_misses);
+		cw_cli(fd, "Index builds: %lu\n", prompt_rescans);
+	}
+#ifdef HAVE_FMEMOPEN
+	cw_cli(fd, "Prompts in memory: %d, %lu of %d KB\n", prompt_store_images, (unsigned long) prompt_store_bytes/1024, option_prompt_cache);
+	cw_cli(fd, "Playbacks: %lu from memory, %lu loads\n", prompt_store_hits, prompt_store_loads);
+#endif
+	cw_mutex_unlock(&promptlock);
+	return RESULT_SUCCESS;
+}
+
+static struct cw_cli_entry show_file_index_cli =
+{
+	{ "show", "file", "index" },
+	show_file_index,
+	"Displays the prompt index",
+	"Usage: show file index\n"
+	"       shows how many prompts under the sounds directory are indexed,\n"
+	"       how lookups in the index went and which prompts are kept in memory\n"
+};
+#endif
+
 int cw_file_init(void)
 {
+	writer_init();
 	cw_cli_register(&show_file);
+	cw_cli_register(&show_file_writers_cli);
+#ifdef HAVE_SYS_INOTIFY_H
+	cw_mutex_lock(&promptlock);
+	prompt_index_build();
+	cw_mutex_unlock(&promptlock);
+	cw_cli_register(&show_file_index_cli);
+#endif
 	return 0;
 }
@@ -30,6 +30,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "callweaver.h"
 
@@ -46,6 +49,9 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/enum.h"
 #include "callweaver/lock.h"
 #include "callweaver/rtp.h"
+#include "callweaver/cli.h"
+#include "callweaver/time.h"
+#include "callweaver/utils.h"
 #include "libltdl/ltdl.h"
 
 #ifndef RTLD_NOW
@@ -64,8 +70,11 @@ struct module {
 	int (*usecount)(void);
 	char *(*description)(void);
 	int (*reload)(void);
+	char *(*depends)(void);
 	void *lib;
 	char resource[256];
+	int open_ms;			/* Time taken to open it */
+	int load_ms;			/* Time its load_module() took */
 	struct module *next;
 };
 
@@ -221,17 +230,17 @@ int cw_module_reload(const char *name)
 	return reloaded;
 }
 
-static int __load_resource(const char *resource_name, const struct cw_config *cfg)
+/* Open a module and add it to the list, without loading it yet */
+static struct module *module_open(const char *resource_name, const struct cw_config *cfg)
 {
-	static char fn[256];
+	char fn[256];
 	int errors=0;
-	int res;
 	struct module *m;
+	struct timeval start;
 //	int flags=RTLD_NOW;
 #ifdef RTLD_GLOBAL
 	char *val;
 #endif
-	char tmp[80];
 
 	if (strncasecmp(resource_name, "res_", 4)) {
 #ifdef RTLD_GLOBAL
@@ -250,6 +259,7 @@ static int __load_resource(const char *resource_name, const struct cw_config *cf
 #endif
 	}
 	
+	start = cw_tvnow();
 	if (cw_mutex_lock(&modlock))
 		cw_log(LOG_WARNING, "Failed to lock\n");
 	m = module_list;
@@ -257,19 +267,20 @@ static int __load_resource(const char *resource_name, const struct cw_config *cf
 		if (!strcasecmp(m->resource, resource_name)) {
 			cw_log(LOG_WARNING, "Module '%s' already exists\n", resource_name);
 			cw_mutex_unlock(&modlock);
-			return -1;
+			return NULL;
 		}
 		m = m->next;
 	}
-	m = malloc(sizeof(struct module));	
+	m = calloc(1, sizeof(struct module));	
 	if (!m) {
 		cw_log(LOG_WARNING, "Out of memory\n");
 		cw_mutex_unlock(&modlock);
-		return -1;
+		return NULL;
 	}
 	strncpy(m->resource, resource_name, sizeof(m->resource)-1);
 	if (resource_name[0] == '/') {
 		strncpy(fn, resource_name, sizeof(fn)-1);
+		fn[sizeof(fn)-1] = '\0';
 	} else {
 		snprintf(fn, sizeof(fn), "%s/%s", (char *)cw_config_CW_MODULE_DIR, resource_name);
 	}
@@ -278,7 +289,7 @@ static int __load_resource(const char *resource_name, const struct cw_config *cf
 		cw_log(LOG_WARNING, "%s\n", lt_dlerror());
 		free(m);
 		cw_mutex_unlock(&modlock);
-		return -1;
+		return NULL;
 	}
 	m->load_module = lt_dlsym(m->lib, "load_module");
 	if (m->load_module == NULL)
@@ -313,21 +324,16 @@ static int __load_resource(const char *resource_name, const struct cw_config *cf
 	if (m->reload == NULL)
 		m->reload = lt_dlsym(m->lib, "_reload");
 
+	m->depends = lt_dlsym(m->lib, "depends");
+	if (m->depends == NULL)
+		m->depends = lt_dlsym(m->lib, "_depends");
+
 	if (errors) {
 		cw_log(LOG_WARNING, "%d error%s loading module %s, aborted\n", errors, (errors != 1) ? "s" : "", fn);
 		lt_dlclose(m->lib);
 		free(m);
 		cw_mutex_unlock(&modlock);
-		return -1;
-	}
-	if (!fully_booted) {
-		if (option_verbose) 
-			cw_verbose( " => (%s)\n", cw_term_color(tmp, m->description(), COLOR_BROWN, COLOR_BLACK, sizeof(tmp)));
-		if (option_console && !option_verbose)
-			cw_verbose( ".");
-	} else {
-		if (option_verbose)
-			cw_verbose(VERBOSE_PREFIX_1 "Loaded %s => (%s)\n", fn, m->description());
+		return NULL;
 	}
 
 	/* add module 'm' to end of module_list chain
@@ -346,16 +352,81 @@ static int __load_resource(const char *resource_name, const struct cw_config *cf
 	}
 	
 	modlistver ++;
+	m->open_ms = cw_tvdiff_ms(cw_tvnow(), start);
 	cw_mutex_unlock(&modlock);
+	return m;
+}
+
+/* Undo module_open() */
+static void module_close(const char *resource_name)
+{
+	struct module *m, *ml = NULL;
+
+	if (cw_mutex_lock(&modlock))
+		cw_log(LOG_WARNING, "Failed to lock\n");
+	for (m = module_list;  m;  ml = m, m = m->next) {
+		if (!strcasecmp(m->resource, resource_name)) {
+			if (ml)
+				ml->next = m->next;
+			else
+				module_list = m->next;
+			lt_dlclose(m->lib);
+			free(m);
+			modlistver++;
+			break;
+		}
+	}
+	cw_mutex_unlock(&modlock);
+}
+
+/* Run the load_module() of an opened module */
+static int module_run(struct module *m)
+{
+	struct timeval start;
+	int res;
+
+	start = cw_tvnow();
 	if ((res = m->load_module())) {
 		cw_log(LOG_WARNING, "%s: load_module failed, returning %d\n", m->resource, res);
-		cw_unload_resource(resource_name, 0);
 		return -1;
 	}
+	m->load_ms = cw_tvdiff_ms(cw_tvnow(), start);
 	cw_update_use_count();
 	return 0;
 }
 
+/* Run the load_module() of an opened module, which is unloaded if it fails */
+static int module_start(struct module *m)
+{
+	char resource[256];
+
+	if (module_run(m)) {
+		cw_copy_string(resource, m->resource, sizeof(resource));
+		cw_unload_resource(resource, 0);
+		return -1;
+	}
+	return 0;
+}
+
+static int __load_resource(const char *resource_name, const struct cw_config *cfg)
+{
+	struct module *m;
+	char tmp[80];
+
+	if (!(m = module_open(resource_name, cfg)))
+		return -1;
+	if (!fully_booted) {
+		if (option_verbose) 
+			cw_verbose( " => (%s)\n", cw_term_color(tmp, m->description(), COLOR_BROWN, COLOR_BLACK, sizeof(tmp)));
+		if (option_console && !option_verbose)
+			cw_verbose( ".");
+	} else {
+		if (option_verbose)
+			cw_verbose(VERBOSE_PREFIX_1 "Loaded %s => (%s)\n", m->resource, m->description());
+	}
+	return module_start(m);
+}
+
 int cw_load_resource(const char *resource_name)
 {
 	int o;
@@ -399,11 +470,263 @@ static const char *loadorder[] =
 	NULL,
 };
 
+/* How many modules load at once at startup, unless modules.conf says.
+   Not every module's load_module() is safe to run alongside the others,
+   so they load one after another unless asked otherwise. */
+#define LOAD_THREADS	1
+
+#define LOAD_WAITING	0
+#define LOAD_RUNNING	1
+#define LOAD_DONE	2
+#define LOAD_FAILED	3
+
+/* A module being loaded at startup */
+struct load_job {
+	struct module *m;
+	char resource[256];
+	struct load_job **deps;		/* Modules of the same kind it needs first */
+	int ndeps;
+	int state;
+	int ran;			/* Its load_module() was called */
+};
+
+/* All the modules of one kind */
+struct load_set {
+	struct load_job *jobs;
+	int njobs;
+	int running;
+	int failed;
+	cw_mutex_t lock;
+	cw_cond_t cond;
+};
+
+struct noload {
+	struct noload *next;
+	unsigned int hash;
+	const char *name;
+};
+
+#define NOLOAD_BUCKETS	64
+
+static unsigned int noload_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)tolower(*name++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int noload_find(struct noload **noload, const char *name)
+{
+	unsigned int hash = noload_hash(name);
+	struct noload *n;
+
+	for (n = noload[hash % NOLOAD_BUCKETS];  n;  n = n->next) {
+		if (n->hash == hash && !strcasecmp(n->name, name))
+			return 1;
+	}
+	return 0;
+}
+
+/* Work out which modules of the set each one has to wait for */
+static void load_set_depends(struct load_set *set)
+{
+	struct load_job *job;
+	char *deps, *dep, *next;
+	int x, y;
+
+	for (x = 0;  x < set->njobs;  x++) {
+		job = &set->jobs[x];
+		if (!job->m->depends || !(deps = job->m->depends()) || !(deps = strdup(deps)))
+			continue;
+		for (next = deps;  (dep = strsep(&next, " \t,"));  ) {
+			if (!*dep)
+				continue;
+			for (y = 0;  y < set->njobs;  y++) {
+				if (!strcasecmp(set->jobs[y].resource, dep))
+					break;
+			}
+			if (y < set->njobs) {
+				if (y == x)
+					continue;
+				if ((job->deps = realloc(job->deps, (job->ndeps + 1) * sizeof(*job->deps))))
+					job->deps[job->ndeps++] = &set->jobs[y];
+				else
+					job->ndeps = 0;
+			} else if (!cw_resource_exists(dep)) {
+				cw_log(LOG_WARNING, "%s needs %s, which isn't loaded\n", job->resource, dep);
+			}
+		}
+		free(deps);
+	}
+}
+
+/* Load whatever modules of the set are ready to be, until none are left */
+static void *load_set_run(void *data)
+{
+	struct load_set *set = data;
+	struct load_job *job;
+	char tmp[80];
+	int waiting, changed, res, x, y;
+
+	cw_mutex_lock(&set->lock);
+	for (;;) {
+		job = NULL;
+		waiting = changed = 0;
+		for (x = 0;  x < set->njobs  &&  !job;  x++) {
+			if (set->jobs[x].state != LOAD_WAITING)
+				continue;
+			res = LOAD_DONE;
+			for (y = 0;  y < set->jobs[x].ndeps;  y++) {
+				if (set->jobs[x].deps[y]->state == LOAD_FAILED) {
+					res = LOAD_FAILED;
+					break;
+				}
+				if (set->jobs[x].deps[y]->state != LOAD_DONE)
+					res = LOAD_WAITING;
+			}
+			if (res == LOAD_FAILED) {
+				cw_log(LOG_WARNING, "Not loading %s, %s failed\n", set->jobs[x].resource, set->jobs[x].deps[y]->resource);
+				set->jobs[x].state = LOAD_FAILED;
+				set->failed++;
+				changed = 1;
+			} else if (res == LOAD_WAITING) {
+				waiting++;
+			} else {
+				job = &set->jobs[x];
+			}
+		}
+		if (job) {
+			job->state = LOAD_RUNNING;
+			job->ran = 1;
+			set->running++;
+			cw_mutex_unlock(&set->lock);
+
+			if (option_debug && !option_verbose)
+				cw_log(LOG_DEBUG, "Loading module %s\n", job->resource);
+			res = module_run(job->m);
+			if (!res) {
+				if (option_verbose) {
+					cw_verbose(VERBOSE_PREFIX_1 "[%s] => (%s) %d ms\n", job->resource,
+						cw_term_color(tmp, job->m->description(), COLOR_BROWN, COLOR_BLACK, sizeof(tmp)),
+						job->m->open_ms + job->m->load_ms);
+				} else if (option_console) {
+					cw_verbose(".");
+				}
+			}
+
+			cw_mutex_lock(&set->lock);
+			set->running--;
+			if (res) {
+				job->state = LOAD_FAILED;
+				set->failed++;
+			} else {
+				job->state = LOAD_DONE;
+			}
+			cw_cond_broadcast(&set->cond);
+			continue;
+		}
+		if (changed)
+			continue;
+		if (!waiting)
+			break;
+		if (!set->running) {
+			/* Everything left is waiting for something else that is left */
+			for (x = 0;  x < set->njobs;  x++) {
+				if (set->jobs[x].state == LOAD_WAITING) {
+					cw_log(LOG_WARNING, "Not loading %s, it depends on itself through another module\n", set->jobs[x].resource);
+					set->jobs[x].state = LOAD_FAILED;
+					set->failed++;
+				}
+			}
+			cw_cond_broadcast(&set->cond);
+			break;
+		}
+		cw_cond_wait(&set->cond, &set->lock);
+	}
+	cw_mutex_unlock(&set->lock);
+	return NULL;
+}
+
+/* Open the named modules one after another, then run their load_module()s
+   on as many threads as we're allowed, each once the modules it depends on
+   are loaded */
+static int load_set(char **names, int n, const struct cw_config *cfg, int threads)
+{
+	struct load_set set;
+	pthread_t *tids;
+	int x, started = 0;
+
+	if (!n)
+		return 0;
+	memset(&set, 0, sizeof(set));
+	if (!(set.jobs = calloc(n, sizeof(*set.jobs))))
+		return -1;
+	for (x = 0;  x < n;  x++) {
+		if (!(set.jobs[set.njobs].m = module_open(names[x], cfg))) {
+			cw_log(LOG_WARNING, "Loading module %s failed!\n", names[x]);
+			set.failed++;
+			break;
+		}
+		cw_copy_string(set.jobs[set.njobs].resource, names[x], sizeof(set.jobs[0].resource));
+		set.njobs++;
+	}
+	if (set.failed) {
+		/* As if none of them had been opened */
+		for (x = 0;  x < set.njobs;  x++)
+			module_close(set.jobs[x].resource);
+		free(set.jobs);
+		return -1;
+	}
+	load_set_depends(&set);
+
+	cw_mutex_init(&set.lock);
+	cw_cond_init(&set.cond, NULL);
+	if (threads > set.njobs)
+		threads = set.njobs;
+	if (threads > 1 && (tids = malloc((threads - 1) * sizeof(*tids)))) {
+		for (started = 0;  started < threads - 1;  started++) {
+			if (cw_pthread_create(&tids[started], NULL, load_set_run, &set)) {
+				cw_log(LOG_WARNING, "Unable to start module loading thread: %s\n", strerror(errno));
+				break;
+			}
+		}
+	} else {
+		tids = NULL;
+	}
+	load_set_run(&set);
+	for (x = 0;  x < started;  x++)
+		pthread_join(tids[x], NULL);
+	free(tids);
+	cw_cond_destroy(&set.cond);
+	cw_mutex_destroy(&set.lock);
+
+	/* Only now that no load_module() is running can libraries be closed */
+	for (x = 0;  x < set.njobs;  x++) {
+		if (set.jobs[x].state != LOAD_FAILED)
+			continue;
+		if (set.jobs[x].ran)
+			cw_unload_resource(set.jobs[x].resource, 0);
+		else
+			module_close(set.jobs[x].resource);
+	}
+	for (x = 0;  x < set.njobs;  x++)
+		free(set.jobs[x].deps);
+	free(set.jobs);
+	return set.failed  ?  -1  :  0;
+}
+
 int load_modules(const int preload_only)
 {
 	struct cw_config *cfg;
 	struct cw_variable *v;
+	struct timeval start;
 	char tmp[80];
+	char *val;
+	int threads = LOAD_THREADS;
 
 	if (option_verbose) {
 		if (preload_only)
@@ -412,6 +735,7 @@ int load_modules(const int preload_only)
 			cw_verbose("CallWeaver Dynamic Loader Starting:\n");
 	}
 
+	start = cw_tvnow();
 	cfg = cw_config_load(CW_MODULE_CONFIG);
 	if (cfg) {
 		int doload;
@@ -439,6 +763,11 @@ int load_modules(const int preload_only)
 				}
 			}
 		}
+		if ((val = cw_variable_retrieve(cfg, "modules", "loadthreads"))
+				&& (sscanf(val, "%d", &threads) != 1 || threads < 1)) {
+			cw_log(LOG_WARNING, "Invalid loadthreads '%s', using %d\n", val, LOAD_THREADS);
+			threads = LOAD_THREADS;
+		}
 	}
 
 	if (preload_only) {
@@ -448,61 +777,83 @@ int load_modules(const int preload_only)
 
 	if (!cfg || cw_true(cw_variable_retrieve(cfg, "modules", "autoload"))) {
 		/* Load all modules */
+		struct noload *noload[NOLOAD_BUCKETS], *nl;
+		char **names = NULL, **phase;
+		int nnames = 0, nphase;
 		DIR *mods;
 		struct dirent *d;
-		int x;
-
-		/* Loop through each order */
-		for (x=0; x<sizeof(loadorder) / sizeof(loadorder[0]); x++) {
-			mods = opendir((char *)cw_config_CW_MODULE_DIR);
-			if (mods) {
-				while((d = readdir(mods))) {
-					/* Must end in .so to load it.  */
-					if ((strlen(d->d_name) > 3) && 
-					    (!loadorder[x] || !strncasecmp(d->d_name, loadorder[x], strlen(loadorder[x]))) && 
-					    !strcasecmp(d->d_name + strlen(d->d_name) - 3, ".so") &&
-						!cw_resource_exists(d->d_name)) {
-						/* It's a shared library -- Just be sure we're allowed to load it -- kinda
-						   an inefficient way to do it, but oh well. */
-						if (cfg) {
-							v = cw_variable_browse(cfg, "modules");
-							while(v) {
-								if (!strcasecmp(v->name, "noload") &&
-								    !strcasecmp(v->value, d->d_name)) 
-									break;
-								v = v->next;
-							}
-							if (v) {
-								if (option_verbose) {
-									cw_verbose( VERBOSE_PREFIX_1 "[skipping %s]\n", d->d_name);
-									fflush(stdout);
-								}
-								continue;
-							}
-							
-						}
-						if (option_debug && !option_verbose)
-							cw_log(LOG_DEBUG, "Loading module %s\n", d->d_name);
-						if (option_verbose) {
-							cw_verbose( VERBOSE_PREFIX_1 "[%s]", cw_term_color(tmp, d->d_name, COLOR_BRWHITE, 0, sizeof(tmp)));
-							fflush(stdout);
-						}
-						if (__load_resource(d->d_name, cfg)) {
-							cw_log(LOG_WARNING, "Loading module %s failed!\n", d->d_name);
-							if (cfg)
-								cw_config_destroy(cfg);
-							return -1;
-						}
+		int x, y, res = 0;
+
+		memset(noload, 0, sizeof(noload));
+		for (v = cfg ? cw_variable_browse(cfg, "modules") : NULL;  v;  v = v->next) {
+			if (!strcasecmp(v->name, "noload") && (nl = malloc(sizeof(*nl)))) {
+				nl->name = v->value;
+				nl->hash = noload_hash(v->value);
+				nl->next = noload[nl->hash % NOLOAD_BUCKETS];
+				noload[nl->hash % NOLOAD_BUCKETS] = nl;
+			}
+		}
+
+		mods = opendir((char *)cw_config_CW_MODULE_DIR);
+		if (mods) {
+			while((d = readdir(mods))) {
+				/* Must end in .so to load it.  */
+				if ((strlen(d->d_name) <= 3) || strcasecmp(d->d_name + strlen(d->d_name) - 3, ".so") || cw_resource_exists(d->d_name))
+					continue;
+				if (noload_find(noload, d->d_name)) {
+					if (option_verbose) {
+						cw_verbose( VERBOSE_PREFIX_1 "[skipping %s]\n", d->d_name);
+						fflush(stdout);
 					}
+					continue;
 				}
-				closedir(mods);
-			} else {
-				if (!option_quiet)
-					cw_log(LOG_WARNING, "Unable to open modules directory %s.\n", (char *)cw_config_CW_MODULE_DIR);
+				if (!(nnames % 64) && !(names = realloc(names, (nnames + 64) * sizeof(*names)))) {
+					nnames = 0;
+					break;
+				}
+				if ((names[nnames] = strdup(d->d_name)))
+					nnames++;
+			}
+			closedir(mods);
+		} else {
+			if (!option_quiet)
+				cw_log(LOG_WARNING, "Unable to open modules directory %s.\n", (char *)cw_config_CW_MODULE_DIR);
+		}
+		for (x = 0;  x < NOLOAD_BUCKETS;  x++) {
+			while ((nl = noload[x])) {
+				noload[x] = nl->next;
+				free(nl);
+			}
+		}
+
+		/* Each kind of module in turn, every one of a kind at once */
+		if ((phase = malloc((nnames + 1) * sizeof(*phase)))) {
+			for (x = 0;  x < sizeof(loadorder) / sizeof(loadorder[0])  &&  !res;  x++) {
+				nphase = 0;
+				for (y = 0;  y < nnames;  y++) {
+					if (names[y] && (!loadorder[x] || !strncasecmp(names[y], loadorder[x], strlen(loadorder[x])))) {
+						phase[nphase++] = names[y];
+						names[y] = NULL;
+					}
+				}
+				res = load_set(phase, nphase, cfg, threads);
+				for (y = 0;  y < nphase;  y++)
+					free(phase[y]);
 			}
+			free(phase);
+		}
+		for (y = 0;  y < nnames;  y++)
+			free(names[y]);
+		free(names);
+		if (res) {
+			if (cfg)
+				cw_config_destroy(cfg);
+			return -1;
 		}
 	} 
 	cw_config_destroy(cfg);
+	if (option_verbose)
+		cw_verbose(VERBOSE_PREFIX_1 "Modules loaded in %d ms\n", cw_tvdiff_ms(cw_tvnow(), start));
 	return 0;
 }
 
@@ -582,8 +933,39 @@ int cw_loader_unregister(int (*v)(void))
 	return res;
 }
 
+static int show_modules_times(int fd, int argc, char *argv[])
+{
+	struct module *m;
+	int open_ms = 0, load_ms = 0;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_cli(fd, "%-30s %8s %8s\n", "Module", "Open ms", "Load ms");
+	cw_mutex_lock(&modlock);
+	for (m = module_list;  m;  m = m->next) {
+		cw_cli(fd, "%-30s %8d %8d\n", m->resource, m->open_ms, m->load_ms);
+		open_ms += m->open_ms;
+		load_ms += m->load_ms;
+	}
+	cw_mutex_unlock(&modlock);
+	cw_cli(fd, "%-30s %8d %8d\n", "Total", open_ms, load_ms);
+	return RESULT_SUCCESS;
+}
+
+static struct cw_cli_entry show_modules_times_cli =
+{
+	{ "show", "modules", "times", NULL },
+	show_modules_times,
+	"Shows how long modules took to load",
+	"Usage: show modules times\n"
+	"       shows how long each module took to open and to run its\n"
+	"       load_module(), which at startup may run alongside others\n"
+};
+
 int cw_loader_init(void)
 {
+	cw_cli_register(&show_modules_times_cli);
 	return lt_dlinit();
 }
 
@@ -77,15 +77,30 @@ static int syslog_level_map[] = {
 
 #if defined(__linux__)
 #define GETTID() ((unsigned long)pthread_self())
+#define TIDTYPE unsigned long
 #define TIDFMT "%lu"
 #elif defined(__solaris__)
 #define GETTID() ((unsigned int)pthread_self())
+#define TIDTYPE unsigned int
 #define TIDFMT "%u"
 #else
 #define GETTID() ((long)getpid())
+#define TIDTYPE long
 #define TIDFMT "%ld"
 #endif
 
+/* Asynchronous logging */
+#define LOG_RING_SIZE_DEFAULT	32768		/* Bytes of queue per logging thread */
+#define LOG_RING_SIZE_MIN	32768		/* Ring sizes are powers of two */
+#define LOG_RING_SIZE_MAX	(1 << 30)
+#define LOG_NAME_MAX		255		/* Longest file/function name kept */
+#define LOG_BATCH_MAX		256		/* Records written between flushes */
+#define LOG_IDLE_MS		100		/* Writer wakes at least this often */
+#define LOG_BLOCK_MS		10		/* Blocked caller rechecks this often */
+#define LOG_RECORD_PAD		0x80000000U
+#define LOG_ALIGN(n)		(((n) + 7) & ~7U)
+#define log_barrier()		__sync_synchronize()
+
 static char dateformat[256] = "%b %e %T";		/* Original CallWeaver Format */
 
 CW_MUTEX_DEFINE_STATIC(msglist_lock);
@@ -127,6 +142,69 @@ static int msgcnt = 0;
 
 static FILE *eventlog = NULL;
 
+static time_t log_date_t = (time_t) -1;
+static char log_date_buf[256];
+
+enum log_overflow {
+	LOG_OVERFLOW_DROP,
+	LOG_OVERFLOW_BLOCK,
+};
+
+static struct {
+	unsigned int enabled:1;
+	enum log_overflow overflow;
+	unsigned int ring_size;
+} logasync = { 1, LOG_OVERFLOW_DROP, LOG_RING_SIZE_DEFAULT };
+
+/*! One queued message; the file name, function name and message text
+    follow it in the ring as NUL terminated strings */
+struct log_record {
+	unsigned int len;		/* Bytes used in the ring, header included */
+	unsigned int seq;		/* Global order of the call to cw_log() */
+	int level;
+	int line;
+	time_t t;
+	unsigned short file_len;
+	unsigned short function_len;
+};
+
+/*! Single producer (the owning thread), single consumer (logger_thread) */
+struct log_ring {
+	char *buf;
+	unsigned int size;
+	volatile unsigned int head;	/* Written by the owning thread */
+	volatile unsigned int tail;	/* Written by logger_thread */
+	volatile int orphaned;		/* Owning thread has exited */
+	TIDTYPE tid;
+	volatile unsigned int queued;
+	volatile unsigned int dropped;
+	volatile unsigned int blocked;
+	unsigned int dropped_reported;
+	struct log_ring *next;
+};
+
+static pthread_t logger_thread = CW_PTHREADT_NULL;
+static volatile int logger_running = 0;
+static volatile int logger_stop = 0;
+static volatile int logger_idle = 0;
+static pthread_key_t log_ring_key;
+CW_MUTEX_DEFINE_STATIC(log_ring_lock);		/* Protects log_rings and the conditions */
+static cw_cond_t logger_cond;
+static cw_cond_t log_space_cond;
+static struct log_ring *log_rings = NULL;
+static volatile unsigned int log_seq = 0;
+static volatile int log_waiters = 0;
+static unsigned int log_written = 0;
+static struct {
+	unsigned int queued;
+	unsigned int dropped;
+	unsigned int blocked;
+} log_reaped;				/* Counters of rings already freed */
+
+static void log_ring_release(void *data);
+static void log_async_start(void);
+static void log_async_stop(void);
+
 static char *levels[] = {
 	"DEBUG",
 	"EVENT",
@@ -304,6 +382,7 @@ static void init_logger_chain(void)
 	struct cw_config *cfg;
 	struct cw_variable *var;
 	char *s;
+	int size;
 
 	/* delete our list of log channels */
 	cw_mutex_lock(&loglock);
@@ -341,12 +420,31 @@ static void init_logger_chain(void)
 		cw_copy_string(dateformat, s, sizeof(dateformat));
 	} else
 		cw_copy_string(dateformat, "%b %e %T", sizeof(dateformat));
+	log_date_t = (time_t) -1;
 	if ((s = cw_variable_retrieve(cfg, "general", "queue_log"))) {
 		logfiles.queue_log = cw_true(s);
 	}
 	if ((s = cw_variable_retrieve(cfg, "general", "event_log"))) {
 		logfiles.event_log = cw_true(s);
 	}
+	logasync.enabled = 1;
+	if ((s = cw_variable_retrieve(cfg, "general", "async")))
+		logasync.enabled = cw_true(s);
+	logasync.ring_size = LOG_RING_SIZE_DEFAULT;
+	if ((s = cw_variable_retrieve(cfg, "general", "queuesize"))) {
+		size = atoi(s);
+		/* A power of two, so positions stay right when head and tail wrap */
+		logasync.ring_size = LOG_RING_SIZE_MIN;
+		while (logasync.ring_size < LOG_RING_SIZE_MAX && (int) logasync.ring_size < size)
+			logasync.ring_size <<= 1;
+	}
+	logasync.overflow = LOG_OVERFLOW_DROP;
+	if ((s = cw_variable_retrieve(cfg, "general", "overflow"))) {
+		if (!strcasecmp(s, "block"))
+			logasync.overflow = LOG_OVERFLOW_BLOCK;
+		else if (strcasecmp(s, "drop"))
+			fprintf(stderr, "Logger Warning: unknown overflow policy '%s', using 'drop'\n", s);
+	}
 
 	var = cw_variable_browse(cfg, "logfiles");
 	while(var) {
@@ -477,6 +575,11 @@ int reload_logger(int rotate)
 	queue_log_init();
 	init_logger_chain();
 
+	if (logasync.enabled)
+		log_async_start();
+	else
+		log_async_stop();
+
 	if (logfiles.event_log) {
 		if (eventlog) {
 			cw_log(LOG_EVENT, "Restarted CallWeaver Event Logger\n");
@@ -515,6 +618,9 @@ static int handle_logger_show_channels(int fd, int argc, char *argv[])
 {
 #define FORMATL	"%-35.35s %-8.8s %-9.9s "
 	struct logchannel *chan;
+	struct log_ring *ring;
+	unsigned int queued, dropped, blocked;
+	int threads;
 
 	cw_mutex_lock(&loglock);
 
@@ -549,6 +655,26 @@ static int handle_logger_show_channels(int fd, int argc, char *argv[])
 	cw_cli(fd, "\n");
 
 	cw_mutex_unlock(&loglock);
+
+	cw_mutex_lock(&log_ring_lock);
+	threads = 0;
+	queued = log_reaped.queued;
+	dropped = log_reaped.dropped;
+	blocked = log_reaped.blocked;
+	for (ring = log_rings; ring; ring = ring->next) {
+		if (!ring->orphaned)
+			threads++;
+		queued += ring->queued;
+		dropped += ring->dropped;
+		blocked += ring->blocked;
+	}
+	cw_mutex_unlock(&log_ring_lock);
+
+	cw_cli(fd, "Queueing: %s, %u bytes per thread, %s when full\n",
+		logger_running ? "Enabled" : "Disabled", logasync.ring_size,
+		(logasync.overflow == LOG_OVERFLOW_BLOCK) ? "block" : "drop");
+	cw_cli(fd, "Threads: %d  Queued: %u  Written: %u  Dropped: %u  Blocked: %u\n",
+		threads, queued, log_written, dropped, blocked);
  		
 	return RESULT_SUCCESS;
 }
@@ -605,12 +731,20 @@ int init_logger(void)
 	cw_cli_register(&rotate_logger_cli);
 	cw_cli_register(&logger_show_channels_cli);
 
+	pthread_key_create(&log_ring_key, log_ring_release);
+	cw_cond_init(&logger_cond, NULL);
+	cw_cond_init(&log_space_cond, NULL);
+
 	/* initialize queue logger */
 	queue_log_init();
 
 	/* create log channels */
 	init_logger_chain();
 
+	/* start the writer thread */
+	if (logasync.enabled)
+		log_async_start();
+
 	/* create the eventlog */
 	if (logfiles.event_log) {
 		mkdir((char *)cw_config_CW_LOG_DIR, 0755);
@@ -633,6 +767,9 @@ void close_logger(void)
 {
 	struct msglist *m, *tmp;
 
+	/* write out anything still queued */
+	log_async_stop();
+
 	cw_mutex_lock(&msglist_lock);
 	m = list;
 	while(m) {
@@ -678,43 +815,465 @@ static void strip_coloring(char *str)
 	*dest = '\0';
 }
 
-static void cw_log_vsyslog(int level, const char *file, int line, const char *function, const char *fmt, va_list args) 
+static void cw_log_syslog(int level, TIDTYPE tid, const char *file, int line, const char *function, const char *msg) 
 {
 	char buf[BUFSIZ];
 	char *s;
 
 	if (level >= SYSLOG_NLEVELS) {
 		/* we are locked here, so cannot cw_log() */
-		fprintf(stderr, "cw_log_vsyslog called with bogus level: %d\n", level);
+		fprintf(stderr, "cw_log_syslog called with bogus level: %d\n", level);
 		return;
 	}
 	if (level == __LOG_VERBOSE) {
-		snprintf(buf, sizeof(buf), "VERBOSE[" TIDFMT "]: ", GETTID());
+		snprintf(buf, sizeof(buf), "VERBOSE[" TIDFMT "]: ", tid);
 		level = __LOG_DEBUG;
 	} else if (level == __LOG_DTMF) {
-		snprintf(buf, sizeof(buf), "DTMF[" TIDFMT "]: ", GETTID());
+		snprintf(buf, sizeof(buf), "DTMF[" TIDFMT "]: ", tid);
 		level = __LOG_DEBUG;
 	} else {
 		snprintf(buf, sizeof(buf), "%s[" TIDFMT "]: %s:%d in %s: ",
-			 levels[level], GETTID(), file, line, function);
+			 levels[level], tid, file, line, function);
 	}
 	s = buf + strlen(buf);
-	vsnprintf(s, sizeof(buf) - strlen(buf), fmt, args);
+	cw_copy_string(s, msg, sizeof(buf) - (s - buf));
 	strip_coloring(s);
 	syslog(syslog_level_map[level], "%s", buf);
 }
 
+/*! Format \a t with the configured dateformat.  The result is cached so
+    strftime() runs at most once a second.  Called with loglock held. */
+static const char *log_date(time_t t)
+{
+	struct tm tm;
+
+	if (t != log_date_t) {
+		localtime_r(&t, &tm);
+		strftime(log_date_buf, sizeof(log_date_buf), dateformat, &tm);
+		log_date_t = t;
+	}
+	return log_date_buf;
+}
+
+/*! Write one formatted message to the event log or to every log channel
+    that wants it.  File channels are not flushed here, see log_flush().
+    Called with loglock held. */
+static void log_write(int level, time_t t, TIDTYPE tid, const char *file, int line, const char *function, const char *msg)
+{
+	struct logchannel *chan;
+	char buf[BUFSIZ];
+	const char *date;
+
+	date = log_date(t);
+
+	if (logfiles.event_log && level == __LOG_EVENT) {
+		if (eventlog)
+			fprintf(eventlog, "%s callweaver[%d]: %s", date, getpid(), msg);
+		return;
+	}
+
+	if (!logchannels) {
+		/* 
+		 * we don't have the logger chain configured yet,
+		 * so just log to stdout 
+		*/
+		if (level != __LOG_VERBOSE)
+			fputs(msg, stdout);
+		return;
+	}
+
+	chan = logchannels;
+	while(chan && !chan->disabled) {
+		/* Check syslog channels */
+		if (chan->type == LOGTYPE_SYSLOG && (chan->logmask & (1 << level))) {
+			cw_log_syslog(level, tid, file, line, function, msg);
+		/* Console channels */
+		} else if ((chan->logmask & (1 << level)) && (chan->type == LOGTYPE_CONSOLE)) {
+			char linestr[128];
+			char tmp1[80], tmp2[80], tmp3[80], tmp4[80];
+
+			if (level != __LOG_VERBOSE) {
+				sprintf(linestr, "%d", line);
+				snprintf(buf, sizeof(buf), option_timestamp ? "[%s] %s[" TIDFMT "]: %s:%s %s: " : "%s %s[" TIDFMT "]: %s:%s %s: ",
+					date,
+					cw_term_color(tmp1, levels[level], colors[level], 0, sizeof(tmp1)),
+					tid,
+					cw_term_color(tmp2, file, COLOR_BRWHITE, 0, sizeof(tmp2)),
+					cw_term_color(tmp3, linestr, COLOR_BRWHITE, 0, sizeof(tmp3)),
+					cw_term_color(tmp4, function, COLOR_BRWHITE, 0, sizeof(tmp4)));
+				
+				cw_console_puts(buf);
+				cw_console_puts(msg);
+			}
+		/* File channels */
+		} else if ((chan->logmask & (1 << level)) && (chan->fileptr)) {
+			int res;
+			snprintf(buf, sizeof(buf), option_timestamp ? "[%s] %s[" TIDFMT "]: " : "%s %s[" TIDFMT "] %s: ", date,
+				levels[level], tid, file);
+			res = fprintf(chan->fileptr, "%s", buf);
+			if (res <= 0 && buf[0] != '\0') {	/* Error, no characters printed */
+				fprintf(stderr,"**** CallWeaver Logging Error: ***********\n");
+				if (errno == ENOMEM || errno == ENOSPC) {
+					fprintf(stderr, "CallWeaver logging error: Out of disk space, can't log to log file %s\n", chan->filename);
+				} else
+					fprintf(stderr, "Logger Warning: Unable to write to log file '%s': %s (disabled)\n", chan->filename, strerror(errno));
+				manager_event(EVENT_FLAG_SYSTEM, "LogChannel", "Channel: %s\r\nEnabled: No\r\nReason: %d - %s\r\n", chan->filename, errno, strerror(errno));
+				chan->disabled = 1;	
+			} else {
+				/* No error message, continue printing */
+				cw_copy_string(buf, msg, sizeof(buf));
+				strip_coloring(buf);
+				fputs(buf, chan->fileptr);
+			}
+		}
+		chan = chan->next;
+	}
+}
+
+/*! Push everything written since the last call out to disk.
+    Called with loglock held. */
+static void log_flush(void)
+{
+	struct logchannel *chan;
+
+	if (eventlog)
+		fflush(eventlog);
+	for (chan = logchannels; chan; chan = chan->next) {
+		if (chan->type == LOGTYPE_FILE && chan->fileptr)
+			fflush(chan->fileptr);
+	}
+}
+
+/*****************************************************************************
+ 
+ ASYNCHRONOUS LOGGING
+
+ Each thread that logs gets its own ring buffer.  cw_log() formats the
+ message in the calling thread and copies it into that ring without taking
+ any lock; logger_thread drains all rings in sequence order, writes the
+ records out under loglock and flushes each file once per batch.  When a
+ ring is full the message is either dropped (and counted) or the caller
+ waits for the writer, depending on the "overflow" setting in logger.conf.
+ 
+ *****************************************************************************/
+
+/*! Thread-specific destructor: the ring is freed by logger_thread once it
+    has been drained. */
+static void log_ring_release(void *data)
+{
+	struct log_ring *ring = data;
+
+	log_barrier();
+	ring->orphaned = 1;
+}
+
+/*! Return the calling thread's ring, creating it on first use. */
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring;
+
+	if ((ring = pthread_getspecific(log_ring_key)))
+		return ring;
+
+	if (!(ring = calloc(1, sizeof(*ring))))
+		return NULL;
+	ring->size = logasync.ring_size;
+	if (!(ring->buf = malloc(ring->size))) {
+		free(ring);
+		return NULL;
+	}
+	ring->tid = GETTID();
+	pthread_setspecific(log_ring_key, ring);
+
+	cw_mutex_lock(&log_ring_lock);
+	ring->next = log_rings;
+	log_rings = ring;
+	cw_mutex_unlock(&log_ring_lock);
+	return ring;
+}
+
+/*! Wait (briefly) for logger_thread to make room in a full ring. */
+static void log_wait_space(void)
+{
+	struct timeval tv;
+	struct timespec ts;
+
+	cw_mutex_lock(&log_ring_lock);
+	log_waiters++;
+	cw_cond_signal(&logger_cond);
+	tv = cw_tvadd(cw_tvnow(), cw_samp2tv(LOG_BLOCK_MS, 1000));
+	ts.tv_sec = tv.tv_sec;
+	ts.tv_nsec = tv.tv_usec * 1000;
+	cw_cond_timedwait(&log_space_cond, &log_ring_lock, &ts);
+	log_waiters--;
+	cw_mutex_unlock(&log_ring_lock);
+}
+
+/*! Copy a formatted message into \a ring.  Only the owning thread ever
+    calls this.  Returns 0 if queued, -1 if the message was dropped. */
+static int log_ring_put(struct log_ring *ring, int level, const char *file, int line, const char *function, const char *msg)
+{
+	struct log_record *rec;
+	size_t flen, fnlen, mlen;
+	unsigned int need, pos, contig, total;
+	int blocked = 0;
+	char *p;
+
+	flen = strlen(file);
+	if (flen > LOG_NAME_MAX)
+		flen = LOG_NAME_MAX;
+	fnlen = strlen(function);
+	if (fnlen > LOG_NAME_MAX)
+		fnlen = LOG_NAME_MAX;
+	mlen = strlen(msg);
+	need = LOG_ALIGN(sizeof(*rec) + flen + fnlen + mlen + 3);
+
+	for (;;) {
+		pos = ring->head & (ring->size - 1);
+		contig = ring->size - pos;
+		/* A record never wraps; pad out the end of the buffer instead */
+		total = (contig < need) ? contig + need : need;
+		if (ring->size - (ring->head - ring->tail) >= total)
+			break;
+		if (logasync.overflow == LOG_OVERFLOW_DROP || logger_stop) {
+			ring->dropped++;
+			return -1;
+		}
+		if (!blocked++)
+			ring->blocked++;
+		log_wait_space();
+	}
+
+	if (contig < need) {
+		*(unsigned int *) (ring->buf + pos) = LOG_RECORD_PAD | contig;
+		pos = 0;
+	}
+	rec = (struct log_record *) (ring->buf + pos);
+	rec->len = need;
+	rec->seq = __sync_fetch_and_add(&log_seq, 1);
+	rec->level = level;
+	rec->line = line;
+	rec->t = time(NULL);
+	rec->file_len = flen;
+	rec->function_len = fnlen;
+	p = (char *) (rec + 1);
+	memcpy(p, file, flen);
+	p[flen] = '\0';
+	p += flen + 1;
+	memcpy(p, function, fnlen);
+	p[fnlen] = '\0';
+	p += fnlen + 1;
+	memcpy(p, msg, mlen + 1);
+
+	/* Publish the record only once it is complete */
+	log_barrier();
+	ring->head += total;
+	ring->queued++;
+	return 0;
+}
+
+/*! Return the oldest record in \a ring without consuming it, skipping any
+    padding at the end of the buffer.  Only logger_thread calls this. */
+static struct log_record *log_ring_peek(struct log_ring *ring)
+{
+	unsigned int pos, len;
+
+	if (ring->tail == ring->head)
+		return NULL;
+	log_barrier();
+	pos = ring->tail & (ring->size - 1);
+	len = *(unsigned int *) (ring->buf + pos);
+	if (len & LOG_RECORD_PAD) {
+		ring->tail += len & ~LOG_RECORD_PAD;
+		pos = 0;
+	}
+	return (struct log_record *) (ring->buf + pos);
+}
+
+/*! Let logger_thread know there is work if it is asleep. */
+static void log_wake_writer(void)
+{
+	log_barrier();
+	if (logger_idle) {
+		cw_mutex_lock(&log_ring_lock);
+		cw_cond_signal(&logger_cond);
+		cw_mutex_unlock(&log_ring_lock);
+	}
+}
+
+/*! Write up to \a max queued records, oldest first across all rings, and
+    flush the log files once at the end.  Returns the number written. */
+static int log_drain(int max)
+{
+	struct log_ring *head, *ring, *best;
+	struct log_record *rec, *bestrec = NULL;
+	char msg[128];
+	char *file, *function;
+	unsigned int dropped;
+	int count = 0;
+
+	cw_mutex_lock(&log_ring_lock);
+	head = log_rings;
+	cw_mutex_unlock(&log_ring_lock);
+
+	cw_mutex_lock(&loglock);
+	for (ring = head; ring; ring = ring->next) {
+		if ((dropped = ring->dropped - ring->dropped_reported)) {
+			ring->dropped_reported += dropped;
+			snprintf(msg, sizeof(msg), "Log queue full, dropped %u message%s from thread " TIDFMT "\n",
+				dropped, (dropped == 1) ? "" : "s", ring->tid);
+			log_write(__LOG_WARNING, time(NULL), ring->tid, __FILE__, __LINE__, __PRETTY_FUNCTION__, msg);
+			count++;
+		}
+	}
+	while (count < max) {
+		best = NULL;
+		for (ring = head; ring; ring = ring->next) {
+			if (!(rec = log_ring_peek(ring)))
+				continue;
+			if (!best || (int) (rec->seq - bestrec->seq) < 0) {
+				best = ring;
+				bestrec = rec;
+			}
+		}
+		if (!best)
+			break;
+		file = (char *) (bestrec + 1);
+		function = file + bestrec->file_len + 1;
+		log_write(bestrec->level, bestrec->t, best->tid, file, bestrec->line, function,
+			function + bestrec->function_len + 1);
+		log_barrier();
+		best->tail += bestrec->len;
+		count++;
+	}
+	if (count)
+		log_flush();
+	cw_mutex_unlock(&loglock);
+
+	log_written += count;
+	return count;
+}
+
+/*! Is anything waiting in any ring?  Called with log_ring_lock held. */
+static int log_pending(void)
+{
+	struct log_ring *ring;
+
+	for (ring = log_rings; ring; ring = ring->next) {
+		if (ring->head != ring->tail || ring->dropped != ring->dropped_reported)
+			return 1;
+	}
+	return 0;
+}
+
+/*! Free the rings of threads that have exited once they are empty. */
+static void log_reap(void)
+{
+	struct log_ring *ring, *prev = NULL, *next;
+
+	cw_mutex_lock(&log_ring_lock);
+	for (ring = log_rings; ring; ring = next) {
+		next = ring->next;
+		if (ring->orphaned && ring->head == ring->tail && ring->dropped == ring->dropped_reported) {
+			if (prev)
+				prev->next = next;
+			else
+				log_rings = next;
+			log_reaped.queued += ring->queued;
+			log_reaped.dropped += ring->dropped;
+			log_reaped.blocked += ring->blocked;
+			free(ring->buf);
+			free(ring);
+		} else
+			prev = ring;
+	}
+	cw_mutex_unlock(&log_ring_lock);
+}
+
+static void *logger_thread_main(void *data)
+{
+	struct timeval tv;
+	struct timespec ts;
+
+	for (;;) {
+		if (log_drain(LOG_BATCH_MAX)) {
+			if (log_waiters) {
+				cw_mutex_lock(&log_ring_lock);
+				cw_cond_broadcast(&log_space_cond);
+				cw_mutex_unlock(&log_ring_lock);
+			}
+			continue;
+		}
+
+		if (filesize_reload_needed) {
+			reload_logger(1);
+			cw_log(LOG_EVENT,"Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
+			if (option_verbose)
+				cw_verbose("Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
+		}
+
+		log_reap();
+
+		cw_mutex_lock(&log_ring_lock);
+		if (logger_stop && !log_pending()) {
+			cw_mutex_unlock(&log_ring_lock);
+			break;
+		}
+		logger_idle = 1;
+		log_barrier();
+		if (!log_pending() && !logger_stop) {
+			tv = cw_tvadd(cw_tvnow(), cw_samp2tv(LOG_IDLE_MS, 1000));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			cw_cond_timedwait(&logger_cond, &log_ring_lock, &ts);
+		}
+		logger_idle = 0;
+		cw_mutex_unlock(&log_ring_lock);
+	}
+
+	return NULL;
+}
+
+static void log_async_start(void)
+{
+	if (logger_thread != CW_PTHREADT_NULL)
+		return;
+
+	logger_stop = 0;
+	if (cw_pthread_create(&logger_thread, NULL, logger_thread_main, NULL)) {
+		logger_thread = CW_PTHREADT_NULL;
+		cw_log(LOG_WARNING, "Unable to start logger thread, logging synchronously\n");
+		return;
+	}
+	log_barrier();
+	logger_running = 1;
+}
+
+static void log_async_stop(void)
+{
+	if (logger_thread == CW_PTHREADT_NULL || pthread_equal(pthread_self(), logger_thread))
+		return;
+
+	/* New messages go straight out; the writer drains what is queued */
+	logger_running = 0;
+	log_barrier();
+	cw_mutex_lock(&log_ring_lock);
+	logger_stop = 1;
+	cw_cond_broadcast(&logger_cond);
+	cw_cond_broadcast(&log_space_cond);
+	cw_mutex_unlock(&log_ring_lock);
+
+	pthread_join(logger_thread, NULL);
+	logger_thread = CW_PTHREADT_NULL;
+}
+
 /*
  * send log messages to syslog and/or the console
  */
 void cw_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
 {
-	struct logchannel *chan;
+	struct log_ring *ring;
 	char buf[BUFSIZ];
-	time_t t;
-	struct tm tm;
-	char date[256];
-
 	va_list ap;
 	
 	/* don't display LOG_DEBUG messages unless option_verbose _or_ option_debug
@@ -735,96 +1294,26 @@ void cw_log(int level, const char *file, int line, const char *function, const c
 	if ((level == __LOG_DEBUG) && !cw_strlen_zero(debug_filename) && strcasecmp(debug_filename, file))
 		return;
 
-	/* begin critical section */
-	cw_mutex_lock(&loglock);
-
-	time(&t);
-	localtime_r(&t, &tm);
-	strftime(date, sizeof(date), dateformat, &tm);
-
-	if (logfiles.event_log && level == __LOG_EVENT) {
-		va_start(ap, fmt);
-
-		fprintf(eventlog, "%s callweaver[%d]: ", date, getpid());
-		vfprintf(eventlog, fmt, ap);
-		fflush(eventlog);
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
 
-		va_end(ap);
-		cw_mutex_unlock(&loglock);
+	/* Hand the message to the logger thread if it is running (it logs
+	   its own messages directly) */
+	if (logger_running && !pthread_equal(pthread_self(), logger_thread) && (ring = log_ring_get())) {
+		if (!log_ring_put(ring, level, file, line, function, buf))
+			log_wake_writer();
 		return;
 	}
 
-	if (logchannels) {
-		chan = logchannels;
-		while(chan && !chan->disabled) {
-			/* Check syslog channels */
-			if (chan->type == LOGTYPE_SYSLOG && (chan->logmask & (1 << level))) {
-				va_start(ap, fmt);
-				cw_log_vsyslog(level, file, line, function, fmt, ap);
-				va_end(ap);
-			/* Console channels */
-			} else if ((chan->logmask & (1 << level)) && (chan->type == LOGTYPE_CONSOLE)) {
-				char linestr[128];
-				char tmp1[80], tmp2[80], tmp3[80], tmp4[80];
-
-				if (level != __LOG_VERBOSE) {
-					sprintf(linestr, "%d", line);
-					snprintf(buf, sizeof(buf), option_timestamp ? "[%s] %s[" TIDFMT "]: %s:%s %s: " : "%s %s[" TIDFMT "]: %s:%s %s: ",
-						date,
-						cw_term_color(tmp1, levels[level], colors[level], 0, sizeof(tmp1)),
-						GETTID(),
-						cw_term_color(tmp2, file, COLOR_BRWHITE, 0, sizeof(tmp2)),
-						cw_term_color(tmp3, linestr, COLOR_BRWHITE, 0, sizeof(tmp3)),
-						cw_term_color(tmp4, function, COLOR_BRWHITE, 0, sizeof(tmp4)));
-					
-					cw_console_puts(buf);
-					va_start(ap, fmt);
-					vsnprintf(buf, sizeof(buf), fmt, ap);
-					va_end(ap);
-					cw_console_puts(buf);
-				}
-			/* File channels */
-			} else if ((chan->logmask & (1 << level)) && (chan->fileptr)) {
-				int res;
-				snprintf(buf, sizeof(buf), option_timestamp ? "[%s] %s[" TIDFMT "]: " : "%s %s[" TIDFMT "] %s: ", date,
-					levels[level], GETTID(), file);
-				res = fprintf(chan->fileptr, buf);
-				if (res <= 0 && buf[0] != '\0') {	/* Error, no characters printed */
-					fprintf(stderr,"**** CallWeaver Logging Error: ***********\n");
-					if (errno == ENOMEM || errno == ENOSPC) {
-						fprintf(stderr, "CallWeaver logging error: Out of disk space, can't log to log file %s\n", chan->filename);
-					} else
-						fprintf(stderr, "Logger Warning: Unable to write to log file '%s': %s (disabled)\n", chan->filename, strerror(errno));
-					manager_event(EVENT_FLAG_SYSTEM, "LogChannel", "Channel: %s\r\nEnabled: No\r\nReason: %d - %s\r\n", chan->filename, errno, strerror(errno));
-					chan->disabled = 1;	
-				} else {
-					/* No error message, continue printing */
-					va_start(ap, fmt);
-					vsnprintf(buf, sizeof(buf), fmt, ap);
-					va_end(ap);
-					strip_coloring(buf);
-					fputs(buf, chan->fileptr);
-					fflush(chan->fileptr);
-				}
-			}
-			chan = chan->next;
-		}
-	} else {
-		/* 
-		 * we don't have the logger chain configured yet,
-		 * so just log to stdout 
-		*/
-		if (level != __LOG_VERBOSE) {
-			va_start(ap, fmt);
-			vsnprintf(buf, sizeof(buf), fmt, ap);
-			va_end(ap);
-			fputs(buf, stdout);
-		}
-	}
-
+	/* begin critical section */
+	cw_mutex_lock(&loglock);
+	log_write(level, time(NULL), GETTID(), file, line, function, buf);
+	log_flush();
 	cw_mutex_unlock(&loglock);
 	/* end critical section */
-	if (filesize_reload_needed) {
+
+	if (filesize_reload_needed && !logger_running) {
 		reload_logger(1);
 		cw_log(LOG_EVENT,"Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
 		if (option_verbose)
@@ -40,6 +40,12 @@
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/poll.h>
+#endif
 
 #include "callweaver.h"
 
@@ -77,6 +83,10 @@ struct fast_originate_helper {
 
 #define DEFAULT_SOCKET_TIMEOUT_SEC	60
 
+/*! Events kept in the ring.  A session that falls further behind than
+    this has missed events and is disconnected. */
+#define MAX_EVENT_QUEUE			4096
+
 static int enabled = 0;
 static int portno = DEFAULT_MANAGER_PORT;
 static int asock = -1;
@@ -84,6 +94,41 @@ static int displayconnects = 1;
 
 static pthread_t t;
 CW_MUTEX_DEFINE_STATIC(sessionlock);
+
+/* One I/O thread serves every session; actions run on a worker pool that
+   grows on demand */
+#define MANAGER_MAX_EVENTS		64
+#define DEFAULT_MANAGER_WORKERS		4
+#define MAX_MANAGER_WORKERS		64
+#define MANAGER_WANT_READ		(1 << 0)
+#define MANAGER_WANT_WRITE		(1 << 1)
+#define MANAGER_TAG_LISTENER		((void *) NULL)
+#define MANAGER_TAG_ALERT		((void *) manager_alert)
+
+static int manager_alert[2] = { -1, -1 };
+static volatile int manager_alerted = 0;
+#ifdef HAVE_SYS_EPOLL_H
+static int manager_epfd = -1;
+#endif
+
+CW_MUTEX_DEFINE_STATIC(joblock);
+static cw_cond_t jobcond;
+static struct mansession *jobs = NULL;		/* Waiting for a worker */
+static struct mansession *jobs_tail = NULL;
+static struct mansession *jobs_done = NULL;	/* Finished, for the I/O thread */
+static int jobs_queued = 0;
+static int manager_workers = 0;
+static int manager_idle_workers = 0;
+static int manager_start_workers = DEFAULT_MANAGER_WORKERS;
+
+/* Sessions subscribed to each event class, and the classes with at
+   least one subscriber.  manager_event() gives up on anything outside
+   manager_event_classes before formatting it. */
+static int event_class_count[sizeof(unsigned int) * 8];
+static volatile unsigned int manager_event_classes = 0;
+
+static void *manager_worker(void *data);
+static void manager_wakeup(void);
 static int block_sockets = 0;
 
 static struct permalias {
@@ -102,6 +147,12 @@ static struct permalias {
 };
 
 static struct mansession *sessions = NULL;
+
+/*! Every event goes into this ring once; each session keeps its own read
+    position (eventq_seq) in it */
+static struct eventqent *eventq[MAX_EVENT_QUEUE];
+static unsigned int eventq_head = 0;		/* Sequence number of the next event */
+CW_MUTEX_DEFINE_STATIC(eventqlock);
 static struct manager_action *first_action = NULL;
 CW_MUTEX_DEFINE_STATIC(actionlock);
 CW_MUTEX_DEFINE_STATIC(hooklock);
@@ -227,12 +278,14 @@ static int handle_showmanconn(int fd, int argc, char *argv[])
 {
 	struct mansession *s;
 	char iabuf[INET_ADDRSTRLEN];
-	char *format = "  %-15.15s  %-15.15s\n";
+	char *format = "  %-15.15s  %-15.15s  %-8s\n";
+	char lag[16];
 	cw_mutex_lock(&sessionlock);
 	s = sessions;
-	cw_cli(fd, format, "Username", "IP Address");
+	cw_cli(fd, format, "Username", "IP Address", "Behind");
 	while (s) {
-		cw_cli(fd, format,s->username, cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr));
+		snprintf(lag, sizeof(lag), "%u", eventq_head - s->eventq_seq);
+		cw_cli(fd, format,s->username, cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr), lag);
 		s = s->next;
 	}
 
@@ -265,23 +318,35 @@ static struct cw_cli_entry show_manconn_cli =
 	{ { "show", "manager", "connected", NULL },
 	handle_showmanconn, "Show connected manager interface users", showmanconn_help };
 
+static void unref_event(struct eventqent *eqe);
+
 static void free_session(struct mansession *s)
 {
-	struct eventqent *eqe;
-	
 	if (s->fd > -1)
 		close(s->fd);
 	cw_mutex_destroy(&s->__lock);
-	cw_mutex_destroy(&s->eventqlock);
-	while (s->eventq) {
-		eqe = s->eventq;
-		s->eventq = s->eventq->next;
-		free(eqe);
-	}
+	if (s->outev)
+		unref_event(s->outev);
+	while (s->heldnext < s->heldcount)
+		unref_event(s->held[s->heldnext++]);
+	free(s->held);
+	free(s->inmsg);
 
 	free(s);
 }
 
+/*! \brief  Drop a reference to an event, freeing it with the last one */
+static void unref_event(struct eventqent *eqe)
+{
+	int usecount;
+
+	cw_mutex_lock(&eventqlock);
+	usecount = --eqe->usecount;
+	cw_mutex_unlock(&eventqlock);
+	if (!usecount)
+		free(eqe);
+}
+
 static void destroy_session(struct mansession *s)
 {
 	struct mansession *cur;
@@ -480,6 +545,58 @@ static int set_eventmask(struct mansession *s, char *eventmask)
 	return maskint;
 }
 
+/*! \brief  Is \a header given in \a m at all, even with an empty value? */
+static int astman_get_header_present(struct message *m, char *header)
+{
+	int x, l = strlen(header);
+
+	for (x = 0;  x < m->hdrcount;  x++) {
+		if (!strncasecmp(header, m->headers[x], l) && (m->headers[x][l] == ':'))
+			return 1;
+	}
+	return 0;
+}
+
+static void set_eventfilter(struct mansession *s, char *filter)
+{
+	char *src, *dst;
+
+	/* Keep it without blanks so matching can compare names directly */
+	cw_mutex_lock(&s->__lock);
+	for (src = filter, dst = s->eventfilter;  *src && dst < s->eventfilter + sizeof(s->eventfilter) - 1;  src++) {
+		if (*src != ' ' && *src != '\t')
+			*dst++ = *src;
+	}
+	*dst = '\0';
+	cw_mutex_unlock(&s->__lock);
+}
+
+/*! \brief  Does the session's event filter let \a eqe through? */
+static int event_filter_match(struct mansession *s, struct eventqent *eqe)
+{
+	const char *name = eqe->eventdata + 7;		/* Skip "Event: " */
+	char *item, *next;
+	int len, include = 0, included = 0;
+
+	if (cw_strlen_zero(s->eventfilter))
+		return 1;
+	for (item = s->eventfilter;  item;  item = next) {
+		if ((next = strchr(item, ',')))
+			len = next++ - item;
+		else
+			len = strlen(item);
+		if (*item == '!') {
+			if (len - 1 == eqe->namelen && !strncasecmp(item + 1, name, eqe->namelen))
+				return 0;
+		} else if (len) {
+			include = 1;
+			if (len == eqe->namelen && !strncasecmp(item, name, eqe->namelen))
+				included = 1;
+		}
+	}
+	return !include || included;
+}
+
 static int authenticate(struct mansession *s, struct message *m)
 {
 	struct cw_config *cfg;
@@ -563,6 +680,8 @@ static int authenticate(struct mansession *s, struct message *m)
 		cw_config_destroy(cfg);
 		if (events)
 			set_eventmask(s, events);
+		if (astman_get_header_present(m, "EventFilter"))
+			set_eventfilter(s, astman_get_header(m, "EventFilter"));
 		return 0;
 	}
 	cw_log(LOG_NOTICE, "%s tried to authenticate with nonexistent user '%s'\n", cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr), user);
@@ -614,13 +733,23 @@ static char mandescr_events[] =
 "Variables:\n"
 "	EventMask: 'on' if all events should be sent,\n"
 "		'off' if no events should be sent,\n"
-"		'system,call,log' to select which flags events should have to be sent.\n";
+"		'system,call,log' to select which flags events should have to be sent.\n"
+"	EventFilter: (optional) comma separated event names; only these are\n"
+"		sent, except names given as '!Name' which are never sent.\n"
+"		An empty EventFilter sends all events again.\n";
 
 static int action_events(struct mansession *s, struct message *m)
 {
 	char *mask = astman_get_header(m, "EventMask");
 	int res;
 
+	if (astman_get_header_present(m, "EventFilter")) {
+		set_eventfilter(s, astman_get_header(m, "EventFilter"));
+		if (cw_strlen_zero(mask)) {
+			astman_send_ack(s, m, "Event filter set");
+			return 0;
+		}
+	}
 	res = set_eventmask(s, mask);
 	if (res > 0)
 		astman_send_response(s, m, "Events On", NULL);
@@ -1246,29 +1375,117 @@ static int action_timeout(struct mansession *s, struct message *m)
 	astman_send_ack(s, m, "Timeout Set");
 	return 0;
 }
+/*! \brief  Write queued events to a session without blocking.  An event
+    the socket will not take in full is kept in s->outev and finished
+    when the socket becomes writable. */
 static int process_queue(struct mansession *s) {
 	struct eventqent *eqe;
+	char iabuf[INET_ADDRSTRLEN];
+	size_t len;
+	int res;
 	int ret=0;
 
 	cw_mutex_lock(&s->__lock);
 
-	while (s->eventq) {
-		cw_mutex_lock(&s->eventqlock);
-		eqe = s->eventq;
-		s->eventq = s->eventq->next;
-		cw_mutex_unlock(&s->eventqlock);
-
-		if (cw_carefulwrite(s->fd, eqe->eventdata, strlen(eqe->eventdata), s->writetimeout) < 0) {
+	for (;;) {
+		cw_mutex_lock(&eventqlock);
+		if (eventq_head - s->eventq_seq > MAX_EVENT_QUEUE) {
+			/* Our next event has already been overwritten */
+			cw_mutex_unlock(&eventqlock);
+			cw_log(LOG_WARNING, "Manager '%s' from %s fell more than %d events behind, disconnecting\n",
+				s->username, cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr), MAX_EVENT_QUEUE);
 			ret = -1;
-			free(eqe);
 			break;
 		}
-		free(eqe);
+		if (!s->outev && s->heldnext < s->heldcount) {
+			/* Events held while an action ran go first */
+			s->outev = s->held[s->heldnext++];
+			s->outoff = 0;
+			if (s->heldnext == s->heldcount)
+				s->heldnext = s->heldcount = 0;
+		}
+		if (!s->outev) {
+			if (s->eventq_seq == eventq_head) {
+				cw_mutex_unlock(&eventqlock);
+				break;
+			}
+			eqe = eventq[s->eventq_seq % MAX_EVENT_QUEUE];
+			s->eventq_seq++;
+			if ((s->readperm & eqe->category) != eqe->category
+				|| (s->send_events & eqe->category) != eqe->category
+				|| !event_filter_match(s, eqe)) {
+				cw_mutex_unlock(&eventqlock);
+				continue;
+			}
+			eqe->usecount++;
+			s->outev = eqe;
+			s->outoff = 0;
+		}
+		cw_mutex_unlock(&eventqlock);
+
+		len = strlen(s->outev->eventdata) - s->outoff;
+		res = write(s->fd, s->outev->eventdata + s->outoff, len);
+		if (res < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				ret = -1;
+			break;
+		}
+		s->outoff += res;
+		if (res < len)
+			break;
+		unref_event(s->outev);
+		s->outev = NULL;
 	}
 	cw_mutex_unlock(&s->__lock);
 
 	return ret;
 }
+/*! \brief  Take the session's events off the ring while an action runs.
+    Nothing can be written to the socket until the action's reply is out,
+    but the ring moves on regardless, so the events the session wants are
+    held by reference until process_queue() can send them. */
+static int hold_events(struct mansession *s)
+{
+	struct eventqent *eqe, **held;
+	char iabuf[INET_ADDRSTRLEN];
+	int ret = 0;
+
+	cw_mutex_lock(&s->__lock);
+	cw_mutex_lock(&eventqlock);
+	if (eventq_head - s->eventq_seq > MAX_EVENT_QUEUE) {
+		cw_mutex_unlock(&eventqlock);
+		cw_mutex_unlock(&s->__lock);
+		cw_log(LOG_WARNING, "Manager '%s' from %s fell more than %d events behind, disconnecting\n",
+			s->username, cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr), MAX_EVENT_QUEUE);
+		return -1;
+	}
+	while (s->eventq_seq != eventq_head) {
+		eqe = eventq[s->eventq_seq % MAX_EVENT_QUEUE];
+		if ((s->readperm & eqe->category) != eqe->category
+			|| (s->send_events & eqe->category) != eqe->category
+			|| !event_filter_match(s, eqe)) {
+			s->eventq_seq++;
+			continue;
+		}
+		if (s->heldcount == s->heldalloc) {
+			if (!(held = realloc(s->held, (s->heldalloc + 64) * sizeof(*held)))) {
+				cw_log(LOG_ERROR, "Out of memory\n");
+				ret = -1;
+				break;
+			}
+			s->held = held;
+			s->heldalloc += 64;
+		}
+		eqe->usecount++;
+		s->held[s->heldcount++] = eqe;
+		s->eventq_seq++;
+	}
+	cw_mutex_unlock(&eventqlock);
+	cw_mutex_unlock(&s->__lock);
+
+	return ret;
+}
+
 static int process_message(struct mansession *s, struct message *m)
 {
 	char action[80] = "";
@@ -1364,6 +1581,8 @@ static int get_data(struct mansession *s) {
 	cw_mutex_lock(&s->__lock);
         res = read(s->fd, s->inbuf + s->inlen, sizeof(s->inbuf) - 1 - s->inlen);
 	cw_mutex_unlock(&s->__lock);
+	if (res < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
         if (res < 1)
         	return -1;
 
@@ -1392,77 +1611,170 @@ static int get_input(struct mansession *s, char *output)
 	return 0;
 }
 
-static void *session_do(void *data)
+/*! \brief  Wake the manager I/O thread: an event was queued or an action finished */
+static void manager_wakeup(void)
 {
-	struct mansession *s = data;
-	struct message m;
-	char iabuf[INET_ADDRSTRLEN];
-	int res;
-	struct timeval timeout;
-	fd_set active_fd_set, read_fd_set;
-	time_t last_received;
-	
-	cw_mutex_lock(&s->__lock);
-	cw_cli(s->fd, "CallWeaver Call Manager/1.0\r\n");
-	cw_mutex_unlock(&s->__lock);
-	memset(&m, 0, sizeof(m));
-	FD_ZERO(&active_fd_set);
-	FD_SET(s->fd, &active_fd_set);
-	
-	time(&last_received);
-	
-	for (;;) {
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 5000;
-		
-		if ((time(NULL) - last_received) >= s->sockettimeout) {
-			if (option_verbose > 3) {
-				if (displayconnects)
-					cw_verbose(VERBOSE_PREFIX_2 "Manager '%s' timed out from %s\n", s->username, cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr));
-			}
+	if (manager_alert[1] > -1 && !__sync_lock_test_and_set(&manager_alerted, 1)) {
+		if (write(manager_alert[1], "x", 1) < 0 && errno != EAGAIN)
+			cw_log(LOG_WARNING, "Unable to wake manager thread: %s\n", strerror(errno));
+	}
+}
 
-			break;
-		}
-		read_fd_set = active_fd_set;
-		res = cw_select(s->fd + 1, &read_fd_set, NULL, NULL, &timeout);
+/*! \brief  Tell the I/O thread what to wait for on a session's socket.
+    Nothing is watched while an action runs, so a worker has the socket
+    to itself; reading resumes once the last event has been written out. */
+static void session_watch(struct mansession *s)
+{
+	int want = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
 
-		if (res < 0) {
-			break;
-		}
-		if (FD_ISSET(s->fd, &read_fd_set)) {
-			res = get_data(s);
-			if (res < 0) {
-				cw_log(LOG_WARNING, "get_data failed: %s\n", strerror(errno));
+	if (!s->dead) {
+		if (s->outev)
+			want = MANAGER_WANT_WRITE;
+		else if (!s->inflight)
+			want = MANAGER_WANT_READ;
+	}
+	if (want == s->watching)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((want & MANAGER_WANT_READ) ? EPOLLIN : 0) | ((want & MANAGER_WANT_WRITE) ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	if (!want)
+		epoll_ctl(manager_epfd, EPOLL_CTL_DEL, s->fd, &ev);
+	else if (!s->watching)
+		epoll_ctl(manager_epfd, EPOLL_CTL_ADD, s->fd, &ev);
+	else
+		epoll_ctl(manager_epfd, EPOLL_CTL_MOD, s->fd, &ev);
+#endif
+	s->watching = want;
+}
 
-				break;
-			}
-			while((res = get_input(s, m.headers[m.hdrcount])) == 1) {
-				/* Strip trailing \r\n */
-				if (strlen(m.headers[m.hdrcount]) < 2)
-					continue;
-				m.headers[m.hdrcount][strlen(m.headers[m.hdrcount]) - 2] = '\0';
-				if (cw_strlen_zero(m.headers[m.hdrcount])) {
-					time(&last_received);
-					if (process_message(s, &m)) {
-						res = -1;
-						break;
-					}
-					memset(&m, 0, sizeof(m));
-				} else if (m.hdrcount < MAX_HEADERS - 1) {
-					m.hdrcount++;
-		            	}
-			}
-			if (res < 0) {
-				break;
-			}
-		}
-		if (process_queue(s) < 0) {
-			res = -1;
-			break;
+/*! \brief  Count the session as a subscriber of the event classes it now
+    reads.  Only the I/O thread calls this. */
+static void session_set_classes(struct mansession *s)
+{
+	unsigned int classes = 0, mask = 0;
+	int x;
+
+	if (s->authenticated && !s->dead)
+		classes = s->readperm & s->send_events;
+	if (classes == s->event_classes)
+		return;
+
+	cw_mutex_lock(&sessionlock);
+	for (x = 0;  x < sizeof(event_class_count) / sizeof(event_class_count[0]);  x++) {
+		if (s->event_classes & (1U << x))
+			event_class_count[x]--;
+		if (classes & (1U << x))
+			event_class_count[x]++;
+		if (event_class_count[x])
+			mask |= (1U << x);
+	}
+	s->event_classes = classes;
+	manager_event_classes = mask;
+	cw_mutex_unlock(&sessionlock);
+}
+
+/*! \brief  Start another manager worker.  Called with joblock held. */
+static void start_worker(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (cw_pthread_create(&tid, &attr, manager_worker, NULL))
+		cw_log(LOG_WARNING, "Unable to start manager worker: %s\n", strerror(errno));
+	else
+		manager_workers++;
+	pthread_attr_destroy(&attr);
+}
+
+/*! \brief  Hand a complete message to the worker pool */
+static void dispatch_message(struct mansession *s)
+{
+	s->inflight = 1;
+	session_watch(s);
+
+	cw_mutex_lock(&joblock);
+	s->jobnext = NULL;
+	if (jobs_tail)
+		jobs_tail->jobnext = s;
+	else
+		jobs = s;
+	jobs_tail = s;
+	jobs_queued++;
+	/* Actions such as a synchronous Originate can run for a long time,
+	   so add workers rather than making other sessions wait */
+	if (jobs_queued > manager_idle_workers && manager_workers < MAX_MANAGER_WORKERS)
+		start_worker();
+	cw_cond_signal(&jobcond);
+	cw_mutex_unlock(&joblock);
+}
+
+static void *manager_worker(void *data)
+{
+	struct mansession *s;
+	int flags = 0;
+
+	for (;;) {
+		cw_mutex_lock(&joblock);
+		manager_idle_workers++;
+		while (!jobs)
+			cw_cond_wait(&jobcond, &joblock);
+		manager_idle_workers--;
+		s = jobs;
+		if (!(jobs = s->jobnext))
+			jobs_tail = NULL;
+		jobs_queued--;
+		cw_mutex_unlock(&joblock);
+
+		if (block_sockets) {
+			flags = fcntl(s->fd, F_GETFL);
+			fcntl(s->fd, F_SETFL, flags & ~O_NONBLOCK);
 		}
+		s->jobres = process_message(s, s->inmsg);
+		if (block_sockets)
+			fcntl(s->fd, F_SETFL, flags);
+		memset(s->inmsg, 0, sizeof(struct message));
+
+		/* Give the session back to the I/O thread */
+		cw_mutex_lock(&joblock);
+		s->jobnext = jobs_done;
+		jobs_done = s;
+		cw_mutex_unlock(&joblock);
+		manager_wakeup();
+	}
+	return NULL;
+}
+
+/*! \brief  Split buffered input into headers; the first complete message
+    goes to a worker and parsing stops until it has been handled */
+static void session_parse(struct mansession *s)
+{
+	struct message *m = s->inmsg;
 
-		
+	while (!s->inflight && get_input(s, m->headers[m->hdrcount]) == 1) {
+		/* Strip trailing \r\n */
+		if (strlen(m->headers[m->hdrcount]) < 2)
+			continue;
+		m->headers[m->hdrcount][strlen(m->headers[m->hdrcount]) - 2] = '\0';
+		if (cw_strlen_zero(m->headers[m->hdrcount])) {
+			time(&s->last_received);
+			dispatch_message(s);
+		} else if (m->hdrcount < MAX_HEADERS - 1) {
+			m->hdrcount++;
+		}
 	}
+}
+
+static void close_session(struct mansession *s)
+{
+	char iabuf[INET_ADDRSTRLEN];
 
 	if (s->authenticated) {
 		if (option_verbose > 3) {
@@ -1477,11 +1789,13 @@ static void *session_do(void *data)
 		}
 		cw_log(LOG_EVENT, "Failed attempt from %s\n", cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr));
 	}
+	s->dead = 1;
+	session_set_classes(s);
+	session_watch(s);
 	destroy_session(s);
-	return NULL;
 }
 
-static void *accept_thread(void *ignore)
+static void accept_sessions(void)
 {
 	int as;
 	struct sockaddr_in sin;
@@ -1490,17 +1804,14 @@ static void *accept_thread(void *ignore)
 	struct protoent *p;
 	int arg = 1;
 	int flags;
-	pthread_attr_t attr;
-
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
 	for (;;) {
 		sinlen = sizeof(sin);
 		as = accept(asock, (struct sockaddr *)&sin, &sinlen);
 		if (as < 0) {
-			cw_log(LOG_NOTICE, "Accept returned -1: %s\n", strerror(errno));
-			continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				cw_log(LOG_NOTICE, "Accept returned -1: %s\n", strerror(errno));
+			return;
 		}
 		p = getprotobyname("tcp");
 		if (p) {
@@ -1510,110 +1821,247 @@ static void *accept_thread(void *ignore)
 		if ((s = malloc(sizeof(struct mansession))) == NULL)
 		{
 			cw_log(LOG_WARNING, "Failed to allocate management session: %s\n", strerror(errno));
+			close(as);
 			continue;
 		} 
 		memset(s, 0, sizeof(struct mansession));
+		if ((s->inmsg = calloc(1, sizeof(struct message))) == NULL) {
+			cw_log(LOG_WARNING, "Failed to allocate management session: %s\n", strerror(errno));
+			free(s);
+			close(as);
+			continue;
+		}
 		memcpy(&s->sin, &sin, sizeof(sin));
 		s->writetimeout = 100;
 
-		if (!block_sockets) {
-			/* For safety, make sure socket is non-blocking */
-			flags = fcntl(as, F_GETFL);
-			fcntl(as, F_SETFL, flags | O_NONBLOCK);
-		}
+		/* The I/O thread never blocks; workers switch back to blocking
+		   writes around each action if block-sockets is set */
+		flags = fcntl(as, F_GETFL);
+		fcntl(as, F_SETFL, flags | O_NONBLOCK);
 		cw_mutex_init(&s->__lock);
-		cw_mutex_init(&s->eventqlock);
-		s->eventq = NULL;
 		s->sockettimeout = DEFAULT_SOCKET_TIMEOUT_SEC;
 		s->fd = as;
 		s->send_events = -1;
+		time(&s->last_received);
+		cw_cli(s->fd, "CallWeaver Call Manager/1.0\r\n");
 		cw_mutex_lock(&sessionlock);
+		cw_mutex_lock(&eventqlock);
+		s->eventq_seq = eventq_head;
+		cw_mutex_unlock(&eventqlock);
 		s->next = sessions;
 		sessions = s;
 		cw_mutex_unlock(&sessionlock);
-		if (cw_pthread_create(&s->t, &attr, session_do, s))
-			destroy_session(s);
+		session_watch(s);
 	}
-	pthread_attr_destroy(&attr);
-	return NULL;
 }
 
-static int append_event(struct mansession *s, const char *str)
+/*! \brief  Handle readiness reported for the listener, the wakeup pipe or a session */
+static void manager_ready(void *tag, int readable, int writable, int hangup)
 {
-	struct eventqent *tmp;
-	struct eventqent *prev = NULL;
+	struct mansession *s = tag;
+	char buf[64];
+
+	if (tag == MANAGER_TAG_LISTENER) {
+		accept_sessions();
+	} else if (tag == MANAGER_TAG_ALERT) {
+		/* Drain before clearing, or a wakeup written in between would be
+		   drained with the flag left set and no later one ever written */
+		while (read(manager_alert[0], buf, sizeof(buf)) > 0)
+			;
+		__sync_lock_release(&manager_alerted);
+		__sync_synchronize();
+	} else if (readable) {
+		if (get_data(s) < 0) {
+			cw_log(LOG_WARNING, "get_data failed: %s\n", strerror(errno));
+			s->dead = 1;
+		} else
+			session_parse(s);
+	} else if (writable) {
+		/* Only finish writing the queued events, so no action's reply
+		   can land in the middle of one */
+		if (!s->dead && !s->inflight && process_queue(s) < 0)
+			s->dead = 1;
+	} else if (hangup)
+		s->dead = 1;
+}
 
-	if ((tmp = malloc(sizeof(struct eventqent) + strlen(str))) == NULL) {
-	        return -1;
-	}
+/*! \brief  The manager I/O thread: accepts connections, reads and parses
+    requests and writes events for every session.  Actions run on the
+    worker pool. */
+static void *manager_io_thread(void *ignore)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[MANAGER_MAX_EVENTS];
+#else
+	struct pollfd *pfds = NULL;
+	void **tags = NULL;
+	int nalloc = 0, nfds;
+#endif
+	struct mansession *s, *next, *done;
+	char iabuf[INET_ADDRSTRLEN];
+	time_t now;
+	int n, x;
 
-	tmp->next = NULL;
-	strcpy(tmp->eventdata, str);
+	for (;;) {
+#ifdef HAVE_SYS_EPOLL_H
+		n = epoll_wait(manager_epfd, events, MANAGER_MAX_EVENTS, 1000);
+		if (n < 0) {
+			if (errno != EINTR)
+				cw_log(LOG_WARNING, "Manager epoll_wait failed: %s\n", strerror(errno));
+			n = 0;
+		}
+		for (x = 0;  x < n;  x++)
+			manager_ready(events[x].data.ptr, events[x].events & EPOLLIN, events[x].events & EPOLLOUT,
+				events[x].events & (EPOLLHUP | EPOLLERR));
+#else
+		for (nfds = 2, s = sessions;  s;  s = s->next) {
+			if (s->watching)
+				nfds++;
+		}
+		if (nfds > nalloc) {
+			nalloc = nfds + 32;
+			pfds = realloc(pfds, nalloc * sizeof(*pfds));
+			tags = realloc(tags, nalloc * sizeof(*tags));
+			if (!pfds || !tags) {
+				cw_log(LOG_ERROR, "Out of memory\n");
+				sleep(1);
+				nalloc = 0;
+				continue;
+			}
+		}
+		pfds[0].fd = asock;
+		pfds[0].events = POLLIN;
+		tags[0] = MANAGER_TAG_LISTENER;
+		pfds[1].fd = manager_alert[0];
+		pfds[1].events = POLLIN;
+		tags[1] = MANAGER_TAG_ALERT;
+		for (nfds = 2, s = sessions;  s;  s = s->next) {
+			if (!s->watching)
+				continue;
+			pfds[nfds].fd = s->fd;
+			pfds[nfds].events = ((s->watching & MANAGER_WANT_READ) ? POLLIN : 0) | ((s->watching & MANAGER_WANT_WRITE) ? POLLOUT : 0);
+			tags[nfds++] = s;
+		}
+		n = poll(pfds, nfds, 1000);
+		if (n < 0) {
+			if (errno != EINTR)
+				cw_log(LOG_WARNING, "Manager poll failed: %s\n", strerror(errno));
+			n = 0;
+		}
+		for (x = 0;  n > 0 && x < nfds;  x++) {
+			if (!pfds[x].revents)
+				continue;
+			n--;
+			manager_ready(tags[x], pfds[x].revents & POLLIN, pfds[x].revents & POLLOUT,
+				pfds[x].revents & (POLLHUP | POLLERR | POLLNVAL));
+		}
+#endif
 
-	cw_mutex_lock(&s->eventqlock);
+		/* Take back sessions whose actions have finished */
+		cw_mutex_lock(&joblock);
+		done = jobs_done;
+		jobs_done = NULL;
+		cw_mutex_unlock(&joblock);
+		for (s = done;  s;  s = next) {
+			next = s->jobnext;
+			s->inflight = 0;
+			if (s->jobres)
+				s->dead = 1;
+			session_set_classes(s);
+			if (!s->dead)
+				session_parse(s);
+		}
 
-	if (s->eventq)
- 	{
-		for (prev = s->eventq;  prev->next;  prev = prev->next);
-		prev->next = tmp;
-	} else {
-		s->eventq = tmp;
+		/* Deliver events, expire idle sessions and close dead ones */
+		now = time(NULL);
+		for (s = sessions;  s;  s = next) {
+			next = s->next;
+			if (!s->dead && !s->inflight) {
+				if ((now - s->last_received) >= s->sockettimeout) {
+					if (option_verbose > 3) {
+						if (displayconnects)
+							cw_verbose(VERBOSE_PREFIX_2 "Manager '%s' timed out from %s\n", s->username, cw_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr));
+					}
+					s->dead = 1;
+				} else if (process_queue(s) < 0)
+					s->dead = 1;
+			} else if (!s->dead && hold_events(s) < 0) {
+				/* Closed once the worker has given the session back */
+				s->dead = 1;
+			}
+			if (s->dead && !s->inflight)
+				close_session(s);
+			else
+				session_watch(s);
+		}
 	}
-	cw_mutex_unlock(&s->eventqlock);
+	return NULL;
+}
 
-	return 0;
+/*! \brief  Put a rendered event into the ring, dropping the ring's
+    reference to the event it replaces */
+static void append_event(int category, int namelen, const char *str, size_t len)
+{
+	struct eventqent *eqe, *old;
+
+	if ((eqe = malloc(sizeof(struct eventqent) + len)) == NULL)
+		return;
+	eqe->usecount = 1;
+	eqe->category = category;
+	eqe->namelen = namelen;
+	memcpy(eqe->eventdata, str, len + 1);
+
+	cw_mutex_lock(&eventqlock);
+	old = eventq[eventq_head % MAX_EVENT_QUEUE];
+	eventq[eventq_head % MAX_EVENT_QUEUE] = eqe;
+	eventq_head++;
+	if (old && --old->usecount)
+		old = NULL;
+	cw_mutex_unlock(&eventqlock);
+
+	if (old)
+		free(old);
+	manager_wakeup();
 }
 
 /*! \brief  manager_event: Send AMI event to client */
 int manager_event(int category, char *event, char *fmt, ...)
 {
-	struct mansession *s;
 	char auth[80];
-	char tmp[4096] = "";
+	char tmp[4096];
 	char *tmp_next = tmp;
-	size_t tmp_left = sizeof(tmp) - 2;
+	size_t tmp_left = sizeof(tmp) - 3;
+	int wanted;
 	va_list ap;
 
-	cw_mutex_lock(&sessionlock);
-	for (s = sessions;  s;  s = s->next) {
-		if ((s->readperm & category) != category)
-			continue;
-
-		if ((s->send_events & category) != category)
-			continue;
+	/* Nobody reads this class of event: don't even format it */
+	wanted = ((manager_event_classes & category) == category);
+	if (!wanted && !manager_hooks)
+		return 0;
 
-		if (cw_strlen_zero(tmp)) {
-			cw_build_string(&tmp_next, &tmp_left, "Event: %s\r\nPrivilege: %s\r\n",
-					 event, authority_to_str(category, auth, sizeof(auth)-1));
-			va_start(ap, fmt);
-			cw_build_string_va(&tmp_next, &tmp_left, fmt, ap);
-			va_end(ap);
-			*tmp_next++ = '\r';
-			*tmp_next++ = '\n';
-			*tmp_next = '\0';
-		}
-
-		append_event(s, tmp);
-	}
-	cw_mutex_unlock(&sessionlock);
+	/* Render the event once for the hooks and every session */
+	cw_build_string(&tmp_next, &tmp_left, "Event: %s\r\nPrivilege: %s\r\n",
+			 event, authority_to_str(category, auth, sizeof(auth)-1));
+	va_start(ap, fmt);
+	cw_build_string_va(&tmp_next, &tmp_left, fmt, ap);
+	va_end(ap);
 
 	if (manager_hooks) {
 		struct manager_custom_hook *hookp;
-		char *p;
-		int len;
 
 		cw_mutex_lock(&hooklock);
-		snprintf(tmp, sizeof(tmp)-1, "Event: %s\r\nPrivilege: %s\r\n", event, authority_to_str(category, auth, sizeof(auth)-1));
-		len = strlen(tmp);
-		p = tmp + len;
-		va_start(ap, fmt);
-		vsnprintf(p, sizeof(tmp) - len - 1, fmt, ap);
-		va_end(ap);
 		for (hookp = manager_hooks ;  hookp;  hookp = hookp->next)
 			hookp->helper(category, event, tmp);
 		cw_mutex_unlock(&hooklock);
 	}
 
+	if (wanted) {
+		*tmp_next++ = '\r';
+		*tmp_next++ = '\n';
+		*tmp_next = '\0';
+		append_event(category, strlen(event), tmp, tmp_next - tmp);
+	}
+
 	return 0;
 }
 
@@ -1716,6 +2164,10 @@ int init_manager(void)
 	int oldportno = portno;
 	static struct sockaddr_in ba;
 	int x = 1;
+	int flags;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
 	
 	if (!registered) {
 		/* Register default actions */
@@ -1773,6 +2225,14 @@ int init_manager(void)
 	if ((val = cw_variable_retrieve(cfg, "general", "displayconnects")))
 		displayconnects = cw_true(val);
 
+	manager_start_workers = DEFAULT_MANAGER_WORKERS;
+	if ((val = cw_variable_retrieve(cfg, "general", "workers"))) {
+		if (sscanf(val, "%d", &manager_start_workers) != 1 || manager_start_workers < 1 || manager_start_workers > MAX_MANAGER_WORKERS) {
+			cw_log(LOG_WARNING, "Invalid number of manager workers '%s'\n", val);
+			manager_start_workers = DEFAULT_MANAGER_WORKERS;
+		}
+	}
+
 	ba.sin_family = AF_INET;
 	ba.sin_port = htons(portno);
 	memset(&ba.sin_addr, 0, sizeof(ba.sin_addr));
@@ -1816,9 +2276,40 @@ int init_manager(void)
 			asock = -1;
 			return -1;
 		}
+		flags = fcntl(asock, F_GETFL);
+		fcntl(asock, F_SETFL, flags | O_NONBLOCK);
+		if (pipe(manager_alert)) {
+			cw_log(LOG_WARNING, "Unable to create manager wakeup pipe: %s\n", strerror(errno));
+			close(asock);
+			asock = -1;
+			return -1;
+		}
+		for (x = 0;  x < 2;  x++) {
+			flags = fcntl(manager_alert[x], F_GETFL);
+			fcntl(manager_alert[x], F_SETFL, flags | O_NONBLOCK);
+		}
+#ifdef HAVE_SYS_EPOLL_H
+		if ((manager_epfd = epoll_create(MANAGER_MAX_EVENTS)) < 0) {
+			cw_log(LOG_WARNING, "Unable to create manager epoll set: %s\n", strerror(errno));
+			close(asock);
+			asock = -1;
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = MANAGER_TAG_LISTENER;
+		epoll_ctl(manager_epfd, EPOLL_CTL_ADD, asock, &ev);
+		ev.data.ptr = MANAGER_TAG_ALERT;
+		epoll_ctl(manager_epfd, EPOLL_CTL_ADD, manager_alert[0], &ev);
+#endif
+		cw_cond_init(&jobcond, NULL);
+		cw_mutex_lock(&joblock);
+		while (manager_workers < manager_start_workers)
+			start_worker();
+		cw_mutex_unlock(&joblock);
 		if (option_verbose)
 			cw_verbose("CallWeaver Management interface listening on port %d\n", portno);
-		cw_pthread_create(&t, NULL, accept_thread, NULL);
+		cw_pthread_create(&t, NULL, manager_io_thread, NULL);
 	}
 	return 0;
 }
@@ -97,6 +97,8 @@ static int nochecksums = 0;
 #define FLAG_NAT_INACTIVE_NOWARN    (1 << 1)
 
 static struct cw_rtp_protocol *protos = NULL;
+/* Channel drivers may register while other modules are still loading */
+CW_MUTEX_DEFINE_STATIC(protolock);
 
 #ifdef ENABLE_SRTP
 struct cw_srtp_res *g_srtp_res;
@@ -1783,6 +1785,7 @@ void cw_rtp_proto_unregister(struct cw_rtp_protocol *proto)
     struct cw_rtp_protocol *cur;
     struct cw_rtp_protocol *prev;
 
+    cw_mutex_lock(&protolock);
     cur = protos;
     prev = NULL;
     while (cur)
@@ -1793,11 +1796,12 @@ void cw_rtp_proto_unregister(struct cw_rtp_protocol *proto)
                 prev->next = proto->next;
             else
                 protos = proto->next;
-            return;
+            break;
         }
         prev = cur;
         cur = cur->next;
     }
+    cw_mutex_unlock(&protolock);
 }
 
 /*--- cw_rtp_proto_register: Register interface to channel driver */
@@ -1805,11 +1809,13 @@ int cw_rtp_proto_register(struct cw_rtp_protocol *proto)
 {
     struct cw_rtp_protocol *cur;
 
+    cw_mutex_lock(&protolock);
     cur = protos;
     while (cur)
     {
         if (cur->type == proto->type)
         {
+            cw_mutex_unlock(&protolock);
             cw_log(LOG_WARNING, "Tried to register same protocol '%s' twice\n", cur->type);
             return -1;
         }
@@ -1817,6 +1823,7 @@ int cw_rtp_proto_register(struct cw_rtp_protocol *proto)
     }
     proto->next = protos;
     protos = proto;
+    cw_mutex_unlock(&protolock);
     return 0;
 }
 
@@ -1825,14 +1832,16 @@ static struct cw_rtp_protocol *get_proto(struct cw_channel *chan)
 {
     struct cw_rtp_protocol *cur;
 
+    cw_mutex_lock(&protolock);
     cur = protos;
     while (cur)
     {
         if (cur->type == chan->type)
-            return cur;
+            break;
         cur = cur->next;
     }
-    return NULL;
+    cw_mutex_unlock(&protolock);
+    return cur;
 }
 
 /* cw_rtp_bridge: Bridge calls. If possible and allowed, initiate
@@ -0,0 +1,90 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief The few core calls made by the files the corelib tests are
+ * built from, so the tests don't have to link libcallweaver, which
+ * already has those files in it
+ */
+#ifdef HAVE_CONFIG_H
+#include "confdefs.h"
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "callweaver.h"
+
+#include "callweaver/logger.h"
+#include "callweaver/cli.h"
+#include "callweaver/options.h"
+#include "callweaver/utils.h"
+
+int option_verbose = 0;
+int option_debug = 0;
+int option_dns_threads = 2;
+
+void cw_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	va_list ap;
+
+	/* Debug and notices would only get in the way of the test output */
+	if (level != __LOG_WARNING && level != __LOG_ERROR)
+		return;
+	printf("%s:%d %s: ", file, line, function);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+void cw_verbose(const char *fmt, ...)
+{
+}
+
+void cw_cli(int fd, char *fmt, ...)
+{
+}
+
+int cw_cli_register(struct cw_cli_entry *e)
+{
+	return 0;
+}
+
+int cw_cli_unregister(struct cw_cli_entry *e)
+{
+	return 0;
+}
+
+void cw_register_file_version(const char *file, const char *version)
+{
+}
+
+void cw_unregister_file_version(const char *file)
+{
+}
+
+const char *cw_inet_ntoa(char *buf, int bufsiz, struct in_addr ia)
+{
+	return inet_ntop(AF_INET, &ia, buf, bufsiz);
+}
+
+int cw_pthread_create_stack(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data, size_t stacksize)
+{
+	return pthread_create(thread, attr, start_routine, data);
+}
@@ -71,6 +71,8 @@ static int udptldebug = 0;                /* Are we debugging? */
 static struct sockaddr_in udptldebugaddr;    /* Debug packets to/from this host */
 
 CW_MUTEX_DEFINE_STATIC(settingslock);
+/* Channel drivers may register while other modules are still loading */
+CW_MUTEX_DEFINE_STATIC(protolock);
 static int nochecksums = 0;
 static int udptlfectype = UDPTL_ERROR_CORRECTION_NONE;
 static int udptlfecentries = 0;
@@ -1004,6 +1006,7 @@ void cw_udptl_proto_unregister(struct cw_udptl_protocol *proto)
     struct cw_udptl_protocol *prev;
 
     cw_log(LOG_NOTICE,"Unregistering UDPTL protocol.\n");
+    cw_mutex_lock(&protolock);
     for (cur = protos, prev = NULL;  cur;  prev = cur, cur = cur->next)
     {
         if (cur == proto)
@@ -1012,26 +1015,30 @@ void cw_udptl_proto_unregister(struct cw_udptl_protocol *proto)
                 prev->next = proto->next;
             else
                 protos = proto->next;
-            return;
+            break;
         }
     }
+    cw_mutex_unlock(&protolock);
 }
 
 int cw_udptl_proto_register(struct cw_udptl_protocol *proto)
 {
     struct cw_udptl_protocol *cur;
 
+    cw_mutex_lock(&protolock);
     for (cur = protos;  cur;  cur = cur->next)
     {
         if (cur->type == proto->type)
         {
+            cw_mutex_unlock(&protolock);
             cw_log(LOG_WARNING, "Tried to register same protocol '%s' twice\n", cur->type);
             return -1;
         }
     }
-    cw_log(LOG_NOTICE,"Registering UDPTL protocol.\n");
     proto->next = protos;
     protos = proto;
+    cw_mutex_unlock(&protolock);
+    cw_log(LOG_NOTICE,"Registering UDPTL protocol.\n");
     return 0;
 }
 
@@ -1039,12 +1046,14 @@ static struct cw_udptl_protocol *get_proto(struct cw_channel *chan)
 {
     struct cw_udptl_protocol *cur;
 
+    cw_mutex_lock(&protolock);
     for (cur = protos;  cur;  cur = cur->next)
     {
         if (cur->type == chan->type)
-            return cur;
+            break;
     }
-    return NULL;
+    cw_mutex_unlock(&protolock);
+    return cur;
 }
 
 enum cw_bridge_result cw_udptl_bridge(struct cw_channel *c0, struct cw_channel *c1, int flags, struct cw_frame **fo, struct cw_channel **rc)
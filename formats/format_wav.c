@@ -55,6 +55,7 @@ struct cw_filestream
     /* This is what a filestream means to us */
     FILE *f; /* Descriptor */
     int bytes;
+    int hdrbytes;                      /* bytes when the header was last updated */
     int needsgain;
     struct cw_frame fr;                /* Frame information */
     char waste[CW_FRIENDLY_OFFSET];    /* Buffer for sending frames, etc */
@@ -78,6 +79,10 @@ static char *exts = "wav";
 
 #define GAIN 2        /* 2^GAIN is the multiple to increase the volume by */
 
+/* The header is brought up to date once a second of audio rather than
+   after every frame, so writes aren't broken up by seeks */
+#define HEADER_INTERVAL 16000
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define htoll(b) (b)
 #define htols(b) (b)
@@ -418,6 +423,8 @@ static void wav_close(struct cw_filestream *s)
     cw_update_use_count();
     if (s->f)
     {
+        if (s->bytes != s->hdrbytes)
+            update_header(s->f);
         /* Pad to even length */
         if (s->bytes & 0x1)
             fwrite(&zero, 1, 1, s->f);
@@ -555,7 +562,11 @@ static int wav_write(struct cw_filestream *fs, struct cw_frame *f)
     }
     
     fs->bytes += f->datalen;
-    update_header(fs->f);
+    if (fs->bytes - fs->hdrbytes >= HEADER_INTERVAL)
+    {
+        update_header(fs->f);
+        fs->hdrbytes = fs->bytes;
+    }
         
     return 0;
 }
@@ -60,6 +60,10 @@ char msgsm_silence[] = /* 65 */
 ,0x92,0x24,0x49,0x92,0x00};
 /* end binary data. size = 65 bytes */
 
+/* The header is brought up to date once a second of audio rather than
+   after every block, so writes aren't broken up by seeks */
+#define HEADER_INTERVAL 25
+
 struct cw_filestream {
     void *reserved[CW_RESERVED_POINTERS];
     /* Believe it or not, we must decode/recode to account for the
@@ -72,6 +76,7 @@ struct cw_filestream {
     unsigned char gsm[66];                /* Two Real GSM Frames */
     int foffset;
     int secondhalf;                        /* Are we on the second half */
+    int unsynced;                          /* 65 byte blocks written since the header was updated */
     struct timeval last;
 };
 
@@ -409,6 +414,8 @@ static void wav_close(struct cw_filestream *s)
     glistcnt--;
     cw_mutex_unlock(&wav_lock);
     cw_update_use_count();
+    if (s->unsynced)
+        update_header(s->f);
     /* Pad to even length */
     fseek(s->f, 0, SEEK_END);
     if (ftell(s->f) & 0x1)
@@ -479,7 +486,11 @@ static int wav_write(struct cw_filestream *fs, struct cw_frame *f)
                 cw_log(LOG_WARNING, "Bad write (%d/65): %s\n", res, strerror(errno));
                 return -1;
             }
-            update_header(fs->f);
+            if (++fs->unsynced >= HEADER_INTERVAL)
+            {
+                update_header(fs->f);
+                fs->unsynced = 0;
+            }
             len += 65;
         }
         else
@@ -493,7 +504,11 @@ static int wav_write(struct cw_filestream *fs, struct cw_frame *f)
                     cw_log(LOG_WARNING, "Bad write (%d/65): %s\n", res, strerror(errno));
                     return -1;
                 }
-                update_header(fs->f);
+                if (++fs->unsynced >= HEADER_INTERVAL)
+                {
+                    update_header(fs->f);
+                    fs->unsynced = 0;
+                }
             }
             else
             {
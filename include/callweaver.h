@@ -83,6 +83,8 @@ extern int cwdb_init(void);
 extern int cwdb_shutdown(void);
 /* Provided by channel.c */
 extern void cw_channels_init(void);
+/* Provided by dns.c */
+extern int cw_dns_init(void);
 /* Provided by dnsmgr.c */
 extern int dnsmgr_init(void);
 extern void dnsmgr_reload(void);
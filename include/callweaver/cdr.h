@@ -102,6 +102,7 @@ extern void cw_cdr_free_vars(struct cw_cdr *cdr, int recur);
 extern int cw_cdr_copy_vars(struct cw_cdr *to_cdr, struct cw_cdr *from_cdr);
 
 typedef int (*cw_cdrbe)(struct cw_cdr *cdr);
+typedef int (*cw_cdrbe_batch)(struct cw_cdr **cdrs, int count);
 
 /*! \brief Allocate a CDR record 
  * Returns a malloc'd cw_cdr structure, returns NULL on error (malloc failure)
@@ -146,6 +147,19 @@ extern int cw_cdr_setcid(struct cw_cdr *cdr, struct cw_channel *chan);
  */
 extern int cw_cdr_register(char *name, char *desc, cw_cdrbe be);
 
+/*! Register a CDR handling engine that can also store a batch of CDRs at once */
+/*!
+ * \param name name associated with the particular CDR handler
+ * \param desc description of the CDR handler
+ * \param be function pointer to a CDR handler, used outside batch mode
+ * \param batch_be function pointer to a batch CDR handler, or NULL
+ * In batch mode batch_be is given every record of a batch in one call and
+ * should store either all of them or none of them (one transaction).  If it
+ * returns non-zero each record of the batch is retried through be.
+ * Returns -1 on error, 0 on success.
+ */
+extern int cw_cdr_register_batch(char *name, char *desc, cw_cdrbe be, cw_cdrbe_batch batch_be);
+
 /*! Unregister a CDR handling engine */
 /*!
  * \param name name of CDR handler to unregister
@@ -207,10 +221,11 @@ extern void cw_cdr_end(struct cw_cdr *cdr);
  */
 extern void cw_cdr_detach(struct cw_cdr *cdr);
 
-/*! Spawns (possibly) a new thread to submit a batch of CDRs to the backend engines */
+/*! Hands the current batch of CDRs to the CDR thread for submission to the backend engines */
 /*!
  * \param shutdown Whether or not we are shutting down
- * Blocks the callweaver shutdown procedures until the CDR data is submitted.
+ * When shutting down, submits the batch and anything still queued in this
+ * thread, blocking the callweaver shutdown procedures until it is done.
  * Returns nothing
  */
 extern void cw_cdr_submit_batch(int shutdown);
@@ -36,4 +36,18 @@ struct cw_channel;
 extern int cw_search_dns(void *context, const char *dname, int class, int type,
 	 int (*callback)(void *context, char *answer, int len, char *fullanswer));
 
+/*!	\brief	Perform DNS lookup from one of the resolver threads
+	\param	context
+	\param	dname	Domain name to lookup (host, SRV domain, TXT record name)
+	\param	class	Record Class (see "man res_search")
+	\param	type	Record type (see "man res_search")
+	\param	callback Callback function for handling DNS result
+	\param	done	Called with what cw_search_dns() would have returned, after callback
+	\return	0 if the lookup was queued, -1 if not, in which case neither
+		callback nor done are called
+*/
+extern int cw_search_dns_async(void *context, const char *dname, int class, int type,
+	 int (*callback)(void *context, char *answer, int len, char *fullanswer),
+	 void (*done)(void *context, int res));
+
 #endif /* _CALLWEAVER_DNS_H */
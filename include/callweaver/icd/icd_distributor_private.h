@@ -45,6 +45,26 @@ typedef enum {
     ICD_DISTRIBUTOR_STATE_LAST_STANDARD
 } icd_distributor_state;
 
+/* What woke up the distributor thread. Producers (callers being added, the
+ * lists being replaced, the distributor being started) post these to the
+ * distributor's event queue, and the run thread only looks at the lists
+ * when it has an event to handle. */
+typedef enum {
+    ICD_DISTRIBUTOR_EVENT_NONE, ICD_DISTRIBUTOR_EVENT_CUSTOMER_ADDED,
+    ICD_DISTRIBUTOR_EVENT_AGENT_ADDED, ICD_DISTRIBUTOR_EVENT_LISTS_CHANGED,
+    ICD_DISTRIBUTOR_EVENT_STATE_CHANGED, ICD_DISTRIBUTOR_EVENT_TIMEOUT,
+    ICD_DISTRIBUTOR_EVENT_LAST_STANDARD
+} icd_distributor_event_type;
+
+/* Number of undelivered events kept per distributor. Repeats of the event at
+ * the tail of the queue, and anything posted to a full queue, are folded into
+ * what is already queued since the run thread works from the list state. */
+#define ICD_DISTRIBUTOR_EVENT_QUEUE_LEN 32
+
+/* How long the run thread waits before retrying a link that failed while
+ * both customers and agents are still waiting. */
+#define ICD_DISTRIBUTOR_RETRY_MS 1000
+
 struct icd_distributor {
     char name[ICD_STRING_LEN];
     icd_member_list *customers;
@@ -68,8 +88,26 @@ struct icd_distributor {
     void_hash_table *params;
 /* This is for distibutor to know that link_fn call is needed  */    
     unsigned int number_of_callers_added;
+/* Event queue for the run thread, protected by lock */
+    icd_distributor_event_type events[ICD_DISTRIBUTOR_EVENT_QUEUE_LEN];
+    int event_head;
+    int event_count;
+    unsigned int events_folded;
+    unsigned int events_handled;
+    unsigned int links_made;
+    unsigned int links_failed;
+/* Agent ordering for the strategies that pick the agent by key, protected by lock.
+   When set the agent list is kept in fifo order and agent_pq decides who goes next. */
+    icd_pqueue *agent_pq;
+    long (*agent_key_fn) (icd_member * member);
 };
 
+/* Event queue of the run thread. Post and wait with the distributor locked,
+ * link without it. */
+void icd_distributor__post_event(icd_distributor * that, icd_distributor_event_type event);
+icd_distributor_event_type icd_distributor__wait_event(icd_distributor * that, int timeout_ms);
+int icd_distributor__link_pending(icd_distributor * that);
+
 #endif
 
 /* For Emacs:
@@ -135,6 +135,9 @@ extern "C" {
 /* Gets the caller of this member object */
     icd_caller *icd_member__get_caller(icd_member * that);
 
+/* Gets the pqueue slot of this member object (see icd_pqueue.h) */
+    int *icd_member__get_pq_slot(void *that);
+
 /* Sets the number of calls dealt with by this member object */
     icd_status icd_member__set_calls(icd_member * that, int calls);
 
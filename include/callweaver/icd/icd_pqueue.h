@@ -0,0 +1,109 @@
+/*
+ * ICD - Intelligent Call Distributor 
+ *
+ * Copyright (C) 2003, 2004, 2005
+ *
+ * Written by Anthony Minessale II <anthmct at yahoo dot com>
+ * Written by Bruce Atherton <bruce at callenish dot com>
+ * Additions, Changes and Support by Tim R. Clark <tclark at shaw dot ca>
+ * Changed to adopt to jabber interaction and adjusted for CallWeaver.org by
+ * Halo Kwadrat Sp. z o.o., Piotr Figurny and Michal Bielicki
+ * 
+ * This application is a part of:
+ * 
+ * CallWeaver -- An open source telephony toolkit.
+ * Copyright (C) 1999 - 2005, Digium, Inc.
+ * Mark Spencer <markster@digium.com>
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+ 
+/*! \file
+ *  \brief icd_pqueue.h  -  binary heap of payloads ordered by a numeric key
+ *
+ * The icd_pqueue module provides a priority queue for distributor strategies
+ * that always want the "best" waiting element (least recently used agent,
+ * agent with the fewest calls, ...). Pushing and popping are O(log n) and
+ * replace the ordered insert of icd_list, which walks the whole list on
+ * every push.
+ *
+ * Each element is pushed with a key, and the element with the lowest key is
+ * popped first. Elements with equal keys come out in the order they were
+ * pushed, which is the same order icd_list__insert_ordered() gives them.
+ *
+ * Each payload must provide an int that the pqueue uses to remember where
+ * in the heap the payload lives (see the slot_fn passed to the constructor).
+ * That int must be zero while the payload is not in any pqueue. This lets
+ * us re-key and remove arbitrary payloads without searching the heap. A
+ * payload can therefore only be in one pqueue at a time.
+ *
+ * The pqueue does no locking of its own. It is meant to live inside an
+ * object with a lock (like icd_distributor) and be protected by it.
+ *
+ */
+
+#ifndef ICD_PQUEUE_H
+#define ICD_PQUEUE_H
+
+#include "callweaver/icd/icd_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***** Constructors and Destructors *****/
+
+/* Constructor for a pqueue. size is the initial number of slots, the heap
+ * grows as needed. slot_fn returns the position storage of a payload. */
+    icd_pqueue *create_icd_pqueue(int size, int *(*slot_fn) (void *payload));
+
+/* Destructor for a pqueue. Resets the pointer passed in to NULL. The
+ * payloads are not freed, but their slots are reset. */
+    icd_status destroy_icd_pqueue(icd_pqueue ** pqueuep);
+
+/* Removes all payloads from the pqueue, resetting their slots. */
+    icd_status icd_pqueue__clear(icd_pqueue * that);
+
+/***** Behaviours *****/
+
+/* Adds a payload with a key. If the payload is already queued it is re-keyed
+ * and moves to the back of the elements with the same key. */
+    icd_status icd_pqueue__push(icd_pqueue * that, void *payload, long key);
+
+/* Removes and returns the payload with the lowest key, NULL if empty. */
+    void *icd_pqueue__pop(icd_pqueue * that);
+
+/* Returns the payload with the lowest key without removing it. */
+    void *icd_pqueue__peek(icd_pqueue * that);
+
+/* Removes a specific payload, ICD_ENOTFOUND if it isn't queued here. */
+    icd_status icd_pqueue__remove(icd_pqueue * that, void *payload);
+
+/* Returns true if the payload is currently in this pqueue. */
+    int icd_pqueue__contains(icd_pqueue * that, void *payload);
+
+/* Returns the number of payloads currently queued. */
+    int icd_pqueue__count(icd_pqueue * that);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+/* For Emacs:
+ * Local Variables:
+ * indent-tabs-mode:nil
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+ */
@@ -55,6 +55,7 @@ typedef struct icd_list icd_list;
 typedef struct icd_list_node icd_list_node;
 typedef struct icd_list_iterator icd_list_iterator;
 typedef struct icd_metalist icd_metalist;
+typedef struct icd_pqueue icd_pqueue;
 
 /* Call distribution specific pieces */
 typedef struct icd_caller icd_caller;
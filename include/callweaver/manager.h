@@ -87,14 +87,19 @@ extern void del_manager_hook(struct manager_custom_hook *hook);
 #define MAX_HEADERS 80
 #define MAX_LEN 256
 
+/*! An event as rendered once by manager_event() and shared by every
+    session that reads it from the event ring */
 struct eventqent {
-	struct eventqent *next;
+	/*! References held by the ring and by sessions writing it out */
+	int usecount;
+	/*! EVENT_FLAG_* class of the event */
+	int category;
+	/*! Length of the event name, which follows "Event: " in eventdata */
+	int namelen;
 	char eventdata[1];
 };
 
 struct mansession {
-	/*! Execution thread */
-	pthread_t t;
 	/*! Thread lock -- don't use in action callbacks, it's already taken care of  */
 	cw_mutex_t __lock;
 	/*! socket address */
@@ -119,10 +124,33 @@ struct mansession {
 	char inbuf[MAX_LEN];
 	int inlen;
 	int send_events;
-	/* Queued events */
-	struct eventqent *eventq;
-	/* Queue events lock */
-	cw_mutex_t eventqlock;
+	/* Event classes this session is counted as a subscriber of */
+	unsigned int event_classes;
+	/* Event names to send ("Name") or not to send ("!Name"), comma separated */
+	char eventfilter[256];
+	/* Sequence number of the next event to send from the event ring */
+	unsigned int eventq_seq;
+	/* Event partly written to a full socket, and how much of it has gone */
+	struct eventqent *outev;
+	size_t outoff;
+	/* Events taken off the ring for the session while an action runs,
+	   sent in order once it has finished */
+	struct eventqent **held;
+	int heldcount;
+	int heldnext;
+	int heldalloc;
+	/* Message being read, or being run by a manager worker */
+	struct message *inmsg;
+	/* Set while a manager worker runs an action for this session */
+	int inflight;
+	/* Result of that action, collected by the manager I/O thread */
+	int jobres;
+	/* Poll events the manager I/O thread is waiting for */
+	int watching;
+	/* When the last complete message was received */
+	time_t last_received;
+	/* Next session waiting for a manager worker */
+	struct mansession *jobnext;
 	/* Timeout for cw_carefulwrite() */
 	int writetimeout;
 	int sockettimeout;
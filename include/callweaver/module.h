@@ -84,6 +84,17 @@ char *description(void);		/* Description of this module */
  */
 int reload(void);		/* reload configs */
 
+/*! 
+ * \brief Names the modules this one needs loaded first (optional).
+ *
+ * At startup modules are loaded several at a time, those of one kind (res_,
+ * chan_, pbx_, then everything else) after all of the kinds before it.  A
+ * module using another one of its own kind has to say so here.
+ *
+ * \return The file names of the modules, separated by spaces or commas.
+ */
+char *depends(void);
+
 #define CW_MODULE_CONFIG "modules.conf" /*!< \brief Module configuration file */
 
 /*! 
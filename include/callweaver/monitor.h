@@ -41,6 +41,11 @@ struct cw_channel_monitor
 	char *format;
 	int joinfiles;
 	int (*stop)( struct cw_channel *chan, int need_lock);
+	/*! Set instead of the streams when both directions are mixed into a
+	    single file as they arrive.  out is 0 for frames read from the
+	    channel and 1 for frames written to it */
+	void (*mix_frame)(struct cw_channel_monitor *monitor, struct cw_frame *f, int out);
+	void *mix;
 };
 
 /* Start monitoring a channel */
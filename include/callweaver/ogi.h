@@ -31,6 +31,7 @@ typedef struct ogi_state {
 	int fd;		/* FD for general output */
 	int audio;	/* FD for audio output */
 	int ctrl;	/* FD for input control */
+	int endsession;	/* Set by END SESSION, the script is done but the FastOGI connection is still good */
 } OGI;
 
 typedef struct ogi_command {
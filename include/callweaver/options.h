@@ -47,6 +47,10 @@ extern int option_timestamp;
 extern int option_transcode_slin;
 extern int option_maxcalls;
 extern double option_maxload;
+extern int option_prompt_cache;
+extern int option_record_writers;
+extern int option_dns_threads;
+extern int option_config_cache;
 extern int option_dontwarn;
 extern int option_priority_jumping;
 extern char defaultlanguage[];
@@ -145,6 +145,11 @@ struct cw_hostent {
 
 extern struct hostent *cw_gethostbyname(const char *host, struct cw_hostent *hp);
 
+/*! Looks up a host from one of the resolver threads, which calls done with
+    the result, or NULL, when it has it.  Returns -1 if the lookup couldn't
+    be queued, in which case done won't be called */
+extern int cw_gethostbyname_async(const char *host, void (*done)(void *data, struct hostent *hp), void *data);
+
 #define CW_MAX_BINARY_MD_SIZE EVP_MAX_MD_SIZE
 #define CW_MAX_HEX_MD_SIZE ((EVP_MAX_MD_SIZE * 2) + 1)
 
@@ -826,6 +826,468 @@ static int dundi_answer_entity(struct dundi_transaction *trans, struct dundi_ies
 	return 0;
 }
 
+/* Answers and hints are cached in memory on the keys they have in the
+   dundi/cache family of the database: peer EID, number (or number prefix
+   for hints), context and either the CRC-32 of the avoid list or the root
+   EID.  The entries are also kept in a heap ordered by expiration, so the
+   expired ones, and the one nearest expiry when the cache is full, are
+   always at the top.  With cachepersist the database only sees the cache
+   through a thread writing changed entries behind the lookups. */
+#define DUNDI_CACHE_BUCKETS			1024
+#define DUNDI_DEFAULT_CACHE_SIZE	10000
+#define DUNDI_CACHE_WRITE_INTERVAL	5		/*!< In seconds */
+
+struct dundi_cache_answer {
+	unsigned int flags;
+	int weight;
+	int techint;
+	dundi_eid eid;
+	char eid_str[20];
+	char *dest;
+};
+
+struct dundi_cache_entry {
+	struct dundi_cache_entry *next;			/* Next in the bucket, or of the entries to delete */
+	struct dundi_cache_entry *dirtynext;	/* Next of the entries to write */
+	struct dundi_cache_entry **dirtyprev;	/* NULL unless waiting to be written */
+	unsigned int hash;
+	time_t expiration;
+	int heapidx;							/* Position in the expiry heap */
+	int stored;								/* Has a copy in the database */
+	int nanswers;
+	struct dundi_cache_answer *answers;
+	char *key;
+};
+
+static struct dundi_cache_entry *cache_table[DUNDI_CACHE_BUCKETS];
+static struct dundi_cache_entry **cache_heap;
+static int cache_heapsize;
+static int cache_entries;
+static struct dundi_cache_entry *cache_dirty;
+static struct dundi_cache_entry *cache_deleted;
+static int cache_hits;
+static int cache_misses;
+static int cache_evictions;
+static int dundi_cache_size = DUNDI_DEFAULT_CACHE_SIZE;
+static int dundi_cache_persist = 1;
+static int cache_thread_stop;
+/* The write thread is running and takes the changes, protected by cachelock */
+static int cache_writing;
+static cw_cond_t cache_cond;
+static pthread_t cachethreadid = CW_PTHREADT_NULL;
+
+CW_MUTEX_DEFINE_STATIC(cachelock);
+/* Taken before cachelock around taking and writing a batch, so a flush
+   can't be undone by a write in progress */
+CW_MUTEX_DEFINE_STATIC(cachewritelock);
+
+static unsigned int cache_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (unsigned char) *key++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void cache_heap_set(int idx, struct dundi_cache_entry *e)
+{
+	cache_heap[idx] = e;
+	e->heapidx = idx;
+}
+
+static void cache_heap_up(int idx)
+{
+	struct dundi_cache_entry *e = cache_heap[idx];
+	int parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (cache_heap[parent]->expiration <= e->expiration)
+			break;
+		cache_heap_set(idx, cache_heap[parent]);
+		idx = parent;
+	}
+	cache_heap_set(idx, e);
+}
+
+static void cache_heap_down(int idx)
+{
+	struct dundi_cache_entry *e = cache_heap[idx];
+	int child;
+
+	for (;;) {
+		child = 2 * idx + 1;
+		if (child >= cache_entries)
+			break;
+		if (child + 1 < cache_entries && cache_heap[child + 1]->expiration < cache_heap[child]->expiration)
+			child++;
+		if (e->expiration <= cache_heap[child]->expiration)
+			break;
+		cache_heap_set(idx, cache_heap[child]);
+		idx = child;
+	}
+	cache_heap_set(idx, e);
+}
+
+/* Must be called with cachelock held */
+static struct dundi_cache_entry *cache_find(const char *key, unsigned int hash)
+{
+	struct dundi_cache_entry *e;
+
+	for (e = cache_table[hash % DUNDI_CACHE_BUCKETS]; e; e = e->next) {
+		if (e->hash == hash && !strcmp(e->key, key))
+			break;
+	}
+	return e;
+}
+
+static void cache_dirty_add(struct dundi_cache_entry *e)
+{
+	if (!cache_dirty && !cache_deleted)
+		cw_cond_signal(&cache_cond);
+	e->dirtynext = cache_dirty;
+	if (cache_dirty)
+		cache_dirty->dirtyprev = &e->dirtynext;
+	e->dirtyprev = &cache_dirty;
+	cache_dirty = e;
+}
+
+static void cache_dirty_remove(struct dundi_cache_entry *e)
+{
+	if (!e->dirtyprev)
+		return;
+	*e->dirtyprev = e->dirtynext;
+	if (e->dirtynext)
+		e->dirtynext->dirtyprev = e->dirtyprev;
+	e->dirtyprev = NULL;
+}
+
+/* Takes an entry out of the table, the heap and the entries to write.
+   Must be called with cachelock held */
+static void cache_unlink(struct dundi_cache_entry *e)
+{
+	struct dundi_cache_entry **prev;
+	struct dundi_cache_entry *last;
+	int idx;
+
+	for (prev = &cache_table[e->hash % DUNDI_CACHE_BUCKETS]; *prev != e; prev = &(*prev)->next)
+		;
+	*prev = e->next;
+	idx = e->heapidx;
+	last = cache_heap[--cache_entries];
+	if (idx < cache_entries) {
+		cache_heap_set(idx, last);
+		cache_heap_up(idx);
+		cache_heap_down(last->heapidx);
+	}
+	cache_dirty_remove(e);
+}
+
+/* Unlinks and frees an entry, leaving its copy in the database, if it has
+   one, for the write thread to delete.  Without the write thread the copy
+   stays, and is deleted when it is found expired on loading.  Must be called
+   with cachelock held */
+static void cache_drop(struct dundi_cache_entry *e)
+{
+	cache_unlink(e);
+	if (e->stored && cache_writing) {
+		if (!cache_dirty && !cache_deleted)
+			cw_cond_signal(&cache_cond);
+		e->next = cache_deleted;
+		cache_deleted = e;
+	} else
+		free(e);
+}
+
+/* Must be called with cachelock held */
+static void cache_expire(time_t now)
+{
+	while (cache_entries && cache_heap[0]->expiration <= now)
+		cache_drop(cache_heap[0]);
+}
+
+/* Caches the answers under key until expiration.  An entry loaded from the
+   database is already stored there, and doesn't replace one cached since */
+static int cache_store(const char *key, time_t expiration, struct dundi_result *dr, int count, int fromdb)
+{
+	struct dundi_cache_entry *e;
+	struct dundi_cache_entry *old;
+	struct dundi_cache_entry **heap;
+	unsigned int hash;
+	size_t len;
+	char *s;
+	int x;
+
+	hash = cache_hash(key);
+	len = sizeof(*e) + count * sizeof(e->answers[0]) + strlen(key) + 1;
+	for (x = 0;  x < count;  x++)
+		len += strlen(dr[x].dest) + 1;
+	if (!(e = malloc(len))) {
+		cw_log(LOG_WARNING, "Out of memory!\n");
+		return -1;
+	}
+	e->hash = hash;
+	e->expiration = expiration;
+	e->dirtyprev = NULL;
+	e->stored = fromdb;
+	e->nanswers = count;
+	e->answers = (struct dundi_cache_answer *) (e + 1);
+	e->key = (char *) (e->answers + count);
+	strcpy(e->key, key);
+	s = e->key + strlen(key) + 1;
+	for (x = 0;  x < count;  x++) {
+		e->answers[x].flags = dr[x].flags;
+		e->answers[x].weight = dr[x].weight;
+		e->answers[x].techint = dr[x].techint;
+		e->answers[x].eid = dr[x].eid;
+		dundi_eid_to_str(e->answers[x].eid_str, sizeof(e->answers[x].eid_str), &dr[x].eid);
+		e->answers[x].dest = s;
+		strcpy(s, dr[x].dest);
+		s += strlen(s) + 1;
+	}
+
+	cw_mutex_lock(&cachelock);
+	cache_expire(time(NULL));
+	if ((old = cache_find(key, hash))) {
+		if (fromdb) {
+			cw_mutex_unlock(&cachelock);
+			free(e);
+			return 0;
+		}
+		/* Writing the new answers will replace the old ones in the database */
+		cache_unlink(old);
+		e->stored = old->stored;
+		free(old);
+	}
+	while (cache_entries && cache_entries >= dundi_cache_size) {
+		cache_drop(cache_heap[0]);
+		cache_evictions++;
+	}
+	if (dundi_cache_size < 1) {
+		cw_mutex_unlock(&cachelock);
+		free(e);
+		return 0;
+	}
+	if (cache_entries == cache_heapsize) {
+		if (!(heap = realloc(cache_heap, (cache_heapsize ? cache_heapsize * 2 : 64) * sizeof(*heap)))) {
+			cw_mutex_unlock(&cachelock);
+			cw_log(LOG_WARNING, "Out of memory!\n");
+			free(e);
+			return -1;
+		}
+		cache_heap = heap;
+		cache_heapsize = cache_heapsize ? cache_heapsize * 2 : 64;
+	}
+	e->next = cache_table[hash % DUNDI_CACHE_BUCKETS];
+	cache_table[hash % DUNDI_CACHE_BUCKETS] = e;
+	cache_heap_set(cache_entries, e);
+	cache_heap_up(cache_entries++);
+	if (!fromdb && cache_writing)
+		cache_dirty_add(e);
+	cw_mutex_unlock(&cachelock);
+	return 0;
+}
+
+/* Empties the cache, deleting nothing from the database.  Must be called
+   with cachelock held */
+static void cache_clear(void)
+{
+	struct dundi_cache_entry *e;
+
+	while (cache_entries) {
+		e = cache_heap[0];
+		cache_unlink(e);
+		free(e);
+	}
+	while ((e = cache_deleted)) {
+		cache_deleted = e->next;
+		free(e);
+	}
+}
+
+/* Serializes an entry the way it is kept in the database */
+static void cache_format(struct dundi_cache_entry *e, char *data, int datalen)
+{
+	char eid_str[20];
+	int len;
+	int x;
+
+	len = snprintf(data, datalen, "%ld,", (long) e->expiration);
+	for (x = 0;  x < e->nanswers && len < datalen;  x++) {
+		/* Skip anything with an illegal comma in it */
+		if (strchr(e->answers[x].dest, ','))
+			continue;
+		len += snprintf(data + len, datalen - len, "%d/%d/%d/%s/%s,",
+			e->answers[x].flags, e->answers[x].weight, e->answers[x].techint, e->answers[x].dest,
+			dundi_eid_to_str_short(eid_str, sizeof(eid_str), &e->answers[x].eid));
+	}
+}
+
+/* Parses answers as kept in the database, returning how many there are or -1 */
+static int cache_parse(char *data, time_t *expiration, struct dundi_result *dr, int maxret)
+{
+	char *ptr, *term, *src;
+	long timeout;
+	int length;
+	int count = 0;
+
+	if (sscanf(data, "%ld,%n", &timeout, &length) != 1)
+		return -1;
+	*expiration = timeout;
+	ptr = data + length;
+	while (count < maxret && sscanf(ptr, "%u/%d/%d/%n", &dr[count].flags, &dr[count].weight, &dr[count].techint, &length) == 3) {
+		ptr += length;
+		if (!(term = strchr(ptr, ',')))
+			break;
+		*term = '\0';
+		if ((src = strrchr(ptr, '/')))
+			*src++ = '\0';
+		else
+			src = "";
+		dundi_str_short_to_eid(&dr[count].eid, src);
+		cw_copy_string(dr[count].dest, ptr, sizeof(dr[count].dest));
+		count++;
+		ptr = term + 1;
+	}
+	return count;
+}
+
+/* Loads what an earlier run left in the database, deleting what expired since */
+static void cache_load(void)
+{
+	struct cw_db_entry *tree;
+	struct cw_db_entry *dbe;
+	struct dundi_result dr[MAX_RESULTS];
+	time_t expiration;
+	time_t now;
+	int loaded = 0;
+	int count;
+
+	tree = cw_db_gettree("dundi/cache", NULL);
+	time(&now);
+	for (dbe = tree; dbe; dbe = dbe->next) {
+		count = cache_parse(dbe->data, &expiration, dr, MAX_RESULTS);
+		if (count < 0 || expiration <= now) {
+			cw_db_del("dundi/cache", dbe->key);
+			continue;
+		}
+		if (!cache_store(dbe->key, expiration, dr, count, 1))
+			loaded++;
+	}
+	cw_db_freetree(tree);
+	if (loaded && option_verbose > 2)
+		cw_verbose(VERBOSE_PREFIX_3 "Loaded %d cached DUNDi answers\n", loaded);
+}
+
+struct dundi_cache_write {
+	struct dundi_cache_write *next;
+	char *key;
+	char data[1024];
+};
+
+/* Writes the changed entries to the database and deletes the dropped ones.
+   Called with cachelock held, which is let go during the writes.  The batch
+   is taken with cachewritelock already held, so a flush either comes before
+   it and empties it, or waits until it is written and then deletes it */
+static void cache_write(void)
+{
+	struct dundi_cache_entry *deleted;
+	struct dundi_cache_entry *e;
+	struct dundi_cache_write *writes = NULL;
+	struct dundi_cache_write *w;
+
+	cw_mutex_unlock(&cachelock);
+	cw_mutex_lock(&cachewritelock);
+	cw_mutex_lock(&cachelock);
+	deleted = cache_deleted;
+	cache_deleted = NULL;
+	while ((e = cache_dirty)) {
+		cache_dirty_remove(e);
+		if (!(w = malloc(sizeof(*w) + strlen(e->key) + 1)))
+			continue;
+		w->key = (char *) (w + 1);
+		strcpy(w->key, e->key);
+		cache_format(e, w->data, sizeof(w->data));
+		w->next = writes;
+		writes = w;
+		e->stored = 1;
+	}
+	cw_mutex_unlock(&cachelock);
+
+	while ((e = deleted)) {
+		deleted = e->next;
+		cw_db_del("dundi/cache", e->key);
+		free(e);
+	}
+	while ((w = writes)) {
+		writes = w->next;
+		cw_db_put("dundi/cache", w->key, w->data);
+		free(w);
+	}
+	cw_mutex_unlock(&cachewritelock);
+
+	cw_mutex_lock(&cachelock);
+}
+
+static void *cache_write_thread(void *ignore)
+{
+	struct timeval tv;
+	struct timespec ts;
+
+	cache_load();
+	cw_mutex_lock(&cachelock);
+	while (!cache_thread_stop) {
+		if (!cache_dirty && !cache_deleted) {
+			cw_cond_wait(&cache_cond, &cachelock);
+			continue;
+		}
+		/* Let the changes gather for a while, so each is written once */
+		tv = cw_tvadd(cw_tvnow(), cw_samp2tv(DUNDI_CACHE_WRITE_INTERVAL, 1));
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		cw_cond_timedwait(&cache_cond, &cachelock, &ts);
+		cache_write();
+	}
+	cache_write();
+	cw_mutex_unlock(&cachelock);
+	return NULL;
+}
+
+static void cache_start_writer(void)
+{
+	if (!dundi_cache_persist || cachethreadid != CW_PTHREADT_NULL)
+		return;
+	cw_mutex_lock(&cachelock);
+	cache_thread_stop = 0;
+	cache_writing = 1;
+	cw_mutex_unlock(&cachelock);
+	if (cw_pthread_create(&cachethreadid, NULL, cache_write_thread, NULL)) {
+		cw_log(LOG_WARNING, "Unable to start the DUNDi cache write thread, not keeping the cache in the database\n");
+		cachethreadid = CW_PTHREADT_NULL;
+		dundi_cache_persist = 0;
+		cw_mutex_lock(&cachelock);
+		cache_writing = 0;
+		cw_mutex_unlock(&cachelock);
+	}
+}
+
+static void cache_stop_writer(void)
+{
+	if (cachethreadid == CW_PTHREADT_NULL)
+		return;
+	/* What is already queued is written before the thread exits */
+	cw_mutex_lock(&cachelock);
+	cache_thread_stop = 1;
+	cache_writing = 0;
+	cw_cond_signal(&cache_cond);
+	cw_mutex_unlock(&cachelock);
+	pthread_join(cachethreadid, NULL);
+	cachethreadid = CW_PTHREADT_NULL;
+}
+
 static int cache_save_hint(dundi_eid *eidpeer, struct dundi_request *req, struct dundi_hint *hint, int expiration)
 {
 	int unaffected;
@@ -833,7 +1295,6 @@ static int cache_save_hint(dundi_eid *eidpeer, struct dundi_request *req, struct
 	char key2[256];
 	char eidpeer_str[20];
 	char eidroot_str[20];
-	char data[80];
 	time_t timeout;
 
 	if (expiration < 0)
@@ -852,21 +1313,18 @@ static int cache_save_hint(dundi_eid *eidpeer, struct dundi_request *req, struct
 
 	time(&timeout);
 	timeout += expiration;
-	snprintf(data, sizeof(data), "%ld,", (long)(timeout));
 	
-	cw_db_put("dundi/cache", key1, data);
+	cache_store(key1, timeout, NULL, 0, 0);
 	cw_log(LOG_DEBUG, "Caching hint at '%s'\n", key1);
-	cw_db_put("dundi/cache", key2, data);
+	cache_store(key2, timeout, NULL, 0, 0);
 	cw_log(LOG_DEBUG, "Caching hint at '%s'\n", key2);
 	return 0;
 }
 
 static int cache_save(dundi_eid *eidpeer, struct dundi_request *req, int start, int unaffected, int expiration, int push)
 {
-	int x;
 	char key1[256];
 	char key2[256];
-	char data[1024];
 	char eidpeer_str[20];
 	char eidroot_str[20];
 	time_t timeout;
@@ -885,20 +1343,10 @@ static int cache_save(dundi_eid *eidpeer, struct dundi_request *req, int start,
 	dundi_eid_to_str_short(eidroot_str, sizeof(eidroot_str), &req->root_eid);
 	snprintf(key1, sizeof(key1), "%s/%s/%s/e%08lx", eidpeer_str, req->number, req->dcontext, unaffected ? 0 : req->crc32);
 	snprintf(key2, sizeof(key2), "%s/%s/%s/r%s", eidpeer_str, req->number, req->dcontext, eidroot_str);
-	/* Build request string */
 	time(&timeout);
 	timeout += expiration;
-	snprintf(data, sizeof(data), "%ld,", (long)(timeout));
-	for (x=start;x<req->respcount;x++) {
-		/* Skip anything with an illegal comma in it */
-		if (strchr(req->dr[x].dest, ','))
-			continue;
-		snprintf(data + strlen(data), sizeof(data) - strlen(data), "%d/%d/%d/%s/%s,", 
-			req->dr[x].flags, req->dr[x].weight, req->dr[x].techint, req->dr[x].dest, 
-			dundi_eid_to_str_short(eidpeer_str, sizeof(eidpeer_str), &req->dr[x].eid));
-	}
-	cw_db_put("dundi/cache", key1, data);
-	cw_db_put("dundi/cache", key2, data);
+	cache_store(key1, timeout, req->dr + start, req->respcount - start, 0);
+	cache_store(key2, timeout, req->dr + start, req->respcount - start, 0);
 	return 0;
 }
 
@@ -1151,74 +1599,60 @@ static int dundi_answer_query(struct dundi_transaction *trans, struct dundi_ies
 
 static int cache_lookup_internal(time_t now, struct dundi_request *req, char *key, char *eid_str_full, int *lowexpiration)
 {
-	char data[1024];
-	char *ptr, *term, *src;
-	int tech;
-	struct cw_flags flags;
-	int weight;
-	int length;
-	int z;
+	struct dundi_cache_entry *e;
+	struct dundi_cache_answer *ans;
+	struct dundi_result *dr;
 	int expiration;
+	int x;
+	int z;
 	char fs[256];
-	time_t timeout;
-	/* Build request string */
-	if (!cw_db_get("dundi/cache", key, data, sizeof(data))) {
-		ptr = data;
-		if (sscanf(ptr, "%ld,%n", &timeout, &length) == 1) {
-			expiration = timeout - now;
-			if (expiration > 0) {
-				cw_log(LOG_DEBUG, "Found cache expiring in %d seconds!\n", (int)(timeout - now));
-				ptr += length;
-				while((sscanf(ptr, "%d/%d/%d/%n", &(flags.flags), &weight, &tech, &length) == 3)) {
-					ptr += length;
-					term = strchr(ptr, ',');
-					if (term) {
-						*term = '\0';
-						src = strrchr(ptr, '/');
-						if (src) {
-							*src = '\0';
-							src++;
-						} else
-							src = "";
-						cw_log(LOG_DEBUG, "Found cached answer '%s/%s' originally from '%s' with flags '%s' on behalf of '%s'\n", 
-							tech2str(tech), ptr, src, dundi_flags2str(fs, sizeof(fs), flags.flags), eid_str_full);
-						/* Make sure it's not already there */
-						for (z=0;z<req->respcount;z++) {
-							if ((req->dr[z].techint == tech) &&
-							    !strcmp(req->dr[z].dest, ptr)) 
-									break;
-						}
-						if (z == req->respcount) {
-							/* Copy into parent responses */
-							cw_copy_flags(&(req->dr[req->respcount]), &flags, CW_FLAGS_ALL);	
-							req->dr[req->respcount].weight = weight;
-							req->dr[req->respcount].techint = tech;
-							req->dr[req->respcount].expiration = expiration;
-							dundi_str_short_to_eid(&req->dr[req->respcount].eid, src);
-							dundi_eid_to_str(req->dr[req->respcount].eid_str, 
-								sizeof(req->dr[req->respcount].eid_str), &req->dr[req->respcount].eid);
-							cw_copy_string(req->dr[req->respcount].dest, ptr,
-								sizeof(req->dr[req->respcount].dest));
-							cw_copy_string(req->dr[req->respcount].tech, tech2str(tech),
-								sizeof(req->dr[req->respcount].tech));
-							req->respcount++;
-							cw_clear_flag_nonstd(req->hmd, DUNDI_HINT_DONT_ASK);	
-						} else if (req->dr[z].weight > weight)
-							req->dr[z].weight = weight;
-						ptr = term + 1;
-					}
-				}
-				/* We found *something* cached */
-				if (expiration < *lowexpiration)
-					*lowexpiration = expiration;
-				return 1;
-			} else 
-				cw_db_del("dundi/cache", key);
-		} else 
-			cw_db_del("dundi/cache", key);
+
+	cw_mutex_lock(&cachelock);
+	if (!(e = cache_find(key, cache_hash(key)))) {
+		cw_mutex_unlock(&cachelock);
+		return 0;
 	}
-		
-	return 0;
+	expiration = e->expiration - now;
+	if (expiration <= 0) {
+		cache_drop(e);
+		cw_mutex_unlock(&cachelock);
+		return 0;
+	}
+	cw_log(LOG_DEBUG, "Found cache expiring in %d seconds!\n", expiration);
+	for (x = 0;  x < e->nanswers;  x++) {
+		ans = &e->answers[x];
+		if (option_debug)
+			cw_log(LOG_DEBUG, "Found cached answer '%s/%s' originally from '%s' with flags '%s' on behalf of '%s'\n", 
+				tech2str(ans->techint), ans->dest, ans->eid_str, dundi_flags2str(fs, sizeof(fs), ans->flags), eid_str_full);
+		/* Make sure it's not already there */
+		for (z=0;z<req->respcount;z++) {
+			if ((req->dr[z].techint == ans->techint) &&
+			    !strcmp(req->dr[z].dest, ans->dest)) 
+					break;
+		}
+		if (z < req->respcount) {
+			if (req->dr[z].weight > ans->weight)
+				req->dr[z].weight = ans->weight;
+		} else if (req->respcount < req->maxcount) {
+			/* Copy into parent responses */
+			dr = &req->dr[req->respcount];
+			dr->flags = ans->flags;
+			dr->weight = ans->weight;
+			dr->techint = ans->techint;
+			dr->expiration = expiration;
+			dr->eid = ans->eid;
+			cw_copy_string(dr->eid_str, ans->eid_str, sizeof(dr->eid_str));
+			cw_copy_string(dr->dest, ans->dest, sizeof(dr->dest));
+			cw_copy_string(dr->tech, tech2str(ans->techint), sizeof(dr->tech));
+			req->respcount++;
+			cw_clear_flag_nonstd(req->hmd, DUNDI_HINT_DONT_ASK);	
+		}
+	}
+	cw_mutex_unlock(&cachelock);
+	/* We found *something* cached */
+	if (expiration < *lowexpiration)
+		*lowexpiration = expiration;
+	return 1;
 }
 
 static int cache_lookup(struct dundi_request *req, dundi_eid *peer_eid, unsigned long crc32, int *lowexpiration)
@@ -1268,6 +1702,12 @@ static int cache_lookup(struct dundi_request *req, dundi_eid *peer_eid, unsigned
 		res |= res2;
 	}
 
+	cw_mutex_lock(&cachelock);
+	if (res)
+		cache_hits++;
+	else
+		cache_misses++;
+	cw_mutex_unlock(&cachelock);
 	return res;
 }
 
@@ -2209,7 +2649,12 @@ static int dundi_flush(int fd, int argc, char *argv[])
 		}
 		cw_mutex_unlock(&peerlock);
 	} else {
+		cw_mutex_lock(&cachewritelock);
+		cw_mutex_lock(&cachelock);
+		cache_clear();
+		cw_mutex_unlock(&cachelock);
 		cw_db_deltree("dundi/cache", NULL);
+		cw_mutex_unlock(&cachewritelock);
 		cw_cli(fd, "DUNDi Cache Flushed\n");
 	}
 	return RESULT_SUCCESS;
@@ -2661,6 +3106,42 @@ static int dundi_show_precache(int fd, int argc, char *argv[])
 #undef FORMAT2
 }
 
+static int dundi_show_cache(int fd, int argc, char *argv[])
+{
+#define FORMAT2 "%-50.50s %-7.7s %-10.10s\n"
+#define FORMAT "%-50.50s %-7d %02d:%02d:%02d\n"
+	struct dundi_cache_entry *e;
+	int h,m,s;
+	int x;
+	int dirty = 0;
+	time_t now;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	time(&now);
+	cw_mutex_lock(&cachelock);
+	cw_cli(fd, FORMAT2, "Key", "Answers", "Expiration");
+	for (x = 0;  x < cache_entries;  x++) {
+		e = cache_heap[x];
+		if (e->dirtyprev)
+			dirty++;
+		s = e->expiration - now;
+		if (s < 0)
+			s = 0;
+		h = s / 3600;
+		s = s % 3600;
+		m = s / 60;
+		s = s % 60;
+		cw_cli(fd, FORMAT, e->key, e->nanswers, h,m,s);
+	}
+	cw_cli(fd, "%d cached entries (limit %d), %d hits, %d misses, %d evicted, %d waiting to be written\n",
+		cache_entries, dundi_cache_size, cache_hits, cache_misses, cache_evictions, dirty);
+	cw_mutex_unlock(&cachelock);
+	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+
 static char debug_usage[] = 
 "Usage: dundi debug\n"
 "       Enables dumping of DUNDi packets for debugging purposes\n";
@@ -2695,6 +3176,11 @@ static char show_precache_usage[] =
 "Usage: dundi show precache\n"
 "       Lists all known DUNDi scheduled precache updates.\n";
 
+static char show_cache_usage[] = 
+"Usage: dundi show cache\n"
+"       Lists all cached DUNDi answers and hints, with the cache\n"
+"statistics.\n";
+
 static char show_entityid_usage[] = 
 "Usage: dundi show entityid\n"
 "       Displays the global entityid for this host.\n";
@@ -2761,6 +3247,9 @@ static struct cw_cli_entry  cli_show_mappings =
 static struct cw_cli_entry  cli_show_precache =
 	{ { "dundi", "show", "precache", NULL }, dundi_show_precache, "Show DUNDi precache", show_precache_usage };
 
+static struct cw_cli_entry  cli_show_cache =
+	{ { "dundi", "show", "cache", NULL }, dundi_show_cache, "Show DUNDi cache", show_cache_usage };
+
 static struct cw_cli_entry  cli_show_requests =
 	{ { "dundi", "show", "requests", NULL }, dundi_show_requests, "Show DUNDi requests", show_requests_usage };
 
@@ -4540,6 +5029,8 @@ static int set_config(char *config_file, struct sockaddr_in* sin)
 
 	dundi_ttl = DUNDI_DEFAULT_TTL;
 	dundi_cache_time = DUNDI_DEFAULT_CACHE_TIME;
+	dundi_cache_size = DUNDI_DEFAULT_CACHE_SIZE;
+	dundi_cache_persist = 1;
 	cfg = cw_config_load(config_file);
 	
 	
@@ -4646,6 +5137,15 @@ static int set_config(char *config_file, struct sockaddr_in* sin)
 				cw_log(LOG_WARNING, "'%s' is not a valid cache time at line %d. Using default value '%d'.\n",
 					v->value, v->lineno, DUNDI_DEFAULT_CACHE_TIME);
 			}
+		} else if (!strcasecmp(v->name, "cachesize")) {
+			if ((sscanf(v->value, "%d", &x) == 1) && (x >= 0)) {
+				dundi_cache_size = x;
+			} else {
+				cw_log(LOG_WARNING, "'%s' is not a valid cache size at line %d. Using default value '%d'.\n",
+					v->value, v->lineno, DUNDI_DEFAULT_CACHE_SIZE);
+			}
+		} else if (!strcasecmp(v->name, "cachepersist")) {
+			dundi_cache_persist = cw_true(v->value);
 		}
 		v = v->next;
 	}
@@ -4692,6 +5192,7 @@ int unload_module(void)
 	cw_cli_unregister(&cli_show_requests);
 	cw_cli_unregister(&cli_show_mappings);
 	cw_cli_unregister(&cli_show_precache);
+	cw_cli_unregister(&cli_show_cache);
 	cw_cli_unregister(&cli_show_peer);
 	cw_cli_unregister(&cli_lookup);
 	cw_cli_unregister(&cli_precache);
@@ -4699,6 +5200,14 @@ int unload_module(void)
 	cw_unregister_switch(&dundi_switch);
 	res |= cw_unregister_function(dundi_func);
 	res |= cw_unregister_application(dundi_app);
+	cache_stop_writer();
+	cw_mutex_lock(&cachelock);
+	cache_clear();
+	free(cache_heap);
+	cache_heap = NULL;
+	cache_heapsize = 0;
+	cw_mutex_unlock(&cachelock);
+	cw_cond_destroy(&cache_cond);
 	return res;
 }
 
@@ -4706,6 +5215,10 @@ int reload(void)
 {
 	struct sockaddr_in sin;
 	set_config("dundi.conf",&sin);
+	if (dundi_cache_persist)
+		cache_start_writer();
+	else
+		cache_stop_writer();
 	return 0;
 }
 
@@ -4731,7 +5244,9 @@ int load_module(void)
 		return -1;
 	}
 
+	cw_cond_init(&cache_cond, NULL);
 	set_config("dundi.conf",&sin);
+	cache_start_writer();
 
 	netsocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
 	
@@ -4771,6 +5286,7 @@ int load_module(void)
 	cw_cli_register(&cli_show_requests);
 	cw_cli_register(&cli_show_mappings);
 	cw_cli_register(&cli_show_precache);
+	cw_cli_register(&cli_show_cache);
 	cw_cli_register(&cli_show_peer);
 	cw_cli_register(&cli_lookup);
 	cw_cli_register(&cli_precache);
@@ -36,12 +36,18 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "callweaver.h"
 
 CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branches/rel/1.2/pbx/pbx_spool.c $", "$Revision: 5073 $")
 
 #include "callweaver/lock.h"
+#include "callweaver/config.h"
 #include "callweaver/file.h"
 #include "callweaver/logger.h"
 #include "callweaver/channel.h"
@@ -54,12 +60,65 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 /*
  * pbx_spool is similar in spirit to qcall, but with substantially enhanced functionality...
  * The spool file contains a header 
+ *
+ * A call file is due when its mtime has passed.  The spool directory is
+ * watched with inotify (or, failing that, its mtime is polled every second
+ * and the directory read when it changes) and the due times are kept in a
+ * timer heap, so a file dropped in is tried straight away and nothing is
+ * rescanned while waiting for retries.  Calls are placed by a bounded pool
+ * of worker threads, at no more than "ratelimit" calls a second.
  */
 
+#define SPOOL_CONF		"pbx_spool.conf"
+#define SPOOL_BUCKETS		1024
+#define SPOOL_MAXCALLS_DEFAULT	100
+
 static char *tdesc = "Outgoing Spool Support";
 static char qdir[255];
 
+/* A call file in the spool directory.  Only the scan thread touches these */
+struct spool_file {
+	/* Hash chain */
+	struct spool_file *next;
+	unsigned int hash;
+	/* When the file is next to be tried */
+	time_t due;
+	/* Position in the timer heap, -1 if not in it */
+	int heapidx;
+	/* A worker is placing the call */
+	int running;
+	/* Found by the current directory scan */
+	int seen;
+	char name[0];
+};
+
+static struct spool_file *spool_files[SPOOL_BUCKETS];
+static struct spool_file **spool_heap = NULL;
+static int spool_heaplen = 0;
+static int spool_heapsize = 0;
+static int spool_notifyfd = -1;
+
+CW_MUTEX_DEFINE_STATIC(spool_lock);
+static cw_cond_t spool_cond;
+/* Calls waiting for a worker, and calls the workers are done with */
+static struct outgoing *spool_jobs = NULL;
+static struct outgoing *spool_jobs_tail = NULL;
+static struct outgoing *spool_done = NULL;
+static int spool_workers = 0;
+static int spool_idle = 0;
+/* Calls waiting for a worker */
+static int spool_queued = 0;
+/* Calls queued or in progress */
+static int spool_busy = 0;
+/* Lets the workers wake the scan thread */
+static int spool_wakefd[2] = { -1, -1 };
+
+static int spool_maxcalls = SPOOL_MAXCALLS_DEFAULT;
+/* Calls started per second, 0 for no limit */
+static double spool_rate = 0.0;
+
 struct outgoing {
+	struct outgoing *next;
 	char fn[256];
 	/* Current number of retries */
 	int retries;
@@ -251,9 +310,8 @@ static void safe_append(struct outgoing *o, time_t now, char *s)
 	}
 }
 
-static void *attempt_thread(void *data)
+static void attempt_call(struct outgoing *o)
 {
-	struct outgoing *o = (struct outgoing *) data;
 	int res, reason;
 	if (!cw_strlen_zero(o->app)) {
 		if (option_verbose > 2)
@@ -279,26 +337,87 @@ static void *attempt_thread(void *data)
 		cw_log(LOG_EVENT, "Queued call to %s/%s completed\n", o->tech, o->dest);
 		unlink(o->fn);
 	}
-	free_outgoing(o);
+}
+
+static void *spool_worker(void *data)
+{
+	struct outgoing *o;
+
+	cw_mutex_lock(&spool_lock);
+	for (;;) {
+		while (!spool_jobs) {
+			spool_idle++;
+			cw_cond_wait(&spool_cond, &spool_lock);
+			spool_idle--;
+		}
+		o = spool_jobs;
+		if (!(spool_jobs = o->next))
+			spool_jobs_tail = NULL;
+		spool_queued--;
+		cw_mutex_unlock(&spool_lock);
+
+		attempt_call(o);
+
+		/* Hand the call back so the scan thread looks at its file again */
+		cw_mutex_lock(&spool_lock);
+		o->next = spool_done;
+		spool_done = o;
+		spool_busy--;
+		/* A full pipe already has the scan thread coming round */
+		while (write(spool_wakefd[1], "", 1) < 0) {
+			if (errno != EINTR) {
+				if (errno != EAGAIN)
+					cw_log(LOG_WARNING, "Unable to wake spool thread: %s\n", strerror(errno));
+				break;
+			}
+		}
+	}
+	cw_mutex_unlock(&spool_lock);
 	return NULL;
 }
 
-static void launch_service(struct outgoing *o)
+/*! Queues a call for the worker pool, starting a worker if there are not
+ *  enough idle ones for every queued call.  Returns -1 if the call can't be
+ *  placed */
+static int launch_service(struct outgoing *o)
 {
 	pthread_t t;
 	pthread_attr_t attr;
-	pthread_attr_init(&attr);
- 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (cw_pthread_create(&t,&attr,attempt_thread, o) == -1) {
-		cw_log(LOG_WARNING, "Unable to create thread :(\n");
-		free_outgoing(o);
+
+	cw_mutex_lock(&spool_lock);
+	/* Each idle worker takes one queued call; any more need new workers */
+	if (spool_queued >= spool_idle && spool_workers < spool_maxcalls) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (cw_pthread_create(&t, &attr, spool_worker, NULL) == -1) {
+			cw_log(LOG_WARNING, "Unable to create thread :(\n");
+			if (!spool_workers) {
+				cw_mutex_unlock(&spool_lock);
+				free_outgoing(o);
+				return -1;
+			}
+		} else
+			spool_workers++;
 	}
+	o->next = NULL;
+	if (spool_jobs_tail)
+		spool_jobs_tail->next = o;
+	else
+		spool_jobs = o;
+	spool_jobs_tail = o;
+	spool_queued++;
+	spool_busy++;
+	cw_cond_signal(&spool_cond);
+	cw_mutex_unlock(&spool_lock);
+	return 0;
 }
 
-static int scan_service(char *fn, time_t now, time_t atime)
+static int scan_service(char *fn, time_t now, int *launched)
 {
 	struct outgoing *o;
 	FILE *f;
+	int retrytime;
+	*launched = 0;
 	o = malloc(sizeof(struct outgoing));
 	if (o) {
 		init_outgoing(o);
@@ -310,9 +429,12 @@ static int scan_service(char *fn, time_t now, time_t atime)
 #endif
 				fclose(f);
 				if (o->retries <= o->maxretries) {
+					/* o belongs to the workers once launched */
+					retrytime = o->retrytime;
 					if (o->callingpid && (o->callingpid == cw_mainpid)) {
 						safe_append(o, time(NULL), "DelayedRetry");
 						cw_log(LOG_DEBUG, "Delaying retry since we're currently running '%s'\n", o->fn);
+						free_outgoing(o);
 					} else {
 						/* Increment retries */
 						o->retries++;
@@ -322,9 +444,10 @@ static int scan_service(char *fn, time_t now, time_t atime)
 							safe_append(o, time(NULL), "AbortRetry");
 
 						safe_append(o, now, "StartRetry");
-						launch_service(o);
+						if (!launch_service(o))
+							*launched = 1;
 					}
-					now += o->retrytime;
+					now += retrytime;
 					return now;
 				} else {
 					cw_log(LOG_EVENT, "Queued call to %s/%s expired without completion after %d attempt%s\n", o->tech, o->dest, o->retries - 1, ((o->retries - 1) != 1) ? "s" : "");
@@ -348,53 +471,376 @@ static int scan_service(char *fn, time_t now, time_t atime)
 	return -1;
 }
 
-static void *scan_thread(void *unused)
+/* Timer heap of the call files by due time, earliest first */
+static void spool_heap_set(int idx, struct spool_file *sf)
+{
+	spool_heap[idx] = sf;
+	sf->heapidx = idx;
+}
+
+static void spool_heap_up(int idx)
+{
+	struct spool_file *sf = spool_heap[idx];
+
+	while (idx > 0 && spool_heap[(idx - 1)/2]->due > sf->due) {
+		spool_heap_set(idx, spool_heap[(idx - 1)/2]);
+		idx = (idx - 1)/2;
+	}
+	spool_heap_set(idx, sf);
+}
+
+static void spool_heap_down(int idx)
+{
+	struct spool_file *sf = spool_heap[idx];
+	int child;
+
+	while ((child = 2*idx + 1) < spool_heaplen) {
+		if (child + 1 < spool_heaplen && spool_heap[child + 1]->due < spool_heap[child]->due)
+			child++;
+		if (spool_heap[child]->due >= sf->due)
+			break;
+		spool_heap_set(idx, spool_heap[child]);
+		idx = child;
+	}
+	spool_heap_set(idx, sf);
+}
+
+static void spool_heap_remove(struct spool_file *sf)
+{
+	int idx = sf->heapidx;
+
+	if (idx < 0)
+		return;
+	sf->heapidx = -1;
+	if (idx == --spool_heaplen)
+		return;
+	spool_heap_set(idx, spool_heap[spool_heaplen]);
+	spool_heap_up(idx);
+	spool_heap_down(spool_heap[idx]->heapidx);
+}
+
+/*! Sets when a call file is next to be tried */
+static void spool_schedule(struct spool_file *sf, time_t due)
+{
+	struct spool_file **heap;
+
+	sf->due = due;
+	if (sf->heapidx < 0) {
+		if (spool_heaplen == spool_heapsize) {
+			if (!(heap = realloc(spool_heap, (spool_heapsize + 256)*sizeof(*heap)))) {
+				cw_log(LOG_WARNING, "Out of memory :(\n");
+				return;
+			}
+			spool_heap = heap;
+			spool_heapsize += 256;
+		}
+		spool_heap_set(spool_heaplen++, sf);
+	}
+	spool_heap_up(sf->heapidx);
+	spool_heap_down(sf->heapidx);
+}
+
+static unsigned int spool_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 16777619U;
+	return h;
+}
+
+static struct spool_file *spool_find(const char *name, int create)
+{
+	struct spool_file *sf;
+	unsigned int hash = spool_hash(name);
+
+	for (sf = spool_files[hash % SPOOL_BUCKETS];  sf;  sf = sf->next) {
+		if (sf->hash == hash && !strcmp(sf->name, name))
+			return sf;
+	}
+	if (!create)
+		return NULL;
+	if (!(sf = malloc(sizeof(*sf) + strlen(name) + 1))) {
+		cw_log(LOG_WARNING, "Out of memory :(\n");
+		return NULL;
+	}
+	strcpy(sf->name, name);
+	sf->hash = hash;
+	sf->due = 0;
+	sf->heapidx = -1;
+	sf->running = 0;
+	sf->seen = 0;
+	sf->next = spool_files[hash % SPOOL_BUCKETS];
+	spool_files[hash % SPOOL_BUCKETS] = sf;
+	return sf;
+}
+
+static void spool_forget(struct spool_file *sf)
+{
+	struct spool_file **psf;
+
+	spool_heap_remove(sf);
+	for (psf = &spool_files[sf->hash % SPOOL_BUCKETS];  *psf;  psf = &(*psf)->next) {
+		if (*psf == sf) {
+			*psf = sf->next;
+			break;
+		}
+	}
+	free(sf);
+}
+
+/*! Looks at a call file again after it changed: schedules it for its
+ *  mtime, but not before notbefore, or forgets it if it's gone */
+static void spool_refresh(struct spool_file *sf, time_t notbefore)
 {
 	struct stat st;
-	DIR *dir;
+	char fn[256];
+
+	snprintf(fn, sizeof(fn), "%s/%s", qdir, sf->name);
+	if (stat(fn, &st) || !S_ISREG(st.st_mode)) {
+		spool_forget(sf);
+		return;
+	}
+	spool_schedule(sf, (st.st_mtime > notbefore) ? st.st_mtime : notbefore);
+}
+
+/*! Reads the whole spool directory, for the initial scan, when inotify
+ *  lost track of things, and when polling without inotify */
+static void spool_rescan(void)
+{
+	struct spool_file *sf;
+	struct spool_file *next;
 	struct dirent *de;
+	struct stat st;
 	char fn[256];
+	DIR *dir;
+	int x;
+
+	if (!(dir = opendir(qdir))) {
+		cw_log(LOG_WARNING, "Unable to open directory %s: %s\n", qdir, strerror(errno));
+		return;
+	}
+	while ((de = readdir(dir))) {
+		snprintf(fn, sizeof(fn), "%s/%s", qdir, de->d_name);
+		if (stat(fn, &st)) {
+			/* Workers remove the files of the calls they finish */
+			if (errno != ENOENT)
+				cw_log(LOG_WARNING, "Unable to stat %s: %s\n", fn, strerror(errno));
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) || !(sf = spool_find(de->d_name, 1)))
+			continue;
+		sf->seen = 1;
+		if (!sf->running)
+			spool_schedule(sf, st.st_mtime);
+	}
+	closedir(dir);
+
+	/* Forget the files that went away, unless a worker still has them */
+	for (x = 0;  x < SPOOL_BUCKETS;  x++) {
+		for (sf = spool_files[x];  sf;  sf = next) {
+			next = sf->next;
+			if (!sf->seen && !sf->running)
+				spool_forget(sf);
+			sf->seen = 0;
+		}
+	}
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void spool_watch(void)
+{
+	if ((spool_notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		cw_log(LOG_NOTICE, "Unable to create inotify instance, polling %s instead: %s\n", qdir, strerror(errno));
+		return;
+	}
+	/* Call files should be moved in, but IN_CLOSE_WRITE catches those written
+	   in place, and IN_ATTRIB a retry time changed with touch */
+	if (inotify_add_watch(spool_notifyfd, qdir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB
+		| IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+		cw_log(LOG_NOTICE, "Unable to watch %s, polling it instead: %s\n", qdir, strerror(errno));
+		close(spool_notifyfd);
+		spool_notifyfd = -1;
+	}
+}
+
+static void spool_read_events(void)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct spool_file *sf;
+	ssize_t len;
+	char *p;
+
+	while (spool_notifyfd > -1 && (len = read(spool_notifyfd, buf, sizeof(buf))) > 0) {
+		for (p = buf;  p < buf + len;  p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				spool_rescan();
+				continue;
+			}
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				cw_log(LOG_WARNING, "%s went away, polling for it instead\n", qdir);
+				close(spool_notifyfd);
+				spool_notifyfd = -1;
+				return;
+			}
+			if (!ev->len || (ev->mask & IN_ISDIR))
+				continue;
+			if (!(sf = spool_find(ev->name, !(ev->mask & (IN_DELETE | IN_MOVED_FROM)))))
+				continue;
+			/* A file being called on is looked at when the worker is done */
+			if (!sf->running)
+				spool_refresh(sf, 0);
+		}
+	}
+}
+#endif
+
+/*! Takes back the calls the workers are done with */
+static void spool_collect(void)
+{
+	struct outgoing *o;
+	struct outgoing *next;
+	struct spool_file *sf;
+	char buf[64];
+	char *name;
+
+	while (read(spool_wakefd[0], buf, sizeof(buf)) > 0)
+		;
+	cw_mutex_lock(&spool_lock);
+	o = spool_done;
+	spool_done = NULL;
+	cw_mutex_unlock(&spool_lock);
+
+	for (;  o;  o = next) {
+		next = o->next;
+		name = strrchr(o->fn, '/');
+		if ((sf = spool_find(name ? name + 1 : o->fn, 0))) {
+			sf->running = 0;
+			spool_refresh(sf, 0);
+		}
+		free_outgoing(o);
+	}
+}
+
+/*! Starts the calls that are due, as far as the worker pool and the rate
+ *  limit allow.  Returns how many ms until there may be more to do, or -1
+ *  if that's up to the workers or the directory */
+static int spool_run(void)
+{
+	static struct timeval last = { 0, 0 };
+	static double tokens = 0.0;
+	struct spool_file *sf;
+	struct timeval tv;
+	struct stat st;
+	char fn[256];
+	double rate;
+	time_t now;
+	int launched;
+	int busy;
 	int res;
-	time_t last = 0, next = 0, now;
-	for(;;) {
-		/* Wait a sec */
-		sleep(1);
-		time(&now);
+
+	if (!fully_booted)
+		return 1000;
+
+	while (spool_heaplen) {
+		tv = cw_tvnow();
+		now = tv.tv_sec;
+		sf = spool_heap[0];
+		if (sf->due > now)
+			return (sf->due - now)*1000 - tv.tv_usec/1000;
+
+		cw_mutex_lock(&spool_lock);
+		busy = (spool_busy >= spool_maxcalls);
+		rate = spool_rate;
+		cw_mutex_unlock(&spool_lock);
+		if (busy)
+			return -1;
+		if (rate > 0.0) {
+			/* Token bucket, holding up to a second's worth of calls */
+			if (last.tv_sec)
+				tokens += rate*cw_tvdiff_ms(tv, last)/1000.0;
+			else
+				tokens = 1.0;
+			last = tv;
+			if (tokens > ((rate > 1.0) ? rate : 1.0))
+				tokens = (rate > 1.0) ? rate : 1.0;
+			if (tokens < 1.0)
+				return (int) ((1.0 - tokens)*1000.0/rate) + 1;
+		}
+
+		/* Make sure it wasn't put off since we last looked */
+		snprintf(fn, sizeof(fn), "%s/%s", qdir, sf->name);
+		if (stat(fn, &st) || !S_ISREG(st.st_mode)) {
+			spool_forget(sf);
+			continue;
+		}
+		if (st.st_mtime > now) {
+			spool_schedule(sf, st.st_mtime);
+			continue;
+		}
+
+		res = scan_service(fn, now, &launched);
+		if (launched) {
+			tokens -= 1.0;
+			sf->running = 1;
+			spool_heap_remove(sf);
+		} else {
+			if (res < 0)
+				cw_log(LOG_WARNING, "Failed to scan service '%s'\n", fn);
+			spool_refresh(sf, now + 1);
+		}
+	}
+	return -1;
+}
+
+static void *scan_thread(void *unused)
+{
+	struct pollfd pfds[2];
+	struct stat st;
+	time_t last = 0;
+	int timeout;
+	int n;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	spool_watch();
+#endif
+	spool_rescan();
+	if (!stat(qdir, &st))
+		last = st.st_mtime;
+
+	for (;;) {
+		timeout = spool_run();
+
+		pfds[0].fd = spool_wakefd[0];
+		pfds[0].events = POLLIN;
+		n = 1;
+		if (spool_notifyfd > -1) {
+			pfds[1].fd = spool_notifyfd;
+			pfds[1].events = POLLIN;
+			n = 2;
+		} else if (timeout < 0 || timeout > 1000) {
+			/* Polling the directory */
+			timeout = 1000;
+		}
+		if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+			cw_log(LOG_WARNING, "poll failed: %s\n", strerror(errno));
+			sleep(1);
+		}
+
+		spool_collect();
+#ifdef HAVE_SYS_INOTIFY_H
+		if (spool_notifyfd > -1) {
+			spool_read_events();
+			continue;
+		}
+#endif
 		if (!stat(qdir, &st)) {
-			if ((st.st_mtime != last) || (next && (now > next))) {
-#if 0
-				printf("atime: %ld, mtime: %ld, ctime: %ld\n", st.st_atime, st.st_mtime, st.st_ctime);
-				printf("Ooh, something changed / timeout\n");
-#endif				
-				next = 0;
+			/* Changes within the second the mtime was last set would go unseen */
+			if (st.st_mtime != last || st.st_mtime >= time(NULL) - 1) {
 				last = st.st_mtime;
-				dir = opendir(qdir);
-				if (dir) {
-					while((de = readdir(dir))) {
-						snprintf(fn, sizeof(fn), "%s/%s", qdir, de->d_name);
-						if (!stat(fn, &st)) {
-							if (S_ISREG(st.st_mode)) {
-								if (st.st_mtime <= now) {
-									res = scan_service(fn, now, st.st_atime);
-									if (res > 0) {
-										/* Update next service time */
-										if (!next || (res < next)) {
-											next = res;
-										}
-									} else if (res)
-										cw_log(LOG_WARNING, "Failed to scan service '%s'\n", fn);
-								} else {
-									/* Update "next" update if necessary */
-									if (!next || (st.st_mtime < next))
-										next = st.st_mtime;
-								}
-							}
-						} else
-							cw_log(LOG_WARNING, "Unable to stat %s: %s\n", fn, strerror(errno));
-					}
-					closedir(dir);
-				} else
-					cw_log(LOG_WARNING, "Unable to open directory %s: %s\n", qdir, strerror(errno));
+				spool_rescan();
 			}
 		} else
 			cw_log(LOG_WARNING, "Unable to stat %s\n", qdir);
@@ -402,11 +848,46 @@ static void *scan_thread(void *unused)
 	return NULL;
 }
 
+static void load_config(void)
+{
+	struct cw_config *cfg;
+	char *s;
+	int maxcalls = SPOOL_MAXCALLS_DEFAULT;
+	double rate = 0.0;
+
+	if ((cfg = cw_config_load(SPOOL_CONF))) {
+		if ((s = cw_variable_retrieve(cfg, "general", "maxcalls"))) {
+			if (sscanf(s, "%d", &maxcalls) != 1 || maxcalls < 1) {
+				cw_log(LOG_WARNING, "Invalid maxcalls '%s' in %s, using %d\n", s, SPOOL_CONF, SPOOL_MAXCALLS_DEFAULT);
+				maxcalls = SPOOL_MAXCALLS_DEFAULT;
+			}
+		}
+		if ((s = cw_variable_retrieve(cfg, "general", "ratelimit"))) {
+			if (sscanf(s, "%lf", &rate) != 1 || rate < 0.0) {
+				cw_log(LOG_WARNING, "Invalid ratelimit '%s' in %s, calls will not be limited\n", s, SPOOL_CONF);
+				rate = 0.0;
+			}
+		}
+		cw_config_destroy(cfg);
+	}
+
+	cw_mutex_lock(&spool_lock);
+	spool_maxcalls = maxcalls;
+	spool_rate = rate;
+	cw_mutex_unlock(&spool_lock);
+}
+
 int unload_module(void)
 {
 	return -1;
 }
 
+int reload(void)
+{
+	load_config();
+	return 0;
+}
+
 int load_module(void)
 {
 	pthread_t thread;
@@ -416,6 +897,14 @@ int load_module(void)
 		cw_log(LOG_WARNING, "Unable to create queue directory %s -- outgoing spool disabled\n", qdir);
 		return 0;
 	}
+	load_config();
+	if (pipe(spool_wakefd)) {
+		cw_log(LOG_WARNING, "Unable to create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(spool_wakefd[0], F_SETFL, fcntl(spool_wakefd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(spool_wakefd[1], F_SETFL, fcntl(spool_wakefd[1], F_GETFL) | O_NONBLOCK);
+	cw_cond_init(&spool_cond, NULL);
 	pthread_attr_init(&attr);
  	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	if (cw_pthread_create(&thread,&attr,scan_thread, NULL) == -1) {
@@ -0,0 +1,343 @@
+/* Runs FastOGI sessions against a server on the loopback interface, checking
+   that connections are kept and used again, checked before they are used,
+   and that requests queue for a server with all the connections it may have */
+
+#include "res_ogi.c"
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "CuTest.h"
+
+enum {
+	/* ends each session with END SESSION if offered keepalive */
+	SERVE_KEEP,
+	/* sends the commands of a session in one write */
+	SERVE_PIPELINE,
+	/* closes the connection after the script, as servers without keepalive do */
+	SERVE_CLOSE,
+	/* closes the connection after END SESSION, as if idle too long */
+	SERVE_DROP_IDLE,
+};
+
+static int listener;
+static int port;
+static int serve_mode;
+static int accepts;
+static int closes;
+static int server_errors;
+static char url[64];
+static struct cw_channel *chan;
+static struct ogi_pool *pool;
+
+CW_MUTEX_DEFINE_STATIC(server_lock);
+
+static int server_readline(int fd, char *buf, int size)
+{
+	int len = 0;
+	char c;
+
+	while (len < size - 1) {
+		if (read(fd, &c, 1) != 1)
+			return -1;
+		if (c == '\n')
+			break;
+		buf[len++] = c;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/* Sends commands and checks each of them is answered with 200 result=0 */
+static int server_send(int fd, const char *cmds, int ncmds)
+{
+	char line[256];
+
+	if (write(fd, cmds, strlen(cmds)) != strlen(cmds))
+		return -1;
+	while (ncmds--) {
+		if (server_readline(fd, line, sizeof(line)) < 0)
+			return -1;
+		if (strcmp(line, "200 result=0")) {
+			cw_mutex_lock(&server_lock);
+			server_errors++;
+			cw_mutex_unlock(&server_lock);
+		}
+	}
+	return 0;
+}
+
+static void *server_conn(void *data)
+{
+	int fd = (long) data;
+	char line[1024];
+	int keepalive;
+	int mode;
+
+	for (;;) {
+		keepalive = 0;
+		do {
+			if (server_readline(fd, line, sizeof(line)) < 0)
+				goto done;
+			if (!strcmp(line, "ogi_network_keepalive: yes"))
+				keepalive = 1;
+		} while (line[0]);
+
+		mode = serve_mode;
+		if (mode == SERVE_PIPELINE) {
+			if (server_send(fd, "NOOP\nNOOP\nEND SESSION\n", 3))
+				break;
+			continue;
+		}
+		if (server_send(fd, "NOOP\n", 1) || mode == SERVE_CLOSE || !keepalive)
+			break;
+		if (server_send(fd, "END SESSION\n", 1) || mode == SERVE_DROP_IDLE)
+			break;
+	}
+done:
+	close(fd);
+	cw_mutex_lock(&server_lock);
+	closes++;
+	cw_mutex_unlock(&server_lock);
+	return NULL;
+}
+
+static void *server(void *data)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	int fd;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while ((fd = accept(listener, NULL, NULL)) > -1) {
+		cw_mutex_lock(&server_lock);
+		accepts++;
+		cw_mutex_unlock(&server_lock);
+		pthread_create(&t, &attr, server_conn, (void *) (long) fd);
+	}
+	return NULL;
+}
+
+static int server_start(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pthread_t t;
+
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listener, (struct sockaddr *) &sin, sizeof(sin)) || listen(listener, 16)
+		|| getsockname(listener, (struct sockaddr *) &sin, &len))
+		return -1;
+	port = ntohs(sin.sin_port);
+	snprintf(url, sizeof(url), "ogi://127.0.0.1:%d/test", port);
+	return pthread_create(&t, NULL, server, NULL);
+}
+
+static int server_count(int *counter)
+{
+	int n;
+
+	cw_mutex_lock(&server_lock);
+	n = *counter;
+	cw_mutex_unlock(&server_lock);
+	return n;
+}
+
+static int accepted(void)
+{
+	return server_count(&accepts);
+}
+
+/* Waits for the server to have closed n connections in all */
+static int wait_closed(int n)
+{
+	int x;
+
+	for (x = 0;  x < 500 && server_count(&closes) < n;  x++)
+		usleep(10000);
+	return server_count(&closes);
+}
+
+static int session(struct cw_channel *chan)
+{
+	char *argv[] = { url, NULL };
+
+	return deadogi_exec(chan, 1, argv);
+}
+
+static void *waiter(void *data)
+{
+	struct ogi_pool *pool = data;
+	int fd;
+
+	if ((fd = ogi_pool_get(pool, url)) > -1)
+		ogi_pool_put(pool, fd, 1);
+	return (void *) (long) fd;
+}
+
+static int waiting(struct ogi_pool *pool)
+{
+	int n;
+
+	cw_mutex_lock(&pool_lock);
+	n = pool->waiting;
+	cw_mutex_unlock(&pool_lock);
+	return n;
+}
+
+static int wait_waiting(struct ogi_pool *pool, int n)
+{
+	int x;
+
+	for (x = 0;  x < 500 && waiting(pool) < n;  x++)
+		usleep(10000);
+	return waiting(pool);
+}
+
+static int elapsed_ms(struct timeval start)
+{
+	return cw_tvdiff_ms(cw_tvnow(), start);
+}
+
+/* One connection does every session */
+void test_ogi_keepalive(CuTest *tc)
+{
+	int x;
+
+	serve_mode = SERVE_KEEP;
+	for (x = 0;  x < 5;  x++)
+		CuAssertIntEquals_Msg(tc, "session with keepalive", 0, session(chan));
+	pool = ogi_pool_find("127.0.0.1", port);
+	CuAssertPtrNotNull(tc, pool);
+	CuAssertIntEquals_Msg(tc, "sessions used one connection", 1, accepted());
+	CuAssertIntEquals_Msg(tc, "idle connection used again", 4, pool->reuses);
+	CuAssertIntEquals_Msg(tc, "connection kept idle", 1, pool->idle);
+	CuAssertIntEquals(tc, 1, pool->conns);
+}
+
+/* Commands sent together are each handled, and the connection kept */
+void test_ogi_pipeline(CuTest *tc)
+{
+	serve_mode = SERVE_PIPELINE;
+	CuAssertIntEquals_Msg(tc, "pipelined session", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "pipelined session", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "pipelined sessions used the same connection", 1, accepted());
+}
+
+/* A server closing the connection does not get it used again */
+void test_ogi_server_close(CuTest *tc)
+{
+	serve_mode = SERVE_CLOSE;
+	CuAssertIntEquals_Msg(tc, "session closed by the server", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "session closed by the server", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "closed connection not used again", 2, accepted());
+	CuAssertIntEquals_Msg(tc, "closed connections let go", 0, pool->idle);
+	CuAssertIntEquals(tc, 0, pool->conns);
+}
+
+/* An idle connection the server closed is found out before use, and so is
+   one idle for too long */
+void test_ogi_idle_checked(CuTest *tc)
+{
+	serve_mode = SERVE_DROP_IDLE;
+	CuAssertIntEquals_Msg(tc, "session before the server drops the connection", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "server dropped the idle connection", 3, wait_closed(3));
+	serve_mode = SERVE_KEEP;
+	CuAssertIntEquals_Msg(tc, "session after the server dropped the idle connection", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "dropped idle connection replaced", 4, accepted());
+
+	pool_idletime = 0;
+	CuAssertIntEquals_Msg(tc, "session after the idle time", 0, session(chan));
+	pool_idletime = 60;
+	CuAssertIntEquals_Msg(tc, "connection idle too long replaced", 5, accepted());
+}
+
+/* With all the connections allowed in use, requests wait for one, for a
+   limited time */
+void test_ogi_pool_limits(CuTest *tc)
+{
+	struct timeval start;
+	pthread_t t;
+	void *res;
+	int fd;
+
+	pool_maxconns = 1;
+	pool_maxwaiting = 1;
+	pool_waittime = 2000;
+	fd = ogi_pool_get(pool, url);
+	CuAssert(tc, "connection taken", fd > -1);
+	pthread_create(&t, NULL, waiter, pool);
+	CuAssertIntEquals_Msg(tc, "request waiting for a connection", 1, wait_waiting(pool, 1));
+	start = cw_tvnow();
+	CuAssertIntEquals_Msg(tc, "request over the waiting limit turned away", -1, ogi_pool_get(pool, url));
+	/* Turned away without waiting, which would have taken the whole wait time */
+	CuAssert(tc, "request turned away at once", elapsed_ms(start) < pool_waittime);
+	ogi_pool_put(pool, fd, 1);
+	pthread_join(t, &res);
+	CuAssertIntEquals_Msg(tc, "waiting request given the connection let go", fd, (int) (long) res);
+	CuAssertIntEquals_Msg(tc, "no more connections than allowed", 1, pool->conns);
+
+	pool_waittime = 300;
+	fd = ogi_pool_get(pool, url);
+	start = cw_tvnow();
+	CuAssertIntEquals_Msg(tc, "waiting request timed out", -1, ogi_pool_get(pool, url));
+	CuAssert(tc, "request waited for the wait time", elapsed_ms(start) >= pool_waittime);
+	ogi_pool_put(pool, fd, 0);
+	CuAssertIntEquals(tc, 0, pool->conns);
+	CuAssertIntEquals(tc, 2, pool->turnedaway);
+
+	CuAssertIntEquals_Msg(tc, "every command answered with 200 result=0", 0, server_errors);
+}
+
+/* A reload closes the idle connections but keeps the pool, which a request
+   may be about to use */
+void test_ogi_pool_reload(CuTest *tc)
+{
+	serve_mode = SERVE_KEEP;
+	CuAssertIntEquals_Msg(tc, "session before the reload", 0, session(chan));
+	CuAssertIntEquals_Msg(tc, "connection kept idle", 1, pool->idle);
+	ogi_pool_flush(0);
+	CuAssertIntEquals_Msg(tc, "idle connection closed", 0, pool->idle);
+	CuAssertIntEquals(tc, 0, pool->conns);
+	CuAssertPtrEquals_Msg(tc, "unused pool kept", pool, ogi_pool_find("127.0.0.1", port));
+	CuAssertIntEquals_Msg(tc, "session after the reload", 0, session(chan));
+}
+
+int main(int argc, char *argv[])
+{
+	CuString *output = CuStringNew();
+	CuSuite *suite = CuSuiteNew();
+	int res;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (server_start()) {
+		printf("Unable to start the test server: %s\n", strerror(errno));
+		return 1;
+	}
+	chan = calloc(1, sizeof(*chan));
+	strcpy(chan->name, "Test/ogitest");
+	chan->type = "Test";
+
+	/* Each test carries on with the pool the one before it left */
+	SUITE_ADD_TEST(suite, test_ogi_keepalive);
+	SUITE_ADD_TEST(suite, test_ogi_pipeline);
+	SUITE_ADD_TEST(suite, test_ogi_server_close);
+	SUITE_ADD_TEST(suite, test_ogi_idle_checked);
+	SUITE_ADD_TEST(suite, test_ogi_pool_limits);
+	SUITE_ADD_TEST(suite, test_ogi_pool_reload);
+
+	CuSuiteRun(suite);
+	CuSuiteSummary(suite, output);
+	CuSuiteDetails(suite, output);
+	printf("%s\n", output->buffer);
+	res = suite->failCount ? 1 : 0;
+
+	ogi_pool_flush(1);
+	free(chan);
+	return res;
+}
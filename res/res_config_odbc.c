@@ -525,6 +525,11 @@ int load_module (void)
 	return 0;
 }
 
+char *depends (void)
+{
+	return "res_odbc.so";
+}
+
 char *description (void)
 {
 	return tdesc;
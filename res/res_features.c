@@ -37,6 +37,9 @@
 #include <sys/time.h>
 #include <sys/signal.h>
 #include <netinet/in.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
 #include <spandsp.h>
 
@@ -153,6 +156,11 @@ struct parkeduser {
 	int notquiteyet;
 	char peername[1024];
 	unsigned char moh_trys;
+	struct timeval expiry;
+	int heap_index;			/* Position in the expiry heap, -1 if not scheduled */
+	unsigned int serial;
+	int watched[CW_MAX_FDS];	/* fds currently registered with the watcher */
+	struct parkeduser *prev;
 	struct parkeduser *next;
 };
 
@@ -162,6 +170,283 @@ CW_MUTEX_DEFINE_STATIC(parking_lock);
 
 static pthread_t parking_thread;
 
+/* Occupancy bitmap and slot table covering the configured parking range */
+#define PARKING_WORD_BITS	(sizeof(unsigned long) * 8)
+
+static unsigned long *parking_map;
+static struct parkeduser **parking_slots;
+static int parking_slots_start;
+static int parking_slots_count;
+
+/* Active parked users ordered by expiry */
+static struct parkeduser **parking_heap;
+static int parking_heap_len;
+static int parking_heap_size;
+
+/* Watch keys carry the parking number, a serial and the fd index so a
+ * stale event for a reused slot can be recognised and dropped */
+#define PARKING_KEY(pu, x)	(((uint64_t)(unsigned int)(pu)->parkingnum << 32) | ((uint64_t)((pu)->serial & 0xffffff) << 8) | (x))
+#define PARKING_KEY_ALERT	(~(uint64_t)0)
+#define PARKING_MAX_EVENTS	64
+
+static unsigned int parking_serial;
+static int parking_alert[2] = { -1, -1 };
+#ifdef HAVE_SYS_EPOLL_H
+static int parking_epfd = -1;
+#endif
+
+static void parking_wakeup(void)
+{
+	if (parking_alert[1] < 0)
+		return;
+	/* A full pipe already has the parking thread coming round */
+	while (write(parking_alert[1], "", 1) < 0) {
+		if (errno != EINTR) {
+			if (errno != EAGAIN)
+				cw_log(LOG_WARNING, "Unable to wake parking thread: %s\n", strerror(errno));
+			break;
+		}
+	}
+}
+
+static void parking_heap_set(int i, struct parkeduser *pu)
+{
+	parking_heap[i] = pu;
+	pu->heap_index = i;
+}
+
+static void parking_heap_sift(int i)
+{
+	struct parkeduser *pu = parking_heap[i];
+	int child;
+
+	while (i > 0 && cw_tvcmp(pu->expiry, parking_heap[(i - 1) / 2]->expiry) < 0) {
+		parking_heap_set(i, parking_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < parking_heap_len) {
+		if (child + 1 < parking_heap_len && cw_tvcmp(parking_heap[child + 1]->expiry, parking_heap[child]->expiry) < 0)
+			child++;
+		if (cw_tvcmp(parking_heap[child]->expiry, pu->expiry) >= 0)
+			break;
+		parking_heap_set(i, parking_heap[child]);
+		i = child;
+	}
+	parking_heap_set(i, pu);
+}
+
+static int parking_heap_push(struct parkeduser *pu)
+{
+	struct parkeduser **heap;
+	int size;
+
+	if (parking_heap_len == parking_heap_size) {
+		size = (parking_heap_size ? parking_heap_size * 2 : 64);
+		if (!(heap = realloc(parking_heap, size * sizeof(*heap)))) {
+			cw_log(LOG_WARNING, "Out of memory\n");
+			return -1;
+		}
+		parking_heap = heap;
+		parking_heap_size = size;
+	}
+	parking_heap_set(parking_heap_len++, pu);
+	parking_heap_sift(pu->heap_index);
+	return 0;
+}
+
+static void parking_heap_remove(struct parkeduser *pu)
+{
+	int i = pu->heap_index;
+
+	if (i < 0)
+		return;
+	pu->heap_index = -1;
+	if (i != --parking_heap_len) {
+		parking_heap_set(i, parking_heap[parking_heap_len]);
+		parking_heap_sift(i);
+	}
+}
+
+/*! Look up a parked user by parking number. Must be called with parking_lock held. */
+static struct parkeduser *parking_find(int num)
+{
+	struct parkeduser *pu;
+	int x = num - parking_slots_start;
+
+	if (x >= 0 && x < parking_slots_count)
+		return parking_slots[x];
+
+	/* Only calls parked before a reload changed the range end up here */
+	for (pu = parkinglot; pu; pu = pu->next) {
+		if (pu->parkingnum == num)
+			return pu;
+	}
+	return NULL;
+}
+
+/*! Size the slot table to the configured range, keeping calls already parked.
+ *  Must be called with parking_lock held. */
+static int parking_slots_rebuild(void)
+{
+	struct parkeduser *pu;
+	struct parkeduser **slots;
+	unsigned long *map;
+	int count, words, x;
+
+	count = parking_stop - parking_start + 1;
+	if (count < 0)
+		count = 0;
+	words = (count + PARKING_WORD_BITS - 1) / PARKING_WORD_BITS;
+
+	map = calloc(words + 1, sizeof(unsigned long));
+	slots = calloc(count + 1, sizeof(struct parkeduser *));
+	if (!map || !slots) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		free(map);
+		free(slots);
+		return -1;
+	}
+
+	/* Bits past the end of the range are never free */
+	for (x = count; x < words * PARKING_WORD_BITS; x++)
+		map[x / PARKING_WORD_BITS] |= 1UL << (x % PARKING_WORD_BITS);
+
+	for (pu = parkinglot; pu; pu = pu->next) {
+		x = pu->parkingnum - parking_start;
+		if (x >= 0 && x < count) {
+			slots[x] = pu;
+			map[x / PARKING_WORD_BITS] |= 1UL << (x % PARKING_WORD_BITS);
+		}
+	}
+
+	free(parking_map);
+	free(parking_slots);
+	parking_map = map;
+	parking_slots = slots;
+	parking_slots_start = parking_start;
+	parking_slots_count = count;
+	return 0;
+}
+
+/*! Find a free slot starting from parking_offset, wrapping around once.
+ *  The bitmap is scanned a word at a time, so this is linear in the size of
+ *  the range over PARKING_WORD_BITS, not constant time.
+ *  Returns the slot index or -1. Must be called with parking_lock held. */
+static int parking_slot_alloc(void)
+{
+	unsigned long avail;
+	int i, w, b, words, first;
+
+	if (!parking_slots_count)
+		return -1;
+
+	words = (parking_slots_count + PARKING_WORD_BITS - 1) / PARKING_WORD_BITS;
+	first = parking_offset % parking_slots_count;
+
+	for (i = 0; i <= words; i++) {
+		w = (first / PARKING_WORD_BITS + i) % words;
+		avail = ~parking_map[w];
+		if (i == 0)
+			avail &= ~0UL << (first % PARKING_WORD_BITS);
+		else if (i == words)
+			avail &= ~(~0UL << (first % PARKING_WORD_BITS));
+		if (avail) {
+			for (b = 0; !(avail & (1UL << b)); b++);
+			return w * PARKING_WORD_BITS + b;
+		}
+	}
+	return -1;
+}
+
+/*! Bring the registered fds of a parked channel in line with its current fds.
+ *  An fd is added even when its number hasn't changed: after a masquerade the
+ *  same number may be a new file, and closing the old one took it out of the
+ *  epoll set.  EEXIST tells us it is still there. */
+static void parking_watch_sync(struct parkeduser *pu)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	int x;
+
+	for (x = 0; x < CW_MAX_FDS; x++) {
+		if (pu->watched[x] > -1 && pu->watched[x] != pu->chan->fds[x])
+			epoll_ctl(parking_epfd, EPOLL_CTL_DEL, pu->watched[x], &ev);
+		if ((pu->watched[x] = pu->chan->fds[x]) > -1) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLPRI;
+			ev.data.u64 = PARKING_KEY(pu, x);
+			if (epoll_ctl(parking_epfd, EPOLL_CTL_ADD, pu->watched[x], &ev) && errno != EEXIST) {
+				cw_log(LOG_WARNING, "Unable to watch fd %d of parked channel '%s': %s\n", pu->watched[x], pu->chan->name, strerror(errno));
+				pu->watched[x] = -1;
+			}
+		}
+	}
+#else
+	memcpy(pu->watched, pu->chan->fds, sizeof(pu->watched));
+#endif
+}
+
+static void parking_watch_remove(struct parkeduser *pu)
+{
+	int x;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	for (x = 0; x < CW_MAX_FDS; x++) {
+		if (pu->watched[x] > -1)
+			epoll_ctl(parking_epfd, EPOLL_CTL_DEL, pu->watched[x], &ev);
+	}
+#endif
+	for (x = 0; x < CW_MAX_FDS; x++)
+		pu->watched[x] = -1;
+}
+
+/*! Start timing out and watching a parked user. Must be called with parking_lock held. */
+static void parking_activate(struct parkeduser *pu)
+{
+	pu->expiry = cw_tvadd(pu->start, cw_samp2tv(pu->parkingtime, 1000));
+	parking_heap_push(pu);
+	parking_watch_sync(pu);
+}
+
+/*! Take a parked user out of the lot. Must be called with parking_lock held
+ *  and before the channel is hung up so its fds are still valid. */
+static void parking_unlink(struct parkeduser *pu)
+{
+	int x;
+
+	parking_heap_remove(pu);
+	parking_watch_remove(pu);
+
+	x = pu->parkingnum - parking_slots_start;
+	if (x >= 0 && x < parking_slots_count && parking_slots[x] == pu) {
+		parking_slots[x] = NULL;
+		parking_map[x / PARKING_WORD_BITS] &= ~(1UL << (x % PARKING_WORD_BITS));
+	}
+
+	if (pu->prev)
+		pu->prev->next = pu->next;
+	else
+		parkinglot = pu->next;
+	if (pu->next)
+		pu->next->prev = pu->prev;
+	pu->prev = pu->next = NULL;
+}
+
+static void parking_remove_exten(int num)
+{
+	char exten[CW_MAX_EXTENSION];
+	struct cw_context *con;
+
+	con = cw_context_find(parking_con);
+	if (con) {
+		snprintf(exten, sizeof(exten), "%d", num);
+		if (cw_context_remove_extension2(con, exten, 1, NULL))
+			cw_log(LOG_WARNING, "Whoa, failed to remove the extension!\n");
+	} else
+		cw_log(LOG_WARNING, "Whoa, no parking context?\n");
+}
+
 /* Predeclare all statics to keep GCC 4.x happy */
 static char *__cw_parking_ext(void);
 static char *__cw_pickup_ext(void);
@@ -293,8 +578,8 @@ static int adsi_announce_park(struct cw_channel *chan, int parkingnum)
 	   after these channels too */
 static int __cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int timeout, int *extout)
 {
-	struct parkeduser *pu, *cur;
-	int i,x,parking_range;
+	struct parkeduser *pu;
+	int i,x;
 	char exten[CW_MAX_EXTENSION];
 	struct cw_context *con;
 
@@ -304,28 +589,22 @@ static int __cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int
 		return -1;
 	}
 	memset(pu, 0, sizeof(struct parkeduser));
+	pu->heap_index = -1;
+	for (i = 0; i < CW_MAX_FDS; i++)
+		pu->watched[i] = -1;
 	cw_mutex_lock(&parking_lock);
-	parking_range = parking_stop - parking_start+1;
-	for (i = 0; i < parking_range; i++) {
-		x = (i + parking_offset) % parking_range + parking_start;
-		cur = parkinglot;
-		while(cur) {
-			if (cur->parkingnum == x) 
-				break;
-			cur = cur->next;
-		}
-		if (!cur)
-			break;
-	}
-
-	if (!(i < parking_range)) {
+	if ((i = parking_slot_alloc()) < 0) {
 		cw_log(LOG_WARNING, "No more parking spaces\n");
 		free(pu);
 		cw_mutex_unlock(&parking_lock);
 		return -1;
 	}
+	x = i + parking_slots_start;
 	if (parkfindnext) 
-		parking_offset = x - parking_start + 1;
+		parking_offset = i + 1;
+	parking_slots[i] = pu;
+	parking_map[i / PARKING_WORD_BITS] |= 1UL << (i % PARKING_WORD_BITS);
+	pu->serial = ++parking_serial;
 	chan->appl = "Parked Call";
 
 	pu->chan = chan;
@@ -360,13 +639,17 @@ static int __cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int
 	else
 		pu->priority = chan->priority;
 	pu->next = parkinglot;
+	if (parkinglot)
+		parkinglot->prev = pu;
 	parkinglot = pu;
 	/* If parking a channel directly, don't quiet yet get parking running on it */
 	if (peer == chan) 
 		pu->notquiteyet = 1;
+	else
+		parking_activate(pu);
 	cw_mutex_unlock(&parking_lock);
-	/* Wake up the (presumably select()ing) thread */
-	pthread_kill(parking_thread, SIGURG);
+	/* Wake up the parking thread so it picks up the new expiry */
+	parking_wakeup();
 	if (option_verbose > 1) 
 		cw_verbose(VERBOSE_PREFIX_2 "Parked %s on %d. Will timeout back to extension [%s] %s, %d in %d seconds\n", pu->chan->name, pu->parkingnum, pu->context, pu->exten, pu->priority, (pu->parkingtime/1000));
 
@@ -404,11 +687,16 @@ static int __cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int
 	}
 	if (peer) 
 		cw_say_digits(peer, pu->parkingnum, "", peer->language);
-	if (pu->notquiteyet) {
+	if (peer == chan) {
 		/* Wake up parking thread if we're really done */
-		cw_moh_start(pu->chan, NULL);
-		pu->notquiteyet = 0;
-		pthread_kill(parking_thread, SIGURG);
+		cw_mutex_lock(&parking_lock);
+		if (parking_find(x) == pu && pu->notquiteyet) {
+			cw_moh_start(pu->chan, NULL);
+			pu->notquiteyet = 0;
+			parking_activate(pu);
+		}
+		cw_mutex_unlock(&parking_lock);
+		parking_wakeup();
 	}
 	return 0;
 }
@@ -1581,182 +1869,219 @@ static int __cw_bridge_call(struct cw_channel *chan,struct cw_channel *peer,stru
 	return res;
 }
 
-static void *do_parking_thread(void *ignore)
+/*! Send a parked call whose time is up back to the dialplan. Called with parking_lock held. */
+static void parking_timeout(struct parkeduser *pu)
 {
-	int ms, tms, max;
-	struct parkeduser *pu, *pl, *pt = NULL;
-	struct timeval tv;
-	struct cw_frame *f;
-	char exten[CW_MAX_EXTENSION];
 	char *peername,*cp;
 	char returnexten[CW_MAX_EXTENSION];
 	struct cw_context *con;
-	int x;
-	fd_set rfds, efds;
-	fd_set nrfds, nefds;
-	FD_ZERO(&rfds);
-	FD_ZERO(&efds);
 
-	for (;;) {
-		ms = -1;
-		max = -1;
-		cw_mutex_lock(&parking_lock);
-		pl = NULL;
-		pu = parkinglot;
-		FD_ZERO(&nrfds);
-		FD_ZERO(&nefds);
-		while(pu) {
-			if (pu->notquiteyet) {
-				/* Pretend this one isn't here yet */
-				pl = pu;
-				pu = pu->next;
-				continue;
+	/* Stop music on hold */
+	cw_moh_stop(pu->chan);
+	cw_indicate(pu->chan, CW_CONTROL_UNHOLD);
+	/* Get chan, exten from derived kludge */
+	if (pu->peername[0]) {
+		peername = cw_strdupa(pu->peername);
+		cp = strrchr(peername, '-');
+		if (cp) 
+			*cp = 0;
+		con = cw_context_find(parking_con_dial);
+		if (!con) {
+			con = cw_context_create(NULL, parking_con_dial, registrar);
+			if (!con) {
+				cw_log(LOG_ERROR, "Parking dial context '%s' does not exist and unable to create\n", parking_con_dial);
 			}
-			tms = cw_tvdiff_ms(cw_tvnow(), pu->start);
-			if (tms > pu->parkingtime) {
-				/* Stop music on hold */
-				cw_moh_stop(pu->chan);
-				cw_indicate(pu->chan, CW_CONTROL_UNHOLD);
-				/* Get chan, exten from derived kludge */
-				if (pu->peername[0]) {
-					peername = cw_strdupa(pu->peername);
-					cp = strrchr(peername, '-');
-					if (cp) 
-						*cp = 0;
-					con = cw_context_find(parking_con_dial);
-					if (!con) {
-						con = cw_context_create(NULL, parking_con_dial, registrar);
-						if (!con) {
-							cw_log(LOG_ERROR, "Parking dial context '%s' does not exist and unable to create\n", parking_con_dial);
-						}
-					}
-					if (con) {
-						snprintf(returnexten, sizeof(returnexten), "%s,,t", peername);
-						cw_add_extension2(con, 1, peername, 1, NULL, NULL, "Dial", strdup(returnexten), FREE, registrar);
-					}
-					cw_copy_string(pu->chan->exten, peername, sizeof(pu->chan->exten));
-					cw_copy_string(pu->chan->context, parking_con_dial, sizeof(pu->chan->context));
-					pu->chan->priority = 1;
+		}
+		if (con) {
+			snprintf(returnexten, sizeof(returnexten), "%s,,t", peername);
+			cw_add_extension2(con, 1, peername, 1, NULL, NULL, "Dial", strdup(returnexten), FREE, registrar);
+		}
+		cw_copy_string(pu->chan->exten, peername, sizeof(pu->chan->exten));
+		cw_copy_string(pu->chan->context, parking_con_dial, sizeof(pu->chan->context));
+		pu->chan->priority = 1;
 
-				} else {
-					/* They've been waiting too long, send them back to where they came.  Theoretically they
-					   should have their original extensions and such, but we copy to be on the safe side */
-					cw_copy_string(pu->chan->exten, pu->exten, sizeof(pu->chan->exten));
-					cw_copy_string(pu->chan->context, pu->context, sizeof(pu->chan->context));
-					pu->chan->priority = pu->priority;
-				}
+	} else {
+		/* They've been waiting too long, send them back to where they came.  Theoretically they
+		   should have their original extensions and such, but we copy to be on the safe side */
+		cw_copy_string(pu->chan->exten, pu->exten, sizeof(pu->chan->exten));
+		cw_copy_string(pu->chan->context, pu->context, sizeof(pu->chan->context));
+		pu->chan->priority = pu->priority;
+	}
 
-				manager_event(EVENT_FLAG_CALL, "ParkedCallTimeOut",
-					"Exten: %d\r\n"
-					"Channel: %s\r\n"
-					"CallerID: %s\r\n"
-					"CallerIDName: %s\r\n\r\n"
-					,pu->parkingnum, pu->chan->name
-					,(pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")
-					,(pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>")
-					);
-
-				if (option_verbose > 1) 
-					cw_verbose(VERBOSE_PREFIX_2 "Timeout for %s parked on %d. Returning to %s,%s,%d\n", pu->chan->name, pu->parkingnum, pu->chan->context, pu->chan->exten, pu->chan->priority);
-				/* Start up the PBX, or hang them up */
-				if (cw_pbx_start(pu->chan))  {
-					cw_log(LOG_WARNING, "Unable to restart the PBX for user on '%s', hanging them up...\n", pu->chan->name);
-					cw_hangup(pu->chan);
-				}
-				/* And take them out of the parking lot */
-				if (pl) 
-					pl->next = pu->next;
-				else
-					parkinglot = pu->next;
-				pt = pu;
-				pu = pu->next;
-				con = cw_context_find(parking_con);
-				if (con) {
-					snprintf(exten, sizeof(exten), "%d", pt->parkingnum);
-					if (cw_context_remove_extension2(con, exten, 1, NULL))
-						cw_log(LOG_WARNING, "Whoa, failed to remove the extension!\n");
-				} else
-					cw_log(LOG_WARNING, "Whoa, no parking context?\n");
-				free(pt);
-			} else {
-				for (x = 0; x < CW_MAX_FDS; x++) {
-					if ((pu->chan->fds[x] > -1) && (FD_ISSET(pu->chan->fds[x], &rfds) || FD_ISSET(pu->chan->fds[x], &efds))) {
-						if (FD_ISSET(pu->chan->fds[x], &efds))
-							cw_set_flag(pu->chan, CW_FLAG_EXCEPTION);
-						else
-							cw_clear_flag(pu->chan, CW_FLAG_EXCEPTION);
-						pu->chan->fdno = x;
-						/* See if they need servicing */
-						f = cw_read(pu->chan);
-						if (!f || ((f->frametype == CW_FRAME_CONTROL) && (f->subclass ==  CW_CONTROL_HANGUP))) {
-
-							manager_event(EVENT_FLAG_CALL, "ParkedCallGiveUp",
-								"Exten: %d\r\n"
-								"Channel: %s\r\n"
-								"CallerID: %s\r\n"
-								"CallerIDName: %s\r\n\r\n"
-								,pu->parkingnum, pu->chan->name
-								,(pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")
-								,(pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>")
-								);
-
-							/* There's a problem, hang them up*/
-							if (option_verbose > 1) 
-								cw_verbose(VERBOSE_PREFIX_2 "%s got tired of being parked\n", pu->chan->name);
-							cw_hangup(pu->chan);
-							/* And take them out of the parking lot */
-							if (pl) 
-								pl->next = pu->next;
-							else
-								parkinglot = pu->next;
-							pt = pu;
-							pu = pu->next;
-							con = cw_context_find(parking_con);
-							if (con) {
-								snprintf(exten, sizeof(exten), "%d", pt->parkingnum);
-								if (cw_context_remove_extension2(con, exten, 1, NULL))
-									cw_log(LOG_WARNING, "Whoa, failed to remove the extension!\n");
-							} else
-								cw_log(LOG_WARNING, "Whoa, no parking context?\n");
-							free(pt);
-							break;
-						} else {
-							/* XXX Maybe we could do something with packets, like dial "0" for operator or something XXX */
-							cw_fr_free(f);
-							if (pu->moh_trys < 3 && !cw_generator_is_active(pu->chan)) {
-								cw_log(LOG_DEBUG, "MOH on parked call stopped by outside source.  Restarting.\n");
-								cw_moh_start(pu->chan, NULL);
-								pu->moh_trys++;
-							}
-							goto std;	/* XXX Ick: jumping into an else statement??? XXX */
-						}
-					}
+	manager_event(EVENT_FLAG_CALL, "ParkedCallTimeOut",
+		"Exten: %d\r\n"
+		"Channel: %s\r\n"
+		"CallerID: %s\r\n"
+		"CallerIDName: %s\r\n\r\n"
+		,pu->parkingnum, pu->chan->name
+		,(pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")
+		,(pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>")
+		);
+
+	if (option_verbose > 1) 
+		cw_verbose(VERBOSE_PREFIX_2 "Timeout for %s parked on %d. Returning to %s,%s,%d\n", pu->chan->name, pu->parkingnum, pu->chan->context, pu->chan->exten, pu->chan->priority);
+	/* Take them out of the parking lot */
+	parking_unlink(pu);
+	/* Start up the PBX, or hang them up */
+	if (cw_pbx_start(pu->chan))  {
+		cw_log(LOG_WARNING, "Unable to restart the PBX for user on '%s', hanging them up...\n", pu->chan->name);
+		cw_hangup(pu->chan);
+	}
+	parking_remove_exten(pu->parkingnum);
+	free(pu);
+}
+
+/*! Service activity on one fd of a parked channel. Called with parking_lock held. */
+static void parking_service(struct parkeduser *pu, int x, int exception)
+{
+	struct cw_frame *f;
+
+	if (exception)
+		cw_set_flag(pu->chan, CW_FLAG_EXCEPTION);
+	else
+		cw_clear_flag(pu->chan, CW_FLAG_EXCEPTION);
+	pu->chan->fdno = x;
+	/* See if they need servicing */
+	f = cw_read(pu->chan);
+	if (!f || ((f->frametype == CW_FRAME_CONTROL) && (f->subclass ==  CW_CONTROL_HANGUP))) {
+		if (f)
+			cw_fr_free(f);
+
+		manager_event(EVENT_FLAG_CALL, "ParkedCallGiveUp",
+			"Exten: %d\r\n"
+			"Channel: %s\r\n"
+			"CallerID: %s\r\n"
+			"CallerIDName: %s\r\n\r\n"
+			,pu->parkingnum, pu->chan->name
+			,(pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")
+			,(pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>")
+			);
+
+		/* There's a problem, hang them up*/
+		if (option_verbose > 1) 
+			cw_verbose(VERBOSE_PREFIX_2 "%s got tired of being parked\n", pu->chan->name);
+		/* Take them out of the parking lot before the fds go away */
+		parking_unlink(pu);
+		cw_hangup(pu->chan);
+		parking_remove_exten(pu->parkingnum);
+		free(pu);
+		return;
+	}
+
+	/* XXX Maybe we could do something with packets, like dial "0" for operator or something XXX */
+	cw_fr_free(f);
+	if (pu->moh_trys < 3 && !cw_generator_is_active(pu->chan)) {
+		cw_log(LOG_DEBUG, "MOH on parked call stopped by outside source.  Restarting.\n");
+		cw_moh_start(pu->chan, NULL);
+		pu->moh_trys++;
+	}
+	/* Reading may have swapped the channel's fds */
+	parking_watch_sync(pu);
+}
+
+static void *do_parking_thread(void *ignore)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[PARKING_MAX_EVENTS];
+#else
+	struct pollfd *pfds = NULL, *ptmp;
+	uint64_t *keys = NULL, *ktmp;
+	int nfds, maxfds = 0;
+#endif
+	struct parkeduser *pu;
+	struct timeval now;
+	uint64_t key;
+	char buf[32];
+	int ms, n, x, revents;
+
+#ifndef HAVE_SYS_EPOLL_H
+	maxfds = 1 + CW_MAX_FDS;
+	pfds = malloc(maxfds * sizeof(*pfds));
+	keys = malloc(maxfds * sizeof(*keys));
+	if (!pfds || !keys) {
+		cw_log(LOG_ERROR, "Out of memory, parking thread exiting\n");
+		free(pfds);
+		free(keys);
+		return NULL;
+	}
+#endif
+	for (;;) {
+		cw_mutex_lock(&parking_lock);
+		now = cw_tvnow();
+		while (parking_heap_len && cw_tvcmp(parking_heap[0]->expiry, now) <= 0)
+			parking_timeout(parking_heap[0]);
+		ms = -1;
+		if (parking_heap_len) {
+			/* Round up so we never wake just short of the deadline */
+			ms = cw_tvdiff_ms(parking_heap[0]->expiry, now) + 1;
+		}
+#ifndef HAVE_SYS_EPOLL_H
+		pfds[0].fd = parking_alert[0];
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		keys[0] = PARKING_KEY_ALERT;
+		nfds = 1;
+		for (pu = parkinglot; pu; pu = pu->next) {
+			if (pu->notquiteyet)
+				continue;
+			if (nfds + CW_MAX_FDS > maxfds) {
+				x = maxfds * 2 + CW_MAX_FDS + 1;
+				if (!(ptmp = realloc(pfds, x * sizeof(*pfds))) || !(ktmp = realloc(keys, x * sizeof(*keys)))) {
+					if (ptmp)
+						pfds = ptmp;
+					cw_log(LOG_WARNING, "Out of memory\n");
+					break;
 				}
-				if (x >= CW_MAX_FDS) {
-std:					for (x=0; x<CW_MAX_FDS; x++) {
-						/* Keep this one for next one */
-						if (pu->chan->fds[x] > -1) {
-							FD_SET(pu->chan->fds[x], &nrfds);
-							FD_SET(pu->chan->fds[x], &nefds);
-							if (pu->chan->fds[x] > max)
-								max = pu->chan->fds[x];
-						}
-					}
-					/* Keep track of our longest wait */
-					if ((tms < ms) || (ms < 0))
-						ms = tms;
-					pl = pu;
-					pu = pu->next;
+				pfds = ptmp;
+				keys = ktmp;
+				maxfds = x;
+			}
+			for (x = 0; x < CW_MAX_FDS; x++) {
+				if (pu->watched[x] > -1) {
+					pfds[nfds].fd = pu->watched[x];
+					pfds[nfds].events = POLLIN | POLLPRI;
+					pfds[nfds].revents = 0;
+					keys[nfds++] = PARKING_KEY(pu, x);
 				}
 			}
 		}
+#endif
 		cw_mutex_unlock(&parking_lock);
-		rfds = nrfds;
-		efds = nefds;
-		tv = cw_samp2tv(ms, 1000);
+
 		/* Wait for something to happen */
-		cw_select(max + 1, &rfds, NULL, &efds, (ms > -1) ? &tv : NULL);
+#ifdef HAVE_SYS_EPOLL_H
+		n = epoll_wait(parking_epfd, events, PARKING_MAX_EVENTS, ms);
+#else
+		n = poll(pfds, nfds, ms);
+#endif
 		pthread_testcancel();
+		if (n <= 0)
+			continue;
+
+		cw_mutex_lock(&parking_lock);
+#ifdef HAVE_SYS_EPOLL_H
+		for (n--; n >= 0; n--) {
+			key = events[n].data.u64;
+			revents = events[n].events;
+			x = (revents & EPOLLPRI);
+#else
+		for (n = 0; n < nfds; n++) {
+			if (!(revents = pfds[n].revents))
+				continue;
+			key = keys[n];
+			x = (revents & POLLPRI);
+#endif
+			if (key == PARKING_KEY_ALERT) {
+				while (read(parking_alert[0], buf, sizeof(buf)) > 0);
+				continue;
+			}
+			/* The parked user may have been picked up or replaced meanwhile */
+			pu = parking_find((int)(unsigned int)(key >> 32));
+			if (!pu || pu->notquiteyet || (uint64_t)(pu->serial & 0xffffff) != ((key >> 8) & 0xffffff) || pu->watched[key & 0xff] < 0)
+				continue;
+			parking_service(pu, key & 0xff, x);
+		}
+		cw_mutex_unlock(&parking_lock);
 	}
 	return NULL;	/* Never reached */
 }
@@ -1789,9 +2114,7 @@ static int park_exec(struct cw_channel *chan, int argc, char **argv)
 	int res=0;
 	struct localuser *u;
 	struct cw_channel *peer=NULL;
-	struct parkeduser *pu, *pl=NULL;
-	char exten[CW_MAX_EXTENSION];
-	struct cw_context *con;
+	struct parkeduser *pu;
 	int park;
 	int dres;
 	struct cw_bridge_config config;
@@ -1805,28 +2128,12 @@ static int park_exec(struct cw_channel *chan, int argc, char **argv)
 
 	park = atoi(argv[0]);
 	cw_mutex_lock(&parking_lock);
-	pu = parkinglot;
-	while(pu) {
-		if (pu->parkingnum == park) {
-			if (pl)
-				pl->next = pu->next;
-			else
-				parkinglot = pu->next;
-			break;
-		}
-		pl = pu;
-		pu = pu->next;
-	}
+	if ((pu = parking_find(park)))
+		parking_unlink(pu);
 	cw_mutex_unlock(&parking_lock);
 	if (pu) {
 		peer = pu->chan;
-		con = cw_context_find(parking_con);
-		if (con) {
-			snprintf(exten, sizeof(exten), "%d", pu->parkingnum);
-			if (cw_context_remove_extension2(con, exten, 1, NULL))
-				cw_log(LOG_WARNING, "Whoa, failed to remove the extension!\n");
-		} else
-			cw_log(LOG_WARNING, "Whoa, no parking context?\n");
+		parking_remove_exten(pu->parkingnum);
 
 		manager_event(EVENT_FLAG_CALL, "UnParkedCall",
 			"Exten: %d\r\n"
@@ -2224,6 +2531,10 @@ static int load_config(void)
 	}
 	cw_config_destroy(cfg);
 
+	cw_mutex_lock(&parking_lock);
+	parking_slots_rebuild();
+	cw_mutex_unlock(&parking_lock);
+
 	/* Remove the old parking extension */
 	if (!cw_strlen_zero(old_parking_con) && (con = cw_context_find(old_parking_con)))   {
 		cw_context_remove_extension2(con, old_parking_ext, 1, registrar);
@@ -2255,6 +2566,27 @@ int load_module(void)
 		return res;
 	cw_cli_register(&showparked);
 	cw_cli_register(&showfeatures);
+
+	if (pipe(parking_alert)) {
+		cw_log(LOG_ERROR, "Unable to create parking alert pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(parking_alert[0], F_SETFL, fcntl(parking_alert[0], F_GETFL) | O_NONBLOCK);
+	fcntl(parking_alert[1], F_SETFL, fcntl(parking_alert[1], F_GETFL) | O_NONBLOCK);
+#ifdef HAVE_SYS_EPOLL_H
+	{
+		struct epoll_event ev;
+
+		if ((parking_epfd = epoll_create(1024)) < 0) {
+			cw_log(LOG_ERROR, "Unable to create parking epoll set: %s\n", strerror(errno));
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = PARKING_KEY_ALERT;
+		epoll_ctl(parking_epfd, EPOLL_CTL_ADD, parking_alert[0], &ev);
+	}
+#endif
 	cw_pthread_create(&parking_thread, NULL, do_parking_thread, NULL);
 
 	parkedcall_app = cw_register_application(parkedcall_name, park_exec, parkedcall_synopsis, parkedcall_syntax, parkedcall_descrip);
@@ -49,6 +49,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/app.h"
 #include "callweaver/utils.h"
 #include "callweaver/config.h"
+#include "callweaver/slinfactory.h"
 
 CW_MUTEX_DEFINE_STATIC(monitorlock);
 
@@ -65,11 +66,13 @@ static const char *monitor_descrip =
 "  file_format		optional, if not set, defaults to \"wav\"\n"
 "  fname_base		if set, changes the filename used to the one specified.\n"
 "  options:\n"
-"    m   - when the recording ends mix the two leg files into one and\n"
-"          delete the two leg files.  If the variable MONITOR_EXEC is set, the\n"
-"          application referenced in it will be executed instead of\n"
-"          soxmix and the raw leg files will NOT be deleted automatically.\n"
-"          soxmix or MONITOR_EXEC is handed 3 arguments, the two leg files\n"
+"    m   - record both directions into one mixed file, named like the leg\n"
+"          files only without the in/out designator, as the call goes.\n"
+"          If the variable MONITOR_EXEC is set, the two leg files are\n"
+"          recorded instead and when the recording ends the application\n"
+"          referenced in it is executed to join them.  The raw leg files\n"
+"          will NOT be deleted automatically.\n"
+"          MONITOR_EXEC is handed 3 arguments, the two leg files\n"
 "          and a target mixed file name which is the same as the leg file names\n"
 "          only without the in/out designator.\n"
 "          If MONITOR_EXEC_ARGS is set, the contents will be passed on as\n"
@@ -104,9 +107,221 @@ static int __cw_monitor_stop(struct cw_channel *, int);
 static int __cw_monitor_change_fname(struct cw_channel *, const char *, int);
 static void __cw_monitor_setjoinfiles(struct cw_channel *, int);
 
-/* Start monitoring a channel */
-static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
-		const char *fname_base, int need_lock)
+/*
+ * Mixed recordings.
+ *
+ * Instead of two leg files joined by soxmix after the call, both directions
+ * can go into one file as the call goes.  The channel thread only decodes
+ * each frame into the monitor's slinfactory for its direction.  A single
+ * mixing thread wakes every MIX_TICK ms, lines the two directions up by
+ * sample count, sums them and writes the result, so the disk is never
+ * touched from a call thread.  When one direction stops sending (silence
+ * suppression, hold) the other is allowed MIX_MAXLAG samples ahead before
+ * the missing audio is taken as silence.
+ */
+#define MIX_TICK		100
+#define MIX_CHUNK		800
+#define MIX_MAXLAG		1600
+#define MIX_MAXQUEUE	(8000*10)
+
+struct monitor_mix {
+	struct monitor_mix *next;
+	/* Decoded audio read from (0) and written to (1) the channel */
+	struct cw_slinfactory sf[2];
+	struct cw_filestream *stream;
+	char *format;
+	/* The file being written, and where it goes when recording stops */
+	char filename[FILENAME_MAX];
+	char target[FILENAME_MAX];
+	int closing;
+	int overrun;
+};
+
+CW_MUTEX_DEFINE_STATIC(mixlock);
+static cw_cond_t mixcond;
+static struct monitor_mix *mixes = NULL;
+static pthread_t mixthread = CW_PTHREADT_NULL;
+
+static inline int16_t mix_saturate(int amp)
+{
+	if (amp > 32767)
+		return 32767;
+	if (amp < -32768)
+		return -32768;
+	return amp;
+}
+
+/* Called from the channel, with the channel locked */
+static void monitor_mix_frame(struct cw_channel_monitor *monitor, struct cw_frame *f, int out)
+{
+	struct monitor_mix *mix = monitor->mix;
+
+	if (!mix || f->frametype != CW_FRAME_VOICE)
+		return;
+	if (mix->sf[out].size > MIX_MAXQUEUE * sizeof(int16_t)) {
+		/* The mixing thread is stuck behind the disk.  Losing audio beats
+		   holding up the call, or eating all the memory */
+		if (!mix->overrun++)
+			cw_log(LOG_WARNING, "Mixed recording %s is falling behind, dropping audio\n", mix->filename);
+		return;
+	}
+	cw_slinfactory_feed(&mix->sf[out], f);
+}
+
+/* Mixes and writes whatever can be lined up.  With flush set everything
+   left is written out, with silence for the shorter direction */
+static void monitor_mix_run(struct monitor_mix *mix, int flush)
+{
+	int16_t buf[2][MIX_CHUNK];
+	struct cw_frame f;
+	int avail[2];
+	int samples;
+	int len[2];
+	int x;
+
+	for (;;) {
+		avail[0] = mix->sf[0].size / sizeof(int16_t);
+		avail[1] = mix->sf[1].size / sizeof(int16_t);
+		samples = (avail[0] < avail[1])  ?  avail[0]  :  avail[1];
+		if (flush || abs(avail[0] - avail[1]) > MIX_MAXLAG)
+			samples = (avail[0] > avail[1])  ?  avail[0]  :  avail[1];
+		if (samples <= 0)
+			break;
+		if (samples > MIX_CHUNK)
+			samples = MIX_CHUNK;
+
+		len[0] = cw_slinfactory_read(&mix->sf[0], buf[0], samples * sizeof(int16_t)) / sizeof(int16_t);
+		len[1] = cw_slinfactory_read(&mix->sf[1], buf[1], samples * sizeof(int16_t)) / sizeof(int16_t);
+		for (x = 0;  x < samples;  x++)
+			buf[0][x] = mix_saturate(((x < len[0])  ?  buf[0][x]  :  0) + ((x < len[1])  ?  buf[1][x]  :  0));
+
+		if (mix->stream) {
+			cw_fr_init_ex(&f, CW_FRAME_VOICE, CW_FORMAT_SLINEAR, "Monitor");
+			f.data = buf[0];
+			f.datalen = samples * sizeof(int16_t);
+			f.samples = samples;
+			if (cw_writestream(mix->stream, &f) < 0) {
+				cw_log(LOG_WARNING, "Failed to write mixed recording %s\n", mix->filename);
+				cw_closestream(mix->stream);
+				mix->stream = NULL;
+			}
+		}
+	}
+}
+
+static void monitor_mix_free(struct monitor_mix *mix)
+{
+	if (mix->stream)
+		cw_closestream(mix->stream);
+	cw_slinfactory_destroy(&mix->sf[0]);
+	cw_slinfactory_destroy(&mix->sf[1]);
+	free(mix->format);
+	free(mix);
+}
+
+/* Writes out what's left of a stopped recording and moves it into place */
+static void monitor_mix_finish(struct monitor_mix *mix)
+{
+	monitor_mix_run(mix, 1);
+	if (mix->stream) {
+		cw_closestream(mix->stream);
+		mix->stream = NULL;
+	}
+	if (mix->overrun)
+		cw_log(LOG_WARNING, "Mixed recording %s lost %d frames\n", mix->filename, mix->overrun);
+	if (!cw_strlen_zero(mix->target) && strcmp(mix->target, mix->filename)) {
+		if (cw_fileexists(mix->target, NULL, NULL) > 0)
+			cw_filedelete(mix->target, NULL);
+		cw_filerename(mix->filename, mix->target, mix->format);
+	}
+	monitor_mix_free(mix);
+}
+
+static void *monitor_mix_thread(void *data)
+{
+	struct monitor_mix *mix, *head, *done, **p;
+	struct timespec ts;
+	struct timeval tv;
+
+	for (;;) {
+		cw_mutex_lock(&mixlock);
+		if (!mixes) {
+			cw_cond_wait(&mixcond, &mixlock);
+		} else {
+			tv = cw_tvadd(cw_tvnow(), cw_samp2tv(MIX_TICK, 1000));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			cw_cond_timedwait(&mixcond, &mixlock, &ts);
+		}
+		/* Take the stopped recordings off the list.  New ones are only ever
+		   pushed on the head, and nothing but this thread removes any, so
+		   the rest can be walked without the lock */
+		done = NULL;
+		for (p = &mixes;  *p;  ) {
+			mix = *p;
+			if (mix->closing) {
+				*p = mix->next;
+				mix->next = done;
+				done = mix;
+			} else {
+				p = &mix->next;
+			}
+		}
+		head = mixes;
+		cw_mutex_unlock(&mixlock);
+
+		for (mix = head;  mix;  mix = mix->next)
+			monitor_mix_run(mix, 0);
+		while ((mix = done)) {
+			done = mix->next;
+			monitor_mix_finish(mix);
+		}
+	}
+	return NULL;
+}
+
+static struct monitor_mix *monitor_mix_new(const char *filename, const char *format)
+{
+	struct monitor_mix *mix;
+
+	if (!(mix = calloc(1, sizeof(*mix))))
+		return NULL;
+	cw_slinfactory_init(&mix->sf[0]);
+	cw_slinfactory_init(&mix->sf[1]);
+	cw_copy_string(mix->filename, filename, sizeof(mix->filename));
+	if (!(mix->format = strdup(format))) {
+		monitor_mix_free(mix);
+		return NULL;
+	}
+	if (!(mix->stream = cw_writefile(mix->filename, mix->format, NULL, O_CREAT|O_TRUNC|O_WRONLY, 0, 0644))) {
+		cw_log(LOG_WARNING, "Could not create file %s\n", mix->filename);
+		monitor_mix_free(mix);
+		return NULL;
+	}
+
+	cw_mutex_lock(&mixlock);
+	mix->next = mixes;
+	mixes = mix;
+	cw_cond_signal(&mixcond);
+	cw_mutex_unlock(&mixlock);
+	return mix;
+}
+
+/* Hands a stopped recording over to the mixing thread to finish off */
+static void monitor_mix_stop(struct monitor_mix *mix, const char *target)
+{
+	cw_mutex_lock(&mixlock);
+	if (target)
+		cw_copy_string(mix->target, target, sizeof(mix->target));
+	mix->closing = 1;
+	cw_cond_signal(&mixcond);
+	cw_mutex_unlock(&mixlock);
+}
+
+/* Start monitoring a channel, into two leg files or, with mixed set, into
+   one file holding both directions */
+static int monitor_start(struct cw_channel *chan, const char *format_spec,
+		const char *fname_base, int need_lock, int mixed)
 {
 	int res = 0;
 	char tmp[256];
@@ -148,15 +363,15 @@ static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
 				free(name);
 				cw_safe_system(tmp);
 			}
-			snprintf(monitor->read_filename, FILENAME_MAX, "%s/%s-in",
-						directory ? "" : cw_config_CW_MONITOR_DIR, fname_base);
+			snprintf(monitor->read_filename, FILENAME_MAX, "%s/%s%s",
+						directory ? "" : cw_config_CW_MONITOR_DIR, fname_base, mixed ? "" : "-in");
 			snprintf(monitor->write_filename, FILENAME_MAX, "%s/%s-out",
 						directory ? "" : cw_config_CW_MONITOR_DIR, fname_base);
 			cw_copy_string(monitor->filename_base, fname_base, sizeof(monitor->filename_base));
 		} else {
 			cw_mutex_lock(&monitorlock);
-			snprintf(monitor->read_filename, FILENAME_MAX, "%s/audio-in-%ld",
-						cw_config_CW_MONITOR_DIR, seq);
+			snprintf(monitor->read_filename, FILENAME_MAX, "%s/audio-%s%ld",
+						cw_config_CW_MONITOR_DIR, mixed ? "" : "in-", seq);
 			snprintf(monitor->write_filename, FILENAME_MAX, "%s/audio-out-%ld",
 						cw_config_CW_MONITOR_DIR, seq);
 			seq++;
@@ -188,7 +403,17 @@ static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
 		if (cw_fileexists(monitor->read_filename, NULL, NULL) > 0) {
 			cw_filedelete(monitor->read_filename, NULL);
 		}
-		if (!(monitor->read_stream = cw_writefile(monitor->read_filename,
+		if (mixed) {
+			if (!(monitor->mix = monitor_mix_new(monitor->read_filename, monitor->format))) {
+				free(monitor->format);
+				free(monitor);
+				if (need_lock)
+					cw_mutex_unlock(&chan->lock);
+				return -1;
+			}
+			monitor->mix_frame = monitor_mix_frame;
+			monitor->joinfiles = 1;
+		} else if (!(monitor->read_stream = cw_writefile(monitor->read_filename,
 						monitor->format, NULL,
 						O_CREAT|O_TRUNC|O_WRONLY, 0, 0644))) {
 			cw_log(LOG_WARNING, "Could not create file %s\n",
@@ -197,10 +422,10 @@ static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
 			cw_mutex_unlock(&chan->lock);
 			return -1;
 		}
-		if (cw_fileexists(monitor->write_filename, NULL, NULL) > 0) {
+		if (!mixed && cw_fileexists(monitor->write_filename, NULL, NULL) > 0) {
 			cw_filedelete(monitor->write_filename, NULL);
 		}
-		if (!(monitor->write_stream = cw_writefile(monitor->write_filename,
+		if (!mixed && !(monitor->write_stream = cw_writefile(monitor->write_filename,
 						monitor->format, NULL,
 						O_CREAT|O_TRUNC|O_WRONLY, 0, 0644))) {
 			cw_log(LOG_WARNING, "Could not create file %s\n",
@@ -225,6 +450,12 @@ static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
 	return res;
 }
 
+static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
+		const char *fname_base, int need_lock)
+{
+	return monitor_start(chan, format_spec, fname_base, need_lock, 0);
+}
+
 /* Stop monitoring a channel */
 static int __cw_monitor_stop(struct cw_channel *chan, int need_lock)
 {
@@ -242,6 +473,7 @@ static int __cw_monitor_stop(struct cw_channel *chan, int need_lock)
 
 	if (chan->monitor) {
 		char filename[ FILENAME_MAX ];
+		int mixed = (chan->monitor->mix != NULL);
 
 		if (chan->monitor->read_stream) {
 			cw_closestream(chan->monitor->read_stream);
@@ -250,7 +482,17 @@ static int __cw_monitor_stop(struct cw_channel *chan, int need_lock)
 			cw_closestream(chan->monitor->write_stream);
 		}
 
-		if (chan->monitor->filename_changed && !cw_strlen_zero(chan->monitor->filename_base)) {
+		if (mixed) {
+			/* The mixing thread writes out the rest and renames the file */
+			char *name = chan->monitor->filename_base;
+
+			filename[0] = '\0';
+			if (!cw_strlen_zero(name))
+				snprintf(filename, FILENAME_MAX, "%s/%s", strchr(name, '/') ? "" : cw_config_CW_MONITOR_DIR, name);
+			monitor_mix_stop(chan->monitor->mix, filename);
+			chan->monitor->mix = NULL;
+			chan->monitor->mix_frame = NULL;
+		} else if (chan->monitor->filename_changed && !cw_strlen_zero(chan->monitor->filename_base)) {
 			if (cw_fileexists(chan->monitor->read_filename,NULL,NULL) > 0) {
 				snprintf(filename, FILENAME_MAX, "%s-in", chan->monitor->filename_base);
 				if (cw_fileexists(filename, NULL, NULL) > 0) {
@@ -272,7 +514,7 @@ static int __cw_monitor_stop(struct cw_channel *chan, int need_lock)
 			}
 		}
 
-		if (chan->monitor->joinfiles && !cw_strlen_zero(chan->monitor->filename_base)) {
+		if (chan->monitor->joinfiles && !mixed && !cw_strlen_zero(chan->monitor->filename_base)) {
 			char tmp[1024];
 			char tmp2[1024];
 			char *format = (strcasecmp(chan->monitor->format, "wav49") == 0)  ?  "WAV"  :  chan->monitor->format;
@@ -373,6 +615,7 @@ static int start_monitor_exec(struct cw_channel *chan, int argc, char **argv)
 	char tmp[256];
 	int joinfiles = 0;
 	int waitforbridge = 0;
+	int mixed = 0;
 	int res = 0;
 
 	if (argc > 2) {
@@ -393,7 +636,11 @@ static int start_monitor_exec(struct cw_channel *chan, int argc, char **argv)
 		return 0;
 	}
 
-	res = __cw_monitor_start(chan, argv[0], (argc > 1 ? argv[1] : ""), 1);
+	/* Unless MONITOR_EXEC wants the legs, mix as we go */
+	if (joinfiles)
+		mixed = cw_strlen_zero(pbx_builtin_getvar_helper(chan, "MONITOR_EXEC"));
+
+	res = monitor_start(chan, argv[0], (argc > 1 ? argv[1] : ""), 1, mixed);
 	if (res < 0)
 		res = __cw_monitor_change_fname(chan, (argc > 1 ? argv[1] : ""), 1);
 	__cw_monitor_setjoinfiles(chan, joinfiles);
@@ -422,8 +669,9 @@ static char start_monitor_action_help[] =
 "  Format      - Optional.  Is the audio recording format.  Defaults\n"
 "                to \"wav\".\n"
 "  Mix         - Optional.  Boolean parameter as to whether to mix\n"
-"                the input and output channels together after the\n"
-"                recording is finished.\n";
+"                the input and output channels together, as they are\n"
+"                recorded or, if MONITOR_EXEC is set on the channel,\n"
+"                after the recording is finished.\n";
 
 static int start_monitor_action(struct mansession *s, struct message *m)
 {
@@ -433,6 +681,7 @@ static int start_monitor_action(struct mansession *s, struct message *m)
 	char *format = astman_get_header(m, "Format");
 	char *mix = astman_get_header(m, "Mix");
 	char *d;
+	int mixed = 0;
 	
 	if ((!name) || (cw_strlen_zero(name))) {
 		astman_send_error(s, m, "No channel specified");
@@ -458,7 +707,10 @@ static int start_monitor_action(struct mansession *s, struct message *m)
 		if ((d=strchr(fname, '/'))) *d='-';
 	}
 	
-	if (__cw_monitor_start(c, format, fname, 1)) {
+	if (cw_true(mix))
+		mixed = cw_strlen_zero(pbx_builtin_getvar_helper(c, "MONITOR_EXEC"));
+
+	if (monitor_start(c, format, fname, 1, mixed)) {
 		if (__cw_monitor_change_fname(c, fname, 1)) {
 			astman_send_error(s, m, "Could not start monitoring channel");
 			cw_mutex_unlock(&c->lock);
@@ -548,6 +800,18 @@ static void __cw_monitor_setjoinfiles(struct cw_channel *chan, int turnon)
 
 int load_module(void)
 {
+	pthread_attr_t attr;
+
+	cw_cond_init(&mixcond, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (cw_pthread_create(&mixthread, &attr, monitor_mix_thread, NULL)) {
+		cw_log(LOG_ERROR, "Unable to start the monitor mixing thread\n");
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+
 	monitor_app = cw_register_application(monitor_name, start_monitor_exec, monitor_synopsis, monitor_syntax, monitor_descrip);
 	stopmonitor_app = cw_register_application(stopmonitor_name, stop_monitor_exec, stopmonitor_synopsis, stopmonitor_syntax, stopmonitor_descrip);
 	changemonitor_app = cw_register_application(changemonitor_name, change_monitor_exec, changemonitor_synopsis, changemonitor_syntax, changemonitor_descrip);
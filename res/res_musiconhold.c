@@ -62,6 +62,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 
 #define MAX_MOHFILES 512
 #define MAX_MOHFILE_LEN 128
+#define MOH_RING_MS 2000	/* Depth of the shared custom command ring */
 
 static void *app0;
 static void *app1;
@@ -125,6 +126,22 @@ struct moh_files_state {
 #define MOH_CUSTOM		(1 << 0)
 #define MOH_RANDOMIZE		(1 << 1)
 
+/*! Shared fan-out ring holding the audio of a custom MOH class in a single
+ *  output format.  The monitor thread appends to it once per interval and
+ *  every listener only keeps a read cursor into it. */
+struct moh_ring {
+	int format;
+	int listeners;
+	/* Translator from the class format, NULL for the source ring */
+	struct cw_trans_pvt *trans;
+	unsigned char *buf;
+	size_t size;
+	/* Total bytes ever written and size of the most recent append */
+	unsigned long long head;
+	size_t last;
+	struct moh_ring *next;
+};
+
 struct mohclass {
 	char name[MAX_MUSICCLASS];
 	char dir[256];
@@ -136,17 +153,20 @@ struct mohclass {
 	int format;
 	int pid;		/* PID of custom command */
 	pthread_t thread;
-	struct mohdata *members;
+	int listeners;
 	/* Source of audio */
 	int srcfd;
+	/* Protects the rings and their listener counts */
+	cw_mutex_t lock;
+	struct moh_ring *rings;
 	struct mohclass *next;
 };
 
 struct mohdata {
-	int pipe[2];
 	int origwfmt;
 	struct mohclass *parent;
-	struct mohdata *next;
+	struct moh_ring *ring;
+	unsigned long long cursor;
 };
 
 static struct mohclass *mohclasses;
@@ -155,17 +175,84 @@ CW_MUTEX_DEFINE_STATIC(moh_lock);
 
 static void cw_moh_free_class(struct mohclass *class) 
 {
-	struct mohdata *members, *mtmp;
-
-	members = class->members;
-	while(members) {
-		mtmp = members;
-		members = members->next;
-		free(mtmp);
+	struct moh_ring *ring;
+
+	while ((ring = class->rings)) {
+		class->rings = ring->next;
+		if (ring->trans)
+			cw_translator_free_path(ring->trans);
+		free(ring->buf);
+		free(ring);
 	}
+	cw_mutex_destroy(&class->lock);
 	free(class);
 }
 
+/*! Find the ring serving the given format, creating it if needed.
+ *  Falls back to the source ring when no translation path exists.
+ *  Must be called with class->lock held. */
+static struct moh_ring *moh_ring_get(struct mohclass *class, int format)
+{
+	struct moh_ring *ring, *source = NULL;
+	int size;
+
+	for (ring = class->rings; ring; ring = ring->next) {
+		if (ring->format == format)
+			return ring;
+		if (!ring->trans)
+			source = ring;
+	}
+
+	if ((size = cw_codec_get_len(format, 8 * MOH_RING_MS)) <= 0)
+		return source;
+
+	if (!(ring = malloc(sizeof(struct moh_ring)))) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		return source;
+	}
+	memset(ring, 0, sizeof(struct moh_ring));
+	ring->format = format;
+	ring->size = size;
+
+	if (format != class->format
+	&& !(ring->trans = cw_translator_build_path(format, 8000, class->format, 8000))) {
+		free(ring);
+		return source;
+	}
+	if (!(ring->buf = malloc(ring->size))) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		if (ring->trans)
+			cw_translator_free_path(ring->trans);
+		free(ring);
+		return source;
+	}
+
+	ring->next = class->rings;
+	class->rings = ring;
+	return ring;
+}
+
+/*! Append one interval of audio to a ring.  Must be called with class->lock held. */
+static void moh_ring_append(struct moh_ring *ring, const unsigned char *data, size_t len)
+{
+	size_t off, n;
+
+	if (len > ring->size) {
+		data += len - ring->size;
+		ring->head += len - ring->size;
+		len = ring->size;
+	}
+
+	off = ring->head % ring->size;
+	n = (len < ring->size - off ? len : ring->size - off);
+	memcpy(ring->buf + off, data, n);
+	if (n < len)
+		memcpy(ring->buf, data + n, len - n);
+
+	ring->head += len;
+	ring->last = len;
+}
+
 
 static void moh_files_release(struct cw_channel *chan, void *data)
 {
@@ -441,7 +528,8 @@ static void *monitor_custom_command(void *data)
 #define	MOH_MS_INTERVAL		100
 
 	struct mohclass *class = data;
-	struct mohdata *moh;
+	struct moh_ring *ring;
+	struct cw_frame f, *out;
 	short sbuf[8192];
 	int res, res2;
 	int len;
@@ -460,12 +548,12 @@ static void *monitor_custom_command(void *data)
 			if ((class->srcfd = spawn_custom_command(class)) < 0) {
 				cw_log(LOG_WARNING, "Unable to spawn custom command\n");
 				/* Try again later */
-				if (!class->members) {
+				if (!class->listeners) {
 					pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 					pthread_testcancel();
 				}
 				sleep(60);
-				if (!class->members)
+				if (!class->listeners)
 					pthread_testcancel();
 				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 				continue;
@@ -473,7 +561,7 @@ static void *monitor_custom_command(void *data)
 		}
 
 		/* Reliable sleep */
-		if (!class->members) {
+		if (!class->listeners) {
 			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 			pthread_testcancel();
 		}
@@ -489,7 +577,7 @@ static void *monitor_custom_command(void *data)
 			tv = tv_tmp;
 		}
 
-		if (!class->members) {
+		if (!class->listeners) {
 			pthread_testcancel();
 			continue;
 		}
@@ -499,7 +587,7 @@ static void *monitor_custom_command(void *data)
 		len = cw_codec_get_len(class->format, res);
 
 		res2 = read(class->srcfd, sbuf, len);
-		if (!class->members)
+		if (!class->listeners)
 			pthread_testcancel();
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
@@ -515,21 +603,22 @@ static void *monitor_custom_command(void *data)
 				cw_log(LOG_DEBUG, "Read %d bytes of audio while expecting %d\n", res2, len);
 			continue;
 		}
-		cw_mutex_lock(&moh_lock);
-		for (moh = class->members; moh; moh = moh->next) {
-			/* Write data */
-			if ((res = write(moh->pipe[1], sbuf, res2)) != res2)  {
-				if (res == -1) {
-					cw_log(LOG_WARNING, "Failed to write to pipe (%d): %s\n", moh->pipe[1], strerror(errno));
-				} else if (option_debug) {
-					cw_log(LOG_DEBUG, "Only wrote %d of %d bytes to pipe %d\n", res, res2, moh->pipe[1]);
-				}
-			}
-			if (option_debug > 8) {
-				cw_log(LOG_DEBUG, "Wrote %d bytes to pipe with handle %d\n", res, moh->pipe[1]);
+		/* Fan out: each ring is filled once per interval, translated at
+		 * most once per output format, however many listeners it has */
+		cw_fr_init_ex(&f, CW_FRAME_VOICE, class->format, NULL);
+		f.datalen = res2;
+		f.data = sbuf;
+		f.samples = res;
+		cw_mutex_lock(&class->lock);
+		for (ring = class->rings; ring; ring = ring->next) {
+			if (!ring->trans) {
+				moh_ring_append(ring, (unsigned char *)sbuf, res2);
+			} else if (ring->listeners) {
+				if ((out = cw_translate(ring->trans, &f, 0)) && out->datalen > 0)
+					moh_ring_append(ring, out->data, out->datalen);
 			}
 		}
-		cw_mutex_unlock(&moh_lock);
+		cw_mutex_unlock(&class->lock);
 	}
 
 	pthread_cleanup_pop(1);
@@ -602,11 +691,9 @@ static struct mohclass *get_mohbyname(char *name)
 	return NULL;
 }
 
-static struct mohdata *mohalloc(struct mohclass *cl)
+static struct mohdata *mohalloc(struct mohclass *cl, int format)
 {
 	struct mohdata *moh;
-	int flags;
-	int res;
 
 	moh = malloc(sizeof(struct mohdata));
 	if (!moh) {
@@ -614,67 +701,36 @@ static struct mohdata *mohalloc(struct mohclass *cl)
 		return NULL;
 	}
 	memset(moh, 0, sizeof(struct mohdata));
-	if (pipe(moh->pipe)) {
-		cw_log(LOG_WARNING, "Failed to create pipe: %s\n", strerror(errno));
-		free(moh);
-		return NULL;
-	}
-	/* Make entirely non-blocking */
-	flags = fcntl(moh->pipe[0], F_GETFL);
-	if (flags == -1) {
-		cw_log(LOG_WARNING, "Failed to get flags for moh->pipe[0](%d): %s\n", moh->pipe[0], strerror(errno));
-		free(moh);
-		return NULL;
-	}
 
-	res = fcntl(moh->pipe[0], F_SETFL, flags | O_NONBLOCK);
-	if (res == -1) {
-		cw_log(LOG_WARNING, "Failed to set flags for moh->pipe[0](%d): %s\n", moh->pipe[0], strerror(errno));
-		free(moh);
-		return NULL;
-	}
-
-	flags = fcntl(moh->pipe[1], F_GETFL);
-	if (flags == -1) {
-		cw_log(LOG_WARNING, "Failed to get flags for moh->pipe[1](%d): %s\n", moh->pipe[1], strerror(errno));
-		free(moh);
-		return NULL;
-	}
-
-	fcntl(moh->pipe[1], F_SETFL, flags | O_NONBLOCK);
-	if (res == -1) {
-		cw_log(LOG_WARNING, "Failed to set flags for moh->pipe[1](%d): %s\n", moh->pipe[1], strerror(errno));
+	cw_mutex_lock(&cl->lock);
+	if (!(moh->ring = moh_ring_get(cl, format))) {
+		cw_mutex_unlock(&cl->lock);
+		cw_log(LOG_WARNING, "No audio ring available for class '%s'\n", cl->name);
 		free(moh);
 		return NULL;
 	}
+	/* Start one interval behind the writer so there is audio to play right away */
+	moh->cursor = moh->ring->head - moh->ring->last;
+	moh->ring->listeners++;
+	cl->listeners++;
+	cw_mutex_unlock(&cl->lock);
 
 	moh->parent = cl;
-	moh->next = cl->members;
-	cl->members = moh;
 	return moh;
 }
 
 static void moh_release(struct cw_channel *chan, void *data)
 {
-	struct mohdata *moh = data, **next;
-
-	cw_mutex_lock(&moh_lock);
+	struct mohdata *moh = data;
 
-	for (next = &moh->parent->members; *next; next = &(*next)->next) {
-		if (*next == moh) {
-			*next = moh->next;
-			break;
-		}
-	}
+	cw_mutex_lock(&moh->parent->lock);
+	moh->ring->listeners--;
+	moh->parent->listeners--;
+	cw_mutex_unlock(&moh->parent->lock);
 
 	if (chan && moh->origwfmt && cw_set_write_format(chan, moh->origwfmt)) 
 		cw_log(LOG_WARNING, "Unable to restore channel '%s' to format %s\n", chan->name, cw_getformatname(moh->origwfmt));
 
-	cw_mutex_unlock(&moh_lock);
-
-	cw_log(LOG_NOTICE, "Attempting to close pipe FDs %d and %d\n", moh->pipe[0], moh->pipe[1]);
-	close(moh->pipe[0]);
-	close(moh->pipe[1]);
 	free(moh);
 
 	if (chan && option_verbose > 2)
@@ -685,12 +741,19 @@ static void *moh_alloc(struct cw_channel *chan, void *params)
 {
 	struct mohdata *res;
 	struct mohclass *class = params;
+	int format;
+
+	/* Prefer a ring in a format the channel speaks natively so the
+	 * channel does not need a write translator of its own */
+	format = class->format;
+	if (!(chan->nativeformats & format) && cw_best_codec(chan->nativeformats))
+		format = cw_best_codec(chan->nativeformats);
 
-	res = mohalloc(class);
+	res = mohalloc(class, format);
 	if (res) {
 		res->origwfmt = chan->writeformat;
-		if (cw_set_write_format(chan, class->format)) {
-			cw_log(LOG_WARNING, "Unable to set channel '%s' to format '%s'\n", chan->name, cw_codec2str(class->format));
+		if (cw_set_write_format(chan, res->ring->format)) {
+			cw_log(LOG_WARNING, "Unable to set channel '%s' to format '%s'\n", chan->name, cw_codec2str(res->ring->format));
 			moh_release(NULL, res);
 			res = NULL;
 		}
@@ -704,49 +767,58 @@ static int moh_generate(struct cw_channel *chan, void *data, int samples)
 {
 	struct cw_frame f;
 	struct mohdata *moh = data;
+	struct moh_ring *ring = moh->ring;
 	short buf[1280 + CW_FRIENDLY_OFFSET / 2];
+	unsigned char *dst = (unsigned char *)(buf + CW_FRIENDLY_OFFSET/2);
+	unsigned long long avail;
+	size_t off, n;
 	int len, res;
 
 	if (!moh->parent->pid)
 		return -1;
 
-	len = cw_codec_get_len(moh->parent->format, samples);
+	len = cw_codec_get_len(ring->format, samples);
 
 	if (len > sizeof(buf) - CW_FRIENDLY_OFFSET) {
 		cw_log(LOG_WARNING, "Only doing %d of %d requested bytes on %s\n", (int)sizeof(buf), len, chan->name);
 		len = sizeof(buf) - CW_FRIENDLY_OFFSET;
 	}
-	res = read(moh->pipe[0], buf + CW_FRIENDLY_OFFSET/2, len);
-#if 0
-	if (res != len) {
-		cw_log(LOG_WARNING, "Read only %d of %d bytes: %s\n", res, len, strerror(errno));
+
+	cw_mutex_lock(&moh->parent->lock);
+	avail = ring->head - moh->cursor;
+	if (avail > ring->size) {
+		/* We fell behind by more than the ring holds, skip to the live audio */
+		if (option_debug)
+			cw_log(LOG_DEBUG, "MOH listener on '%s' overrun, skipping ahead\n", chan->name);
+		moh->cursor = ring->head - ring->last;
+		avail = ring->last;
 	}
-#endif
-	if (res > 0) {
-		cw_fr_init_ex(&f, CW_FRAME_VOICE, moh->parent->format, NULL);
-		f.datalen = res;
-		f.data = buf + CW_FRIENDLY_OFFSET/2;
-		f.offset = CW_FRIENDLY_OFFSET;
-		f.samples = cw_codec_get_samples(&f);
-		res = 0;
-
-		if (cw_write(chan, &f) < 0) {
-			cw_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
-			res = -1;
-		}
-	} else if (res < 0) {
-		/* This can happen either because the custom command has only just
-		 * been started and is not yet providing data OR because it is
-		 * unable to provide data fast enough on occasion OR because the
-		 * monitor_custom_command thread is unable to pass data from the
-		 * custom command pipe to the generator pipes quickly enough on
-		 * occasion.
-		 * The first _always_ happens. The last occasionally happens even
-		 * on a reasonably fast dual cored AMD64 with a single call in MOH.
-		 */
-		if (errno == EAGAIN)
-			res = 0;
-	} else {
+	if (len > avail)
+		len = avail;
+	if (len > 0) {
+		off = moh->cursor % ring->size;
+		n = (len < ring->size - off ? len : ring->size - off);
+		memcpy(dst, ring->buf + off, n);
+		if (n < len)
+			memcpy(dst + n, ring->buf, len - n);
+		moh->cursor += len;
+	}
+	cw_mutex_unlock(&moh->parent->lock);
+
+	/* Nothing buffered yet happens while the custom command is starting up
+	 * or when it is occasionally unable to provide data fast enough. */
+	if (len <= 0)
+		return 0;
+
+	cw_fr_init_ex(&f, CW_FRAME_VOICE, ring->format, NULL);
+	f.datalen = len;
+	f.data = dst;
+	f.offset = CW_FRIENDLY_OFFSET;
+	f.samples = cw_codec_get_samples(&f);
+	res = 0;
+
+	if (cw_write(chan, &f) < 0) {
+		cw_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
 		res = -1;
 	}
 
@@ -818,7 +890,7 @@ static int moh_register(struct mohclass *moh)
 	cw_mutex_lock(&moh_lock);
 	if (get_mohbyname(moh->name)) {
 		cw_log(LOG_WARNING, "Music on Hold class '%s' already exists\n", moh->name);
-		free(moh);	
+		cw_moh_free_class(moh);
 		cw_mutex_unlock(&moh_lock);
 		return -1;
 	}
@@ -836,6 +908,11 @@ static int moh_register(struct mohclass *moh)
 		cw_set_flag(moh, MOH_CUSTOM);
 		
 		moh->srcfd = -1;
+		if (!moh_ring_get(moh, moh->format)) {
+			cw_log(LOG_WARNING, "Unable to create audio ring for format '%s'\n", cw_getformatname(moh->format));
+			cw_moh_free_class(moh);
+			return -1;
+		}
 		if (cw_pthread_create(&moh->thread, NULL, monitor_custom_command, moh)) {
 			cw_log(LOG_WARNING, "Unable to create moh...\n");
 			cw_moh_free_class(moh);
@@ -913,6 +990,7 @@ static struct mohclass *moh_class_malloc(void)
 	memset(class, 0, sizeof(struct mohclass));
 
 	class->format = CW_FORMAT_SLINEAR;
+	cw_mutex_init(&class->lock);
 
 	return class;
 }
@@ -967,18 +1045,18 @@ static int load_moh_classes(void)
 					strcpy(class->dir, "nodir");
 				} else {
 					cw_log(LOG_WARNING, "A directory must be specified for class '%s'!\n", class->name);
-					free(class);
+					cw_moh_free_class(class);
 					continue;
 				}
 			}
 			if (cw_strlen_zero(class->mode)) {
 				cw_log(LOG_WARNING, "A mode must be specified for class '%s'!\n", class->name);
-				free(class);
+				cw_moh_free_class(class);
 				continue;
 			}
 			if (cw_strlen_zero(class->args) && !strcasecmp(class->mode, "custom")) {
 				cw_log(LOG_WARNING, "An application must be specified for class '%s'!\n", class->name);
-				free(class);
+				cw_moh_free_class(class);
 				continue;
 			}
 
@@ -1125,6 +1203,7 @@ static int cli_files_show(int fd, int argc, char *argv[])
 static int moh_classes_show(int fd, int argc, char *argv[])
 {
 	struct mohclass *class;
+	struct moh_ring *ring;
 
 	cw_mutex_lock(&moh_lock);
 	for (class = mohclasses; class; class = class->next) {
@@ -1134,6 +1213,12 @@ static int moh_classes_show(int fd, int argc, char *argv[])
 		if (cw_test_flag(class, MOH_CUSTOM))
 			cw_cli(fd, "\tApplication: %s\n", cw_strlen_zero(class->args) ? "<none>" : class->args);
 		cw_cli(fd, "\tFormat: %s\n", cw_getformatname(class->format));
+		if (cw_test_flag(class, MOH_CUSTOM)) {
+			cw_mutex_lock(&class->lock);
+			for (ring = class->rings; ring; ring = ring->next)
+				cw_cli(fd, "\tRing: %s, %d listener%s\n", cw_getformatname(ring->format), ring->listeners, ring->listeners == 1 ? "" : "s");
+			cw_mutex_unlock(&class->lock);
+		}
 	}
 	cw_mutex_unlock(&moh_lock);
 
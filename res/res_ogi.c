@@ -116,6 +116,52 @@ LOCAL_USER_DECL;
 
 #define OGI_PORT 4573
 
+#define OGI_CONF "ogi.conf"
+
+/*
+ * FastOGI connection pools, one for each server (host and port).  The
+ * request tells the server it may keep the connection with
+ * "ogi_network_keepalive: yes".  A script that then finishes with
+ * END SESSION instead of closing leaves the connection for the next
+ * request to the same server, saving the connect and the TIME_WAIT
+ * socket left by the close.  Idle connections are checked before they
+ * are used again.  When a server has all the connections it may have,
+ * requests queue for one, up to a limit and for a limited time.
+ */
+struct ogi_conn {
+	int fd;
+	time_t idle_since;
+	struct ogi_conn *next;
+};
+
+struct ogi_pool {
+	struct ogi_pool *next;
+	char host[256];
+	int port;
+	/*! Connections open to the server, idle or in use */
+	int conns;
+	int idle;
+	int waiting;
+	/*! Most recently used first */
+	struct ogi_conn *idlelist;
+	cw_cond_t cond;
+	unsigned long connects;
+	unsigned long reuses;
+	unsigned long turnedaway;
+};
+
+static struct ogi_pool *pools;
+
+CW_MUTEX_DEFINE_STATIC(pool_lock);
+
+/* [fastogi] in ogi.conf */
+static int pool_keepalive = 1;
+static int pool_maxconns = 0;
+static int pool_maxidle = 8;
+static int pool_maxwaiting = 32;
+static int pool_waittime = MAX_OGI_CONNECT;
+static int pool_idletime = 60;
+
 static void ogi_debug_cli(int fd, char *fmt, ...)
 {
 	char *stuff;
@@ -135,37 +181,17 @@ static void ogi_debug_cli(int fd, char *fmt, ...)
 	}
 }
 
-/* launch_netscript: The fastogi handler.
-	FastOGI defaults to port 4573 */
-static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int *opid)
+static int ogi_connect(const char *host, int port, const char *ogiurl)
 {
 	int s;
 	int flags;
+	int err;
+	socklen_t len;
 	struct pollfd pfds[1];
-	char *host;
-	char *c; int port = OGI_PORT;
-	char *script="";
 	struct sockaddr_in sin;
 	struct hostent *hp;
 	struct cw_hostent ahp;
 
-	host = cw_strdupa(ogiurl + 6);	/* Remove ogi:// */
-
-	/* Strip off any script name */
-	if ((c = strchr(host, '/'))) {
-		*c = '\0';
-		c++;
-		script = c;
-	}
-	if ((c = strchr(host, ':'))) {
-		*c = '\0';
-		c++;
-		port = atoi(c);
-	}
-	if (efd) {
-		cw_log(LOG_WARNING, "OGI URI's don't support Enhanced OGI yet\n");
-		return -1;
-	}
 	hp = cw_gethostbyname(host, &ahp);
 	if (!hp) {
 		cw_log(LOG_WARNING, "Unable to locate host '%s'\n", host);
@@ -187,6 +213,15 @@ static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int
 		close(s);
 		return -1;
 	}
+	/* commands and replies are single short lines, each to go out at once
+	   rather than wait for the other end to acknowledge the last one */
+	flags = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+	if (pool_keepalive) {
+		/* finds out about servers gone away while their connections sit idle */
+		flags = 1;
+		setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &flags, sizeof(flags));
+	}
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(port);
@@ -198,30 +233,253 @@ static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int
 	}
 	pfds[0].fd = s;
 	pfds[0].events = POLLOUT;
-	if (poll(pfds, 1, MAX_OGI_CONNECT) != 1) {
+	err = 0;
+	len = sizeof(err);
+	if (poll(pfds, 1, MAX_OGI_CONNECT) != 1 || getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
 		cw_log(LOG_WARNING, "Connect to '%s' failed!\n", ogiurl);
 		close(s);
 		return -1;
 	}
-	if (write(s, "ogi_network: yes\n", strlen("ogi_network: yes\n")) < 0) {
-		cw_log(LOG_WARNING, "Connect to '%s' failed: %s\n", ogiurl, strerror(errno));
-		close(s);
+	if (option_debug > 3)
+		cw_log(LOG_DEBUG, "Wow, connected!\n");
+	return s;
+}
+
+static struct ogi_pool *ogi_pool_find(const char *host, int port)
+{
+	struct ogi_pool *pool;
+
+	cw_mutex_lock(&pool_lock);
+	for (pool = pools;  pool;  pool = pool->next) {
+		if (pool->port == port && !strcasecmp(pool->host, host))
+			break;
+	}
+	if (!pool && (pool = calloc(1, sizeof(*pool)))) {
+		cw_copy_string(pool->host, host, sizeof(pool->host));
+		pool->port = port;
+		cw_cond_init(&pool->cond, NULL);
+		pool->next = pools;
+		pools = pool;
+	}
+	cw_mutex_unlock(&pool_lock);
+	return pool;
+}
+
+/*! An idle connection is fit for use if it has not been idle too long, and
+ *  the server has neither closed it nor sent anything since the last session */
+static int ogi_conn_usable(struct ogi_conn *conn, time_t now)
+{
+	struct pollfd pfd;
+
+	if (now - conn->idle_since >= pool_idletime)
+		return 0;
+	pfd.fd = conn->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+/*! Returns a connection to the pool's server, an idle one if there is one
+ *  fit for use, or -1 */
+static int ogi_pool_get(struct ogi_pool *pool, const char *ogiurl)
+{
+	struct ogi_conn *conn;
+	struct timeval tv;
+	struct timespec ts;
+	int timedout = 0;
+	int fd;
+
+	tv = cw_tvadd(cw_tvnow(), cw_samp2tv(pool_waittime, 1000));
+	ts.tv_sec = tv.tv_sec;
+	ts.tv_nsec = tv.tv_usec * 1000;
+
+	cw_mutex_lock(&pool_lock);
+	for (;;) {
+		while ((conn = pool->idlelist)) {
+			pool->idlelist = conn->next;
+			pool->idle--;
+			fd = conn->fd;
+			if (ogi_conn_usable(conn, time(NULL))) {
+				pool->reuses++;
+				cw_mutex_unlock(&pool_lock);
+				free(conn);
+				return fd;
+			}
+			close(fd);
+			free(conn);
+			pool->conns--;
+		}
+		if (!pool_maxconns || pool->conns < pool_maxconns) {
+			pool->conns++;
+			pool->connects++;
+			cw_mutex_unlock(&pool_lock);
+			if ((fd = ogi_connect(pool->host, pool->port, ogiurl)) < 0) {
+				cw_mutex_lock(&pool_lock);
+				pool->conns--;
+				cw_cond_signal(&pool->cond);
+				cw_mutex_unlock(&pool_lock);
+			}
+			return fd;
+		}
+		if (timedout || pool->waiting >= pool_maxwaiting) {
+			pool->turnedaway++;
+			cw_log(LOG_WARNING, "No connection free to FastOGI server %s:%d for '%s' (%d open, %d waiting)\n",
+				pool->host, pool->port, ogiurl, pool->conns, pool->waiting);
+			cw_mutex_unlock(&pool_lock);
+			return -1;
+		}
+		pool->waiting++;
+		timedout = (cw_cond_timedwait(&pool->cond, &pool_lock, &ts) == ETIMEDOUT);
+		pool->waiting--;
+	}
+}
+
+/*! Gives a connection back, keeping it for the next request if reusable */
+static void ogi_pool_put(struct ogi_pool *pool, int fd, int reusable)
+{
+	struct ogi_conn *conn = NULL;
+
+	cw_mutex_lock(&pool_lock);
+	if (reusable && pool_keepalive && pool->idle < pool_maxidle && (conn = malloc(sizeof(*conn)))) {
+		conn->fd = fd;
+		conn->idle_since = time(NULL);
+		conn->next = pool->idlelist;
+		pool->idlelist = conn;
+		pool->idle++;
+	} else {
+		close(fd);
+		pool->conns--;
+	}
+	cw_cond_signal(&pool->cond);
+	cw_mutex_unlock(&pool_lock);
+}
+
+/*! Closes the idle connections, and when unloading frees the pools nothing
+    is using.  A pool stays on reload, as a request may hold it from
+    ogi_pool_find() without having counted itself in it yet. */
+static void ogi_pool_flush(int unloading)
+{
+	struct ogi_pool *pool;
+	struct ogi_pool **pp;
+	struct ogi_conn *conn;
+
+	cw_mutex_lock(&pool_lock);
+	for (pp = &pools;  (pool = *pp);  ) {
+		while ((conn = pool->idlelist)) {
+			pool->idlelist = conn->next;
+			close(conn->fd);
+			free(conn);
+			pool->conns--;
+		}
+		pool->idle = 0;
+		if (unloading && !pool->conns && !pool->waiting) {
+			*pp = pool->next;
+			cw_cond_destroy(&pool->cond);
+			free(pool);
+		} else {
+			pp = &pool->next;
+		}
+	}
+	cw_mutex_unlock(&pool_lock);
+}
+
+static void ogi_read_config(void)
+{
+	struct cw_config *cfg;
+	struct cw_variable *v;
+
+	pool_keepalive = 1;
+	pool_maxconns = 0;
+	pool_maxidle = 8;
+	pool_maxwaiting = 32;
+	pool_waittime = MAX_OGI_CONNECT;
+	pool_idletime = 60;
+
+	if (!(cfg = cw_config_load(OGI_CONF)))
+		return;
+	for (v = cw_variable_browse(cfg, "fastogi");  v;  v = v->next) {
+		if (!strcasecmp(v->name, "keepalive")) {
+			pool_keepalive = cw_true(v->value);
+		} else if (!strcasecmp(v->name, "maxconnections")) {
+			if (sscanf(v->value, "%d", &pool_maxconns) != 1 || pool_maxconns < 0)
+				pool_maxconns = 0;
+		} else if (!strcasecmp(v->name, "maxidle")) {
+			if (sscanf(v->value, "%d", &pool_maxidle) != 1 || pool_maxidle < 0)
+				pool_maxidle = 8;
+		} else if (!strcasecmp(v->name, "maxwaiting")) {
+			if (sscanf(v->value, "%d", &pool_maxwaiting) != 1 || pool_maxwaiting < 0)
+				pool_maxwaiting = 32;
+		} else if (!strcasecmp(v->name, "waittime")) {
+			if (sscanf(v->value, "%d", &pool_waittime) != 1 || pool_waittime < 0)
+				pool_waittime = MAX_OGI_CONNECT;
+		} else if (!strcasecmp(v->name, "idletime")) {
+			if (sscanf(v->value, "%d", &pool_idletime) != 1 || pool_idletime < 0)
+				pool_idletime = 60;
+		} else {
+			cw_log(LOG_WARNING, "Unknown option '%s' at line %d of %s\n", v->name, v->lineno, OGI_CONF);
+		}
+	}
+	cw_config_destroy(cfg);
+}
+
+/* launch_netscript: The fastogi handler.
+	FastOGI defaults to port 4573 */
+static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int *opid, struct ogi_pool **opool)
+{
+	int s;
+	char *host;
+	char *c; int port = OGI_PORT;
+	char *script="";
+	char *header;
+	size_t len;
+	struct ogi_pool *pool;
+
+	host = cw_strdupa(ogiurl + 6);	/* Remove ogi:// */
+
+	/* Strip off any script name */
+	if ((c = strchr(host, '/'))) {
+		*c = '\0';
+		c++;
+		script = c;
+	}
+	if ((c = strchr(host, ':'))) {
+		*c = '\0';
+		c++;
+		port = atoi(c);
+	}
+	if (efd) {
+		cw_log(LOG_WARNING, "OGI URI's don't support Enhanced OGI yet\n");
 		return -1;
 	}
+	if (!(pool = ogi_pool_find(host, port))) {
+		cw_log(LOG_ERROR, "Out of memory\n");
+		return -1;
+	}
+	if ((s = ogi_pool_get(pool, ogiurl)) < 0)
+		return -1;
 
 	/* If we have a script parameter, relay it to the fastogi server */
+	len = strlen(script) + 100;
+	header = alloca(len);
+	snprintf(header, len, "ogi_network: yes\n%s", pool_keepalive ? "ogi_network_keepalive: yes\n" : "");
 	if (!cw_strlen_zero(script))
-		fdprintf(s, "ogi_network_script: %s\n", script);
+		snprintf(header + strlen(header), len - strlen(header), "ogi_network_script: %s\n", script);
+	if (ogidebug)
+		cw_verbose("OGI Tx >> %s", header);
+	if (cw_carefulwrite(s, header, strlen(header), 100) < 0) {
+		cw_log(LOG_WARNING, "Connect to '%s' failed: %s\n", ogiurl, strerror(errno));
+		ogi_pool_put(pool, s, 0);
+		return -1;
+	}
 
-	if (option_debug > 3)
-		cw_log(LOG_DEBUG, "Wow, connected!\n");
 	fds[0] = s;
 	fds[1] = s;
 	*opid = -1;
+	*opool = pool;
 	return 0;
 }
 
-static int launch_script(char *script, char *argv[], int *fds, int *efd, int *opid)
+static int launch_script(char *script, char *argv[], int *fds, int *efd, int *opid, struct ogi_pool **opool)
 {
 	char tmp[256];
 	pid_t pid;
@@ -232,8 +490,9 @@ static int launch_script(char *script, char *argv[], int *fds, int *efd, int *op
 	int res;
 	sigset_t signal_set;
 	
+	*opool = NULL;
 	if (!strncasecmp(script, "ogi://", 6))
-		return launch_netscript(script, argv, fds, efd, opid);
+		return launch_netscript(script, argv, fds, efd, opid, opool);
 	
 	if (script[0] != '/') {
 		snprintf(tmp, sizeof(tmp), "%s/%s", (char *)cw_config_CW_OGI_DIR, script);
@@ -336,37 +595,77 @@ static int launch_script(char *script, char *argv[], int *fds, int *efd, int *op
 		
 }
 
+/*! The environment sent at the start of a session, gathered so it goes to
+ *  the script in one write instead of one for each line */
+struct ogi_env {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void envprintf(struct ogi_env *env, const char *fmt, ...)
+{
+	va_list ap;
+	char *line;
+	char *buf;
+	int len;
+
+	va_start(ap, fmt);
+	len = vasprintf(&line, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (env->len + len + 1 > env->size) {
+		if (!(buf = realloc(env->buf, env->size + len + 1024))) {
+			free(line);
+			return;
+		}
+		env->buf = buf;
+		env->size += len + 1024;
+	}
+	memcpy(env->buf + env->len, line, len + 1);
+	env->len += len;
+	free(line);
+}
+
 static void setup_env(struct cw_channel *chan, char *request, int fd, int enhanced)
 {
+	struct ogi_env env = { NULL, 0, 0 };
+
 	/* Print initial environment, with ogi_request always being the first
 	   thing */
-	fdprintf(fd, "ogi_request: %s\n", request);
-	fdprintf(fd, "ogi_channel: %s\n", chan->name);
-	fdprintf(fd, "ogi_language: %s\n", chan->language);
-	fdprintf(fd, "ogi_type: %s\n", chan->type);
-	fdprintf(fd, "ogi_uniqueid: %s\n", chan->uniqueid);
+	envprintf(&env, "ogi_request: %s\n", request);
+	envprintf(&env, "ogi_channel: %s\n", chan->name);
+	envprintf(&env, "ogi_language: %s\n", chan->language);
+	envprintf(&env, "ogi_type: %s\n", chan->type);
+	envprintf(&env, "ogi_uniqueid: %s\n", chan->uniqueid);
 
 	/* ANI/DNIS */
-	fdprintf(fd, "ogi_callerid: %s\n", chan->cid.cid_num ? chan->cid.cid_num : "unknown");
-	fdprintf(fd, "ogi_calleridname: %s\n", chan->cid.cid_name ? chan->cid.cid_name : "unknown");
-	fdprintf(fd, "ogi_callingpres: %d\n", chan->cid.cid_pres);
-	fdprintf(fd, "ogi_callingani2: %d\n", chan->cid.cid_ani2);
-	fdprintf(fd, "ogi_callington: %d\n", chan->cid.cid_ton);
-	fdprintf(fd, "ogi_callingtns: %d\n", chan->cid.cid_tns);
-	fdprintf(fd, "ogi_dnid: %s\n", chan->cid.cid_dnid ? chan->cid.cid_dnid : "unknown");
-	fdprintf(fd, "ogi_rdnis: %s\n", chan->cid.cid_rdnis ? chan->cid.cid_rdnis : "unknown");
+	envprintf(&env, "ogi_callerid: %s\n", chan->cid.cid_num ? chan->cid.cid_num : "unknown");
+	envprintf(&env, "ogi_calleridname: %s\n", chan->cid.cid_name ? chan->cid.cid_name : "unknown");
+	envprintf(&env, "ogi_callingpres: %d\n", chan->cid.cid_pres);
+	envprintf(&env, "ogi_callingani2: %d\n", chan->cid.cid_ani2);
+	envprintf(&env, "ogi_callington: %d\n", chan->cid.cid_ton);
+	envprintf(&env, "ogi_callingtns: %d\n", chan->cid.cid_tns);
+	envprintf(&env, "ogi_dnid: %s\n", chan->cid.cid_dnid ? chan->cid.cid_dnid : "unknown");
+	envprintf(&env, "ogi_rdnis: %s\n", chan->cid.cid_rdnis ? chan->cid.cid_rdnis : "unknown");
 
 	/* Context information */
-	fdprintf(fd, "ogi_context: %s\n", chan->context);
-	fdprintf(fd, "ogi_extension: %s\n", chan->exten);
-	fdprintf(fd, "ogi_priority: %d\n", chan->priority);
-	fdprintf(fd, "ogi_enhanced: %s\n", enhanced ? "1.0" : "0.0");
+	envprintf(&env, "ogi_context: %s\n", chan->context);
+	envprintf(&env, "ogi_extension: %s\n", chan->exten);
+	envprintf(&env, "ogi_priority: %d\n", chan->priority);
+	envprintf(&env, "ogi_enhanced: %s\n", enhanced ? "1.0" : "0.0");
 
 	/* User information */
-	fdprintf(fd, "ogi_accountcode: %s\n", chan->accountcode ? chan->accountcode : "");
+	envprintf(&env, "ogi_accountcode: %s\n", chan->accountcode ? chan->accountcode : "");
     
 	/* End with empty return */
-	fdprintf(fd, "\n");
+	envprintf(&env, "\n");
+
+	if (env.buf) {
+		fdprintf(fd, "%s", env.buf);
+		free(env.buf);
+	}
 }
 
 static int handle_answer(struct cw_channel *chan, OGI *ogi, int argc, char *argv[])
@@ -1341,6 +1640,15 @@ static int handle_noop(struct cw_channel *chan, OGI *ogi, int arg, char *argv[])
 	return RESULT_SUCCESS;
 }
 
+static int handle_endsession(struct cw_channel *chan, OGI *ogi, int argc, char *argv[])
+{
+	if (argc != 2)
+		return RESULT_SHOWUSAGE;
+	fdprintf(ogi->fd, "200 result=0\n");
+	ogi->endsession = 1;
+	return RESULT_SUCCESS;
+}
+
 static int handle_setmusic(struct cw_channel *chan, OGI *ogi, int argc, char *argv[])
 {
 	if (!strncasecmp(argv[2],"on",2)) {
@@ -1603,6 +1911,13 @@ static char usage_noop[] =
 " Usage: NoOp\n"
 "	Does nothing.\n";
 
+static char usage_endsession[] =
+" Usage: END SESSION\n"
+"	Ends the OGI script as if it had closed the connection, returning\n"
+" to the dialplan.  A FastOGI server sent \"ogi_network_keepalive: yes\" keeps\n"
+" the connection open after this, and callweaver sends the next request to\n"
+" the server over it.  Returns 200 result=0.\n";
+
 static ogi_command commands[MAX_COMMANDS] = {
 	{ { "answer", NULL }, handle_answer, "Answer channel", usage_answer },
 	{ { "channel", "status", NULL }, handle_channelstatus, "Returns status of the connected channel", usage_channelstatus },
@@ -1610,6 +1925,7 @@ static ogi_command commands[MAX_COMMANDS] = {
 	{ { "database", "deltree", NULL }, handle_dbdeltree, "Removes database keytree/value", usage_dbdeltree },
 	{ { "database", "get", NULL }, handle_dbget, "Gets database value", usage_dbget },
 	{ { "database", "put", NULL }, handle_dbput, "Adds/updates database value", usage_dbput },
+	{ { "end", "session", NULL }, handle_endsession, "Ends the script, keeping a FastOGI connection", usage_endsession },
 	{ { "exec", NULL }, handle_exec, "Executes a given Application", usage_exec },
 	{ { "get", "data", NULL }, handle_getdata, "Prompts for DTMF on a channel", usage_getdata },
 	{ { "get", "full", "variable", NULL }, handle_getvariablefull, "Evaluates a channel expression", usage_getvariablefull },
@@ -1846,6 +2162,55 @@ static int ogi_handle_command(struct cw_channel *chan, OGI *ogi, char *buf)
 	}
 	return 0;
 }
+/*! Input from the script, read in blocks and handed out a line at a time.
+ *  Unlike with stdio, lines read ahead are handled before waiting on the fd
+ *  again, and nothing is left behind in a buffer when a FastOGI connection
+ *  goes back to its pool */
+struct ogi_input {
+	int start;
+	int len;
+	char buf[2048];
+};
+
+/*! Returns the next whole line, without its newline, or NULL if there is
+ *  none yet.  Like fgets(), a line too long for the buffer comes in pieces,
+ *  and at the end of the input the last line needs no newline */
+static char *ogi_input_line(struct ogi_input *in, int eof)
+{
+	char *line;
+	char *nl;
+	int left = in->len - in->start;
+
+	if (!left)
+		return NULL;
+	if (!(nl = memchr(in->buf + in->start, '\n', left))) {
+		if (!eof && left < sizeof(in->buf) - 1)
+			return NULL;
+		nl = in->buf + in->len;
+	}
+	*nl = '\0';
+	line = in->buf + in->start;
+	in->start = (nl < in->buf + in->len) ? nl - in->buf + 1 : in->len;
+	return line;
+}
+
+/*! Reads what the script sent.  Returns 0 at the end of the input */
+static int ogi_input_fill(struct ogi_input *in, int fd)
+{
+	int res;
+
+	if (in->start) {
+		memmove(in->buf, in->buf + in->start, in->len - in->start);
+		in->len -= in->start;
+		in->start = 0;
+	}
+	res = read(fd, in->buf + in->len, sizeof(in->buf) - 1 - in->len);
+	if (res < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 1 : 0;
+	in->len += res;
+	return res;
+}
+
 #define RETRY	3
 static int run_ogi(struct cw_channel *chan, char *request, OGI *ogi, int pid, int dead)
 {
@@ -1854,22 +2219,49 @@ static int run_ogi(struct cw_channel *chan, char *request, OGI *ogi, int pid, in
 	int ms;
 	int returnstatus = 0;
 	struct cw_frame *f;
-	char buf[2048];
-	FILE *readf;
+	struct ogi_input in;
+	char *buf;
+	int eof = 0;
 	/* how many times we'll retry if cw_waitfor_nandfs will return without either 
 	  channel or file descriptor in case select is interrupted by a system call (EINTR) */
 	int retry = RETRY;
 
-	if (!(readf = fdopen(ogi->ctrl, "r"))) {
-		cw_log(LOG_WARNING, "Unable to fdopen file descriptor\n");
-		if (pid > -1)
-			kill(pid, SIGHUP);
-		close(ogi->ctrl);
-		return -1;
-	}
-	setlinebuf(readf);
+	in.start = 0;
+	in.len = 0;
 	setup_env(chan, request, ogi->fd, (ogi->audio > -1));
 	for (;;) {
+		if ((buf = ogi_input_line(&in, eof))) {
+			retry = RETRY;
+			if (ogidebug)
+				cw_verbose("OGI Rx << %s\n", buf);
+			returnstatus |= ogi_handle_command(chan, ogi, buf);
+			/* If the handle_command returns -1, we need to stop */
+			if ((returnstatus < 0) || (returnstatus == CW_PBX_KEEPALIVE)) {
+				break;
+			}
+			if (ogi->endsession) {
+				if (returnstatus)
+					returnstatus = -1;
+				if (option_verbose > 2) 
+					cw_verbose(VERBOSE_PREFIX_3 "OGI Script %s ended the session, returning %d\n", request, returnstatus);
+				/* whatever came after END SESSION belongs to no request */
+				if (in.len > in.start)
+					ogi->endsession = 0;
+				pid = -1;
+				break;
+			}
+			continue;
+		}
+		if (eof) {
+			/* Program terminated */
+			if (returnstatus)
+				returnstatus = -1;
+			if (option_verbose > 2) 
+				cw_verbose(VERBOSE_PREFIX_3 "OGI Script %s completed, returning %d\n", request, returnstatus);
+			/* No need to kill the pid anymore, since they closed us */
+			pid = -1;
+			break;
+		}
 		ms = -1;
 		c = cw_waitfor_nandfds(&chan, dead ? 0 : 1, &ogi->ctrl, 1, NULL, &outfd, &ms);
 		if (c) {
@@ -1890,26 +2282,8 @@ static int run_ogi(struct cw_channel *chan, char *request, OGI *ogi, int pid, in
 			}
 		} else if (outfd > -1) {
 			retry = RETRY;
-			if (!fgets(buf, sizeof(buf), readf)) {
-				/* Program terminated */
-				if (returnstatus)
-					returnstatus = -1;
-				if (option_verbose > 2) 
-					cw_verbose(VERBOSE_PREFIX_3 "OGI Script %s completed, returning %d\n", request, returnstatus);
-				/* No need to kill the pid anymore, since they closed us */
-				pid = -1;
-				break;
-			}
-			/* get rid of trailing newline, if any */
-			if (*buf && buf[strlen(buf) - 1] == '\n')
-				buf[strlen(buf) - 1] = 0;
-			if (ogidebug)
-				cw_verbose("OGI Rx << %s\n", buf);
-			returnstatus |= ogi_handle_command(chan, ogi, buf);
-			/* If the handle_command returns -1, we need to stop */
-			if ((returnstatus < 0) || (returnstatus == CW_PBX_KEEPALIVE)) {
-				break;
-			}
+			if (!ogi_input_fill(&in, ogi->ctrl))
+				eof = 1;
 		} else {
 			if (--retry <= 0) {
 				cw_log(LOG_WARNING, "No channel, no fd?\n");
@@ -1923,7 +2297,6 @@ static int run_ogi(struct cw_channel *chan, char *request, OGI *ogi, int pid, in
 		if (kill(pid, SIGHUP))
 			cw_log(LOG_WARNING, "unable to send SIGHUP to OGI process %d: %s\n", pid, strerror(errno));
 	}
-	fclose(readf);
 	return returnstatus;
 }
 
@@ -2013,6 +2386,7 @@ static int ogi_exec_full(struct cw_channel *chan, int argc, char **argv, int enh
 	int fds[2];
 	int efd = -1;
 	int pid;
+	struct ogi_pool *pool;
 	OGI ogi;
 
 	if (argc < 1 || !argv[0][0]) {
@@ -2030,14 +2404,21 @@ static int ogi_exec_full(struct cw_channel *chan, int argc, char **argv, int enh
 		}
 	}
 #endif
-	res = launch_script(argv[0], argv, fds, enhanced ? &efd : NULL, &pid);
+	res = launch_script(argv[0], argv, fds, enhanced ? &efd : NULL, &pid, &pool);
 	if (!res) {
 		ogi.fd = fds[1];
 		ogi.ctrl = fds[0];
 		ogi.audio = efd;
+		ogi.endsession = 0;
 		res = run_ogi(chan, argv[0], &ogi, pid, dead);
-		if (fds[1] != fds[0])
-			close(fds[1]);
+		if (pool) {
+			/* only a session the script ended leaves the connection in a known state */
+			ogi_pool_put(pool, fds[0], ogi.endsession);
+		} else {
+			close(fds[0]);
+			if (fds[1] != fds[0])
+				close(fds[1]);
+		}
 		if (efd > -1)
 			close(efd);
 	}
@@ -2096,24 +2477,68 @@ static struct cw_cli_entry showogi =
 static struct cw_cli_entry dumpogihtml = 
 { { "dump", "ogihtml", NULL }, handle_dumpogihtml, "Dumps a list of ogi command in html format", dumpogihtml_help };
 
+static int handle_showfastogi(int fd, int argc, char *argv[])
+{
+	struct ogi_pool *pool;
+
+	if (argc != 2)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&pool_lock);
+	cw_cli(fd, "%-32s %6s %6s %7s %10s %10s %10s\n", "Server", "Open", "Idle", "Waiting", "Connects", "Reused", "Turned away");
+	for (pool = pools;  pool;  pool = pool->next) {
+		cw_cli(fd, "%-26s:%-5d %6d %6d %7d %10lu %10lu %10lu\n", pool->host, pool->port,
+			pool->conns, pool->idle, pool->waiting, pool->connects, pool->reuses, pool->turnedaway);
+	}
+	cw_cli(fd, "Keepalive %s, %d idle connections kept for %d seconds, ",
+		pool_keepalive ? "on" : "off", pool_maxidle, pool_idletime);
+	if (pool_maxconns)
+		cw_cli(fd, "at most %d open, %d waiting up to %d ms\n", pool_maxconns, pool_maxwaiting, pool_waittime);
+	else
+		cw_cli(fd, "no limit on open connections\n");
+	cw_mutex_unlock(&pool_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static char showfastogi_help[] =
+"Usage: show fastogi\n"
+"       Lists the FastOGI servers connected to, with the connections\n"
+"       open and kept idle for the next request.\n";
+
+static struct cw_cli_entry showfastogi = 
+{ { "show", "fastogi", NULL }, handle_showfastogi, "Show FastOGI connection pools", showfastogi_help };
+
 int unload_module(void)
 {
 	int res = 0;
 	STANDARD_HANGUP_LOCALUSERS;
 	cw_cli_unregister(&showogi);
 	cw_cli_unregister(&dumpogihtml);
+	cw_cli_unregister(&showfastogi);
 	cw_cli_unregister(&cli_debug);
 	cw_cli_unregister(&cli_no_debug);
 	res |= cw_unregister_application(eapp_app);
 	res |= cw_unregister_application(deadapp_app);
 	res |= cw_unregister_application(app_app);
+	ogi_pool_flush(1);
 	return res;
 }
 
+int reload(void)
+{
+	ogi_read_config();
+	/* idle connections are reopened with the new settings */
+	ogi_pool_flush(0);
+	return 0;
+}
+
 int load_module(void)
 {
+	ogi_read_config();
 	cw_cli_register(&showogi);
 	cw_cli_register(&dumpogihtml);
+	cw_cli_register(&showfastogi);
 	cw_cli_register(&cli_debug);
 	cw_cli_register(&cli_no_debug);
 	deadapp_app = cw_register_application(deadapp_name, deadogi_exec, deadapp_synopsis, deadapp_syntax, descrip);